@@ -0,0 +1,127 @@
+#ifndef KEYCARD_ACCESS_DEPLOY_QUEUE_HPP
+#define KEYCARD_ACCESS_DEPLOY_QUEUE_HPP
+
+#include <ka/data.hpp>
+#include <ka/key_pair.hpp>
+#include <ka/nvs.hpp>
+#include <optional>
+#include <unordered_map>
+
+namespace ka {
+
+    /**
+     * @brief What a gate needs to enroll a token by itself, the next time it is tapped.
+     *
+     * This is the deploy certificate of the whitepaper. The keymaker issues it for a single gate and delivers it over
+     * the secure channel, which authenticates it as coming from the programmer. Besides the identity to write in the
+     * gate file, it carries the only key the gate cannot derive: the gate app master key of this token, to enroll the
+     * token key and write the file. It deliberately does not carry the token root key, which is the PICC master key:
+     * certificates sit in the gate NVS until used, and the root key would let whoever dumps it reformat the token.
+     * Without it, the gate can only enroll into a gate app the token already has, see @ref member_token::enroll_gate.
+     */
+    struct deploy_certificate {
+        identity who{};
+        /**
+         * Unix time, in seconds, after which the certificate is dropped, see @ref deploy_queue::now.
+         */
+        std::uint32_t expires_at = 0;
+        raw_gate_app_master_key mkey{};
+    };
+
+    struct deploy_queue_status {
+        std::uint32_t pending = 0;
+        std::uint32_t capacity = 0;
+        /**
+         * See @ref deploy_queue::now.
+         */
+        std::uint32_t now = 0;
+    };
+
+    /**
+     * @brief Bounded set of pending @ref deploy_certificate, keyed by token id, with O(1) lookup on tap.
+     *
+     * Gates have no RTC. Time is estimated as the latest of the system clock and the most recent time received from
+     * the keymaker, advanced by the uptime since then, see @ref advance_clock. This never runs ahead of the actual
+     * time, so a certificate may at most outlive its expiry by the time the gate spent powered off.
+     */
+    class deploy_queue {
+    public:
+        static constexpr std::size_t default_capacity = 64;
+
+        explicit deploy_queue(std::size_t capacity = default_capacity);
+
+        [[nodiscard]] std::size_t size() const;
+        [[nodiscard]] std::size_t capacity() const;
+        [[nodiscard]] bool empty() const;
+        [[nodiscard]] deploy_queue_status status() const;
+
+        /**
+         * @brief Incremented by each change, so that the owner knows when to persist.
+         */
+        [[nodiscard]] std::uint32_t revision() const;
+
+        /**
+         * @brief Estimated Unix time, in seconds.
+         */
+        [[nodiscard]] std::uint32_t now() const;
+
+        /**
+         * @brief Moves @ref now forward to @p unix_time, if it is behind. It never moves backwards.
+         */
+        void advance_clock(std::uint32_t unix_time);
+
+        /**
+         * @brief Adds @p cert, or replaces the certificate of the same token. Expired certificates are dropped.
+         * @return False if @p cert is expired, or the queue is full.
+         */
+        [[nodiscard]] bool insert(deploy_certificate const &cert);
+
+        [[nodiscard]] bool contains(token_id const &id) const;
+
+        /**
+         * @brief Removes and returns the certificate of @p id.
+         * @return The certificate, or nothing if there is none, or it has expired, in which case it is dropped.
+         */
+        [[nodiscard]] std::optional<deploy_certificate> take(token_id const &id);
+
+        /**
+         * @return The number of certificates dropped.
+         */
+        std::size_t purge_expired();
+
+        void clear();
+
+        /**
+         * @brief Stores the certificates and the clock. Certificates are key material, store them only in an
+         *  encrypted partition.
+         */
+        [[nodiscard]] nvs::r<> store(nvs::namespc &ns, const char *key) const;
+        [[nodiscard]] nvs::r<> load(nvs::const_namespc const &ns, const char *key);
+
+    private:
+        struct token_id_hash {
+            [[nodiscard]] std::size_t operator()(token_id const &id) const;
+        };
+
+        std::size_t _capacity;
+        std::unordered_map<token_id, deploy_certificate, token_id_hash> _pending{};
+        std::uint32_t _clock = 0;
+        /**
+         * Microseconds since boot at which @ref _clock was set, as per `esp_timer_get_time`.
+         */
+        std::int64_t _clock_set_at = 0;
+        std::uint32_t _revision = 0;
+
+        void erase(decltype(_pending)::iterator it);
+    };
+
+}// namespace ka
+
+namespace mlab {
+    bin_stream &operator>>(bin_stream &s, ka::deploy_certificate &cert);
+    bin_data &operator<<(bin_data &bd, ka::deploy_certificate const &cert);
+    bin_stream &operator>>(bin_stream &s, ka::deploy_queue_status &status);
+    bin_data &operator<<(bin_data &bd, ka::deploy_queue_status const &status);
+}// namespace mlab
+
+#endif//KEYCARD_ACCESS_DEPLOY_QUEUE_HPP
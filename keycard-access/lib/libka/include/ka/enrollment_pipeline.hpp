@@ -0,0 +1,108 @@
+#ifndef KEYCARD_ACCESS_ENROLLMENT_PIPELINE_HPP
+#define KEYCARD_ACCESS_ENROLLMENT_PIPELINE_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <ka/gate.hpp>
+#include <ka/member_token.hpp>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace ka {
+
+    struct enrollment_pipeline_stats {
+        std::uint32_t tokens = 0;
+        std::uint32_t gates = 0;
+        /**
+         * Time the worker spent deriving keys and encrypting files.
+         */
+        std::chrono::milliseconds crypto{0};
+        /**
+         * Time the RF side spent waiting for the worker. Zero when the worker keeps ahead of the RF commands.
+         */
+        std::chrono::milliseconds stalled{0};
+    };
+
+    /**
+     * @brief Prepares keys and encrypted files for a token on the second core, while the first one talks to the token.
+     *
+     * As soon as the @ref token_id is known, @ref start hands the identity and the gates to a worker task pinned to the
+     * other core. The worker derives the root and master keys and encrypts the master file (@ref prepared_token), then
+     * derives the token key and encrypts the file of each gate (@ref prepared_gate), in order, staying at most `depth`
+     * gates ahead of the consumer. The RF side takes them with @ref take_token and @ref take_gate and passes them to
+     * @ref member_token::deploy and @ref member_token::enroll_gate, so it only ever waits on the PN532, unless the worker
+     * falls behind, which is tracked in @ref enrollment_pipeline_stats::stalled.
+     */
+    class enrollment_pipeline {
+    public:
+        static constexpr std::size_t default_depth = 4;
+
+        explicit enrollment_pipeline(keymaker const &km, std::size_t depth = default_depth);
+        ~enrollment_pipeline();
+
+        enrollment_pipeline(enrollment_pipeline const &) = delete;
+        enrollment_pipeline &operator=(enrollment_pipeline const &) = delete;
+
+        /**
+         * @brief Starts preparing @p who and @p gates in the background, dropping whatever was prepared before.
+         */
+        void start(identity who, std::vector<gate_config> gates);
+
+        /**
+         * @brief Serves @p t and @p gates, prepared elsewhere, e.g. by a @ref provisioning_plan. The worker stays idle.
+         */
+        void start(prepared_token t, std::vector<prepared_gate> gates);
+
+        /**
+         * @brief Drops the current token. Outstanding @ref take_token and @ref take_gate calls return an error.
+         */
+        void cancel();
+
+        /**
+         * @brief Blocks until the keys and master file of the token passed to @ref start are ready.
+         * @return The prepared token, or
+         *  - @ref desfire::error::parameter_error If no token was started, or it was cancelled.
+         *  - @ref desfire::error::crypto_error If it was not possible to encrypt the identity.
+         */
+        [[nodiscard]] r<prepared_token> take_token();
+
+        /**
+         * @brief Blocks until the next gate, in the order passed to @ref start, is ready.
+         * @return The prepared gate, or
+         *  - @ref desfire::error::parameter_error If all gates have been taken, no token was started, or it was cancelled.
+         *  - @ref desfire::error::crypto_error If it was not possible to encrypt the identity.
+         */
+        [[nodiscard]] r<prepared_gate> take_gate();
+
+        [[nodiscard]] enrollment_pipeline_stats stats() const;
+
+    private:
+        keymaker const &_km;
+        std::size_t _depth;
+        mutable std::mutex _mutex;
+        std::condition_variable _cv;
+        /**
+         * Incremented by @ref start and @ref cancel, so that the worker drops the results of a stale job.
+         */
+        std::uint32_t _generation = 0;
+        bool _active = false;
+        identity _who{};
+        std::vector<gate_config> _gates{};
+        std::optional<r<prepared_token>> _token = std::nullopt;
+        std::deque<r<prepared_gate>> _ready{};
+        std::size_t _count = 0;
+        std::size_t _prepared = 0;
+        std::size_t _taken = 0;
+        enrollment_pipeline_stats _stats{};
+        bool _stop = false;
+        std::thread _worker;
+
+        [[nodiscard]] bool has_work() const;
+        void worker_loop();
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_ENROLLMENT_PIPELINE_HPP
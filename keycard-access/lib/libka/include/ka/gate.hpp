@@ -8,8 +8,14 @@
 #include <cstdint>
 #include <desfire/data.hpp>
 #include <ka/data.hpp>
+#include <ka/deploy_queue.hpp>
 #include <ka/key_pair.hpp>
+#include <ka/link_quality.hpp>
 #include <ka/member_token.hpp>
+#include <ka/revocation_record.hpp>
+#include <ka/token_list.hpp>
+#include <optional>
+#include <vector>
 
 namespace pn532 {
     class controller;
@@ -26,6 +32,13 @@ namespace ka {
 
     struct gate_base_key : public mlab::tagged_array<gate_base_key_tag, 32> {
         [[nodiscard]] gate_token_key derive_token_key(token_id const &token_id, std::uint8_t key_no) const;
+
+        /**
+         * @brief Base key of gate @p id derived from the secret key of a keymaker, which then does not need to store it.
+         * @param version Version of the key material of the gate, see @ref gate::rotate_keys. Version 0 is the key
+         *  the gate is configured with.
+         */
+        [[nodiscard]] static gate_base_key derive_from(sec_key const &master, gate_id id, std::uint32_t version = 0);
     };
 
     struct gate_config {
@@ -34,6 +47,48 @@ namespace ka {
         gate_base_key app_base_key{};
     };
 
+    /**
+     * @brief Credentials shared by a group of gates, e.g. all the doors of a floor.
+     *
+     * A group takes an id from the same space as the gates, and is enrolled on a token exactly like a gate with
+     * @ref config, so a single file and key on the token open every member gate. Each member gate holds the secret
+     * key and the base key of the group, and tries the group file when the token has no file for the gate itself.
+     */
+    struct gate_group {
+        gate_id id{};
+        key_pair keys{};
+        gate_base_key app_base_key{};
+
+        /**
+         * @brief The configuration under which the group is registered and enrolled, as if it were a gate.
+         */
+        [[nodiscard]] gate_config config() const;
+
+        /**
+         * @brief Key pair and base key of group @p id derived from the secret key of a keymaker, which then does not
+         * need to store them.
+         */
+        [[nodiscard]] static gate_group derive_from(sec_key const &master, gate_id id);
+    };
+
+    /**
+     * @brief Key pair and base key of a gate, as they were before @ref gate::rotate_keys.
+     */
+    struct gate_key_material {
+        key_pair keys{};
+        gate_base_key app_base_key{};
+    };
+
+    struct gate_key_status {
+        std::uint32_t version = 0;
+        bool previous_accepted = false;
+        std::uint32_t rekey_grants = 0;
+        /**
+         * Tokens moved to the current version since the last rotation, or since the gate was started.
+         */
+        std::uint32_t migrated = 0;
+    };
+
     /**
      * @brief Class that reacts to authentication attempts.
      */
@@ -50,10 +105,16 @@ namespace ka {
      */
     class gate_responder : public virtual member_token_responder, public virtual gate_auth_responder {
         gate &_g;
+        link_quality _link{};
 
     public:
         explicit gate_responder(gate &g) : _g{g} {}
 
+        /**
+         * @brief RF statistics of the reader, fed by @ref on_failed_scan.
+         */
+        [[nodiscard]] link_quality &link() { return _link; }
+
         /**
          * @addtogroup Default responder method implementations
          * These methods are implemented only so that who sees this header can glance over all available events.
@@ -77,6 +138,31 @@ namespace ka {
 
     class gate {
     public:
+        /**
+         * Each group costs one more file read on a token that is not enrolled in the gate itself.
+         */
+        static constexpr std::size_t max_groups = 8;
+        /**
+         * @addtogroup NVS budget
+         * Everything the gate persists shares the 16 KiB nvs partition, of which about 12 KiB hold data, and a blob
+         * is rewritten before the old copy is erased, so the largest one must fit twice. With the revocation list at
+         * most @ref token_list::max_size ids (3.5 KiB), the grants and the certificates below take at most about
+         * 1.5 KiB and 2 KiB.
+         * @{
+         */
+        /**
+         * Grants take 23 bytes each, in RAM and in NVS. Each one is dropped once its token is migrated, so the keymaker
+         * can grant more in a later session.
+         */
+        static constexpr std::size_t max_rekey_grants = 64;
+        /**
+         * Certificates take up to about 85 bytes each, in RAM and in NVS.
+         */
+        static constexpr std::size_t max_deploy_certificates = 24;
+        /**
+         * @}
+         */
+
         gate() = default;
         gate(gate const &) = delete;
         gate(gate &&) = default;
@@ -90,9 +176,91 @@ namespace ka {
         [[nodiscard]] inline gate_id id() const;
         [[nodiscard]] inline gate_base_key app_base_key() const;
 
+        /**
+         * @brief Tokens that are denied access even if they hold a valid gate file. Kept in sync by the keymaker.
+         */
+        [[nodiscard]] inline token_list const &revoked_tokens() const;
+        [[nodiscard]] inline token_list &revoked_tokens();
+
+        /**
+         * @brief Public key of the keymaker for @ref revocation_record, see @ref keymaker::derive_epoch_signer.
+         *
+         * Once set, on each tap the gate reads the @ref revocation_epoch of the token; if it is newer than
+         * @ref revoked_tokens, it reads the delta, verifies it and applies it, so that revocations reach the gate
+         * through the cards of its members.
+         */
+        [[nodiscard]] inline std::optional<epoch_pub_key> const &epoch_key() const;
+        inline void set_epoch_key(std::optional<epoch_pub_key> key);
+
+        /**
+         * @brief Groups this gate is a member of; their files on a token grant access too.
+         */
+        [[nodiscard]] inline std::vector<gate_group> const &groups() const;
+
+        /**
+         * @brief Tokens this gate enrolls by itself on their next tap.
+         *
+         * When a token that is not enrolled in the gate, nor in any of its groups, has a certificate here, the gate
+         * runs @ref member_token::enroll_gate with it, grants access and drops the certificate.
+         */
+        [[nodiscard]] inline deploy_queue const &pending_deploys() const;
+        [[nodiscard]] inline deploy_queue &pending_deploys();
+
+        /**
+         * @brief Version of @ref keys and @ref app_base_key, increased by each @ref rotate_keys.
+         */
+        [[nodiscard]] inline std::uint32_t key_version() const;
+        [[nodiscard]] gate_key_status key_status() const;
+
+        /**
+         * @brief Switches to a new key pair and to @p base_key, as version @p version of the key material.
+         *
+         * Tokens enrolled with the previous version are still accepted until @ref retire_previous_keys. On tap, a
+         * token holding the previous version is migrated to the current one: the gate encrypts its identity with
+         * the new keys, writes the gate file and changes the token key. This needs the gate app master key of the
+         * token, which the keymaker grants with @ref grant_rekey; tokens without a grant are accepted but not
+         * migrated. If the previous version is still accepted, it is dropped.
+         * @return False if @p version is not the next one.
+         */
+        [[nodiscard]] bool rotate_keys(std::uint32_t version, gate_base_key base_key);
+
+        /**
+         * @brief Ends the grace period of the previous key material, and drops the grants.
+         */
+        void retire_previous_keys();
+
+        /**
+         * @brief Allows the gate to migrate token @p id, see @ref rotate_keys.
+         * @return False if the gate already holds @ref max_rekey_grants grants.
+         */
+        [[nodiscard]] bool grant_rekey(token_id const &id, raw_gate_app_master_key const &mkey);
+
+        /**
+         * @brief Incremented by each change to the grants, also when one replaces another, so that an admin session
+         * knows when to persist them with @ref key_rotation_store.
+         */
+        [[nodiscard]] inline std::uint32_t rekey_grants_revision() const;
+
+        /**
+         * @brief Adds the gate to @p grp, or updates its credentials if it is already a member.
+         * @return False if the gate is already a member of @ref max_groups groups.
+         */
+        [[nodiscard]] bool join_group(gate_group const &grp);
+
+        /**
+         * @return False if the gate was not a member of @p id.
+         */
+        bool leave_group(gate_id id);
+
         void regenerate_keys();
         void configure(gate_id id, std::string desc, pub_key prog_pub_key);
 
+        /**
+         * @brief Configures the gate with a base key chosen by the programmer, instead of the one generated by
+         * @ref regenerate_keys. See @ref gate_base_key::derive_from.
+         */
+        void configure(gate_id id, std::string desc, pub_key prog_pub_key, gate_base_key base_key);
+
         /**
          * @warning This is intended for demonstrational use only on one device, *never* use in prod!
          */
@@ -106,19 +274,71 @@ namespace ka {
         [[nodiscard]] bool config_load();
         static void config_clear();
 
+        /**
+         * @brief Persists only @ref revoked_tokens and @ref epoch_key, which change more often than the rest of the
+         * configuration.
+         */
+        void token_lists_store(nvs::partition &partition) const;
+        void token_lists_store() const;
+
+        /**
+         * @brief Persists only the previous key material and the grants of @ref rotate_keys.
+         */
+        void key_rotation_store(nvs::partition &partition) const;
+        void key_rotation_store() const;
+
+        /**
+         * @brief Persists only @ref groups.
+         */
+        void groups_store(nvs::partition &partition) const;
+        void groups_store() const;
+
+        /**
+         * @brief Persists only @ref pending_deploys.
+         */
+        void pending_deploys_store(nvs::partition &partition) const;
+        void pending_deploys_store() const;
+
         [[nodiscard]] static gate load_from_config(nvs::partition &partition);
         [[nodiscard]] static gate load_from_config();
 
-        void try_authenticate(member_token &token, gate_auth_responder &responder) const;
+        void try_authenticate(member_token &token, gate_auth_responder &responder);
 
         void log_public_gate_info() const;
 
     private:
+        void migrate_token(member_token &token, token_id const &id, identity const &who);
+        [[nodiscard]] r<identity, token_id> deploy_token(member_token &token, desfire::error not_enrolled);
+        void refresh_revocations(member_token &token);
+        [[nodiscard]] nvs::r<> store_key_rotation(nvs::namespc &ns) const;
+        [[nodiscard]] nvs::r<> load_key_rotation(nvs::const_namespc const &ns);
+
         gate_id _id = std::numeric_limits<gate_id>::max();
         std::string _desc;
         key_pair _kp;
         pub_key _prog_pk;
         gate_base_key _base_key{};
+        /**
+         * Also brought up to date by the @ref revocation_record of the tokens, on tap.
+         */
+        token_list _revoked{};
+        std::optional<epoch_pub_key> _epoch_key = std::nullopt;
+        std::vector<gate_group> _groups{};
+        std::uint32_t _key_version = 0;
+        std::optional<gate_key_material> _previous = std::nullopt;
+        /**
+         * Sorted by token id. A grant is dropped once its token is migrated, on tap.
+         */
+        std::vector<std::pair<token_id, raw_gate_app_master_key>> _rekey_grants{};
+        std::uint32_t _rekey_grants_revision = 0;
+        /**
+         * Statistics, updated on tap.
+         */
+        std::uint32_t _migrated = 0;
+        /**
+         * Certificates are consumed on tap.
+         */
+        deploy_queue _deploys{max_deploy_certificates};
     };
 }// namespace ka
 
@@ -143,6 +363,47 @@ namespace ka {
         return _base_key;
     }
 
+    token_list const &gate::revoked_tokens() const {
+        return _revoked;
+    }
+
+    token_list &gate::revoked_tokens() {
+        return _revoked;
+    }
+
+    std::optional<epoch_pub_key> const &gate::epoch_key() const {
+        return _epoch_key;
+    }
+
+    void gate::set_epoch_key(std::optional<epoch_pub_key> key) {
+        _epoch_key = key;
+    }
+
+    std::vector<gate_group> const &gate::groups() const {
+        return _groups;
+    }
+
+    std::uint32_t gate::rekey_grants_revision() const {
+        return _rekey_grants_revision;
+    }
+
+    deploy_queue const &gate::pending_deploys() const {
+        return _deploys;
+    }
+
+    deploy_queue &gate::pending_deploys() {
+        return _deploys;
+    }
+
+    std::uint32_t gate::key_version() const {
+        return _key_version;
+    }
+
 }// namespace ka
 
+namespace mlab {
+    bin_stream &operator>>(bin_stream &s, ka::gate_key_status &status);
+    bin_data &operator<<(bin_data &bd, ka::gate_key_status const &status);
+}// namespace mlab
+
 #endif//KEYCARDACCESS_GATE_HPP
@@ -0,0 +1,88 @@
+#ifndef KEYCARD_ACCESS_GATE_DIRECTORY_HPP
+#define KEYCARD_ACCESS_GATE_DIRECTORY_HPP
+
+#include <ka/data.hpp>
+#include <optional>
+#include <vector>
+
+namespace ka {
+    class gate_directory;
+}
+
+namespace mlab {
+    bin_stream &operator>>(bin_stream &s, ka::gate_directory &dir);
+    bin_data &operator<<(bin_data &bd, ka::gate_directory const &dir);
+}// namespace mlab
+
+namespace ka {
+
+    /**
+     * @brief Maps the gates enrolled on a token to compact locations, so that any @ref gate_id fits on any card.
+     *
+     * With the fixed @ref gate_id::app_and_file mapping, gate `n` lives in app `n / 13`, so a large or sparse id
+     * needs an app far up the range, which a card with room for about 28 apps cannot reach. The directory instead
+     * assigns to each gate the lowest app index that has its file free; the file, and thus the key number, stays
+     * @ref gate_id::file, so the keys derived for a gate do not depend on where it lands. The location is expressed
+     * as the @ref gate_id that the fixed mapping would place there.
+     *
+     * It is stored in plain in file @ref file_id of the master app, freely readable, like the list of gate apps is.
+     * The table uses open addressing with linear probing on a hash of the gate id, so that after reading the file
+     * once per session a gate finds its location in O(1). Layout: version, base 2 log of the capacity, then for each
+     * slot the gate id (32 bits, little endian, @ref empty if unused) and the app index (8 bits).
+     */
+    class gate_directory {
+    public:
+        static constexpr desfire::file_id file_id = 0x1f;
+        static constexpr std::uint8_t version = 1;
+        static constexpr std::size_t entry_size = 4 + 1;
+        static constexpr std::uint8_t min_capacity_log2 = 3;
+        static constexpr std::uint8_t max_capacity_log2 = 9;
+        static constexpr std::uint32_t empty = 0xffffffff;
+
+        gate_directory();
+
+        /**
+         * @brief Location of @p gid on the token, or nothing if it is not enrolled.
+         */
+        [[nodiscard]] std::optional<gate_id> find(gate_id gid) const;
+
+        /**
+         * @brief Location of @p gid, assigning a new one if needed.
+         * @return The location, or nothing if the directory is full.
+         */
+        [[nodiscard]] std::optional<gate_id> assign(gate_id gid);
+
+        [[nodiscard]] std::size_t size() const;
+        [[nodiscard]] std::size_t capacity() const;
+
+        /**
+         * @brief Number of gate apps the locations span.
+         */
+        [[nodiscard]] std::uint32_t apps() const;
+
+        /**
+         * @brief The enrolled gates, in table order.
+         */
+        [[nodiscard]] std::vector<gate_id> gates() const;
+
+        friend mlab::bin_stream &mlab::operator>>(mlab::bin_stream &s, gate_directory &dir);
+        friend mlab::bin_data &mlab::operator<<(mlab::bin_data &bd, gate_directory const &dir);
+
+    private:
+        struct entry {
+            std::uint32_t gid = empty;
+            std::uint8_t app = 0;
+        };
+
+        std::uint8_t _capacity_log2 = min_capacity_log2;
+        std::vector<entry> _table;
+        std::size_t _size = 0;
+
+        [[nodiscard]] std::size_t home_of(std::uint32_t gid) const;
+        void place(entry e);
+        [[nodiscard]] bool grow();
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_GATE_DIRECTORY_HPP
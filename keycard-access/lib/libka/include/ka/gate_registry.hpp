@@ -0,0 +1,118 @@
+#ifndef KEYCARD_ACCESS_GATE_REGISTRY_HPP
+#define KEYCARD_ACCESS_GATE_REGISTRY_HPP
+
+#include <ka/gate.hpp>
+#include <ka/paged_table.hpp>
+#include <optional>
+#include <vector>
+
+namespace ka {
+
+    struct gate_registry_stats {
+        paged_table_stats by_id{};
+        paged_table_stats by_pub_key{};
+        page_cache_stats cache{};
+    };
+
+    /**
+     * @brief The @ref gate_config of every gate configured by a keymaker, on flash.
+     *
+     * The gates are stored in a @ref paged_table keyed by @ref gate_id, with a secondary @ref paged_table that maps a
+     * prefix of the public key to the gate id. Lookups by id or by public key take a binary search over the in-RAM page
+     * table and a few block reads, regardless of the number of gates; the RAM used is the page tables, the logs and
+     * the @ref page_cache.
+     *
+     * Until @ref open is called, the registry is kept in RAM only.
+     *
+     * When a master key is set with @ref set_master_key, gates whose base key is @ref gate_base_key::derive_from
+     * the master key are stored with a blank base key, which @ref find derives again; the flash then holds no
+     * per-gate secret.
+     *
+     * Ids below @ref next_id that are not registered, because their gate was erased or skipped by @ref allocate,
+     * are kept in a free list and handed out again. With a master key, however, an erased gate leaves a retired entry
+     * behind and its id is never handed out again: keys derived from the master key depend only on the id (and the
+     * key version, which restarts with a new gate), so a new gate with that id would accept the cards of the old one.
+     */
+    class gate_registry {
+    public:
+        static constexpr std::size_t pub_key_prefix_size = 4;
+        static constexpr std::size_t id_entry_size = 4 + raw_pub_key::array_size + gate_base_key::array_size;
+        static constexpr std::size_t pub_key_entry_size = pub_key_prefix_size + 4;
+
+        gate_registry();
+
+        gate_registry(gate_registry const &) = delete;
+        gate_registry &operator=(gate_registry const &) = delete;
+
+        /**
+         * @brief Loads the registry from @p region, formatting it if needed.
+         * A quarter of the region goes to the public key index.
+         */
+        [[nodiscard]] bool open(flash_region region);
+
+        [[nodiscard]] bool is_persistent() const;
+
+        /**
+         * @brief Key from which gate base keys are derived. Must outlive the registry; nullptr stores every key.
+         */
+        void set_master_key(sec_key const *master);
+
+        /**
+         * @brief One past the largest registered @ref gate_id.
+         */
+        [[nodiscard]] gate_id next_id() const;
+
+        /**
+         * @brief Picks an unused id for a new gate, that is usually granted together with the gates in @p affinity.
+         *
+         * Each DESFire app holds @ref gate_id::gates_per_app gates, so a member whose gates share apps needs fewer
+         * apps on the card. The id is taken from the app block holding most of @p affinity that has room; if none,
+         * a fresh block is started, so that the gates granted together with this one can join it. Without affinity,
+         * the lowest free id is reused, or @ref next_id.
+         */
+        [[nodiscard]] gate_id allocate(std::vector<gate_id> const &affinity = {}) const;
+
+        /**
+         * @brief Registers a new gate, or replaces the configuration of an existing one. Fails on a retired id.
+         */
+        [[nodiscard]] bool insert(gate_config const &cfg);
+
+        /**
+         * @brief Removes a decommissioned gate; its id goes to the free list, or is retired if a master key is set.
+         */
+        [[nodiscard]] bool erase(gate_id id);
+
+        /**
+         * @brief True if @p id belonged to an erased gate and cannot be registered again.
+         */
+        [[nodiscard]] bool is_retired(gate_id id);
+
+        /**
+         * @brief Ids below @ref next_id that are not registered, in order.
+         */
+        [[nodiscard]] std::vector<gate_id> const &free_ids() const;
+
+        [[nodiscard]] std::optional<gate_config> find(gate_id id);
+        [[nodiscard]] std::optional<gate_config> find(pub_key const &pk);
+
+        /**
+         * @brief Merges the pending updates into the tables. Happens automatically when the logs are full.
+         */
+        [[nodiscard]] bool compact();
+
+        [[nodiscard]] gate_registry_stats stats() const;
+
+    private:
+        page_cache _cache;
+        paged_table _by_id;
+        paged_table _by_pk;
+        gate_id _next_id{0};
+        std::vector<gate_id> _free{};
+        sec_key const *_master = nullptr;
+
+        void load_ids();
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_GATE_REGISTRY_HPP
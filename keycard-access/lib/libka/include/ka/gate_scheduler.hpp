@@ -0,0 +1,159 @@
+#ifndef KEYCARD_ACCESS_GATE_SCHEDULER_HPP
+#define KEYCARD_ACCESS_GATE_SCHEDULER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <ka/gate.hpp>
+#include <ka/p2p_ops.hpp>
+#include <ka/secure_p2p.hpp>
+#include <memory>
+#include <pn532/controller.hpp>
+
+namespace ka {
+
+    struct gate_scheduler_options {
+        /**
+         * Time spent polling for cards before listening for a keymaker, when no admin session is in progress.
+         */
+        std::chrono::milliseconds card_window{400};
+        /**
+         * Time spent as a DEP target waiting for a keymaker, when no admin session is in progress.
+         */
+        std::chrono::milliseconds admin_window{100};
+        /**
+         * Longest time an admin session holds the controller before cards get a window. This bounds the latency that
+         * an admin session adds to a member badging in.
+         */
+        std::chrono::milliseconds admin_slice{500};
+        /**
+         * Card window granted between two slices of an admin session. This bounds the latency that card service adds
+         * to an admin session.
+         */
+        std::chrono::milliseconds card_window_during_admin{250};
+        /**
+         * How long a preempted admin session has to come back before it is considered over.
+         */
+        std::chrono::milliseconds admin_resume_window{1000};
+        /**
+         * An admin session ends when the keymaker does not send anything for this long.
+         */
+        std::chrono::milliseconds admin_idle_timeout{1000};
+    };
+
+    struct gate_scheduler_stats {
+        std::uint32_t card_windows = 0;
+        std::uint32_t admin_windows = 0;
+        std::uint32_t admin_sessions = 0;
+        /**
+         * Times an admin session was suspended to give cards a window.
+         */
+        std::uint32_t preemptions = 0;
+        std::uint32_t resumed_sessions = 0;
+        std::uint32_t batches_served = 0;
+        /**
+         * Longest time the card reader was not polling.
+         */
+        std::chrono::milliseconds max_card_wait{0};
+        /**
+         * Longest time a preempted admin session waited for the controller.
+         */
+        std::chrono::milliseconds max_admin_wait{0};
+    };
+
+    /**
+     * @brief The card side of a @ref gate_scheduler.
+     */
+    class card_service {
+    public:
+        /**
+         * @brief Serves cards for about @p duration. A card that is being served is never interrupted.
+         */
+        virtual void serve(std::chrono::milliseconds duration) = 0;
+
+        /**
+         * @brief Makes @ref serve return at the first chance. Can be called from any task.
+         */
+        virtual void stop() = 0;
+
+        virtual ~card_service() = default;
+    };
+
+    /**
+     * @brief @ref card_service that polls cards with a PN532 and hands them to a @ref gate_responder.
+     */
+    class pn532_card_service final : public card_service {
+        gate_responder &_responder;
+        pn532::scanner _scanner;
+
+    public:
+        pn532_card_service(pn532::controller &ctrl, gate_responder &responder);
+
+        void serve(std::chrono::milliseconds duration) override;
+        void stop() override;
+    };
+
+    /**
+     * @brief Cooperative scheduler that shares a single PN532 between card service and admin sessions.
+     *
+     * The controller alternates between polling cards through @ref gate_responder, and listening as a DEP target for
+     * a keymaker. Whichever side is active gets priority: a card in the field is served to the end, and an admin
+     * session keeps the controller for up to @ref gate_scheduler_options::admin_slice. After that, the session is
+     * suspended for a short card window; the keymaker then reactivates the gate and resumes the secure session
+     * through its ticket, without a new key exchange.
+     *
+     * Token lists changed by an admin session are persisted once the session is over.
+     *
+     * On a PN532, both sides share the controller: pass a @ref pn532_card_service and a @ref p2p::pn532_dep_target
+     * built on the same @ref pn532::controller.
+     */
+    class gate_scheduler {
+        card_service &_cards;
+        p2p::dep_target &_admin;
+        gate &_g;
+        gate_scheduler_options _opts;
+        std::shared_ptr<p2p::session_ticket_store> _tickets;
+        std::atomic<bool> _stop{false};
+
+        /**
+         * True while an admin session is suspended.
+         */
+        bool _admin_pending = false;
+        list_summary _revoked_before{};
+        std::uint32_t _rekey_grants_before = 0;
+        std::uint32_t _deploys_before = 0;
+        std::int64_t _card_idle_since = 0;
+        std::int64_t _admin_suspended_at = 0;
+        gate_scheduler_stats _stats{};
+
+        enum struct admin_outcome {
+            nobody,
+            suspended,
+            ended
+        };
+
+        void card_window(std::chrono::milliseconds duration);
+        [[nodiscard]] admin_outcome admin_window(std::chrono::milliseconds activation_timeout);
+        void end_admin_session();
+
+    public:
+        gate_scheduler(card_service &cards, p2p::dep_target &admin, gate &g, gate_scheduler_options opts = {});
+
+        gate_scheduler(gate_scheduler const &) = delete;
+        gate_scheduler &operator=(gate_scheduler const &) = delete;
+
+        /**
+         * @brief Runs until @ref stop is called.
+         */
+        void loop();
+
+        /**
+         * @brief Makes @ref loop return at the end of the current window. Can be called from any task.
+         */
+        void stop();
+
+        [[nodiscard]] gate_scheduler_stats const &stats() const;
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_GATE_SCHEDULER_HPP
@@ -15,6 +15,20 @@ namespace ka {
     using raw_pub_key = mlab::tagged_array<pub_key_tag, 32>;
     using raw_sec_key = mlab::tagged_array<sec_key_tag, 32>;
 
+    struct gate_app_master_key_tag {};
+
+    /**
+     * @brief Body of a @ref gate_app_master_key, which always has key number 0, to hand it over to a gate.
+     */
+    using raw_gate_app_master_key = mlab::tagged_array<gate_app_master_key_tag, key_type::size>;
+
+    struct token_root_key_tag {};
+
+    /**
+     * @brief Body of a @ref token_root_key, which always has key number 0, to hand it over to a gate.
+     */
+    using raw_token_root_key = mlab::tagged_array<token_root_key_tag, key_type::size>;
+
 
     class pub_key {
     public:
@@ -45,6 +59,7 @@ namespace ka {
          * @return A key_type which gives root access to the card.
          */
         [[nodiscard]] token_root_key derive_token_root_key(token_id const &id) const;
+        [[nodiscard]] raw_token_root_key derive_raw_token_root_key(token_id const &id) const;
 
         /**
          * @brief A differentiated app key to be used as the master of a token app.
@@ -52,6 +67,7 @@ namespace ka {
          * @return A key_type which gives root access to the card.
          */
         [[nodiscard]] gate_app_master_key derive_gate_app_master_key(token_id const &id) const;
+        [[nodiscard]] raw_gate_app_master_key derive_raw_gate_app_master_key(token_id const &id) const;
 
     protected:
         raw_sec_key _sk{};
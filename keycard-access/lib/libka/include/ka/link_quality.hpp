@@ -0,0 +1,122 @@
+#ifndef KEYCARD_ACCESS_LINK_QUALITY_HPP
+#define KEYCARD_ACCESS_LINK_QUALITY_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace ka {
+
+    struct rtt_policy {
+        std::chrono::milliseconds initial_timeout{250};
+        std::chrono::milliseconds min_timeout{20};
+        std::chrono::milliseconds max_timeout{1000};
+        unsigned min_retries = 1;
+        unsigned max_retries = 5;
+        /**
+         * Probability of giving up on a message that the retries should not exceed, given the measured loss rate.
+         */
+        float target_failure = 0.01f;
+    };
+
+    /**
+     * @brief Round trip time estimator in the style of TCP (RFC 6298, Jacobson/Karels).
+     *
+     * The smoothed RTT and its variation are updated with gains 1/8 and 1/4, and the timeout is `srtt + 4 rttvar`,
+     * doubled after each consecutive loss. Only round trips that were not retransmitted must be sampled (Karn's
+     * algorithm). The loss rate is an exponential average over the last ~16 exchanges, and determines how many
+     * retries are needed to reach @ref rtt_policy::target_failure.
+     */
+    class rtt_estimator {
+        rtt_policy _policy{};
+        std::chrono::microseconds _srtt{0};
+        std::chrono::microseconds _rttvar{0};
+        bool _has_samples = false;
+        unsigned _backoff = 0;
+        float _loss_rate = 0.f;
+
+    public:
+        rtt_estimator() = default;
+        explicit rtt_estimator(rtt_policy policy);
+
+        void sample(std::chrono::microseconds rtt);
+        void on_success();
+        void on_loss();
+
+        [[nodiscard]] bool has_samples() const;
+        [[nodiscard]] std::chrono::microseconds srtt() const;
+        [[nodiscard]] std::chrono::microseconds rttvar() const;
+        [[nodiscard]] float loss_rate() const;
+
+        /**
+         * @brief Timeout for the next attempt, including the exponential backoff.
+         */
+        [[nodiscard]] std::chrono::milliseconds timeout() const;
+
+        /**
+         * @brief Number of retries after the first attempt.
+         */
+        [[nodiscard]] unsigned retries() const;
+
+        [[nodiscard]] rtt_policy const &policy() const;
+    };
+
+    /**
+     * @brief Counts events over a sliding window of one minute, in 10 s buckets.
+     */
+    class event_rate {
+        static constexpr std::int64_t bucket_us = 10'000'000;
+        std::array<std::uint32_t, 6> _buckets{};
+        std::int64_t _current = 0;
+        std::uint32_t _total = 0;
+
+        void advance(std::int64_t now_us);
+
+    public:
+        void record(std::int64_t now_us);
+        [[nodiscard]] std::uint32_t per_minute(std::int64_t now_us);
+        [[nodiscard]] std::uint32_t total() const;
+    };
+
+    struct link_quality_report {
+        std::chrono::microseconds srtt{0};
+        std::chrono::microseconds rttvar{0};
+        std::chrono::milliseconds timeout{0};
+        unsigned retries = 0;
+        float loss_rate = 0.f;
+        std::uint32_t failed_scans_per_minute = 0;
+        std::uint32_t retries_per_minute = 0;
+        std::uint32_t timeouts_per_minute = 0;
+        std::uint32_t failed_scans = 0;
+        std::uint32_t total_retries = 0;
+        std::uint32_t timeouts = 0;
+    };
+
+    /**
+     * @brief RF link statistics, and the @ref rtt_estimator that sets timeouts and retries on it.
+     * @note Not thread safe, meant to be used by the task that drives the PN532.
+     */
+    class link_quality {
+        rtt_estimator _rtt;
+        event_rate _failed_scans;
+        event_rate _retries;
+        event_rate _timeouts;
+
+    public:
+        link_quality() = default;
+        explicit link_quality(rtt_policy policy);
+
+        [[nodiscard]] rtt_estimator &rtt();
+        [[nodiscard]] rtt_estimator const &rtt() const;
+
+        void record_failed_scan();
+        void record_retry();
+        void record_timeout();
+
+        [[nodiscard]] link_quality_report report();
+        void log_report();
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_LINK_QUALITY_HPP
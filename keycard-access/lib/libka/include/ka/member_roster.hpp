@@ -0,0 +1,149 @@
+#ifndef KEYCARD_ACCESS_MEMBER_ROSTER_HPP
+#define KEYCARD_ACCESS_MEMBER_ROSTER_HPP
+
+#include <ka/data.hpp>
+#include <ka/paged_table.hpp>
+#include <optional>
+
+namespace ka {
+
+    struct member_record {
+        identity who{};
+        bool revoked = false;
+    };
+
+    struct member_roster_stats {
+        std::uint32_t members = 0;
+        paged_table_stats records{};
+        paged_table_stats by_hash{};
+        paged_table_stats gates_by_token{};
+        paged_table_stats tokens_by_gate{};
+        page_cache_stats cache{};
+    };
+
+    /**
+     * @brief How the gates of the roster spread over the DESFire apps of the cards, see @ref gate_id::app.
+     */
+    struct gate_app_usage {
+        /**
+         * Members that open at least one gate.
+         */
+        std::uint32_t cards = 0;
+        std::uint32_t gates = 0;
+        /**
+         * Gate apps over all cards, and on the card that has the most, with the fixed @ref gate_id::app mapping of
+         * cards without a @ref gate_directory.
+         */
+        std::uint32_t apps = 0;
+        std::uint32_t max_apps = 0;
+        /**
+         * The same, with the locations of a @ref gate_directory, which every deployed card carries. The directory puts
+         * each gate in the lowest app where its file is free, so a card spans as many apps as it has gates sharing the
+         * same @ref gate_id::file, whatever the enrollment order.
+         */
+        std::uint32_t directory_apps = 0;
+        std::uint32_t max_directory_apps = 0;
+        /**
+         * Gate apps that would be needed if the gates of each card were packed in as few apps as possible.
+         */
+        std::uint32_t packed_apps = 0;
+
+        [[nodiscard]] float apps_per_card() const;
+        [[nodiscard]] float directory_apps_per_card() const;
+    };
+
+    /**
+     * @brief The members enrolled by a keymaker: which @ref identity is on each token, and which gates each token opens.
+     *
+     * Four @ref paged_table share the region:
+     *  - the records, keyed by @ref token_id, with holder, publisher and revocation flag;
+     *  - an index from a prefix of @ref identity::hash to the token, verified against the record;
+     *  - the gates of each token, keyed by token and gate;
+     *  - the inverted index, keyed by gate and token, so that the holders of a gate are a range scan.
+     *
+     * Every change is appended to the table logs and survives a reboot; see @ref paged_table for crash safety.
+     * Until @ref open is called, the roster is kept in RAM only.
+     */
+    class member_roster {
+    public:
+        static constexpr std::size_t max_holder_size = 32;
+        static constexpr std::size_t max_publisher_size = 16;
+        static constexpr std::size_t record_size = token_id::array_size + 1 + max_holder_size + max_publisher_size;
+        static constexpr std::size_t hash_prefix_size = 4;
+        static constexpr std::size_t hash_entry_size = hash_prefix_size + token_id::array_size;
+        static constexpr std::size_t edge_size = token_id::array_size + 4;
+
+        member_roster();
+
+        member_roster(member_roster const &) = delete;
+        member_roster &operator=(member_roster const &) = delete;
+
+        /**
+         * @brief Loads the roster from @p region, formatting it if needed.
+         * The records take about 60% of the region, the three indices the rest in equal parts.
+         */
+        [[nodiscard]] bool open(flash_region region);
+
+        [[nodiscard]] bool is_persistent() const;
+
+        /**
+         * @brief Number of members.
+         */
+        [[nodiscard]] std::uint32_t size() const;
+
+        /**
+         * @brief Adds a member, or updates its identity, keeping revocation and gates.
+         * Fails if holder or publisher exceed @ref max_holder_size or @ref max_publisher_size.
+         */
+        [[nodiscard]] bool insert(identity const &who);
+
+        /**
+         * @brief Removes the member and all its gates.
+         */
+        [[nodiscard]] bool erase(token_id const &id);
+
+        [[nodiscard]] std::optional<member_record> find(token_id const &id);
+        [[nodiscard]] std::optional<member_record> find(hash_type const &hash);
+
+        [[nodiscard]] bool set_revoked(token_id const &id, bool revoked);
+
+        /**
+         * @brief Records that the token of member @p id opens gate @p gid. The member must exist.
+         */
+        [[nodiscard]] bool add_gate(token_id const &id, gate_id gid);
+        [[nodiscard]] bool remove_gate(token_id const &id, gate_id gid);
+
+        [[nodiscard]] std::vector<gate_id> gates_of(token_id const &id);
+        [[nodiscard]] std::vector<token_id> holders_of(gate_id gid);
+
+        /**
+         * @brief Counts the gate apps on the cards of the roster, in a single scan of the gates of all tokens.
+         */
+        [[nodiscard]] std::optional<gate_app_usage> app_usage();
+
+        /**
+         * @brief Calls @p fn on every member, in @ref token_id order, until it returns false.
+         */
+        [[nodiscard]] bool for_each(std::function<bool(member_record const &)> const &fn);
+
+        /**
+         * @brief Merges the pending updates into the tables. Happens automatically when the logs are full.
+         */
+        [[nodiscard]] bool compact();
+
+        [[nodiscard]] member_roster_stats stats() const;
+
+    private:
+        page_cache _cache;
+        paged_table _records;
+        paged_table _by_hash;
+        paged_table _gates_by_token;
+        paged_table _tokens_by_gate;
+        std::uint32_t _size = 0;
+
+        [[nodiscard]] bool put_edge(token_id const &id, gate_id gid, bool live);
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_MEMBER_ROSTER_HPP
@@ -8,6 +8,9 @@
 #include <desfire/esp32/cipher_provider.hpp>
 #include <desfire/tag_responder.hpp>
 #include <ka/data.hpp>
+#include <ka/gate_directory.hpp>
+#include <ka/revocation_record.hpp>
+#include <optional>
 
 namespace ka {
 
@@ -16,8 +19,32 @@ namespace ka {
     class key_pair;
     class pub_key;
     struct gate_config;
+    struct gate_group;
+    struct gate_key_material;
+    struct deploy_certificate;
     class keymaker;
 
+    /**
+     * @brief Keys and encrypted master file of a token, everything @ref member_token::deploy computes before talking to it.
+     * @see enrollment_pipeline
+     */
+    struct prepared_token {
+        token_id id{};
+        token_root_key rkey{};
+        gate_app_master_key mkey{};
+        mlab::bin_data master_file{};
+    };
+
+    /**
+     * @brief Token key and encrypted file of a gate, everything @ref member_token::enroll_gate computes before talking to the token.
+     * @see enrollment_pipeline
+     */
+    struct prepared_gate {
+        gate_id id{};
+        gate_token_key key{};
+        mlab::bin_data gate_file{};
+    };
+
     /**
      * @brief Specialization of a token responder which casts a @ref desfire::tag into a @ref member_token
      */
@@ -36,6 +63,12 @@ namespace ka {
          */
         mutable desfire::tag *_tag;
 
+        /**
+         * @brief The @ref gate_directory read in this session, or @ref desfire::error::file_not_found if the token has
+         * none and uses the fixed gate mapping.
+         */
+        mutable std::optional<r<gate_directory>> _directory = std::nullopt;
+
         /**
          * @param aid App Id
          * @param fid File Id
@@ -196,6 +229,14 @@ namespace ka {
         template <class Fn>
         r<> list_gate_apps_internal(bool check_app, Fn &&app_action) const;
 
+        /**
+         * @brief Like @ref locate_gate, but adds @p gid to the directory if it is not there, and writes it back.
+         * @return The location, or
+         *  - @ref desfire::error::parameter_error If the directory is full.
+         *  - Any error of @ref read_gate_directory other than @ref desfire::error::file_not_found, or of @ref write_gate_directory.
+         */
+        [[nodiscard]] r<gate_id> assign_gate_location(gate_id gid, gate_app_master_key const &mkey);
+
     public:
         explicit member_token(desfire::tag &tag);
 
@@ -392,6 +433,69 @@ namespace ka {
          */
         r<> write_master_file(gate_app_master_key const &mkey, mlab::bin_data const &data, bool check_app);
 
+        /**
+         * @brief Reads the @ref gate_directory from the master app, once per session.
+         * Does not require any password, the directory is freely readable.
+         * @return The directory, or
+         *  - @ref desfire::error::file_not_found If the token has no directory, and gates are at their @ref gate_id::app_and_file.
+         *  - @ref desfire::error::app_not_found If the master app was not found
+         *  - @ref desfire::error::malformed If it was not possible to parse the directory.
+         *  - Any other @ref desfire::error in case of communication failure.
+         */
+        [[nodiscard]] r<gate_directory> read_gate_directory() const;
+
+        /**
+         * @brief Replaces the @ref gate_directory in the master app.
+         * @param mkey Master key for the gate app. This must have @ref key_type::key_number 0, otherwise
+         *  @ref desfire::error::parameter_error is returned.
+         * @return
+         *  - @ref desfire::error::parameter_error If @p mkey does not have key number 0.
+         *  - @ref desfire::error::permission_denied If @p mkey cannot login
+         *  - @ref desfire::error::app_not_found If the master app was not found
+         *  - Any other @ref desfire::error in case of communication failure.
+         */
+        r<> write_gate_directory(gate_app_master_key const &mkey, gate_directory const &dir);
+
+        /**
+         * @brief Where the app and file of gate @p gid are on this token: the location in the @ref gate_directory if the
+         * token has one, otherwise @p gid itself. The key number is always @ref gate_id::key_no of @p gid.
+         * @return The location, to be used with @ref gate_id::app_and_file, or
+         *  - @ref desfire::error::file_not_found If the token has a directory and @p gid is not in it.
+         *  - Any other error of @ref read_gate_directory.
+         */
+        [[nodiscard]] r<gate_id> locate_gate(gate_id gid) const;
+
+        /**
+         * @brief Reads the header of the @ref revocation_record from the master app. Like the directory, it is freely
+         * readable. The signature is not checked.
+         * @return The header, or
+         *  - @ref desfire::error::file_not_found If the token carries no record.
+         *  - @ref desfire::error::app_not_found If the master app was not found
+         *  - @ref desfire::error::malformed If it was not possible to parse the header.
+         *  - Any other @ref desfire::error in case of communication failure.
+         */
+        [[nodiscard]] r<revocation_epoch> read_revocation_epoch() const;
+
+        /**
+         * @brief Reads the delta of the @ref revocation_record whose header is @p epoch. Neither the digest nor the
+         * signature are checked, see @ref revocation_record::verify.
+         * @return The record, or the same errors as @ref read_revocation_epoch.
+         */
+        [[nodiscard]] r<revocation_record> read_revocation_record(revocation_epoch const &epoch) const;
+
+        /**
+         * @brief Replaces the @ref revocation_record in the master app. The delta is written first, so that an
+         * interrupted write leaves a header whose digest does not match, which gates ignore.
+         * @param mkey Master key for the gate app. This must have @ref key_type::key_number 0, otherwise
+         *  @ref desfire::error::parameter_error is returned.
+         * @return
+         *  - @ref desfire::error::parameter_error If @p mkey does not have key number 0.
+         *  - @ref desfire::error::permission_denied If @p mkey cannot login
+         *  - @ref desfire::error::app_not_found If the master app was not found
+         *  - Any other @ref desfire::error in case of communication failure.
+         */
+        r<> write_revocation_record(gate_app_master_key const &mkey, revocation_record const &rec);
+
         /**
          * @}
          */
@@ -437,6 +541,22 @@ namespace ka {
          */
         r<> enroll_gate_key(gate_id gid, gate_app_master_key const &mkey, gate_token_key const &key, bool check_app);
 
+        /**
+         * @brief Changes the gate key associated to the gate file @p gid from @p previous to @p key.
+         * Unlike @ref enroll_gate_key, the key in place is not the default one.
+         * @param gid Group ID identifying the gate file.
+         * @param mkey Master key to use to change the gate key. This must have @ref key_type::key_number equal to 0,
+         *  otherwise @ref desfire::error::parameter_error is returned.
+         * @param previous Key currently in place, @p key Key to set. Both must have @ref key_type::key_number equal to
+         *  @ref gate_id::key_no, otherwise @ref desfire::error::parameter_error is returned.
+         * @return
+         *  - @ref desfire::error::parameter_error If any key number is incorrect
+         *  - @ref desfire::error::permission_denied If @p mkey does not authenticate
+         *  - @ref desfire::error::app_not_found If the app was not found
+         *  - Any other @ref desfire::error in case of communication failure.
+         */
+        r<> change_gate_key(gate_id gid, gate_app_master_key const &mkey, gate_token_key const &previous, gate_token_key const &key);
+
         /**
          * @brief Lists all gates app existing on this card.
          * Does not require any password, as the gate apps can be selected one by one.
@@ -550,7 +670,7 @@ namespace ka {
          */
 
         /**
-         * @brief Tests if a gate is enrolled.
+         * @brief Tests if a gate is enrolled, at the location given by @ref locate_gate.
          * @param gid Gate ID
          * @param check_app If true, it will call @ref check_gate_app on @ref gate_id::app and in case of failure, it will return
          *  @ref desfire::error::app_integrity_error.
@@ -586,6 +706,7 @@ namespace ka {
 
         /**
          * @brief Lists all gates that are enrolled in this card (according to the existence of gate files).
+         * If the token has a @ref gate_directory, these are the gates in it, otherwise the gate apps are scanned.
          * Does not require any password, as the gate apps are listable without authentication. All apps and files that are
          * not readable or not checkable are simply skipped (and a warning issued).
          * @param check_app If true, it will call @ref check_gate_app on each potential gate app, and skips those that fail the tests.
@@ -619,6 +740,41 @@ namespace ka {
          */
         [[nodiscard]] r<identity, token_id> read_encrypted_gate_file(gate const &g, bool check_app, bool check_file) const;
 
+        /**
+         * @brief Reads the identity from the file of @p grp, a group @p g is a member of.
+         * Like @ref read_encrypted_gate_file, but the key is derived from @ref gate_group::app_base_key, and the identity
+         * is decrypted using @ref gate_group::keys.
+         * @param g Gate. Must be configured, otherwise @ref desfire::error::parameter_error is returned.
+         * @param grp Group of @p g.
+         * @return The identity and the token id, or the same errors as @ref read_encrypted_gate_file.
+         */
+        [[nodiscard]] r<identity, token_id> read_encrypted_gate_file(gate const &g, gate_group const &grp, bool check_app, bool check_file) const;
+
+        /**
+         * @brief Reads the identity from the file of @p g using the key material @p previous, that @p g had before its
+         * last @ref gate::rotate_keys.
+         * A file that is already encrypted with @ref gate::keys is accepted too, as left by an interrupted
+         * @ref migrate_gate_file.
+         * @return The identity and the token id, or the same errors as @ref read_encrypted_gate_file.
+         */
+        [[nodiscard]] r<identity, token_id> read_encrypted_gate_file(gate const &g, gate_key_material const &previous, bool check_app, bool check_file) const;
+
+        /**
+         * @brief Moves the file of @p g from the key material @p previous to the current one.
+         * Writes @p who encrypted with @ref gate::keys into the gate file, then changes the token key with
+         * @ref change_gate_key. If interrupted in between, the file is still readable with the previous token key.
+         * @param g Gate.
+         * @param previous Key material @p g had before its last @ref gate::rotate_keys.
+         * @param mkey Gate app master key of this token, granted by the keymaker.
+         * @param id Id of this token.
+         * @param who Identity read from the gate file.
+         * @return
+         *  - @ref desfire::error::permission_denied If @p mkey cannot login
+         *  - @ref desfire::error::crypto_error If it was not possible to encrypt the identity.
+         *  - Any other error of @ref locate_gate, or @ref desfire::error in case of communication failure.
+         */
+        r<> migrate_gate_file(gate const &g, gate_key_material const &previous, gate_app_master_key const &mkey, token_id const &id, identity const &who);
+
         /**
          * @brief Reads the identity from master file, i.e. file 0 at @ref gate_id::aid_range_begin.
          * This file is exclusively set up by the programmer for its own identification.
@@ -720,6 +876,8 @@ namespace ka {
          *  - @ref setup_root
          *  - @ref create_app
          *  - @ref write_encrypted_master_file
+         *  - @ref write_gate_directory, with an empty @ref gate_directory
+         *  - @ref write_revocation_record, with @ref keymaker::sign_revocations
          * @warning This will format the picc!
          * @return The token id that was used to generate keys, or
          *  - @ref desfire::error::permission_denied if it was not possible to authenticate with any root key
@@ -734,6 +892,8 @@ namespace ka {
          *  - @ref setup_root
          *  - @ref create_app
          *  - @ref write_encrypted_master_file
+         *  - @ref write_gate_directory, with an empty @ref gate_directory
+         *  - @ref write_revocation_record, with @ref keymaker::sign_revocations
          * @warning This will format the picc!
          * @return The token id that was used to generate keys, or
          *  - @ref desfire::error::permission_denied if it was not possible to authenticate with any root key
@@ -747,11 +907,13 @@ namespace ka {
          * This method performs the following sequence of operations:
          *   1. @ref read_encrypted_master_file is called, with app checks and file checks on.
          *      If the obtained identity does not match @p id, @ref desfire::error::parameter_error is returned.
-         *   2. The gate app for @p g is created, if it does not exist. If it exists, it is checked via @ref check_gate_app/
+         *   2. The location of @p g is assigned in the @ref gate_directory, if the token has one.
+         *      The gate app for @p g is created, if it does not exist. If it exists, it is checked via @ref check_gate_app/
          *      This is done via @ref ensure_gate_app.
          *   3. The gate token key is derived from @ref gate_config::app_base_key via @ref gate_base_key::derive_token_key.
          *   4. The @ref gate_token_key is enrolled via @ref enroll_gate_key.
          *   5. The encrypted file is created with @ref write_encrypted_gate_file.
+         *   6. The @ref revocation_record is refreshed with @ref keymaker::sign_revocations.
          * @param km Keymaker.
          * @param g Public gate configuration.
          * @param id Identity to enroll.
@@ -769,6 +931,32 @@ namespace ka {
          */
         r<token_id> enroll_gate(keymaker const &km, gate_config const &g, identity const &id);
 
+        /**
+         * @brief Same as @ref deploy, with keys and master file already computed, so that only RF commands are left.
+         * The token must be the one with id @ref prepared_token::id; this is not checked.
+         */
+        r<> deploy(prepared_token const &t);
+
+        /**
+         * @brief Same as @ref enroll_gate, with keys and gate file already computed, so that only RF commands are left.
+         * The master file is not read back: @p t must be the one just passed to @ref deploy, on this very token.
+         */
+        r<> enroll_gate(prepared_token const &t, prepared_gate const &g);
+
+        /**
+         * @brief Same as @ref enroll_gate, run by gate @p g itself with the keys of a @ref deploy_certificate.
+         * The identity is encrypted with @ref gate::keys for the programmer, which yields the same file the keymaker
+         * would write. The master file is not read back: the token must be the one with id `cert.who.id`.
+         * The certificate does not carry the token root key, so the gate app at the location of @p g must exist
+         * already. This is always the case for the first gate app, which @ref deploy creates.
+         * @return
+         *  - @ref desfire::error::app_not_found If the location of @p g is in a gate app that the token does not have.
+         *  - @ref desfire::error::permission_denied If the key of @p cert does not open the gate app.
+         *  - @ref desfire::error::crypto_error If it was not possible to encrypt the identity.
+         *  - Any other error of @ref assign_gate_location, or @ref desfire::error in case of communication failure.
+         */
+        r<> enroll_gate(gate const &g, deploy_certificate const &cert);
+
         /**
          * @}
          */
@@ -11,6 +11,7 @@
 #include <mlab/bin_data.hpp>
 #include <mlab/result.hpp>
 #include <nvs_flash.h>
+#include <string_view>
 
 namespace ka::nvs {
 
@@ -88,6 +89,9 @@ namespace ka::nvs {
         template <class T, class U, nvs_sized_getter_t<U> GetFn>
         [[nodiscard]] r<T> get_known_sized_type(const char *key) const;
 
+        template <class U, nvs_sized_getter_t<U> GetFn>
+        [[nodiscard]] r<std::size_t> get_known_sized_type_into(const char *key, U *dest, std::size_t capacity) const;
+
         friend class partition;
         const_namespc(std::shared_ptr<const partition> part, nvs_handle_t hdl);
 
@@ -109,11 +113,45 @@ namespace ka::nvs {
         [[nodiscard]] r<std::string> get_str(const char *key) const;
         [[nodiscard]] r<mlab::bin_data> get_blob(const char *key) const;
 
+        /**
+         * @brief Reads a blob straight into @p dest, without any intermediate allocation.
+         * The stored blob must have exactly the size of @p dest. In case of failure, @p dest is zeroed.
+         * @return
+         *  - @ref error::invalid_length if the stored blob is shorter or longer than @p dest
+         *  - @ref error::not_found if @p key does not exist
+         *  - Any other @ref error in case of failure.
+         */
+        r<> get_blob_into(const char *key, mlab::range<std::uint8_t *> dest) const;
+
+        /**
+         * @brief Reads a string straight into @p dest, including the terminating nul character, without allocating.
+         * @return The length of the string (excluding the nul character), or
+         *  - @ref error::invalid_length if the string (with its nul character) does not fit into @p dest
+         *  - @ref error::not_found if @p key does not exist
+         *  - Any other @ref error in case of failure.
+         */
+        [[nodiscard]] r<std::size_t> get_str_into(const char *key, mlab::range<char *> dest) const;
+
         [[nodiscard]] std::size_t used_entries() const;
 
         template <class T>
         [[nodiscard]] r<T> get(const char *key) const;
 
+        /**
+         * @brief Allocation-free version of @ref get_blob for fixed-size data such as keys (works with `tagged_array`).
+         * @see get_blob_into
+         */
+        template <std::size_t N>
+        r<> get_into(const char *key, std::array<std::uint8_t, N> &dest) const;
+
+        /**
+         * @brief Allocation-free version of @ref get_str for short strings.
+         * @return A view over @p dest, without the terminating nul character.
+         * @see get_str_into
+         */
+        template <std::size_t N>
+        [[nodiscard]] r<std::string_view> get_into(const char *key, std::array<char, N> &dest) const;
+
         ~const_namespc();
     };
 
@@ -187,6 +225,21 @@ namespace ka::nvs {
             return get_blob(key);
         }
     }
+
+    template <std::size_t N>
+    r<> const_namespc::get_into(const char *key, std::array<std::uint8_t, N> &dest) const {
+        return get_blob_into(key, mlab::make_range(dest.data(), dest.data() + N));
+    }
+
+    template <std::size_t N>
+    r<std::string_view> const_namespc::get_into(const char *key, std::array<char, N> &dest) const {
+        if (const auto r = get_str_into(key, mlab::make_range(dest.data(), dest.data() + N)); r) {
+            return std::string_view{dest.data(), *r};
+        } else {
+            return r.error();
+        }
+    }
+
     template <class T>
     r<> namespc::set(const char *key, T const &value) {
         if constexpr (std::is_same_v<T, std::uint8_t>) {
@@ -0,0 +1,137 @@
+#ifndef KEYCARD_ACCESS_NVS_CACHE_HPP
+#define KEYCARD_ACCESS_NVS_CACHE_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <ka/nvs.hpp>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <variant>
+
+namespace ka::nvs {
+
+    using cached_value = std::variant<std::uint8_t, std::uint16_t, std::uint32_t, std::uint64_t,
+                                      std::int8_t, std::int16_t, std::int32_t, std::int64_t,
+                                      std::string, mlab::bin_data>;
+
+    struct write_back_stats {
+        /**
+         * Number of @ref write_back_cache::set and @ref write_back_cache::erase calls.
+         */
+        std::uint32_t updates = 0;
+        /**
+         * Number of set and erase operations that actually reached NVS.
+         */
+        std::uint32_t writes = 0;
+        /**
+         * Number of flushes that wrote at least one item, and number of those that failed.
+         */
+        std::uint32_t flushes = 0;
+        std::uint32_t failed_flushes = 0;
+
+        std::chrono::microseconds last_flush_latency{0};
+        std::chrono::microseconds max_flush_latency{0};
+        std::chrono::microseconds total_flush_latency{0};
+
+        /**
+         * @brief Ratio between NVS writes and logical updates. Below 1 means the cache is coalescing updates.
+         */
+        [[nodiscard]] float write_amplification() const;
+
+        [[nodiscard]] std::chrono::microseconds average_flush_latency() const;
+    };
+
+    /**
+     * @brief Write-back layer on top of @ref namespc.
+     * Updates are kept in RAM and coalesced, so that a value that changes many times between flushes hits the flash
+     * only once. Dirty values are flushed periodically by a background thread, when @ref flush is called, when the
+     * cache is destroyed and before the chip restarts via `esp_restart`.
+     * @note ESP-IDF does not notify before entering deep sleep, call @ref flush_all before `esp_deep_sleep_start`.
+     */
+    class write_back_cache {
+        std::shared_ptr<namespc> _ns;
+        std::map<std::string, std::optional<cached_value>> _dirty;
+        write_back_stats _stats{};
+        mutable std::recursive_mutex _mutex;
+        /**
+         * Guard @ref _stop only, so that the flusher can wait on @ref _cv without holding @ref _mutex.
+         */
+        std::mutex _stop_mutex;
+        std::condition_variable _cv;
+        bool _stop = false;
+        std::thread _flusher;
+
+        void mark_dirty(const char *key, std::optional<cached_value> value);
+
+        void flusher_loop(std::chrono::milliseconds flush_interval);
+
+    public:
+        static constexpr auto default_flush_interval = std::chrono::seconds{30};
+
+        /**
+         * @param ns Namespace to write back into. The cache must be the only writer of the keys it manages.
+         * @param flush_interval Period of the automatic flush; zero disables the background thread.
+         */
+        explicit write_back_cache(std::shared_ptr<namespc> ns, std::chrono::milliseconds flush_interval = default_flush_interval);
+
+        write_back_cache(write_back_cache const &) = delete;
+        write_back_cache(write_back_cache &&) = delete;
+        write_back_cache &operator=(write_back_cache const &) = delete;
+        write_back_cache &operator=(write_back_cache &&) = delete;
+
+        /**
+         * @brief Stops and joins the background thread, then flushes any pending write.
+         */
+        ~write_back_cache();
+
+        template <class T>
+        void set(const char *key, T value);
+
+        void erase(const char *key);
+
+        /**
+         * @brief Reads @p key, giving precedence to pending writes.
+         * @return @ref error::not_found also if a pending value has a different type than @p T, consistently with NVS.
+         */
+        template <class T>
+        [[nodiscard]] r<T> get(const char *key) const;
+
+        /**
+         * @brief Writes all pending values and commits. Values stay dirty until they are written and committed, so
+         * that a failed flush is retried by the next one.
+         */
+        r<> flush();
+
+        [[nodiscard]] std::size_t dirty_count() const;
+        [[nodiscard]] write_back_stats stats() const;
+
+        /**
+         * @brief Flushes every live @ref write_back_cache. Registered as a shutdown handler, call before deep sleep.
+         */
+        static void flush_all();
+    };
+}// namespace ka::nvs
+
+namespace ka::nvs {
+
+    template <class T>
+    void write_back_cache::set(const char *key, T value) {
+        static_assert(std::is_constructible_v<cached_value, T>, "Unsupported NVS type.");
+        mark_dirty(key, cached_value{std::move(value)});
+    }
+
+    template <class T>
+    r<T> write_back_cache::get(const char *key) const {
+        std::unique_lock guard{_mutex};
+        if (const auto it = _dirty.find(key); it != std::end(_dirty)) {
+            if (it->second and std::holds_alternative<T>(*it->second)) {
+                return std::get<T>(*it->second);
+            }
+            return error::not_found;
+        }
+        return _ns->get<T>(key);
+    }
+}// namespace ka::nvs
+
+#endif//KEYCARD_ACCESS_NVS_CACHE_HPP
@@ -0,0 +1,183 @@
+#ifndef KEYCARD_ACCESS_OTA_HPP
+#define KEYCARD_ACCESS_OTA_HPP
+
+#include <array>
+#include <condition_variable>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <ka/key_pair.hpp>
+#include <ka/p2p_ops.hpp>
+#include <ka/p2p_stream.hpp>
+#include <mutex>
+#include <sodium/crypto_box.h>
+#include <sodium/crypto_hash_sha512.h>
+#include <thread>
+
+namespace ka {
+
+    /**
+     * @addtogroup Firmware update
+     * A signed image is streamed as `image | signature`, where the signature is the SHA-512 digest of the image
+     * followed by its size, encrypted by the keymaker for the gate with @ref key_pair::encrypt_for. Only the
+     * programmer of the gate can produce a signature that the gate accepts.
+     * @{
+     */
+
+    using ota_digest = std::array<std::uint8_t, crypto_hash_sha512_BYTES>;
+
+    static constexpr std::size_t ota_signature_size = crypto_hash_sha512_BYTES + 4 + crypto_box_MACBYTES + crypto_box_NONCEBYTES;
+
+    enum struct ota_error : std::uint8_t {
+        none = 0,
+        no_partition,
+        invalid_size,
+        flash_error,
+        invalid_signature,
+        invalid_image
+    };
+
+    [[nodiscard]] const char *to_string(ota_error e);
+
+    /**
+     * @brief Keymaker side: appends the signature for @p gate_pk to an image.
+     * The image is read twice, once to sign it in @ref prepare, and once while streaming.
+     */
+    class signed_image_source final : public p2p::stream_source {
+        p2p::stream_source &_image;
+        key_pair const &_keys;
+        pub_key _gate_pk;
+        mlab::bin_data _signature{};
+        std::uint32_t _transfer_id = 0;
+
+    public:
+        signed_image_source(p2p::stream_source &image, key_pair const &keymaker_keys, pub_key gate_pk);
+
+        /**
+         * @brief Hashes and signs the image. Must be called before streaming.
+         */
+        [[nodiscard]] bool prepare();
+
+        /**
+         * @brief Derived from the digest, so that the same image resumes across sessions.
+         */
+        [[nodiscard]] std::uint32_t transfer_id() const override;
+        [[nodiscard]] std::uint32_t size() const override;
+        [[nodiscard]] bool read(std::uint32_t offset, mlab::range<std::uint8_t *> dest) override;
+    };
+
+    /**
+     * @brief Source over the first @p size bytes of a flash partition, e.g. an image stored on the keymaker.
+     */
+    class partition_source final : public p2p::stream_source {
+        esp_partition_t const &_part;
+        std::uint32_t _size;
+
+    public:
+        partition_source(esp_partition_t const &part, std::uint32_t size);
+
+        [[nodiscard]] std::uint32_t transfer_id() const override;
+        [[nodiscard]] std::uint32_t size() const override;
+        [[nodiscard]] bool read(std::uint32_t offset, mlab::range<std::uint8_t *> dest) override;
+    };
+
+    struct ota_stats {
+        std::uint32_t bytes_written = 0;
+        /**
+         * Time spent erasing and writing flash, which overlaps with the RF transfer.
+         */
+        std::chrono::microseconds flash_time{0};
+    };
+
+    /**
+     * @brief Gate side: writes the image into the inactive OTA partition while it is being received.
+     *
+     * Chunks are handed over to a writer thread through @ref pipeline_depth buffers, so that erasing and writing
+     * flash overlap with the reception of the next chunks; the stream flow control holds the sender back when all the
+     * buffers are in use. Sectors are erased incrementally as the writes progress, and nothing but the chunks in
+     * flight is kept in RAM.
+     *
+     * The sink keeps its progress across sessions: streaming again the same image, even over a new secure channel,
+     * resumes from the last written byte.
+     */
+    class ota_sink final : public p2p::stream_sink {
+    public:
+        static constexpr std::size_t pipeline_depth = 2;
+
+        /**
+         * @param activate If true, the new image is selected for the next boot once verified.
+         */
+        explicit ota_sink(gate const &g, bool activate = true);
+        ~ota_sink() override;
+
+        ota_sink(ota_sink const &) = delete;
+        ota_sink &operator=(ota_sink const &) = delete;
+
+        std::uint32_t resume_offset(std::uint32_t transfer_id, std::uint32_t total_size) override;
+        p2p::sink_status write(std::uint32_t offset, mlab::range<std::uint8_t const *> data) override;
+        [[nodiscard]] std::uint8_t credit() const override;
+        bool finish(std::uint32_t transfer_id) override;
+
+        /**
+         * @brief True once an image was received, verified and, if requested, selected for the next boot.
+         */
+        [[nodiscard]] bool succeeded() const;
+        [[nodiscard]] ota_error error() const;
+        [[nodiscard]] ota_stats stats() const;
+
+    private:
+        struct chunk {
+            std::uint32_t offset = 0;
+            mlab::bin_data data{};
+        };
+
+        gate const &_g;
+        bool _activate;
+        esp_partition_t const *_part = nullptr;
+        esp_ota_handle_t _handle = 0;
+        bool _begun = false;
+        bool _succeeded = false;
+        std::uint32_t _transfer_id = 0;
+        std::uint32_t _image_size = 0;
+        std::uint32_t _received = 0;
+        std::array<std::uint8_t, ota_signature_size> _signature{};
+        crypto_hash_sha512_state _hash{};
+
+        mutable std::mutex _mutex;
+        std::condition_variable _cv;
+        std::array<chunk, pipeline_depth> _chunks{};
+        std::size_t _first_queued = 0;
+        std::size_t _queued = 0;
+        ota_error _error = ota_error::none;
+        ota_stats _stats{};
+        bool _stop = false;
+        std::thread _writer;
+
+        void writer_loop();
+        void wait_idle(std::unique_lock<std::mutex> &lock);
+        void restart(std::uint32_t transfer_id, std::uint32_t total_size);
+        void abort_update();
+    };
+
+    /**
+     * @}
+     */
+
+}// namespace ka
+
+namespace ka::p2p {
+
+    /**
+     * @brief Keymaker side: signs and streams @p image to the gate at the other end of @p comm.
+     * If interrupted, calling it again with the same image resumes the transfer.
+     */
+    result<stream_stats> send_firmware_update(secure_initiator &comm, keymaker const &km, stream_source &image, stream_options const &opts = {});
+
+    /**
+     * @brief Gate side: accepts an image into @p sink, only from the programmer of @p g.
+     * @p sink must be kept across calls for the transfer to resume.
+     */
+    result<stream_stats> receive_firmware_update(gate const &g, secure_target &comm, ota_sink &sink, stream_options const &opts = {});
+
+}// namespace ka::p2p
+
+#endif//KEYCARD_ACCESS_OTA_HPP
@@ -5,41 +5,521 @@
 #ifndef KEYCARD_ACCESS_P2P_OPS_HPP
 #define KEYCARD_ACCESS_P2P_OPS_HPP
 
+#include <ka/gate.hpp>
+#include <ka/gate_registry.hpp>
+#include <ka/member_roster.hpp>
+#include <ka/revocation_record.hpp>
+#include <ka/rpc.hpp>
+#include <ka/telemetry.hpp>
+#include <ka/token_list.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
 #include <pn532/p2p.hpp>
+#include <thread>
 
 namespace ka {
-    class gate;
-    class secure_target;
-    class secure_initiator;
 
     class keymaker {
     public:
         key_pair _kp{randomize};
-        std::vector<gate_config> _gates;
+        gate_registry _gates{};
+        member_roster _members{};
+        versioned_token_list _revoked{};
+        link_quality _link{};
+        bool _derive_gate_keys = false;
+
+        keymaker() { _gates.set_master_key(&_kp); }
+
+        keymaker(keymaker const &) = delete;
+        keymaker &operator=(keymaker const &) = delete;
 
         [[nodiscard]] key_pair const &keys() const { return _kp; }
-        [[nodiscard]] gate_id allocate_gate_id() { return gate_id{_gates.size()}; }
+        [[nodiscard]] link_quality &link() { return _link; }
+        [[nodiscard]] versioned_token_list const &revoked_tokens() const { return _revoked; }
+        [[nodiscard]] versioned_token_list &revoked_tokens() { return _revoked; }
+
+        /**
+         * @brief Key with which @ref sign_revocations signs; gates get its public key via @ref p2p::push_epoch_key.
+         */
+        [[nodiscard]] epoch_signer derive_epoch_signer() const { return epoch_signer::derive_from(_kp); }
+
+        /**
+         * @brief The @ref revocation_record written on every card that is issued or refreshed.
+         */
+        [[nodiscard]] revocation_record sign_revocations() const { return derive_epoch_signer().sign(_revoked); }
+        [[nodiscard]] gate_registry &gates() { return _gates; }
+        [[nodiscard]] member_roster &members() { return _members; }
+
+        /**
+         * @brief Loads gates and members from the data partition @p label, and persists changes there.
+         * The gates get one sixth of the partition. Without it, gates and members are kept in RAM only.
+         * The revocation list is rebuilt from the revoked members, at the last version saved by @ref revoke.
+         */
+        [[nodiscard]] bool open_store(const char *label = ka_store_partition);
+
+        /**
+         * @brief Flags the member as revoked and adds its token to the revocation list.
+         * With a store, the new list version is saved first, so that it never goes back after a reboot, which would
+         * make gates ignore the next @ref revocation_record.
+         */
+        [[nodiscard]] bool revoke(token_id const &id);
+
+        /**
+         * @brief When set, new gates get a base key derived from @ref keys and the gate id, which does not need to be
+         * stored (see @ref gate_base_key::derive_from), instead of one generated by the gate.
+         */
+        void set_derive_gate_keys(bool derive) { _derive_gate_keys = derive; }
+        [[nodiscard]] bool derives_gate_keys() const { return _derive_gate_keys; }
+        [[nodiscard]] gate_base_key derive_gate_base_key(gate_id id) const { return gate_base_key::derive_from(_kp, id); }
+
+        /**
+         * @brief Id for a new gate that is usually granted together with @p affinity, see @ref gate_registry::allocate.
+         */
+        [[nodiscard]] gate_id allocate_gate_id(std::vector<gate_id> const &affinity = {}) const { return _gates.allocate(affinity); }
         void register_gate(gate_config cfg) {
-            if (cfg.id == _gates.size()) {
-                _gates.emplace_back(cfg);
-            } else {
-                ESP_LOGE("KA", "Invalid gate.");
+            if (_gates.find(cfg.id)) {
+                ESP_LOGE("KA", "Gate %lu is already registered.", std::uint32_t(cfg.id));
+            } else if (not _gates.insert(cfg)) {
+                ESP_LOGE("KA", "Unable to store gate %lu.", std::uint32_t(cfg.id));
+            }
+        }
+
+        /**
+         * @brief Registers a new @ref gate_group, with an id allocated like a gate's (see @ref allocate_gate_id).
+         * Key pair and base key are derived from @ref keys, so only the public configuration is stored. Gates join it
+         * with @ref p2p::add_gate_to_group, tokens get it with @ref member_token::enroll_gate on @ref gate_group::config.
+         */
+        [[nodiscard]] std::optional<gate_group> register_gate_group(std::vector<gate_id> const &affinity = {}) {
+            auto grp = gate_group::derive_from(_kp, _gates.allocate(affinity));
+            if (not _gates.insert(grp.config())) {
+                ESP_LOGE("KA", "Unable to store gate group %lu.", std::uint32_t(grp.id));
+                return std::nullopt;
+            }
+            return grp;
+        }
+
+        /**
+         * @brief The credentials of group @p id, or nothing if @p id is not a registered group.
+         */
+        [[nodiscard]] std::optional<gate_group> find_gate_group(gate_id id) {
+            if (const auto cfg = _gates.find(id); cfg) {
+                // A gate has its own key pair, a group has the derived one
+                if (auto grp = gate_group::derive_from(_kp, id); grp.keys.raw_pk() == cfg->gate_pub_key.raw_pk()) {
+                    return grp;
+                }
+            }
+            return std::nullopt;
+        }
+
+        /**
+         * @brief Removes the gate from the registry and from every member. The id is retired, see @ref gate_registry.
+         */
+        [[nodiscard]] bool decommission_gate(gate_id id) {
+            for (auto const &holder : _members.holders_of(id)) {
+                if (not _members.remove_gate(holder, id)) {
+                    return false;
+                }
             }
+            return _gates.erase(id);
         }
     };
 
 }// namespace ka
 namespace ka::p2p {
 
-    pn532::result<> configure_gate_exchange(keymaker &km, secure_initiator &comm, std::string const &gate_description);
+    /**
+     * @addtogroup Gate commands
+     * Commands served by a gate over @ref rpc::dispatcher.
+     * @{
+     */
+    namespace cmd {
+        /**
+         * @brief Assigns id and description to the gate, and makes the caller its programmer.
+         * A configured gate accepts it only from its programmer.
+         */
+        struct configure {
+            static constexpr rpc::opcode code = 0xcf;
+            struct request {
+                gate_id id{};
+                std::string description{};
+            };
+            using response = gate_base_key;
+        };
+
+        /**
+         * @brief Like @ref configure, but sets the base key of the gate to @ref request::base_key, which the keymaker
+         * derives and does not need to store. Returns the base key now in use.
+         */
+        struct configure_with_key {
+            static constexpr rpc::opcode code = 0xce;
+            struct request {
+                gate_id id{};
+                gate_base_key base_key{};
+                std::string description{};
+            };
+            using response = gate_base_key;
+        };
+
+        /**
+         * @brief Makes the gate a member of a @ref gate_group, or updates its credentials.
+         * Returns the public key of the group, as derived by the gate.
+         */
+        struct join_group {
+            static constexpr rpc::opcode code = 0x40;
+            struct request {
+                gate_id id{};
+                raw_sec_key secret_key{};
+                gate_base_key base_key{};
+            };
+            using response = raw_pub_key;
+        };
+
+        /**
+         * @brief Removes the gate from a @ref gate_group. Fails if it was not a member.
+         */
+        struct leave_group {
+            static constexpr rpc::opcode code = 0x41;
+            struct request {
+                gate_id id{};
+            };
+            using response = rpc::none;
+        };
+
+        /**
+         * @brief Reports the version of the key material of the gate, and the progress of the migration.
+         */
+        struct key_status {
+            static constexpr rpc::opcode code = 0x50;
+            using request = rpc::none;
+            using response = gate_key_status;
+        };
+
+        /**
+         * @brief Rotates the key material of the gate to @ref request::version, see @ref gate::rotate_keys.
+         * Returns the new public key of the gate.
+         */
+        struct rotate_keys {
+            static constexpr rpc::opcode code = 0x51;
+            struct request {
+                std::uint32_t version = 0;
+                gate_base_key base_key{};
+            };
+            using response = raw_pub_key;
+        };
+
+        /**
+         * @brief Grants the gate the master keys it needs to migrate these tokens, see @ref gate::grant_rekey.
+         * The grants are persisted at the end of the session.
+         */
+        struct grant_rekey {
+            static constexpr rpc::opcode code = 0x52;
+            struct request {
+                std::vector<std::pair<token_id, raw_gate_app_master_key>> grants{};
+            };
+            using response = gate_key_status;
+        };
+
+        /**
+         * @brief Stops accepting the previous key material, see @ref gate::retire_previous_keys.
+         */
+        struct retire_keys {
+            static constexpr rpc::opcode code = 0x53;
+            using request = rpc::none;
+            using response = gate_key_status;
+        };
+
+        /**
+         * @brief Queues deploy certificates on the gate, see @ref gate::pending_deploys.
+         * @ref request::now is the time of the keymaker, which moves the clock of the gate forward, see
+         * @ref deploy_queue::advance_clock. The certificates are persisted at the end of the session.
+         */
+        struct queue_deploys {
+            static constexpr rpc::opcode code = 0x60;
+            struct request {
+                std::uint32_t now = 0;
+                std::vector<deploy_certificate> certificates{};
+            };
+            using response = deploy_queue_status;
+        };
+
+        /**
+         * @brief Reports version, size and hash of a list.
+         */
+        struct list_status {
+            static constexpr rpc::opcode code = 0x20;
+            struct request {
+                token_list_id list = token_list_id::revoked;
+            };
+            using response = list_summary;
+        };
+
+        /**
+         * @brief Applies @ref request::changes to a list that is at @ref request::base_version, and fails otherwise.
+         * The list version is then increased by the number of changes.
+         */
+        struct list_delta {
+            static constexpr rpc::opcode code = 0x21;
+            struct request {
+                token_list_id list = token_list_id::revoked;
+                std::uint32_t base_version = 0;
+                std::vector<list_change> changes{};
+            };
+            using response = list_summary;
+        };
+
+        /**
+         * @brief Replaces the whole list. Sent in chunks, the list is replaced when the last chunk is received.
+         */
+        struct list_snapshot {
+            static constexpr rpc::opcode code = 0x22;
+            struct request {
+                token_list_id list = token_list_id::revoked;
+                std::uint32_t version = 0;
+                std::uint32_t offset = 0;
+                std::uint32_t total = 0;
+                std::vector<token_id> ids{};
+            };
+            using response = list_summary;
+        };
+
+        /**
+         * @brief Sets the key with which the gate verifies the @ref revocation_record on tokens, see
+         * @ref gate::epoch_key.
+         */
+        struct set_epoch_key {
+            static constexpr rpc::opcode code = 0x23;
+            using request = epoch_pub_key;
+            using response = rpc::none;
+        };
+
+        /**
+         * @brief Returns a @ref telemetry_snapshot of the gate.
+         */
+        struct read_telemetry {
+            static constexpr rpc::opcode code = 0x30;
+            using request = rpc::none;
+            using response = telemetry_snapshot;
+        };
+    }// namespace cmd
+    /**
+     * @}
+     */
+
+    /**
+     * @brief Registers on @p d the handlers for all the @ref cmd, issued by the peer of @p comm.
+     */
+    void register_gate_handlers(rpc::dispatcher &d, gate &g, secure_target const &comm);
+
+    /**
+     * @brief Serves administration commands until the initiator stops sending them for @p idle_timeout.
+     * Lists that changed during the session are persisted once at the end.
+     */
+    pn532::result<> serve_gate_admin(gate &g, secure_target &comm, ms idle_timeout = 1s);
+
+    struct list_sync_stats {
+        list_summary before{};
+        list_summary after{};
+        bool used_snapshot = false;
+        std::uint32_t changes_sent = 0;
+        std::uint32_t ids_sent = 0;
+        std::uint32_t round_trips = 0;
+    };
+
+    /**
+     * @brief Brings the gate's copy of @p list up to date. Only the changes since the gate's version are sent, unless
+     * they are no longer in the changelog, or the gate diverged, in which case the whole list is sent.
+     * The hash reported by the gate at the end must match the hash of @p list.
+     */
+    pn532::result<list_sync_stats> sync_token_list(secure_initiator &comm, token_list_id id, versioned_token_list const &list);
+
+    /**
+     * @brief Lets the gate at the other end of @p comm pick up revocations from the tokens of its members, by sending
+     * it the public key of @ref keymaker::derive_epoch_signer. See @ref revocation_record.
+     */
+    pn532::result<> push_epoch_key(keymaker const &km, secure_initiator &comm);
+
+    /**
+     * @brief Pulls the telemetry of the gate at the other end of @p comm, in a single round trip.
+     */
+    pn532::result<telemetry_snapshot> pull_telemetry(secure_initiator &comm);
+
+    /**
+     * @brief Makes the gate at the other end of @p comm a member of @p grp, in a single round trip.
+     */
+    pn532::result<> add_gate_to_group(secure_initiator &comm, gate_group const &grp);
+    pn532::result<> remove_gate_from_group(secure_initiator &comm, gate_id group_id);
+
+    struct key_rotation_stats {
+        gate_key_status before{};
+        gate_key_status after{};
+        std::uint32_t grants_sent = 0;
+    };
+
+    /**
+     * @brief Rotates the key material of gate @p id, at the other end of @p comm, and updates its registration.
+     * The gate is granted the master keys of all the holders of @p id in @ref keymaker::members, so that their tokens
+     * are migrated on tap. The new base key is derived if @ref keymaker::derives_gate_keys, random otherwise.
+     * At most @ref gate::max_rekey_grants holders are granted; @ref key_rotation_stats::grants_sent tells how many.
+     */
+    pn532::result<key_rotation_stats> rotate_gate_keys(keymaker &km, secure_initiator &comm, gate_id id);
+
+    /**
+     * @brief Ends the grace period of the previous key material of the gate at the other end of @p comm.
+     */
+    pn532::result<gate_key_status> retire_gate_keys(secure_initiator &comm);
+
+    /**
+     * @brief Lets gate @p id, at the other end of @p comm, enroll @p tokens by itself on their next tap.
+     * Each token gets a @ref deploy_certificate for the identity in @ref keymaker::members, which expires after
+     * @p validity; revoked and unknown tokens are skipped. Once the gate accepts it, @p id is recorded among the
+     * gates of the member, as if it had been enrolled here.
+     * @return The state of the queue of the gate. If the queue fills up, the tokens left out are not recorded.
+     */
+    pn532::result<deploy_queue_status> issue_deploy_certificates(keymaker &km, secure_initiator &comm, gate_id id, std::vector<token_id> const &tokens, std::chrono::seconds validity);
+
+    /**
+     * @brief Logs @p snapshot as a single hex line, to be bulk decoded on the host with `misc/decode-telemetry.py`.
+     */
+    void log_telemetry(gate_id id, telemetry_snapshot const &snapshot);
+
+    /**
+     * @brief Configures the gate at the other end of @p comm and registers it; see @ref keymaker::allocate_gate_id for
+     * @p affinity.
+     */
+    pn532::result<> configure_gate_exchange(keymaker &km, secure_initiator &comm, std::string const &gate_description, std::vector<gate_id> const &affinity = {});
     pn532::result<> configure_gate_exchange(gate &g, secure_target &comm);
 
+    /**
+     * @brief NFCID3 under which the gate presents itself as a DEP target, derived from its id.
+     */
+    [[nodiscard]] pn532::nfcid_3t fabricate_nfcid(gate const &g);
+
     [[nodiscard]] bool configure_gate_in_rf(pn532::controller &ctrl, gate &g);
-    [[nodiscard]] bool configure_gate_in_rf(pn532::controller &ctrl, std::uint8_t logical_index, keymaker &km, std::string const &gate_description);
+    [[nodiscard]] bool configure_gate_in_rf(pn532::controller &ctrl, std::uint8_t logical_index, keymaker &km, std::string const &gate_description, std::vector<gate_id> const &affinity = {});
+
+    /**
+     * @brief A DEP target that waits for an initiator under a given NFCID3 before exchanging data.
+     */
+    class dep_target : public pn532::p2p::target {
+    public:
+        /**
+         * @brief Waits up to @p timeout for an initiator to activate this target.
+         * @return @ref pn532::channel_error::timeout if nobody showed up, or any other error of the link.
+         */
+        virtual pn532::result<> activate(pn532::nfcid_3t const &nfcid, ms timeout) = 0;
+    };
+
+    /**
+     * @brief @ref dep_target on a PN532, which waits for the initiator in hardware while the task sleeps.
+     */
+    class pn532_dep_target final : public dep_target {
+        pn532::p2p::pn532_target _raw;
 
+    public:
+        explicit pn532_dep_target(pn532::controller &ctrl);
+
+        pn532::result<> activate(pn532::nfcid_3t const &nfcid, ms timeout) override;
+        pn532::result<mlab::bin_data> receive(ms timeout) override;
+        pn532::result<> send(mlab::bin_data const &data, ms timeout) override;
+    };
+
+    struct configure_listener_options {
+        /**
+         * How long the PN532 waits in a single target activation. The PN532 waits in hardware, and the task sleeps
+         * on the serial line meanwhile, so this only sets how often the listener wakes up when nobody shows up.
+         */
+        ms activation_timeout = 10s;
+        /**
+         * Pause after an error of the controller, so that a faulty link is not hammered.
+         */
+        ms error_backoff = 250ms;
+    };
+
+    struct configure_listener_stats {
+        /**
+         * Number of times the listener woke up, i.e. the number of target activations requested.
+         */
+        std::uint32_t wakeups = 0;
+        std::uint32_t activations = 0;
+        std::uint32_t failed_attempts = 0;
+        std::uint32_t controller_errors = 0;
+        std::chrono::milliseconds time_to_configure{0};
+        /**
+         * Time spent generating key pairs in the background, off the activation path.
+         */
+        std::chrono::milliseconds key_generation{0};
+        /**
+         * Fraction of the time of all cores that was not spent idle, in [0, 1]. Requires
+         * `CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS`.
+         */
+        float cpu_utilization = 0.f;
+    };
+
+    /**
+     * @brief Waits for a keymaker to configure a gate, sleeping between target activations.
+     *
+     * The PN532 is set up as a DEP target and waits in hardware for an initiator; the listener only wakes up when
+     * the PN532 replies, i.e. on activation or after @ref configure_listener_options::activation_timeout. The key pair
+     * of the gate is generated in the background, ahead of time: a failed configuration attempt, which has exposed
+     * the public key, immediately switches to the next pre-generated key pair.
+     */
+    class configure_listener {
+        dep_target &_comm;
+        gate &_g;
+        configure_listener_options _opts;
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::optional<gate> _candidate = std::nullopt;
+        std::chrono::milliseconds _key_generation{0};
+        bool _stop = false;
+        std::thread _keygen;
+
+        void keygen_loop();
+        [[nodiscard]] gate take_candidate();
+
+    public:
+        configure_listener(dep_target &comm, gate &g, configure_listener_options opts = {});
+        ~configure_listener();
+
+        configure_listener(configure_listener const &) = delete;
+        configure_listener &operator=(configure_listener const &) = delete;
+
+        /**
+         * @brief Blocks until the gate is configured. Returns right away, with empty stats, if it already is.
+         */
+        configure_listener_stats run();
+    };
+
+    /**
+     * @brief Runs a @ref configure_listener on @p g, and logs its statistics.
+     */
     void configure_gate_loop(pn532::controller &ctrl, gate &g);
-    [[nodiscard]] bool configure_gate_loop(pn532::controller &ctrl, keymaker &km, std::string const &gate_description);
+    [[nodiscard]] bool configure_gate_loop(pn532::controller &ctrl, keymaker &km, std::string const &gate_description, std::vector<gate_id> const &affinity = {});
 
 }// namespace ka::p2p
 
+namespace mlab {
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::configure::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::configure::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::configure_with_key::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::configure_with_key::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::join_group::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::join_group::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::leave_group::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::leave_group::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::rotate_keys::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::rotate_keys::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::grant_rekey::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::grant_rekey::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::queue_deploys::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::queue_deploys::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::list_status::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::list_status::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::list_delta::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::list_delta::request const &req);
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::list_snapshot::request &req);
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::list_snapshot::request const &req);
+}// namespace mlab
+
 #endif//KEYCARD_ACCESS_P2P_OPS_HPP
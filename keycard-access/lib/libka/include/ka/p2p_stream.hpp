@@ -0,0 +1,141 @@
+#ifndef KEYCARD_ACCESS_P2P_STREAM_HPP
+#define KEYCARD_ACCESS_P2P_STREAM_HPP
+
+#include <functional>
+#include <ka/secure_p2p.hpp>
+
+namespace ka::p2p {
+
+    /**
+     * @brief Maximum payload of a single chunk, so that a chunk frame fits a DEP frame over @ref secure_initiator.
+     */
+    static constexpr std::uint16_t default_chunk_size = 192;
+
+    struct stream_options {
+        std::uint16_t chunk_size = default_chunk_size;
+        /**
+         * Timeout for each frame exchange.
+         */
+        ms timeout = 1s;
+        /**
+         * How long the sender waits before polling again a receiver that has no credit left.
+         */
+        ms busy_backoff = 20ms;
+        /**
+         * Number of consecutive polls after which a receiver with no credit is abandoned.
+         */
+        unsigned max_busy_polls = 250;
+    };
+
+    struct stream_stats {
+        std::uint32_t bytes = 0;
+        std::uint32_t chunks = 0;
+        /**
+         * Offset from which the transfer was resumed; nonzero if the receiver already had part of the data.
+         */
+        std::uint32_t resumed_from = 0;
+        std::uint32_t busy_polls = 0;
+        std::chrono::milliseconds elapsed{0};
+
+        /**
+         * @brief Bytes per millisecond, i.e. kilobytes (1000 bytes) per second.
+         */
+        [[nodiscard]] float throughput_kilobytes_per_s() const;
+    };
+
+    enum struct sink_status : std::uint8_t {
+        accepted,
+        abort
+    };
+
+    /**
+     * @brief Receiving end of a stream. Chunks are delivered in order, exactly once per transfer segment.
+     */
+    struct stream_sink {
+        /**
+         * @brief Called when a transfer is opened or reopened.
+         * @return Number of bytes of @p transfer_id already received and stored, from which the transfer resumes.
+         *  It is rounded down to a multiple of the chunk size.
+         */
+        virtual std::uint32_t resume_offset([[maybe_unused]] std::uint32_t transfer_id, [[maybe_unused]] std::uint32_t total_size) { return 0; }
+
+        virtual sink_status write(std::uint32_t offset, mlab::range<std::uint8_t const *> data) = 0;
+
+        /**
+         * @brief Flow control: number of chunks that can be accepted without waiting. When zero, the sender backs off.
+         */
+        [[nodiscard]] virtual std::uint8_t credit() const { return std::numeric_limits<std::uint8_t>::max(); }
+
+        /**
+         * @brief Called after the last chunk of the transfer has been written.
+         * @return False to report the transfer as failed to the sender.
+         */
+        virtual bool finish([[maybe_unused]] std::uint32_t transfer_id) { return true; }
+
+        virtual ~stream_sink() = default;
+    };
+
+    /**
+     * @brief Sink that forwards each chunk to a callback, and does not support resuming.
+     */
+    class callback_sink final : public stream_sink {
+        std::function<sink_status(std::uint32_t, mlab::range<std::uint8_t const *>)> _fn;
+
+    public:
+        explicit callback_sink(std::function<sink_status(std::uint32_t, mlab::range<std::uint8_t const *>)> fn);
+        sink_status write(std::uint32_t offset, mlab::range<std::uint8_t const *> data) override;
+    };
+
+    struct stream_source {
+        /**
+         * @brief Identifies the content, so that an interrupted transfer can be resumed by the receiver.
+         */
+        [[nodiscard]] virtual std::uint32_t transfer_id() const = 0;
+        [[nodiscard]] virtual std::uint32_t size() const = 0;
+        /**
+         * @brief Fills exactly @p dest with the data at @p offset.
+         */
+        [[nodiscard]] virtual bool read(std::uint32_t offset, mlab::range<std::uint8_t *> dest) = 0;
+
+        virtual ~stream_source() = default;
+    };
+
+    /**
+     * @brief Source over a buffer in memory, which must outlive the source.
+     */
+    class data_source final : public stream_source {
+        mlab::bin_data const &_data;
+        std::uint32_t _transfer_id;
+
+    public:
+        data_source(mlab::bin_data const &data, std::uint32_t transfer_id);
+
+        [[nodiscard]] std::uint32_t transfer_id() const override;
+        [[nodiscard]] std::uint32_t size() const override;
+        [[nodiscard]] bool read(std::uint32_t offset, mlab::range<std::uint8_t *> dest) override;
+    };
+
+    /**
+     * @addtogroup Streaming
+     * Transfers data larger than a single frame as a sequence of chunks. Each transfer segment is sealed with its own
+     * `crypto_secretstream`, whose key and header travel in the opening frame: every chunk is authenticated,
+     * bound to its offset, and the last one carries `TAG_FINAL`, so truncation is detected. The receiver acknowledges
+     * each chunk with the next expected offset and its credit; an interrupted transfer is resumed from the last
+     * acknowledged chunk by reopening a new segment.
+     * @warning The key of each segment travels in the clear within the underlying channel, which must thus be a
+     *  @ref secure_initiator or @ref secure_target.
+     * Either side of the DEP link can be the sender; when the target sends, the initiator drives the exchange by
+     * pulling.
+     * @{
+     */
+    result<stream_stats> send_stream(initiator &comm, stream_source &source, stream_options const &opts = {});
+    result<stream_stats> send_stream(target &comm, stream_source &source, stream_options const &opts = {});
+    result<stream_stats> receive_stream(target &comm, stream_sink &sink, stream_options const &opts = {});
+    result<stream_stats> receive_stream(initiator &comm, stream_sink &sink, stream_options const &opts = {});
+    /**
+     * @}
+     */
+
+}// namespace ka::p2p
+
+#endif//KEYCARD_ACCESS_P2P_STREAM_HPP
@@ -0,0 +1,228 @@
+#ifndef KEYCARD_ACCESS_PAGED_TABLE_HPP
+#define KEYCARD_ACCESS_PAGED_TABLE_HPP
+
+#include <array>
+#include <cstdint>
+#include <esp_partition.h>
+#include <functional>
+#include <mlab/bin_data.hpp>
+#include <vector>
+
+namespace ka {
+
+    /**
+     * Label of the data partition that holds the keymaker databases.
+     */
+    static constexpr const char *ka_store_partition = "ka_store";
+
+    /**
+     * @brief A sector-aligned area of a data partition.
+     */
+    struct flash_region {
+        static constexpr std::uint32_t sector_size = 0x1000;
+
+        esp_partition_t const *partition = nullptr;
+        std::uint32_t offset = 0;
+        std::uint32_t size = 0;
+
+        /**
+         * @brief The whole data partition with the given label, or an empty region if not found.
+         */
+        [[nodiscard]] static flash_region find(const char *label);
+
+        [[nodiscard]] bool empty() const;
+        [[nodiscard]] std::uint32_t sectors() const;
+        [[nodiscard]] flash_region subregion(std::uint32_t first_sector, std::uint32_t num_sectors) const;
+
+        [[nodiscard]] bool read(std::uint32_t addr, mlab::range<std::uint8_t *> dest) const;
+        [[nodiscard]] bool write(std::uint32_t addr, mlab::range<std::uint8_t const *> src) const;
+        [[nodiscard]] bool erase_sector(std::uint32_t sector) const;
+    };
+
+    struct page_cache_stats {
+        std::uint32_t hits = 0;
+        std::uint32_t misses = 0;
+    };
+
+    /**
+     * @brief Small LRU cache of flash blocks, shared by the tables that live on the same partition.
+     */
+    class page_cache {
+    public:
+        static constexpr std::size_t block_size = 512;
+
+        explicit page_cache(std::size_t capacity = 8);
+
+        /**
+         * @brief Reads @p dest from @p region at @p addr, going to flash only for the blocks not in cache.
+         */
+        [[nodiscard]] bool read(flash_region const &region, std::uint32_t addr, mlab::range<std::uint8_t *> dest);
+
+        void invalidate();
+
+        [[nodiscard]] page_cache_stats const &stats() const;
+
+    private:
+        struct block {
+            esp_partition_t const *partition = nullptr;
+            std::uint32_t addr = 0;
+            std::uint32_t last_use = 0;
+            std::array<std::uint8_t, block_size> data{};
+        };
+
+        std::vector<block> _blocks;
+        std::uint32_t _clock = 0;
+        page_cache_stats _stats{};
+
+        [[nodiscard]] block const *fetch(esp_partition_t const *partition, std::uint32_t addr);
+    };
+
+    struct paged_table_stats {
+        std::uint32_t pages = 0;
+        std::uint32_t page_entries = 0;
+        std::uint32_t log_entries = 0;
+        std::uint32_t log_capacity = 0;
+        std::uint32_t free_sectors = 0;
+        std::uint32_t compactions = 0;
+        std::uint32_t generation = 0;
+    };
+
+    /**
+     * @brief Table of fixed-size entries on flash, sorted by key, for stores much larger than the RAM.
+     *
+     * The key is the first @ref key_size bytes of each entry, compared as a byte string (encode integers big endian).
+     * The region is laid out as:
+     *  - two header sectors, used alternately; each holds the page table, i.e. the sector, the number of entries and
+     *    the first key (fence) of each page, and the most recent valid one is loaded at @ref open;
+     *  - @ref log_sectors sectors of append-only log, which receives every @ref put and @ref erase;
+     *  - the page pool: each page is a sector of entries sorted by key, and pages are sorted by fence.
+     *
+     * The page table and the log are mirrored in RAM, the pages are read through a @ref page_cache. A lookup is a binary
+     * search over the fences and one within the page. When the log is full, @ref compact merges it into the pages:
+     * only the pages that receive changes are rewritten, into free sectors, and the new page table is committed by
+     * writing the other header. Consecutive pages that receive changes are repacked together into full pages. When the
+     * free sectors run out, the pages merged so far are committed, which frees the ones they replace, so the table can
+     * fill almost all of its region. The log is erased only after the last commit: it is tagged with a log epoch, and
+     * replaying it over pages that already contain it is harmless. A crash at any point leaves a consistent table.
+     *
+     * A table that is not opened on a region lives entirely in RAM, in the log, without a size limit.
+     */
+    class paged_table {
+    public:
+        static constexpr std::uint32_t log_sectors = 2;
+
+        /**
+         * @param entry_size Size of an entry, key included. Must be at most a sector.
+         * @param key_size Size of the key at the beginning of each entry.
+         */
+        paged_table(std::uint16_t entry_size, std::uint16_t key_size, page_cache &cache);
+
+        paged_table(paged_table const &) = delete;
+        paged_table &operator=(paged_table const &) = delete;
+
+        /**
+         * @brief Loads the table from @p region, or formats it if it does not contain a valid table of this layout.
+         */
+        [[nodiscard]] bool open(flash_region region);
+
+        [[nodiscard]] bool is_persistent() const;
+
+        [[nodiscard]] std::uint16_t entry_size() const;
+        [[nodiscard]] std::uint16_t key_size() const;
+
+        /**
+         * @brief Looks up the entry with @p key into @p entry, which must be @ref entry_size bytes.
+         */
+        [[nodiscard]] bool find(mlab::range<std::uint8_t const *> key, mlab::range<std::uint8_t *> entry);
+
+        /**
+         * @brief Inserts or replaces the entry with the same key.
+         */
+        [[nodiscard]] bool put(mlab::range<std::uint8_t const *> entry);
+
+        [[nodiscard]] bool erase(mlab::range<std::uint8_t const *> key);
+
+        /**
+         * @brief Calls @p fn on the entries with key not smaller than @p from, in key order, until it returns false.
+         * @note @p fn must not modify the table.
+         */
+        [[nodiscard]] bool scan(mlab::range<std::uint8_t const *> from, std::function<bool(mlab::range<std::uint8_t const *>)> const &fn);
+
+        /**
+         * @brief The entry with the largest key, if any.
+         */
+        [[nodiscard]] bool last(mlab::range<std::uint8_t *> entry);
+
+        /**
+         * @brief Merges the log into the pages, and empties the log.
+         */
+        [[nodiscard]] bool compact();
+
+        [[nodiscard]] paged_table_stats stats() const;
+
+    private:
+        struct page_ref {
+            std::uint16_t sector = 0;
+            std::uint16_t count = 0;
+            std::vector<std::uint8_t> fence{};
+        };
+
+        struct log_item {
+            bool live = true;
+            std::vector<std::uint8_t> entry{};
+        };
+
+        std::uint16_t _entry_size;
+        std::uint16_t _key_size;
+        page_cache &_cache;
+        flash_region _region{};
+        std::uint32_t _generation = 0;
+        std::uint32_t _log_epoch = 0;
+        std::vector<page_ref> _pages{};
+        /**
+         * Sorted by key, at most one item per key.
+         */
+        std::vector<log_item> _log{};
+        std::uint32_t _log_used = 0;
+        std::uint32_t _compactions = 0;
+
+        [[nodiscard]] std::uint32_t entries_per_page() const;
+        [[nodiscard]] std::uint32_t log_slot_size() const;
+        [[nodiscard]] std::uint32_t log_capacity() const;
+        [[nodiscard]] std::uint32_t max_pages() const;
+        [[nodiscard]] std::uint32_t first_page_sector() const;
+        /**
+         * @brief Free sectors that @ref compact needs to be able to complete.
+         */
+        [[nodiscard]] std::uint32_t spare_sectors() const;
+        [[nodiscard]] std::uint32_t max_entries() const;
+        [[nodiscard]] std::vector<bool> used_sectors() const;
+
+        [[nodiscard]] int compare_key(std::uint8_t const *lhs, std::uint8_t const *rhs) const;
+        [[nodiscard]] std::vector<log_item>::iterator log_lower_bound(std::uint8_t const *key);
+        /**
+         * @brief Index of the page that would contain @p key, 0 if there are no pages.
+         */
+        [[nodiscard]] std::size_t page_of(std::uint8_t const *key) const;
+        [[nodiscard]] bool read_entry(page_ref const &page, std::uint32_t index, mlab::range<std::uint8_t *> dest);
+        /**
+         * @brief Index of the first entry in @p page with key not smaller than @p key.
+         */
+        [[nodiscard]] bool page_lower_bound(page_ref const &page, std::uint8_t const *key, std::uint32_t &index);
+
+        void log_insert(bool live, mlab::range<std::uint8_t const *> entry);
+        [[nodiscard]] bool append(bool live, mlab::range<std::uint8_t const *> entry);
+        [[nodiscard]] bool load_header(std::uint32_t sector);
+        [[nodiscard]] bool write_header(std::uint32_t generation, std::uint32_t log_epoch, std::vector<page_ref> const &pages);
+        [[nodiscard]] bool load_log();
+        [[nodiscard]] bool erase_log();
+        [[nodiscard]] bool write_page(mlab::range<std::uint8_t const *> entries, std::vector<bool> &used, std::vector<page_ref> &out);
+        /**
+         * @brief Writes the full pages of @p run, and also the partial tail if @p all.
+         */
+        [[nodiscard]] bool flush_run(std::vector<std::uint8_t> &run, bool all, std::vector<bool> &used, std::vector<page_ref> &out);
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_PAGED_TABLE_HPP
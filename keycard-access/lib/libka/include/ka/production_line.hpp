@@ -0,0 +1,150 @@
+#ifndef KEYCARD_ACCESS_PRODUCTION_LINE_HPP
+#define KEYCARD_ACCESS_PRODUCTION_LINE_HPP
+
+#include <chrono>
+#include <deque>
+#include <ka/enrollment_pipeline.hpp>
+#include <ka/gate.hpp>
+#include <ka/member_token.hpp>
+#include <ka/p2p_ops.hpp>
+#include <ka/provisioning_plan.hpp>
+#include <mutex>
+#include <optional>
+
+namespace ka {
+
+    /**
+     * @brief A card to issue: the identity to deploy, minus the token id which is read from the card, and its gates.
+     */
+    struct issuance_job {
+        std::string holder{};
+        std::string publisher{};
+        std::vector<gate_config> gates{};
+    };
+
+    /**
+     * @brief Time spent in each phase of issuing one card.
+     */
+    struct issuance_timings {
+        /**
+         * Reading the token id, and checking it against the roster.
+         */
+        std::chrono::milliseconds identify{0};
+        /**
+         * Formatting, root key, master app and encrypted identity.
+         */
+        std::chrono::milliseconds deploy{0};
+        /**
+         * All the gates of the job.
+         */
+        std::chrono::milliseconds enroll{0};
+        /**
+         * Updating the @ref member_roster.
+         */
+        std::chrono::milliseconds record{0};
+        /**
+         * From the activation of the card to the end, including the time the PN532 took to select it.
+         */
+        std::chrono::milliseconds total{0};
+    };
+
+    struct production_line_stats {
+        std::uint32_t issued = 0;
+        std::uint32_t failed = 0;
+        /**
+         * Cards that were presented again after being issued, and that were left untouched.
+         */
+        std::uint32_t duplicates = 0;
+        /**
+         * Sum of the phase timings of all the issued cards.
+         */
+        issuance_timings issued_time{};
+        std::chrono::milliseconds slowest{0};
+        /**
+         * From the first activation of the batch to the last card issued.
+         */
+        std::chrono::milliseconds elapsed{0};
+        /**
+         * Crypto done on the second core, since the line was created.
+         */
+        enrollment_pipeline_stats pipeline{};
+
+        [[nodiscard]] float cards_per_minute() const;
+    };
+
+    /**
+     * @brief Issues cards from a queue of @ref issuance_job, one per card presented, like an onboarding desk.
+     *
+     * Each card is deployed with @ref member_token::deploy, enrolled into every gate of the job, and recorded in
+     * @ref keymaker::members. Cards already in the roster are not touched again, so picking up a finished card from the
+     * reader does not reprogram it. If a card fails, its job goes back to the front of the queue, for the next card.
+     * Keys and encrypted files are prepared by an @ref enrollment_pipeline while the card is being programmed.
+     * Cards listed in a @ref provisioning_plan are issued as planned instead, with their files encrypted on a host.
+     * When the queue is empty and the last card has left the field, the batch is complete and the scanner is stopped.
+     */
+    class production_line : public virtual member_token_responder {
+    public:
+        explicit production_line(keymaker &km);
+
+        /**
+         * @brief Adds a job to the queue. Safe to call from any task, also while scanning.
+         * @return False if the identity does not fit in the @ref member_roster.
+         */
+        [[nodiscard]] bool enqueue(issuance_job job);
+
+        /**
+         * @brief Issues the cards of the @ref provisioning_plan in @p region as they are presented, taking precedence
+         * over the queued jobs. The other cards still take the next job.
+         */
+        [[nodiscard]] bool open_plan(flash_region region = flash_region::find(ka_plan_partition));
+
+        /**
+         * @brief Queued jobs, plus planned cards not issued yet.
+         */
+        [[nodiscard]] std::size_t pending() const;
+
+        [[nodiscard]] production_line_stats stats() const;
+
+        void log_summary() const;
+
+        /**
+         * @addtogroup Default responder method implementations
+         * The defaults log with the prefix "LINE"; @ref on_batch_complete also logs the summary and stops the scanner.
+         * @{
+         */
+        virtual void on_issued(identity const &who, issuance_timings const &timings);
+        virtual void on_failed(desfire::error e);
+        virtual void on_duplicate(token_id const &id);
+        virtual void on_batch_complete(pn532::scanner &scanner);
+        /**
+         * @}
+         */
+
+        void on_activation(pn532::scanner &scanner, pn532::scanned_target const &target) override;
+        void on_leaving_rf(pn532::scanner &scanner, pn532::scanned_target const &target) override;
+
+        pn532::post_interaction interact_with_token(member_token &token) override;
+
+    private:
+        keymaker &_km;
+        enrollment_pipeline _pipeline;
+        provisioning_plan _plan;
+        mutable std::mutex _mutex;
+        std::deque<issuance_job> _jobs{};
+        std::uint32_t _planned_left = 0;
+        production_line_stats _stats{};
+        std::int64_t _activated_at = 0;
+        std::int64_t _batch_start = 0;
+        bool _batch_complete = false;
+        /**
+         * Signed once per version of the revoked list, not once per card.
+         */
+        std::optional<revocation_record> _revocations = std::nullopt;
+
+        [[nodiscard]] revocation_record const &revocations();
+        [[nodiscard]] r<> issue(member_token &token, identity const &who, std::vector<gate_id> const &gates, issuance_timings &timings);
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_PRODUCTION_LINE_HPP
@@ -0,0 +1,88 @@
+#ifndef KEYCARD_ACCESS_PROVISIONING_PLAN_HPP
+#define KEYCARD_ACCESS_PROVISIONING_PLAN_HPP
+
+#include <functional>
+#include <ka/gate.hpp>
+#include <ka/member_token.hpp>
+#include <ka/paged_table.hpp>
+#include <optional>
+
+namespace ka {
+
+    static constexpr const char *ka_plan_partition = "ka_plan";
+
+    /**
+     * @brief A token of the plan, with keys derived and files ready to be written.
+     */
+    struct planned_card {
+        identity who{};
+        prepared_token token{};
+        std::vector<prepared_gate> gates{};
+    };
+
+    /**
+     * @brief Identities and encrypted files for a roster of tokens, compiled ahead of time on a host by
+     * `misc/compile-plan.py` and flashed to the @ref ka_plan_partition partition.
+     *
+     * Only what does not need the physical card is in the plan: the encoded identities and their ciphertexts for
+     * the keymaker and every gate. The DESFire keys are derived from the @ref token_id at tap time, which is cheap,
+     * so the plan holds no secret. Layout, integers little endian:
+     *  - header: magic `KAPL`, version, keymaker public key, 16 bytes nonce prefix, number of cards (32 bits),
+     *    number of gates (16 bits), body size and CRC32 of the body (32 bits each);
+     *  - gate table: gate id (32 bits) and public key of each gate;
+     *  - card index, sorted by @ref token_id: token id and offset of the card record in the body (32 bits);
+     *  - card records: size of the encoded identity `n` (16 bits), the identity, the master file ciphertext
+     *    (`n` + MAC bytes), the number of gates (8 bits), and for each the index in the gate table (16 bits) and
+     *    the gate file ciphertext.
+     * The nonce of each ciphertext is the nonce prefix, followed by the position of the card in the index and by the
+     * position of the file in the record, master file first (32 bits each); it is appended to the file on the card
+     * as @ref key_pair::encrypt_for does.
+     */
+    class provisioning_plan {
+    public:
+        static constexpr std::uint8_t version = 1;
+        static constexpr std::size_t nonce_prefix_size = 16;
+        static constexpr std::size_t header_size = 4 + 1 + raw_pub_key::array_size + nonce_prefix_size + 4 + 2 + 4 + 4;
+        static constexpr std::size_t gate_entry_size = 4 + raw_pub_key::array_size;
+        static constexpr std::size_t index_entry_size = token_id::array_size + 4;
+
+        explicit provisioning_plan(keymaker &km);
+
+        /**
+         * @brief Checks the plan in @p region: header, checksum, keymaker key, and that every gate is registered in
+         * @ref keymaker::gates with the same public key.
+         */
+        [[nodiscard]] bool open(flash_region region);
+
+        [[nodiscard]] bool is_open() const;
+
+        /**
+         * @brief Number of cards in the plan.
+         */
+        [[nodiscard]] std::uint32_t size() const;
+
+        /**
+         * @brief Reads the record of @p id from flash and derives its keys.
+         * @return The card, or nothing if @p id is not in the plan or the record cannot be read.
+         */
+        [[nodiscard]] std::optional<planned_card> find(token_id const &id) const;
+
+        /**
+         * @brief Calls @p fn on every token of the plan, in @ref token_id order, until it returns false.
+         */
+        [[nodiscard]] bool for_each(std::function<bool(token_id const &)> const &fn) const;
+
+    private:
+        keymaker &_km;
+        flash_region _region{};
+        std::array<std::uint8_t, nonce_prefix_size> _nonce_prefix{};
+        std::uint32_t _cards = 0;
+        std::vector<gate_config> _gates{};
+
+        [[nodiscard]] std::uint32_t index_offset() const;
+        [[nodiscard]] bool read_index(std::uint32_t pos, token_id &id, std::uint32_t &record) const;
+    };
+
+}// namespace ka
+
+#endif//KEYCARD_ACCESS_PROVISIONING_PLAN_HPP
@@ -0,0 +1,115 @@
+#ifndef KEYCARD_ACCESS_REVOCATION_RECORD_HPP
+#define KEYCARD_ACCESS_REVOCATION_RECORD_HPP
+
+#include <ka/data.hpp>
+#include <ka/key_pair.hpp>
+#include <ka/token_list.hpp>
+#include <vector>
+
+namespace ka {
+
+    struct epoch_pub_key_tag {};
+    struct epoch_sec_key_tag {};
+    struct epoch_signature_tag {};
+
+    using epoch_pub_key = mlab::tagged_array<epoch_pub_key_tag, 32>;
+    using epoch_sec_key = mlab::tagged_array<epoch_sec_key_tag, 64>;
+    using epoch_signature = mlab::tagged_array<epoch_signature_tag, 64>;
+
+    /**
+     * @brief Signed header of a @ref revocation_record, the only part a gate reads on every tap.
+     *
+     * It is stored in plain in file @ref file_id of the master app, freely readable, like the @ref gate_directory.
+     * Layout: version, epoch and base epoch (32 bits, little endian), @ref list_digest, @ref delta_digest, signature.
+     */
+    struct revocation_epoch {
+        static constexpr desfire::file_id file_id = 0x1e;
+        static constexpr std::uint8_t version = 1;
+        static constexpr std::size_t size = 1 + 4 + 4 + list_hash::array_size + list_hash::array_size + epoch_signature::array_size;
+
+        /**
+         * Version of the keymaker revoked list, see @ref versioned_token_list::version.
+         */
+        std::uint32_t epoch = 0;
+        /**
+         * Version the delta starts from.
+         */
+        std::uint32_t base_epoch = 0;
+        /**
+         * @ref token_list::hash of the list at @ref epoch, to detect a gate that diverged.
+         */
+        list_hash list_digest{};
+        list_hash delta_digest{};
+        epoch_signature signature{};
+
+        /**
+         * @brief Everything but the signature, which is what is signed.
+         */
+        [[nodiscard]] mlab::bin_data signed_data() const;
+    };
+
+    /**
+     * @brief The revocations a member card carries from the keymaker to offline gates.
+     *
+     * The keymaker writes it on every card it issues or refreshes, see @ref member_token::write_revocation_record.
+     * A gate reads @ref header on each tap; only if its @ref revocation_epoch::epoch is newer than the gate's revoked
+     * list, it reads the delta from @ref delta_file_id, checks it against the signed digest, and applies it.
+     * The delta holds the last @ref max_delta changes at most, so gates further behind need the keymaker.
+     * Layout of the delta file: number of changes (16 bits, little endian), then the changes.
+     */
+    struct revocation_record {
+        static constexpr desfire::file_id delta_file_id = 0x1d;
+        static constexpr std::size_t max_delta = 32;
+
+        revocation_epoch header{};
+        std::vector<list_change> delta{};
+
+        [[nodiscard]] mlab::bin_data delta_file() const;
+
+        /**
+         * @return True if the delta matches the digest in @ref header and @ref header is signed by @p pk.
+         */
+        [[nodiscard]] bool verify(epoch_pub_key const &pk) const;
+
+        /**
+         * @brief Brings @p list to @ref revocation_epoch::epoch. @p list is changed only if it ends up with
+         *  @ref revocation_epoch::list_digest.
+         * @return False if @p list is not older than the epoch, older than the base epoch, or diverged.
+         */
+        [[nodiscard]] bool apply_to(token_list &list) const;
+    };
+
+    /**
+     * @brief Ed25519 key with which the keymaker signs the @ref revocation_record. Gates only hold @ref pub_key.
+     */
+    class epoch_signer {
+        epoch_sec_key _sk{};
+        epoch_pub_key _pk{};
+
+    public:
+        epoch_signer() = default;
+        epoch_signer(epoch_signer const &) = default;
+        epoch_signer &operator=(epoch_signer const &) = default;
+        ~epoch_signer();
+
+        /**
+         * @brief Signing key derived from the secret key of a keymaker, which then does not need to store it.
+         */
+        [[nodiscard]] static epoch_signer derive_from(sec_key const &master);
+
+        [[nodiscard]] epoch_pub_key const &pub_key() const;
+
+        /**
+         * @brief Record of the current version of @p list, with up to @ref revocation_record::max_delta changes.
+         */
+        [[nodiscard]] revocation_record sign(versioned_token_list const &list) const;
+    };
+
+}// namespace ka
+
+namespace mlab {
+    bin_stream &operator>>(bin_stream &s, ka::revocation_epoch &epoch);
+    bin_data &operator<<(bin_data &bd, ka::revocation_epoch const &epoch);
+}// namespace mlab
+
+#endif//KEYCARD_ACCESS_REVOCATION_RECORD_HPP
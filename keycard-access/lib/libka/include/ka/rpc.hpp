@@ -0,0 +1,264 @@
+#ifndef KEYCARD_ACCESS_RPC_HPP
+#define KEYCARD_ACCESS_RPC_HPP
+
+#include <chrono>
+#include <functional>
+#include <ka/secure_p2p.hpp>
+#include <limits>
+#include <map>
+#include <mlab/bin_data.hpp>
+#include <mlab/result.hpp>
+#include <utility>
+#include <vector>
+
+namespace ka::rpc {
+    using ms = std::chrono::milliseconds;
+    using namespace std::chrono_literals;
+
+    using opcode = std::uint8_t;
+
+    /**
+     * @brief Outcome of a single command within a batch.
+     */
+    enum struct status : std::uint8_t {
+        ok = 0,
+        unknown_opcode,
+        malformed_request,
+        malformed_response,
+        unauthorized,
+        failed,
+        missing
+    };
+
+    [[nodiscard]] const char *to_string(status s);
+
+    template <class... Tn>
+    using r = mlab::result<status, Tn...>;
+
+    /**
+     * @brief Empty request or response.
+     */
+    struct none {};
+
+    /**
+     * @addtogroup Commands
+     * A command is a type that describes an opcode and its payloads, e.g.
+     * @code
+     * struct set_time {
+     *     static constexpr opcode code = 0x10;
+     *     using request = std::uint64_t;
+     *     using response = none;
+     * };
+     * @endcode
+     * The request and the response are encoded with `mlab::bin_data::operator<<` and decoded with
+     * `mlab::bin_stream::operator>>`, which must be defined for custom types, as for @ref ka::identity.
+     * @{
+     */
+    template <class Cmd>
+    using request_t = typename Cmd::request;
+
+    template <class Cmd>
+    using response_t = typename Cmd::response;
+    /**
+     * @}
+     */
+
+    struct opcode_stats {
+        std::uint32_t calls = 0;
+        std::uint32_t failures = 0;
+        std::chrono::microseconds last_latency{0};
+        std::chrono::microseconds max_latency{0};
+        std::chrono::microseconds total_latency{0};
+
+        [[nodiscard]] std::chrono::microseconds average_latency() const;
+    };
+
+    /**
+     * @brief Server side: decodes a batch of commands, runs the handler of each opcode in order, and collects the
+     * responses in a single reply.
+     *
+     * A batch is encoded as `count | (opcode | length16 | payload) * count`; the reply as
+     * `count | (opcode | status | length16 | payload) * count`. All commands are executed, even if one fails.
+     */
+    class dispatcher {
+    public:
+        /**
+         * @brief Handler working on the encoded payloads. @p request is positioned at the beginning of the payload.
+         */
+        using raw_handler = std::function<status(mlab::bin_stream &request, mlab::bin_data &response)>;
+
+        void register_raw_handler(opcode code, raw_handler handler);
+
+        /**
+         * @brief Registers a handler for @p Cmd.
+         * @param fn Callable as `r<response_t<Cmd>>(request_t<Cmd> const &)`.
+         */
+        template <class Cmd, class Fn>
+        void register_handler(Fn &&fn);
+
+        [[nodiscard]] bool has_handler(opcode code) const;
+
+        /**
+         * @brief Executes all the commands in @p batch.
+         * @return The encoded reply.
+         */
+        [[nodiscard]] mlab::bin_data dispatch(mlab::bin_data const &batch);
+
+        /**
+         * @brief Receives one batch over @p comm, executes it and sends back the reply.
+         */
+        pn532::result<> serve_one(p2p::secure_target &comm, ms timeout = 1s);
+
+        [[nodiscard]] std::map<opcode, opcode_stats> const &stats() const;
+
+    private:
+        std::map<opcode, raw_handler> _handlers;
+        std::map<opcode, opcode_stats> _stats;
+        mlab::bin_data _payload;
+    };
+
+    class batch_reply {
+        struct item {
+            opcode code = 0;
+            status result = status::missing;
+            mlab::bin_data payload{};
+        };
+        std::vector<item> _items;
+        std::chrono::microseconds _latency{0};
+
+        batch_reply(std::vector<item> items, std::chrono::microseconds latency);
+
+    public:
+        batch_reply() = default;
+
+        [[nodiscard]] static pn532::result<batch_reply> parse(mlab::bin_data const &data, std::vector<opcode> const &expected, std::chrono::microseconds latency);
+
+        [[nodiscard]] std::size_t size() const;
+        [[nodiscard]] status status_of(std::size_t index) const;
+        [[nodiscard]] bool all_ok() const;
+
+        /**
+         * @brief Round trip time of the whole batch.
+         */
+        [[nodiscard]] std::chrono::microseconds latency() const;
+
+        /**
+         * @brief Decodes the response to the command at @p index, which must have been added as @p Cmd.
+         */
+        template <class Cmd>
+        [[nodiscard]] r<response_t<Cmd>> get(std::size_t index) const;
+    };
+
+    /**
+     * @brief Client side: collects commands to be sent in a single round trip.
+     * @note The whole batch and its reply must fit in a single frame of the secure channel.
+     */
+    class batch {
+        mlab::bin_data _data;
+        std::vector<opcode> _codes;
+        /**
+         * Set when a command does not fit the encoding, see @ref max_commands; such a batch is never sent.
+         */
+        bool _oversized = false;
+
+        void append(opcode code, mlab::bin_data const &payload);
+
+    public:
+        /**
+         * @brief The count is encoded in a single byte, and so is the count of the reply. Larger batches fail to send.
+         */
+        static constexpr std::size_t max_commands = std::numeric_limits<std::uint8_t>::max();
+
+        batch();
+
+        /**
+         * @return The index of the command in the batch, to be used with @ref batch_reply::get.
+         */
+        template <class Cmd>
+        std::size_t add(request_t<Cmd> const &req = {});
+
+        [[nodiscard]] std::size_t size() const;
+        [[nodiscard]] bool empty() const;
+        [[nodiscard]] mlab::bin_data const &encoded() const;
+
+        /**
+         * @return @ref pn532::channel_error::app_error without sending anything if the batch holds more than
+         *  @ref max_commands commands, or a payload longer than 64 KiB.
+         */
+        pn532::result<batch_reply> send(p2p::secure_initiator &comm, ms timeout = 1s) const;
+    };
+
+    /**
+     * @brief Sends a batch made of a single command.
+     * @return A channel error, or the outcome of the command.
+     */
+    template <class Cmd>
+    pn532::result<r<response_t<Cmd>>> call(p2p::secure_initiator &comm, request_t<Cmd> const &req = {}, ms timeout = 1s);
+
+}// namespace ka::rpc
+
+namespace mlab {
+    inline bin_stream &operator>>(bin_stream &s, ka::rpc::none &) { return s; }
+    inline bin_data &operator<<(bin_data &bd, ka::rpc::none const &) { return bd; }
+}// namespace mlab
+
+namespace ka::rpc {
+
+    template <class Cmd, class Fn>
+    void dispatcher::register_handler(Fn &&fn) {
+        register_raw_handler(Cmd::code, [fn = std::forward<Fn>(fn)](mlab::bin_stream &s, mlab::bin_data &response) -> status {
+            request_t<Cmd> req{};
+            s >> req;
+            if (s.bad()) {
+                return status::malformed_request;
+            }
+            if (auto r = fn(std::as_const(req)); r) {
+                response << *r;
+                return status::ok;
+            } else {
+                return r.error();
+            }
+        });
+    }
+
+    template <class Cmd>
+    std::size_t batch::add(request_t<Cmd> const &req) {
+        mlab::bin_data payload{};
+        payload << req;
+        append(Cmd::code, payload);
+        return _codes.size() - 1;
+    }
+
+    template <class Cmd>
+    pn532::result<r<response_t<Cmd>>> call(p2p::secure_initiator &comm, request_t<Cmd> const &req, ms timeout) {
+        batch b{};
+        const auto index = b.add<Cmd>(req);
+        if (const auto r_reply = b.send(comm, timeout); not r_reply) {
+            return r_reply.error();
+        } else {
+            return r_reply->template get<Cmd>(index);
+        }
+    }
+
+    template <class Cmd>
+    r<response_t<Cmd>> batch_reply::get(std::size_t index) const {
+        if (index >= _items.size()) {
+            return status::missing;
+        }
+        auto const &it = _items[index];
+        if (it.code != Cmd::code) {
+            return status::malformed_response;
+        } else if (it.result != status::ok) {
+            return it.result;
+        }
+        mlab::bin_stream s{it.payload};
+        response_t<Cmd> resp{};
+        s >> resp;
+        if (s.bad()) {
+            return status::malformed_response;
+        }
+        return resp;
+    }
+}// namespace ka::rpc
+
+#endif//KEYCARD_ACCESS_RPC_HPP
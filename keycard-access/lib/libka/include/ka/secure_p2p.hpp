@@ -7,7 +7,11 @@
 
 #include <ka/data.hpp>
 #include <ka/key_pair.hpp>
+#include <ka/link_quality.hpp>
+#include <memory>
+#include <optional>
 #include <pn532/p2p.hpp>
+#include <sodium/crypto_kdf.h>
 #include <sodium/crypto_secretstream_xchacha20poly1305.h>
 
 
@@ -21,11 +25,134 @@ namespace ka::p2p {
     struct tx_tag {};
     struct rx_tag {};
     struct header_tag {};
+    struct ticket_id_tag {};
+    struct ticket_secret_tag {};
 
     using tx_key = mlab::tagged_array<tx_tag, 32>;
     using rx_key = mlab::tagged_array<rx_tag, 32>;
     using header = mlab::tagged_array<header_tag, crypto_secretstream_xchacha20poly1305_HEADERBYTES>;
+    using ticket_id = mlab::tagged_array<ticket_id_tag, 16>;
+    using ticket_secret = mlab::tagged_array<ticket_secret_tag, crypto_kdf_KEYBYTES>;
 
+    /**
+     * @brief Allows a peer that dropped out of the field to resume a secure session without a new key exchange.
+     * Both sides derive the same ticket from the session keys. Tickets are single use: resuming a session derives the
+     * next ticket, which replaces the used one on both sides.
+     */
+    struct session_ticket {
+        static constexpr std::chrono::seconds lifetime{120};
+
+        ticket_id id{};
+        ticket_secret secret{};
+        raw_pub_key peer_pk{};
+        /**
+         * Microseconds since boot, as per `esp_timer_get_time`.
+         */
+        std::int64_t expires_at = 0;
+
+        /**
+         * @return True if the ticket has been issued and has not expired.
+         */
+        [[nodiscard]] bool is_valid() const;
+    };
+
+    /**
+     * @brief Tickets issued by a @ref secure_target, to be shared across sessions.
+     */
+    class session_ticket_store {
+    public:
+        static constexpr std::size_t capacity = 4;
+
+        /**
+         * @brief Stores @p ticket, replacing the one that expires first if the store is full.
+         */
+        void insert(session_ticket const &ticket);
+
+        /**
+         * @brief Removes and returns the ticket with the given @p id, if it exists and it has not expired.
+         */
+        [[nodiscard]] std::optional<session_ticket> take(ticket_id const &id);
+
+        void clear();
+
+    private:
+        std::array<session_ticket, capacity> _tickets{};
+    };
+
+    struct session_stats {
+        /**
+         * Frames sent again by the initiator because the reply was lost or corrupted.
+         */
+        std::uint32_t retransmissions = 0;
+        /**
+         * Retransmitted frames received by the target, answered with the cached reply.
+         */
+        std::uint32_t duplicates = 0;
+        bool resumed = false;
+    };
+
+    /**
+     * @brief Caller-owned storage for zero-copy messages over @ref secure_initiator and @ref secure_target.
+     * The payload is written in place after @ref headroom bytes, and it is encrypted in place, with the authentication
+     * data filling the headroom and @ref tailroom. Reusing the same buffer for every message avoids any allocation once
+     * its capacity has grown to the largest message.
+     */
+    class message_buffer {
+        mlab::bin_data _frame{};
+
+    public:
+        /**
+         * Room for the sequence number and the encrypted secretstream tag before the payload.
+         */
+        static constexpr std::size_t headroom = 2;
+        /**
+         * Room for the MAC after the payload.
+         */
+        static constexpr std::size_t tailroom = crypto_secretstream_xchacha20poly1305_ABYTES - 1;
+
+        message_buffer() = default;
+        explicit message_buffer(std::size_t payload_capacity);
+
+        /**
+         * @brief Sets the payload size to @p length, without reallocating if the capacity suffices.
+         * @return A writable view over the payload.
+         */
+        [[nodiscard]] mlab::range<std::uint8_t *> prepare(std::size_t length);
+
+        [[nodiscard]] mlab::range<std::uint8_t *> payload();
+        [[nodiscard]] std::size_t payload_capacity() const;
+
+        /**
+         * @brief The whole frame, headroom and tailroom included, as it goes on the wire.
+         */
+        [[nodiscard]] mlab::bin_data &frame();
+    };
+
+    /**
+     * @brief Secure channel over a raw P2P layer.
+     *
+     * The full handshake takes two round trips:
+     *  1. initiator → target: initiator public key; target → initiator: target public key;
+     *  2. initiator → target: initiator secretstream header; target → initiator: target secretstream header.
+     *
+     * When the initiator already knows the target's public key (e.g. a keymaker talking to a gate it configured), the
+     * handshake is piggybacked on the first message, and completes in a single round trip:
+     *  1. initiator → target: initiator public key | initiator header | first encrypted message;
+     *     target → initiator: target header | first encrypted reply.
+     *
+     * If the target cannot decrypt the first message (e.g. its key pair changed), it replies with just its public key,
+     * and the initiator continues with step 2 of the full handshake, and then resends the first message.
+     *
+     * An initiator holding a @ref session_ticket from a previous session skips the key exchange:
+     *  1. initiator → target: initiator public key | ticket id | initiator header;
+     *     target → initiator: target header, or the target public key if the ticket is unknown or expired, in which
+     *     case the full handshake continues from step 2.
+     *
+     * Every message is prefixed by a sequence number, which is authenticated together with it. If a reply is lost or
+     * corrupted, the initiator sends again the same frame, up to @ref max_retransmissions times; the target recognizes
+     * the duplicate and sends again its last reply, so that the secretstream states stay in sync. Handshake frames are
+     * not retransmitted: a session that fails during the handshake is resumed or restarted.
+     */
     class secure_initiator : public initiator {
         initiator *_raw_layer = nullptr;
         crypto_secretstream_xchacha20poly1305_state _tx{};
@@ -35,8 +162,28 @@ namespace ka::p2p {
         key_pair _kp{};
         mlab::bin_data _buffer{};
         raw_pub_key _peer_pk{};
+        rx_key _pending_rx_key{};
+        bool _has_known_peer = false;
+        mlab::bin_data _rx_frame{};
+        message_buffer _tx_buffer{};
+        std::uint8_t _tx_seq = 0;
+        unsigned _max_retransmissions = default_max_retransmissions;
+        link_quality *_link = nullptr;
+        session_ticket _ticket{};
+        session_stats _stats{};
+
+        [[nodiscard]] bool setup_tx(raw_pub_key const &peer_pk);
+        void setup_resumed_tx();
+        void setup_rx(header const &target_header);
+        [[nodiscard]] result<> exchange_headers(ms timeout);
+        [[nodiscard]] result<> complete_from_target_pub_key(mlab::bin_data const &reply, ms timeout);
+        [[nodiscard]] result<> resume(ms timeout);
+        [[nodiscard]] result<mlab::bin_data> communicate_with_fast_handshake(mlab::bin_data const &data, ms timeout);
+        [[nodiscard]] result<mlab::range<std::uint8_t const *>> transmit(message_buffer &buffer, ms timeout);
 
     public:
+        static constexpr unsigned default_max_retransmissions = 2;
+
         secure_initiator() = default;
         secure_initiator(secure_initiator const &) = delete;
         secure_initiator(secure_initiator &&) noexcept = default;
@@ -45,14 +192,68 @@ namespace ka::p2p {
 
         secure_initiator(initiator &raw_layer, key_pair kp);
 
+        /**
+         * @brief Constructs an initiator that will perform a single round trip handshake with @p known_peer.
+         * The handshake is carried out together with the first call to @ref communicate. If the target presents a
+         * different public key, the handshake fails.
+         */
+        secure_initiator(initiator &raw_layer, key_pair kp, pub_key const &known_peer);
+
+        /**
+         * @brief Constructs an initiator that resumes the session that issued @p ticket, if still valid.
+         * Obtain the ticket from @ref ticket at the end of the previous session.
+         */
+        secure_initiator(initiator &raw_layer, key_pair kp, session_ticket const &ticket);
+
+        /**
+         * @brief Performs the full two round trip handshake, or resumes the session if a valid ticket was specified.
+         * @note If a known peer was specified, prefer calling @ref communicate directly, which saves a round trip.
+         */
         result<raw_pub_key> handshake(ms timeout = 1s);
 
         [[nodiscard]] inline bool did_handshake() const;
         [[nodiscard]] inline raw_pub_key const &peer_pub_key() const;
 
+        /**
+         * @brief Ticket to resume this session later with a new @ref secure_initiator. Valid after the handshake.
+         */
+        [[nodiscard]] inline session_ticket const &ticket() const;
+        [[nodiscard]] inline session_stats const &stats() const;
+
+        /**
+         * @brief Number of times the same frame is sent again before giving up; the timeout of each @ref communicate
+         * call is split among all the attempts.
+         */
+        [[nodiscard]] inline unsigned max_retransmissions() const;
+        inline void set_max_retransmissions(unsigned n);
+
+        /**
+         * @brief Adapts timeouts and retransmissions to the link, instead of splitting the timeout evenly.
+         * Each attempt waits for the timeout estimated by @p link, and the number of retransmissions follows the
+         * measured loss rate; the timeout passed to @ref communicate is then only an upper bound on the total time.
+         * Every round trip that needs no retransmission is sampled into @p link.
+         * @param link Must outlive this object, or be reset to `nullptr`.
+         */
+        inline void set_link_quality(link_quality *link);
+        [[nodiscard]] inline link_quality *link() const;
+
         [[nodiscard]] result<mlab::bin_data> communicate(mlab::bin_data const &data, ms timeout) override;
+
+        /**
+         * @brief Zero-copy version of @ref communicate.
+         * The payload of @p buffer is encrypted in place and sent; the reply is decrypted in place inside the frame
+         * returned by the raw layer, and no other allocation takes place.
+         * @param buffer Contains the message to send; its payload is overwritten with ciphertext.
+         * @return A view over the decrypted reply, valid until the next call to any `communicate` method.
+         */
+        [[nodiscard]] result<mlab::range<std::uint8_t const *>> communicate(message_buffer &buffer, ms timeout);
     };
 
+    /**
+     * @brief Target side of the secure channel, see @ref secure_initiator for the handshake.
+     * The target accepts the full and the single round trip handshake, and resumes sessions from the tickets in its
+     * @ref session_ticket_store, whichever the initiator starts.
+     */
     class secure_target : public target {
         target *_raw_layer = nullptr;
         crypto_secretstream_xchacha20poly1305_state _tx{};
@@ -62,6 +263,41 @@ namespace ka::p2p {
         key_pair _kp{};
         mlab::bin_data _buffer{};
         raw_pub_key _peer_pk{};
+        /**
+         * Set after a single round trip handshake: the first message has already been received, and the first reply
+         * must carry our header.
+         */
+        bool _has_pending_rx = false;
+        bool _reply_needs_header = false;
+        mlab::bin_data _rx_frame{};
+        message_buffer _tx_buffer{};
+        std::shared_ptr<session_ticket_store> _tickets = nullptr;
+        /**
+         * Sequence number of the next message, and of the message being answered.
+         */
+        std::uint8_t _rx_seq = 0;
+        std::uint8_t _reply_seq = 0;
+        /**
+         * Last encrypted reply, sent again if the initiator retransmits its frame.
+         */
+        mlab::bin_data _last_reply{};
+        bool _has_last_reply = false;
+        /**
+         * Set while @ref _last_reply answers a single round trip handshake, whose retransmission is the whole frame.
+         */
+        bool _last_reply_is_handshake = false;
+        /**
+         * Ticket of the session being established, stored in @ref _tickets only once the handshake succeeds.
+         */
+        session_ticket _pending_ticket{};
+        session_stats _stats{};
+
+        [[nodiscard]] bool derive_keys(header const &initiator_header);
+        void store_pending_ticket();
+        [[nodiscard]] bool is_handshake_retransmission(mlab::bin_data const &frame) const;
+        [[nodiscard]] bool try_fast_handshake(mlab::bin_data const &frame);
+        [[nodiscard]] bool try_resume(mlab::bin_data const &frame);
+        [[nodiscard]] result<> full_handshake_from_pub_key(ms timeout);
 
     public:
         secure_target() = default;
@@ -70,15 +306,33 @@ namespace ka::p2p {
         secure_target &operator=(secure_target const &) = delete;
         secure_target &operator=(secure_target &&) noexcept = default;
 
-        secure_target(target &raw_layer, key_pair kp);
+        /**
+         * @param tickets If specified, a ticket for each session is stored here, and the initiator can resume it.
+         */
+        secure_target(target &raw_layer, key_pair kp, std::shared_ptr<session_ticket_store> tickets = nullptr);
 
         result<raw_pub_key> handshake(ms timeout = 1s);
 
         [[nodiscard]] inline bool did_handshake() const;
         [[nodiscard]] inline raw_pub_key const &peer_pub_key() const;
+        [[nodiscard]] inline session_stats const &stats() const;
 
         [[nodiscard]] result<mlab::bin_data> receive(ms timeout) override;
         result<> send(mlab::bin_data const &data, ms timeout) override;
+
+        /**
+         * @brief Zero-copy version of @ref receive: the message is decrypted in place inside the frame returned by the
+         * raw layer.
+         * @return A view over the decrypted message, valid until the next call to any `receive` method.
+         */
+        [[nodiscard]] result<mlab::range<std::uint8_t const *>> receive_view(ms timeout);
+
+        /**
+         * @brief Zero-copy version of @ref send. The payload of @p buffer is encrypted in place.
+         * The encrypted frame is kept for retransmissions by swapping storage: afterwards @p buffer holds the storage
+         * of an earlier reply, whose content is unspecified. Call @ref message_buffer::prepare before reusing it.
+         */
+        result<> send(message_buffer &buffer, ms timeout);
     };
 }// namespace ka::p2p
 
@@ -91,12 +345,33 @@ namespace ka::p2p {
     raw_pub_key const &secure_target::peer_pub_key() const {
         return _peer_pk;
     }
+    session_stats const &secure_target::stats() const {
+        return _stats;
+    }
     bool secure_initiator::did_handshake() const {
         return _did_handshake;
     }
     raw_pub_key const &secure_initiator::peer_pub_key() const {
         return _peer_pk;
     }
+    session_ticket const &secure_initiator::ticket() const {
+        return _ticket;
+    }
+    session_stats const &secure_initiator::stats() const {
+        return _stats;
+    }
+    unsigned secure_initiator::max_retransmissions() const {
+        return _max_retransmissions;
+    }
+    void secure_initiator::set_max_retransmissions(unsigned n) {
+        _max_retransmissions = n;
+    }
+    void secure_initiator::set_link_quality(link_quality *link) {
+        _link = link;
+    }
+    link_quality *secure_initiator::link() const {
+        return _link;
+    }
 }// namespace ka::p2p
 
 #endif//KEYCARD_ACCESS_SECURE_P2P_HPP
@@ -0,0 +1,115 @@
+#ifndef KEYCARD_ACCESS_TELEMETRY_HPP
+#define KEYCARD_ACCESS_TELEMETRY_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <desfire/data.hpp>
+#include <mlab/bin_data.hpp>
+#include <nvs_flash.h>
+#include <pn532/channel.hpp>
+#include <utility>
+#include <vector>
+
+namespace ka {
+    /**
+     * @brief Log-linear latency buckets: each power of two is split in 4 buckets, so that every bucket is at most 25%
+     * wider than its lower bound. Values below 4 µs have their own bucket; the last bucket collects everything above
+     * ~16 s.
+     */
+    struct latency_buckets {
+        static constexpr std::size_t count = 100;
+
+        [[nodiscard]] static std::size_t index_of(std::chrono::microseconds latency);
+        [[nodiscard]] static std::chrono::microseconds lower_bound(std::size_t index);
+    };
+
+    /**
+     * @brief Point-in-time copy of the @ref telemetry counters, as sent over the wire.
+     * Only nonzero counters are listed.
+     */
+    struct telemetry_snapshot {
+        static constexpr std::uint8_t format_version = 2;
+
+        std::chrono::seconds uptime{0};
+
+        std::uint32_t free_heap = 0;
+        std::uint32_t min_free_heap = 0;
+        std::uint32_t largest_free_block = 0;
+
+        /**
+         * @addtogroup Flash wear
+         * NVS entry usage of the default partition, and number of commits since boot.
+         * @{
+         */
+        std::uint32_t nvs_used_entries = 0;
+        std::uint32_t nvs_free_entries = 0;
+        std::uint32_t nvs_commits = 0;
+        /**
+         * @}
+         */
+
+        std::uint32_t taps_ok = 0;
+        std::vector<std::pair<desfire::error, std::uint32_t>> tap_failures{};
+        std::vector<std::pair<pn532::channel_error, std::uint32_t>> failed_scans{};
+        std::vector<std::pair<std::uint8_t, std::uint32_t>> tap_latency{};
+
+        [[nodiscard]] std::uint32_t taps() const;
+        [[nodiscard]] std::uint32_t failures_of(desfire::error e) const;
+
+        /**
+         * @brief Upper bound of the tap latency below which fall @p q of the taps, e.g. 0.99 for the 99th percentile.
+         * @return Zero if no tap was recorded.
+         */
+        [[nodiscard]] std::chrono::microseconds latency_percentile(float q) const;
+    };
+
+    /**
+     * @brief Process-wide counters about the gate activity. All the `record_*` methods are lock-free and can be called
+     * from the tap path; reading is done via @ref snapshot.
+     */
+    class telemetry {
+        static_assert(sizeof(desfire::error) == 1, "Tap failures are indexed by the DESFire error code.");
+        static constexpr std::size_t max_channel_errors = 16;
+
+        std::atomic<std::uint32_t> _taps_ok{0};
+        std::array<std::atomic<std::uint32_t>, 0x100> _tap_failures{};
+        std::array<std::atomic<std::uint32_t>, max_channel_errors> _failed_scans{};
+        std::array<std::atomic<std::uint32_t>, latency_buckets::count> _tap_latency{};
+        std::atomic<std::uint32_t> _nvs_commits{0};
+
+    public:
+        telemetry() = default;
+        telemetry(telemetry const &) = delete;
+        telemetry &operator=(telemetry const &) = delete;
+
+        /**
+         * @brief The instance fed by @ref gate, @ref gate_responder and @ref nvs::namespc.
+         */
+        [[nodiscard]] static telemetry &instance();
+
+        void record_tap(std::chrono::microseconds latency);
+        void record_tap(std::chrono::microseconds latency, desfire::error e);
+        void record_failed_scan(pn532::channel_error e);
+        void record_nvs_commit();
+
+        /**
+         * @param nvs_partition Label of the NVS partition whose entry usage is reported.
+         */
+        [[nodiscard]] telemetry_snapshot snapshot(const char *nvs_partition = NVS_DEFAULT_PART_NAME) const;
+
+        void reset();
+    };
+
+}// namespace ka
+
+namespace mlab {
+    /**
+     * Encoded as `version | varint fields | 3 × (varint count | (key | varint)*)`, see `misc/decode-telemetry.py`.
+     */
+    bin_stream &operator>>(bin_stream &s, ka::telemetry_snapshot &snapshot);
+    bin_data &operator<<(bin_data &bd, ka::telemetry_snapshot const &snapshot);
+}// namespace mlab
+
+#endif//KEYCARD_ACCESS_TELEMETRY_HPP
@@ -0,0 +1,148 @@
+#ifndef KEYCARD_ACCESS_TOKEN_LIST_HPP
+#define KEYCARD_ACCESS_TOKEN_LIST_HPP
+
+#include <deque>
+#include <ka/data.hpp>
+#include <ka/nvs.hpp>
+#include <optional>
+#include <vector>
+
+namespace ka {
+
+    enum struct token_list_id : std::uint8_t {
+        revoked = 0
+    };
+
+    enum struct list_op : std::uint8_t {
+        remove = 0,
+        add = 1
+    };
+
+    struct list_change {
+        list_op op = list_op::add;
+        token_id id{};
+    };
+
+    struct list_hash_tag {};
+    using list_hash = mlab::tagged_array<list_hash_tag, 16>;
+
+    /**
+     * @brief What a gate reports about one of its lists, enough to decide what to send and to detect divergence.
+     */
+    struct list_summary {
+        std::uint32_t version = 0;
+        std::uint32_t size = 0;
+        list_hash hash{};
+
+        [[nodiscard]] bool operator==(list_summary const &other) const;
+        [[nodiscard]] bool operator!=(list_summary const &other) const;
+    };
+
+    /**
+     * @brief Sorted set of token ids, with the version of the keymaker list it mirrors.
+     */
+    class token_list {
+        std::uint32_t _version = 0;
+        std::vector<token_id> _items;
+        mutable std::optional<list_hash> _hash = std::nullopt;
+
+    public:
+        /**
+         * @brief Largest list a gate accepts, about 3.5 KB once stored: it shares the NVS partition with the other gate
+         * data, and a blob can only be rewritten if the partition has room for a second copy.
+         */
+        static constexpr std::size_t max_size = 512;
+
+        token_list() = default;
+
+        [[nodiscard]] std::uint32_t version() const;
+        [[nodiscard]] std::size_t size() const;
+        [[nodiscard]] bool empty() const;
+        [[nodiscard]] std::vector<token_id> const &items() const;
+
+        /**
+         * @brief O(log n) lookup.
+         */
+        [[nodiscard]] bool contains(token_id const &id) const;
+
+        /**
+         * @brief Hash of the content, independent of the version. Cached until the next change.
+         */
+        [[nodiscard]] list_hash hash() const;
+        [[nodiscard]] list_summary summary() const;
+
+        /**
+         * @brief Applies @p change; adding an existing id or removing a missing one does nothing.
+         * @return True if the content changed.
+         */
+        bool apply(list_change const &change);
+
+        void set_version(std::uint32_t version);
+
+        /**
+         * @brief Replaces the whole content; @p items does not need to be sorted.
+         */
+        void assign(std::vector<token_id> items, std::uint32_t version);
+
+        void clear();
+
+        [[nodiscard]] nvs::r<> store(nvs::namespc &ns, const char *key) const;
+        [[nodiscard]] nvs::r<> load(nvs::const_namespc const &ns, const char *key);
+    };
+
+    /**
+     * @brief Authoritative copy of a list on the keymaker. Each change bumps the version by one and is recorded in a
+     * bounded changelog, so that a gate can be brought up to date by sending only what changed since its version.
+     */
+    class versioned_token_list {
+        token_list _list;
+        /**
+         * The i-th change brings the list from version `first_logged_version() + i` to the next one.
+         */
+        std::deque<list_change> _changelog;
+        std::size_t _max_changelog;
+
+        void record(list_change const &change);
+
+    public:
+        static constexpr std::size_t default_max_changelog = 256;
+
+        explicit versioned_token_list(std::size_t max_changelog = default_max_changelog);
+
+        /**
+         * @return True if the list changed, and thus a new version was created.
+         */
+        bool add(token_id const &id);
+        bool remove(token_id const &id);
+
+        /**
+         * @brief Replaces content and version, e.g. when rebuilding the list after a reboot. The changelog is dropped,
+         * so gates at an older version are brought up to date with a snapshot.
+         */
+        void restore(std::vector<token_id> items, std::uint32_t version);
+
+        [[nodiscard]] token_list const &list() const;
+        [[nodiscard]] std::uint32_t version() const;
+
+        /**
+         * @brief Oldest version from which a delta can be computed.
+         */
+        [[nodiscard]] std::uint32_t first_logged_version() const;
+
+        /**
+         * @return The changes that bring a list at @p version to the current version, or `std::nullopt` if the
+         *  changelog does not go back that far, or @p version is newer than the current one.
+         */
+        [[nodiscard]] std::optional<std::vector<list_change>> delta_since(std::uint32_t version) const;
+    };
+
+}// namespace ka
+
+namespace mlab {
+    bin_stream &operator>>(bin_stream &s, ka::list_change &change);
+    bin_data &operator<<(bin_data &bd, ka::list_change const &change);
+    bin_stream &operator>>(bin_stream &s, ka::list_summary &summary);
+    bin_data &operator<<(bin_data &bd, ka::list_summary const &summary);
+}// namespace mlab
+
+#endif//KEYCARD_ACCESS_TOKEN_LIST_HPP
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <ctime>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <ka/deploy_queue.hpp>
+#include <sodium/utils.h>
+
+namespace ka {
+
+    namespace {
+        void wipe(deploy_certificate &cert) {
+            sodium_memzero(cert.mkey.data(), cert.mkey.size());
+        }
+    }// namespace
+
+    std::size_t deploy_queue::token_id_hash::operator()(token_id const &id) const {
+        return std::hash<std::uint64_t>{}(util::pack_token_id(id));
+    }
+
+    deploy_queue::deploy_queue(std::size_t capacity) : _capacity{capacity} {
+        _pending.reserve(capacity);
+    }
+
+    std::size_t deploy_queue::size() const {
+        return _pending.size();
+    }
+
+    std::size_t deploy_queue::capacity() const {
+        return _capacity;
+    }
+
+    bool deploy_queue::empty() const {
+        return _pending.empty();
+    }
+
+    deploy_queue_status deploy_queue::status() const {
+        return {std::uint32_t(_pending.size()), std::uint32_t(_capacity), now()};
+    }
+
+    std::uint32_t deploy_queue::revision() const {
+        return _revision;
+    }
+
+    std::uint32_t deploy_queue::now() const {
+        const auto uptime_s = std::uint32_t((esp_timer_get_time() - _clock_set_at) / 1000000);
+        // Without an RTC or SNTP the system clock starts from the epoch at boot
+        return std::max(std::uint32_t(std::time(nullptr)), _clock + uptime_s);
+    }
+
+    void deploy_queue::advance_clock(std::uint32_t unix_time) {
+        if (unix_time > now()) {
+            _clock = unix_time;
+            _clock_set_at = esp_timer_get_time();
+            ++_revision;
+        }
+    }
+
+    void deploy_queue::erase(decltype(_pending)::iterator it) {
+        wipe(it->second);
+        _pending.erase(it);
+        ++_revision;
+    }
+
+    bool deploy_queue::insert(deploy_certificate const &cert) {
+        if (cert.expires_at <= now()) {
+            return false;
+        }
+        if (auto it = _pending.find(cert.who.id); it != std::end(_pending)) {
+            it->second = cert;
+            ++_revision;
+            return true;
+        }
+        if (_pending.size() >= _capacity and purge_expired() == 0) {
+            return false;
+        }
+        _pending.emplace(cert.who.id, cert);
+        ++_revision;
+        return true;
+    }
+
+    bool deploy_queue::contains(token_id const &id) const {
+        return _pending.find(id) != std::end(_pending);
+    }
+
+    std::optional<deploy_certificate> deploy_queue::take(token_id const &id) {
+        auto it = _pending.find(id);
+        if (it == std::end(_pending)) {
+            return std::nullopt;
+        }
+        std::optional<deploy_certificate> cert = std::nullopt;
+        if (it->second.expires_at > now()) {
+            cert = it->second;
+        }
+        erase(it);
+        return cert;
+    }
+
+    std::size_t deploy_queue::purge_expired() {
+        const auto t = now();
+        std::size_t purged = 0;
+        for (auto it = std::begin(_pending); it != std::end(_pending);) {
+            if (it->second.expires_at <= t) {
+                auto next = std::next(it);
+                erase(it);
+                it = next;
+                ++purged;
+            } else {
+                ++it;
+            }
+        }
+        return purged;
+    }
+
+    void deploy_queue::clear() {
+        while (not _pending.empty()) {
+            erase(std::begin(_pending));
+        }
+    }
+
+    nvs::r<> deploy_queue::store(nvs::namespc &ns, const char *key) const {
+        mlab::bin_data bd{};
+        bd << mlab::lsb32 << now() << mlab::lsb32 << std::uint32_t(_pending.size());
+        for (auto const &[id, cert] : _pending) {
+            bd << cert;
+        }
+        const auto r = ns.set<mlab::bin_data>(key, bd);
+        sodium_memzero(bd.data(), bd.size());
+        return r;
+    }
+
+    nvs::r<> deploy_queue::load(nvs::const_namespc const &ns, const char *key) {
+        auto r = ns.get<mlab::bin_data>(key);
+        if (not r) {
+            return r.error();
+        }
+        clear();
+        mlab::bin_stream s{*r};
+        std::uint32_t clock = 0;
+        std::uint32_t count = 0;
+        s >> mlab::lsb32 >> clock >> mlab::lsb32 >> count;
+        nvs::r<> retval = mlab::result_success;
+        if (s.bad() or count > _capacity) {
+            retval = nvs::error::invalid_length;
+        } else {
+            for (std::uint32_t i = 0; i < count and not s.bad(); ++i) {
+                deploy_certificate cert{};
+                s >> cert;
+                if (not s.bad()) {
+                    _pending.emplace(cert.who.id, cert);
+                }
+                wipe(cert);
+            }
+            if (s.bad() or s.remaining() > 0) {
+                clear();
+                retval = nvs::error::invalid_length;
+            }
+        }
+        if (not retval) {
+            ESP_LOGE("KA", "Invalid %s size.", key);
+        } else {
+            // The gate was powered off meanwhile for an unknown time, resume from when it was stored
+            advance_clock(clock);
+            purge_expired();
+        }
+        sodium_memzero(r->data(), r->size());
+        return retval;
+    }
+
+}// namespace ka
+
+namespace mlab {
+
+    bin_stream &operator>>(bin_stream &s, ka::deploy_certificate &cert) {
+        s >> cert.who;
+        if (s.bad() or s.remaining() < 4 + cert.mkey.size()) {
+            s.set_bad();
+            return s;
+        }
+        return s >> mlab::lsb32 >> cert.expires_at >> cert.mkey;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::deploy_certificate const &cert) {
+        return bd << cert.who << mlab::lsb32 << cert.expires_at << cert.mkey;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::deploy_queue_status &status) {
+        return s >> mlab::lsb32 >> status.pending >> mlab::lsb32 >> status.capacity >> mlab::lsb32 >> status.now;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::deploy_queue_status const &status) {
+        return bd << mlab::lsb32 << status.pending << mlab::lsb32 << status.capacity << mlab::lsb32 << status.now;
+    }
+
+}// namespace mlab
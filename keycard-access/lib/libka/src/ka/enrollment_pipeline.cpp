@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <esp_pthread.h>
+#include <esp_timer.h>
+#include <functional>
+#include <ka/enrollment_pipeline.hpp>
+#include <ka/p2p_ops.hpp>
+#include <sdkconfig.h>
+
+namespace ka {
+
+    namespace {
+        [[nodiscard]] std::thread spawn_worker(std::function<void()> fn) {
+            auto cfg = esp_pthread_get_default_config();
+            cfg.thread_name = "ka_enroll";
+            // Room for the sodium primitives
+            cfg.stack_size = 6144;
+#ifndef CONFIG_FREERTOS_UNICORE
+            // The main task, and thus the PN532, runs on the first core
+            cfg.pin_to_core = 1;
+#endif
+            esp_pthread_set_cfg(&cfg);
+            std::thread worker{std::move(fn)};
+            const auto default_cfg = esp_pthread_get_default_config();
+            esp_pthread_set_cfg(&default_cfg);
+            return worker;
+        }
+
+        [[nodiscard]] r<prepared_token> prepare_token(key_pair const &kp, identity const &who) {
+            prepared_token t{who.id, kp.derive_token_root_key(who.id), kp.derive_gate_app_master_key(who.id), {}};
+            t.master_file << who;
+            if (not kp.encrypt_for(kp, t.master_file)) {
+                return desfire::error::crypto_error;
+            }
+            return t;
+        }
+
+        [[nodiscard]] r<prepared_gate> prepare_gate(key_pair const &kp, identity const &who, gate_config const &g) {
+            prepared_gate pg{g.id, g.app_base_key.derive_token_key(who.id, g.id.key_no()), {}};
+            pg.gate_file << who;
+            if (not kp.encrypt_for(g.gate_pub_key, pg.gate_file)) {
+                return desfire::error::crypto_error;
+            }
+            return pg;
+        }
+
+        [[nodiscard]] std::chrono::milliseconds elapsed_since(std::int64_t start_us) {
+            return std::chrono::milliseconds{(esp_timer_get_time() - start_us) / 1000};
+        }
+    }// namespace
+
+    enrollment_pipeline::enrollment_pipeline(keymaker const &km, std::size_t depth)
+        : _km{km}, _depth{std::max(depth, std::size_t{1})}, _worker{spawn_worker([this] { worker_loop(); })} {}
+
+    enrollment_pipeline::~enrollment_pipeline() {
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            _stop = true;
+        }
+        _cv.notify_all();
+        _worker.join();
+    }
+
+    void enrollment_pipeline::start(identity who, std::vector<gate_config> gates) {
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            ++_generation;
+            _active = true;
+            _who = std::move(who);
+            _gates = std::move(gates);
+            _token = std::nullopt;
+            _ready.clear();
+            _count = _gates.size();
+            _prepared = 0;
+            _taken = 0;
+        }
+        _cv.notify_all();
+    }
+
+    void enrollment_pipeline::start(prepared_token t, std::vector<prepared_gate> gates) {
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            ++_generation;
+            _active = true;
+            _who = {};
+            _gates.clear();
+            _token = std::move(t);
+            _ready.clear();
+            for (auto &pg : gates) {
+                _ready.emplace_back(std::move(pg));
+            }
+            _count = _ready.size();
+            _prepared = 0;
+            _taken = 0;
+        }
+        _cv.notify_all();
+    }
+
+    void enrollment_pipeline::cancel() {
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            ++_generation;
+            _active = false;
+            _token = std::nullopt;
+            _ready.clear();
+        }
+        _cv.notify_all();
+    }
+
+    bool enrollment_pipeline::has_work() const {
+        if (not _active) {
+            return false;
+        }
+        if (not _token) {
+            return true;
+        }
+        // No point in encrypting gate files for a token that cannot be deployed
+        return *_token and _prepared < _gates.size() and _ready.size() < _depth;
+    }
+
+    void enrollment_pipeline::worker_loop() {
+        std::unique_lock<std::mutex> lock{_mutex};
+        while (true) {
+            _cv.wait(lock, [&] { return _stop or has_work(); });
+            if (_stop) {
+                return;
+            }
+            const auto generation = _generation;
+            const identity who = _who;
+            const std::optional<gate_config> g = _token ? std::optional<gate_config>{_gates[_prepared]} : std::nullopt;
+            // Crypto does not need the lock, and the RF side can meanwhile consume what is ready
+            lock.unlock();
+            const auto start = esp_timer_get_time();
+            std::optional<r<prepared_token>> t = std::nullopt;
+            std::optional<r<prepared_gate>> pg = std::nullopt;
+            if (g) {
+                pg = prepare_gate(_km.keys(), who, *g);
+            } else {
+                t = prepare_token(_km.keys(), who);
+            }
+            const auto elapsed = elapsed_since(start);
+            lock.lock();
+            _stats.crypto += elapsed;
+            if (generation != _generation) {
+                // Started again or cancelled meanwhile
+                continue;
+            }
+            if (pg) {
+                _ready.push_back(std::move(*pg));
+                ++_prepared;
+                ++_stats.gates;
+            } else {
+                _token = std::move(t);
+                ++_stats.tokens;
+            }
+            _cv.notify_all();
+        }
+    }
+
+    r<prepared_token> enrollment_pipeline::take_token() {
+        std::unique_lock<std::mutex> lock{_mutex};
+        const auto generation = _generation;
+        const auto start = esp_timer_get_time();
+        _cv.wait(lock, [&] { return generation != _generation or not _active or _token; });
+        _stats.stalled += elapsed_since(start);
+        if (generation != _generation or not _active) {
+            return desfire::error::parameter_error;
+        }
+        return *_token;
+    }
+
+    r<prepared_gate> enrollment_pipeline::take_gate() {
+        std::unique_lock<std::mutex> lock{_mutex};
+        if (not _active or _taken >= _count) {
+            return desfire::error::parameter_error;
+        }
+        const auto generation = _generation;
+        const auto start = esp_timer_get_time();
+        _cv.wait(lock, [&] { return generation != _generation or not _ready.empty() or (_token and not *_token); });
+        _stats.stalled += elapsed_since(start);
+        if (generation != _generation) {
+            return desfire::error::parameter_error;
+        }
+        if (_ready.empty()) {
+            return _token->error();
+        }
+        auto pg = std::move(_ready.front());
+        _ready.pop_front();
+        ++_taken;
+        // Make room for the next one
+        _cv.notify_all();
+        return pg;
+    }
+
+    enrollment_pipeline_stats enrollment_pipeline::stats() const {
+        std::unique_lock<std::mutex> lock{_mutex};
+        return _stats;
+    }
+
+}// namespace ka
@@ -2,16 +2,20 @@
 // Created by spak on 10/1/22.
 //
 
+#include <algorithm>
 #include <desfire/esp32/utils.hpp>
+#include <esp_timer.h>
 #include <ka/desfire_fs.hpp>
 #include <ka/gate.hpp>
 #include <ka/member_token.hpp>
 #include <ka/nvs.hpp>
+#include <ka/telemetry.hpp>
 #include <mlab/strutils.hpp>
 #include <pn532/controller.hpp>
 #include <sdkconfig.h>
 #include <sodium/crypto_kdf_blake2b.h>
 #include <sodium/randombytes.h>
+#include <sodium/utils.h>
 
 
 using namespace std::chrono_literals;
@@ -25,6 +29,14 @@ namespace ka {
         constexpr auto ka_gid = "gate-id";
         constexpr auto ka_prog_pk = "programmer-key";
         constexpr auto ka_base_key = "gate-base-key";
+        constexpr auto ka_revoked = "revoked-tokens";
+        constexpr auto ka_groups = "gate-groups";
+        constexpr auto ka_key_version = "key-version";
+        constexpr auto ka_prev_sk = "prev-secret-key";
+        constexpr auto ka_prev_base_key = "prev-base-key";
+        constexpr auto ka_rekey_grants = "rekey-grants";
+        constexpr auto ka_deploys = "deploy-certs";
+        constexpr auto ka_epoch_key = "epoch-key";
 
 
 #ifdef CONFIG_NVS_ENCRYPTION
@@ -33,6 +45,68 @@ namespace ka {
         constexpr bool nvs_encrypted = false;
 #endif
         constexpr std::array<char, crypto_kdf_blake2b_CONTEXTBYTES> app_master_key_context{"gateapp"};
+        constexpr std::array<char, crypto_kdf_blake2b_CONTEXTBYTES> base_key_context{"basekey"};
+        constexpr std::array<char, crypto_kdf_blake2b_CONTEXTBYTES> group_key_context{"groupkp"};
+
+        [[nodiscard]] nvs::r<> erase_if_exists(nvs::namespc &ns, const char *key) {
+            if (const auto r = ns.erase(key); not r and r.error() != nvs::error::not_found) {
+                return r;
+            }
+            return mlab::result_success;
+        }
+
+        [[nodiscard]] nvs::r<> store_epoch_key(nvs::namespc &ns, std::optional<epoch_pub_key> const &key) {
+            if (not key) {
+                return erase_if_exists(ns, ka_epoch_key);
+            }
+            return ns.set<mlab::bin_data>(ka_epoch_key, mlab::bin_data::chain(*key));
+        }
+
+        constexpr std::size_t group_entry_size = 4 + raw_sec_key::array_size + gate_base_key::array_size;
+
+        [[nodiscard]] nvs::r<> store_groups(nvs::namespc &ns, std::vector<gate_group> const &groups) {
+            if (groups.empty()) {
+                return erase_if_exists(ns, ka_groups);
+            }
+            mlab::bin_data bd{mlab::prealloc(groups.size() * group_entry_size)};
+            for (gate_group const &grp : groups) {
+                bd << mlab::lsb32 << std::uint32_t(grp.id) << grp.keys.raw_sk() << grp.app_base_key;
+            }
+            const auto r = ns.set<mlab::bin_data>(ka_groups, bd);
+            sodium_memzero(bd.data(), bd.size());
+            return r;
+        }
+
+        constexpr std::size_t rekey_grant_size = token_id::array_size + raw_gate_app_master_key::array_size;
+
+        [[nodiscard]] bool token_id_less(std::pair<token_id, raw_gate_app_master_key> const &grant, token_id const &id) {
+            return grant.first < id;
+        }
+
+        [[nodiscard]] nvs::r<> load_groups(nvs::const_namespc const &ns, std::vector<gate_group> &groups) {
+            auto r = ns.get<mlab::bin_data>(ka_groups);
+            if (not r) {
+                return r.error();
+            }
+            nvs::r<> retval = mlab::result_success;
+            if (r->size() % group_entry_size != 0 or r->size() / group_entry_size > gate::max_groups) {
+                ESP_LOGE("KA", "Invalid %s size.", ka_groups);
+                retval = nvs::error::invalid_length;
+            } else {
+                mlab::bin_stream s{*r};
+                groups.resize(r->size() / group_entry_size);
+                for (gate_group &grp : groups) {
+                    std::uint32_t id = 0;
+                    raw_sec_key sk{};
+                    s >> mlab::lsb32 >> id >> sk >> grp.app_base_key;
+                    grp.id = gate_id{id};
+                    grp.keys = key_pair{sk};
+                    sodium_memzero(sk.data(), sk.size());
+                }
+            }
+            sodium_memzero(r->data(), r->size());
+            return retval;
+        }
     }// namespace
 
     static_assert(gate_base_key::array_size == crypto_kdf_blake2b_KEYBYTES);
@@ -49,6 +123,184 @@ namespace ka {
         return gate_token_key{key_no, derived_key_data};
     }
 
+    gate_base_key gate_base_key::derive_from(sec_key const &master, gate_id id, std::uint32_t version) {
+        gate_base_key base_key{};
+        if (0 != crypto_kdf_blake2b_derive_from_key(
+                         base_key.data(), base_key.size(),
+                         (std::uint64_t(version) << 32) | std::uint32_t(id),
+                         base_key_context.data(),
+                         master.raw_sk().data())) {
+            ESP_LOGE("KA", "Unable to derive gate base key.");
+        }
+        return base_key;
+    }
+
+    gate_config gate_group::config() const {
+        return {id, keys.drop_secret_key(), app_base_key};
+    }
+
+    gate_group gate_group::derive_from(sec_key const &master, gate_id id) {
+        raw_sec_key sk{};
+        if (0 != crypto_kdf_blake2b_derive_from_key(
+                         sk.data(), sk.size(),
+                         std::uint32_t(id),
+                         group_key_context.data(),
+                         master.raw_sk().data())) {
+            ESP_LOGE("KA", "Unable to derive gate group key.");
+        }
+        gate_group grp{id, key_pair{sk}, gate_base_key::derive_from(master, id)};
+        sodium_memzero(sk.data(), sk.size());
+        return grp;
+    }
+
+    bool gate::join_group(gate_group const &grp) {
+        if (auto it = std::find_if(std::begin(_groups), std::end(_groups), [&](gate_group const &g) { return g.id == grp.id; }); it != std::end(_groups)) {
+            *it = grp;
+            return true;
+        } else if (_groups.size() >= max_groups) {
+            ESP_LOGE("KA", "The gate is already in %d groups.", _groups.size());
+            return false;
+        }
+        _groups.push_back(grp);
+        return true;
+    }
+
+    bool gate::leave_group(gate_id id) {
+        if (auto it = std::find_if(std::begin(_groups), std::end(_groups), [&](gate_group const &g) { return g.id == id; }); it != std::end(_groups)) {
+            _groups.erase(it);
+            return true;
+        }
+        return false;
+    }
+
+    gate_key_status gate::key_status() const {
+        return {_key_version, bool(_previous), std::uint32_t(_rekey_grants.size()), _migrated};
+    }
+
+    bool gate::rotate_keys(std::uint32_t version, gate_base_key base_key) {
+        if (version != _key_version + 1) {
+            ESP_LOGE("KA", "Cannot rotate keys from version %lu to %lu.", _key_version, version);
+            return false;
+        }
+        if (_previous) {
+            ESP_LOGW("KA", "Tokens still on key version %lu are no longer accepted.", _key_version - 1);
+        }
+        _previous = gate_key_material{_kp, _base_key};
+        _kp.generate_random();
+        _base_key = base_key;
+        _key_version = version;
+        _migrated = 0;
+        return true;
+    }
+
+    void gate::retire_previous_keys() {
+        if (_previous) {
+            *_previous = gate_key_material{};
+            _previous = std::nullopt;
+        }
+        if (not _rekey_grants.empty()) {
+            for (auto &[id, mkey] : _rekey_grants) {
+                sodium_memzero(mkey.data(), mkey.size());
+            }
+            _rekey_grants.clear();
+            ++_rekey_grants_revision;
+        }
+    }
+
+    bool gate::grant_rekey(token_id const &id, raw_gate_app_master_key const &mkey) {
+        const auto it = std::lower_bound(std::begin(_rekey_grants), std::end(_rekey_grants), id, token_id_less);
+        if (it != std::end(_rekey_grants) and it->first == id) {
+            it->second = mkey;
+        } else if (_rekey_grants.size() >= max_rekey_grants) {
+            return false;
+        } else {
+            _rekey_grants.emplace(it, id, mkey);
+        }
+        ++_rekey_grants_revision;
+        return true;
+    }
+
+    void gate::migrate_token(member_token &token, token_id const &id, identity const &who) {
+        const auto it = std::lower_bound(std::begin(_rekey_grants), std::end(_rekey_grants), id, token_id_less);
+        if (it == std::end(_rekey_grants) or it->first != id) {
+            ESP_LOGW("KA", "Token of %s has the previous keys, but no grant to migrate it.", who.holder.c_str());
+            return;
+        }
+        desfire::key_body<key_type::size> mkey_data{};
+        std::copy(std::begin(it->second), std::end(it->second), std::begin(mkey_data));
+        if (const auto r = token.migrate_gate_file(*this, *_previous, gate_app_master_key{0, mkey_data}, id, who); r) {
+            ++_migrated;
+            ESP_LOGI("KA", "Migrated token of %s to key version %lu.", who.holder.c_str(), _key_version);
+            // The grant is not needed anymore, do not keep the key around
+            sodium_memzero(it->second.data(), it->second.size());
+            _rekey_grants.erase(it);
+            ++_rekey_grants_revision;
+            key_rotation_store();
+        } else {
+            ESP_LOGW("KA", "Unable to migrate token of %s, %s", who.holder.c_str(), member_token::describe(r.error()));
+        }
+        sodium_memzero(mkey_data.data(), mkey_data.size());
+    }
+
+    r<identity, token_id> gate::deploy_token(member_token &token, desfire::error not_enrolled) {
+        const auto r_id = token.get_id();
+        if (not r_id) {
+            return r_id.error();
+        }
+        auto cert = _deploys.take(*r_id);
+        if (not cert) {
+            return not_enrolled;
+        }
+        r<identity, token_id> retval = not_enrolled;
+        if (_revoked.contains(*r_id)) {
+            ESP_LOGW("KA", "Dropping the deploy certificate of %s, which has been revoked.", cert->who.holder.c_str());
+            pending_deploys_store();
+        } else if (const auto r = token.enroll_gate(*this, *cert); r) {
+            ESP_LOGI("KA", "Enrolled token of %s from its deploy certificate.", cert->who.holder.c_str());
+            pending_deploys_store();
+            retval = std::make_pair(cert->who, *r_id);
+        } else if (r.error() == desfire::error::app_not_found) {
+            ESP_LOGW("KA", "Token of %s has no gate app for this gate, enroll it at the keymaker.", cert->who.holder.c_str());
+            pending_deploys_store();
+        } else {
+            ESP_LOGW("KA", "Unable to enroll token of %s, %s", cert->who.holder.c_str(), member_token::describe(r.error()));
+            // Try again on the next tap, e.g. if the token left the field halfway
+            void(_deploys.insert(*cert));
+        }
+        sodium_memzero(cert->mkey.data(), cert->mkey.size());
+        return retval;
+    }
+
+    void gate::refresh_revocations(member_token &token) {
+        if (not _epoch_key) {
+            return;
+        }
+        // The only extra read on tap; tokens issued before revocation records fail here and are skipped
+        const auto r_epoch = token.read_revocation_epoch();
+        if (not r_epoch or r_epoch->epoch <= _revoked.version()) {
+            return;
+        }
+        if (r_epoch->base_epoch > _revoked.version()) {
+            ESP_LOGW("KA", "Revoked tokens at version %lu, token carries %lu to %lu, sync with the keymaker.",
+                     _revoked.version(), r_epoch->base_epoch, r_epoch->epoch);
+            return;
+        }
+        const auto r_rec = token.read_revocation_record(*r_epoch);
+        if (not r_rec) {
+            return;
+        }
+        if (not r_rec->verify(*_epoch_key)) {
+            ESP_LOGW("KA", "Invalid revocation record, ignoring.");
+            return;
+        }
+        if (not r_rec->apply_to(_revoked)) {
+            ESP_LOGE("KA", "Revoked tokens diverged from the keymaker, sync with the keymaker.");
+            return;
+        }
+        ESP_LOGI("KA", "Revoked tokens updated to version %lu from a token.", _revoked.version());
+        token_lists_store();
+    }
+
     void gate::configure(gate_id id, std::string desc, pub_key prog_pub_key) {
         if (app_base_key() == gate_base_key{} or keys().raw_pk() == raw_pub_key{}) {
             ESP_LOGE("KA", "Keys have not been generated for this gate! You must re-query the public key.");
@@ -59,6 +311,17 @@ namespace ka {
         _prog_pk = prog_pub_key;
     }
 
+    void gate::configure(gate_id id, std::string desc, pub_key prog_pub_key, gate_base_key base_key) {
+        if (keys().raw_pk() == raw_pub_key{}) {
+            ESP_LOGE("KA", "Keys have not been generated for this gate! You must re-query the public key.");
+            regenerate_keys();
+        }
+        _base_key = base_key;
+        _id = id;
+        _desc = std::move(desc);
+        _prog_pk = prog_pub_key;
+    }
+
     void gate::configure_demo_from_pwhash(std::string const &password, gate_id id, std::string desc, pub_key prog_pub_key) {
         _kp.generate_from_pwhash(password);
         _base_key = gate_base_key{_kp.raw_pk()};
@@ -68,11 +331,47 @@ namespace ka {
     }
 
 
-    void gate::try_authenticate(member_token &token, gate_auth_responder &responder) const {
-        if (const auto r = token.read_encrypted_gate_file(*this, true, true); r) {
+    void gate::try_authenticate(member_token &token, gate_auth_responder &responder) {
+        const auto start = esp_timer_get_time();
+        const auto elapsed = [&]() { return std::chrono::microseconds{esp_timer_get_time() - start}; };
+        const auto is_not_enrolled = [](desfire::error e) {
+            return e == desfire::error::app_not_found or e == desfire::error::file_not_found;
+        };
+        auto r = token.read_encrypted_gate_file(*this, true, true);
+        // A token that was not tapped since the last rotation still has the previous keys
+        bool on_previous_keys = false;
+        if (not r and _previous and (r.error() == desfire::error::permission_denied or r.error() == desfire::error::crypto_error)) {
+            if (auto r_previous = token.read_encrypted_gate_file(*this, *_previous, true, true); r_previous) {
+                r = std::move(r_previous);
+                on_previous_keys = true;
+            }
+        }
+        // A token that has no file for this gate may still hold the file of one of its groups
+        for (auto it = std::begin(_groups); not r and is_not_enrolled(r.error()) and it != std::end(_groups); ++it) {
+            r = token.read_encrypted_gate_file(*this, *it, true, true);
+        }
+        // The token may carry a newer revoked list, which both the deploy certificates and the check below need
+        refresh_revocations(token);
+        // Or a deploy certificate, in which case the gate enrolls it here and now
+        if (not r and is_not_enrolled(r.error()) and not _deploys.empty()) {
+            r = deploy_token(token, r.error());
+        }
+        if (r) {
+            if (_revoked.contains(r->first.id)) {
+                telemetry::instance().record_tap(elapsed(), desfire::error::permission_denied);
+                ESP_LOGW("KA", "Token of %s has been revoked.", r->first.holder.c_str());
+                responder.on_authentication_fail(desfire::error::permission_denied, false);
+                return;
+            }
+            telemetry::instance().record_tap(elapsed());
             ESP_LOGI("KA", "Authenticated as %s.", r->first.holder.c_str());
             responder.on_authentication_success(r->first);
+            // Open first, then migrate while the token is still in the field
+            if (on_previous_keys) {
+                migrate_token(token, r->second, r->first);
+            }
         } else {
+            telemetry::instance().record_tap(elapsed(), r.error());
             switch (r.error()) {
                 case desfire::error::app_not_found:
                     [[fallthrough]];
@@ -125,6 +424,11 @@ namespace ka {
         ESP_LOGI("GATE", "NFC target %s has left the RF field.", s_id.c_str());
     }
     void gate_responder::on_failed_scan(pn532::scanner &, pn532::channel_error err) {
+        telemetry::instance().record_failed_scan(err);
+        _link.record_failed_scan();
+        if (err == pn532::channel_error::timeout) {
+            _link.record_timeout();
+        }
         ESP_LOGV("GATE", "Scan failed with error: %s", pn532::to_string(err));
     }
 
@@ -140,12 +444,106 @@ namespace ka {
         const auto r_prog_pk = ns->set<mlab::bin_data>(ka_prog_pk, mlab::bin_data::chain(programmer_pub_key().raw_pk()));
         const auto r_sk = ns->set<mlab::bin_data>(ka_sk, mlab::bin_data::chain(keys().raw_sk()));
         const auto r_base_key = ns->set<mlab::bin_data>(ka_base_key, mlab::bin_data::chain(app_base_key()));
+        const auto r_revoked = revoked_tokens().store(*ns, ka_revoked);
+        const auto r_epoch_key = store_epoch_key(*ns, epoch_key());
+        const auto r_groups = store_groups(*ns, groups());
+        const auto r_rotation = store_key_rotation(*ns);
+        const auto r_deploys = pending_deploys().store(*ns, ka_deploys);
         const auto r_commit = ns->commit();
-        if (not(r_id and r_desc and r_prog_pk and r_sk and r_base_key and r_commit)) {
+        if (not(r_id and r_desc and r_prog_pk and r_sk and r_base_key and r_revoked and r_epoch_key and r_groups and r_rotation and r_deploys and r_commit)) {
             ESP_LOGE("KA", "Unable to save gate configuration.");
         }
     }
 
+    void gate::token_lists_store(nvs::partition &partition) const {
+        auto ns = partition.open_namespc(ka_namespc);
+        if (ns == nullptr) {
+            ESP_LOGE("KA", "Unable to create or access NVS namespace.");
+            return;
+        }
+        const auto r_revoked = revoked_tokens().store(*ns, ka_revoked);
+        const auto r_epoch_key = store_epoch_key(*ns, epoch_key());
+        const auto r_commit = ns->commit();
+        if (not(r_revoked and r_epoch_key and r_commit)) {
+            ESP_LOGE("KA", "Unable to save gate token lists.");
+        }
+    }
+
+    void gate::key_rotation_store(nvs::partition &partition) const {
+        auto ns = partition.open_namespc(ka_namespc);
+        if (ns == nullptr) {
+            ESP_LOGE("KA", "Unable to create or access NVS namespace.");
+            return;
+        }
+        const auto r_rotation = store_key_rotation(*ns);
+        const auto r_commit = ns->commit();
+        if (not(r_rotation and r_commit)) {
+            ESP_LOGE("KA", "Unable to save gate key rotation.");
+        }
+    }
+
+    void gate::key_rotation_store() const {
+        nvs::nvs nvs{};
+        if (auto partition = nvs.open_partition(NVS_DEFAULT_PART_NAME, nvs_encrypted); partition == nullptr) {
+            ESP_LOGE("KA", "NVS partition is not available.");
+        } else {
+            key_rotation_store(*partition);
+        }
+    }
+
+    void gate::groups_store(nvs::partition &partition) const {
+        auto ns = partition.open_namespc(ka_namespc);
+        if (ns == nullptr) {
+            ESP_LOGE("KA", "Unable to create or access NVS namespace.");
+            return;
+        }
+        const auto r_groups = store_groups(*ns, groups());
+        const auto r_commit = ns->commit();
+        if (not(r_groups and r_commit)) {
+            ESP_LOGE("KA", "Unable to save gate groups.");
+        }
+    }
+
+    void gate::pending_deploys_store(nvs::partition &partition) const {
+        auto ns = partition.open_namespc(ka_namespc);
+        if (ns == nullptr) {
+            ESP_LOGE("KA", "Unable to create or access NVS namespace.");
+            return;
+        }
+        const auto r_deploys = pending_deploys().store(*ns, ka_deploys);
+        const auto r_commit = ns->commit();
+        if (not(r_deploys and r_commit)) {
+            ESP_LOGE("KA", "Unable to save gate deploy certificates.");
+        }
+    }
+
+    void gate::pending_deploys_store() const {
+        nvs::nvs nvs{};
+        if (auto partition = nvs.open_partition(NVS_DEFAULT_PART_NAME, nvs_encrypted); partition == nullptr) {
+            ESP_LOGE("KA", "NVS partition is not available.");
+        } else {
+            pending_deploys_store(*partition);
+        }
+    }
+
+    void gate::groups_store() const {
+        nvs::nvs nvs{};
+        if (auto partition = nvs.open_partition(NVS_DEFAULT_PART_NAME, nvs_encrypted); partition == nullptr) {
+            ESP_LOGE("KA", "NVS partition is not available.");
+        } else {
+            groups_store(*partition);
+        }
+    }
+
+    void gate::token_lists_store() const {
+        nvs::nvs nvs{};
+        if (auto partition = nvs.open_partition(NVS_DEFAULT_PART_NAME, nvs_encrypted); partition == nullptr) {
+            ESP_LOGE("KA", "NVS partition is not available.");
+        } else {
+            token_lists_store(*partition);
+        }
+    }
+
     void gate::config_store() const {
 #ifndef CONFIG_NVS_ENCRYPTION
         ESP_LOGW("KA", "Encryption is disabled!");
@@ -208,44 +606,154 @@ namespace ka {
 
 
     namespace {
-        [[nodiscard]] nvs::r<mlab::bin_data> assert_size(nvs::r<mlab::bin_data> r_data, std::size_t size, const char *item) {
-            if (r_data and r_data->size() != size) {
-                ESP_LOGE("KA", "Invalid %s size %d, should be %d.", item, r_data->size(), size);
-                // Reject the result
-                r_data = nvs::error::invalid_length;
+        [[nodiscard]] nvs::r<> log_size_mismatch(nvs::r<> r, const char *item) {
+            if (not r and r.error() == nvs::error::invalid_length) {
+                ESP_LOGE("KA", "Invalid %s size.", item);
             }
-            return r_data;
+            return r;
         }
+
+        /**
+         * Descriptions are short labels; longer ones are still loaded, but go through the heap.
+         */
+        constexpr std::size_t desc_inline_capacity = 64;
     }// namespace
 
+    nvs::r<> gate::store_key_rotation(nvs::namespc &ns) const {
+        if (const auto r = ns.set<std::uint32_t>(ka_key_version, _key_version); not r) {
+            return r;
+        }
+        if (not _previous) {
+            if (const auto r = erase_if_exists(ns, ka_prev_sk); not r) {
+                return r;
+            }
+            if (const auto r = erase_if_exists(ns, ka_prev_base_key); not r) {
+                return r;
+            }
+            return erase_if_exists(ns, ka_rekey_grants);
+        }
+        if (const auto r = ns.set<mlab::bin_data>(ka_prev_sk, mlab::bin_data::chain(_previous->keys.raw_sk())); not r) {
+            return r;
+        }
+        if (const auto r = ns.set<mlab::bin_data>(ka_prev_base_key, mlab::bin_data::chain(_previous->app_base_key)); not r) {
+            return r;
+        }
+        if (_rekey_grants.empty()) {
+            return erase_if_exists(ns, ka_rekey_grants);
+        }
+        mlab::bin_data bd{mlab::prealloc(_rekey_grants.size() * rekey_grant_size)};
+        for (auto const &[id, mkey] : _rekey_grants) {
+            bd << id << mkey;
+        }
+        const auto r = ns.set<mlab::bin_data>(ka_rekey_grants, bd);
+        sodium_memzero(bd.data(), bd.size());
+        return r;
+    }
+
+    nvs::r<> gate::load_key_rotation(nvs::const_namespc const &ns) {
+        if (const auto r_version = ns.get<std::uint32_t>(ka_key_version); r_version) {
+            _key_version = *r_version;
+        } else {
+            return r_version.error();
+        }
+        raw_sec_key sk{};
+        gate_base_key base_key{};
+        const auto r_sk = log_size_mismatch(ns.get_into(ka_prev_sk, sk), "previous secret key");
+        const auto r_base_key = log_size_mismatch(ns.get_into(ka_prev_base_key, base_key), "previous gate app base key");
+        if (r_sk and r_base_key) {
+            _previous = gate_key_material{key_pair{sk}, base_key};
+            if (auto r_grants = ns.get<mlab::bin_data>(ka_rekey_grants); r_grants) {
+                if (r_grants->size() % rekey_grant_size != 0 or r_grants->size() / rekey_grant_size > max_rekey_grants) {
+                    ESP_LOGE("KA", "Invalid %s size.", ka_rekey_grants);
+                } else {
+                    mlab::bin_stream s{*r_grants};
+                    _rekey_grants.resize(r_grants->size() / rekey_grant_size);
+                    for (auto &[id, mkey] : _rekey_grants) {
+                        s >> id >> mkey;
+                    }
+                }
+                sodium_memzero(r_grants->data(), r_grants->size());
+            }
+        }
+        sodium_memzero(sk.data(), sk.size());
+        sodium_memzero(base_key.data(), base_key.size());
+        return mlab::result_success;
+    }
+
     bool gate::config_load(nvs::partition &partition) {
         auto ns = partition.open_namespc(ka_namespc);
         if (ns == nullptr) {
             return false;
         }
         ESP_LOGW("KA", "Loading gate configuration.");
+        // Read keys directly into fixed-size storage, so that no secret material is left behind on the heap
+        raw_sec_key sk{};
+        raw_pub_key prog_pk{};
+        gate_base_key base_key{};
+        std::array<char, desc_inline_capacity> desc_buffer{};
         const auto r_id = ns->get<std::uint32_t>(ka_gid);
-        const auto r_desc = ns->get<std::string>(ka_desc);
-        const auto r_prog_pk = assert_size(ns->get<mlab::bin_data>(ka_prog_pk), raw_pub_key::array_size, "programmer key");
-        const auto r_sk = assert_size(ns->get<mlab::bin_data>(ka_sk), raw_sec_key::array_size, "secret key");
-        const auto r_base_key = assert_size(ns->get<mlab::bin_data>(ka_base_key), gate_base_key::array_size, "gate app base key");
+        auto r_desc = ns->get_into(ka_desc, desc_buffer);
+        std::string desc_fallback{};
+        if (not r_desc and r_desc.error() == nvs::error::invalid_length) {
+            if (auto r_long_desc = ns->get<std::string>(ka_desc); r_long_desc) {
+                desc_fallback = std::move(*r_long_desc);
+                r_desc = std::string_view{desc_fallback};
+            }
+        }
+        const auto r_prog_pk = log_size_mismatch(ns->get_into(ka_prog_pk, prog_pk), "programmer key");
+        const auto r_sk = log_size_mismatch(ns->get_into(ka_sk, sk), "secret key");
+        const auto r_base_key = log_size_mismatch(ns->get_into(ka_base_key, base_key), "gate app base key");
+        bool success = false;
         if (r_id and r_desc and r_prog_pk and r_sk and r_base_key) {
             _id = gate_id{*r_id};
-            _desc = *r_desc;
             // Trim the nul ending character
-            _desc.erase(std::find(std::begin(_desc), std::end(_desc), '\0'), std::end(_desc));
-            _kp = key_pair{r_sk->data_view()};
-            _prog_pk = pub_key{r_prog_pk->data_view()};
-            std::copy(std::begin(*r_base_key), std::end(*r_base_key), std::begin(_base_key));
+            _desc = std::string{r_desc->substr(0, r_desc->find('\0'))};
+            _kp = key_pair{sk};
+            _prog_pk = pub_key{prog_pk};
+            _base_key = base_key;
             if (not _kp.is_valid()) {
                 ESP_LOGE("KA", "Invalid secret key, rejecting stored configuration.");
             } else {
-                return true;
+                success = true;
+            }
+            // The list is optional, a gate that was never synced has none
+            if (const auto r_revoked = _revoked.load(*ns, ka_revoked); not r_revoked) {
+                _revoked.clear();
+                if (r_revoked.error() != nvs::error::not_found) {
+                    ESP_LOGE("KA", "Unable to load the revoked tokens, starting from an empty list.");
+                }
+            }
+            // As is the key that signs the revocation records
+            epoch_pub_key epoch_key{};
+            if (const auto r_epoch_key = log_size_mismatch(ns->get_into(ka_epoch_key, epoch_key), "epoch key"); r_epoch_key) {
+                _epoch_key = epoch_key;
+            } else {
+                _epoch_key = std::nullopt;
+                if (r_epoch_key.error() != nvs::error::not_found) {
+                    ESP_LOGE("KA", "Unable to load the epoch key, revocations will not be read from tokens.");
+                }
+            }
+            // So is the key rotation state, a gate that was never rotated has none
+            if (const auto r_rotation = load_key_rotation(*ns); not r_rotation and r_rotation.error() != nvs::error::not_found) {
+                ESP_LOGE("KA", "Unable to load the key rotation state.");
+            }
+            // So are the groups
+            if (const auto r_groups = load_groups(*ns, _groups); not r_groups) {
+                _groups.clear();
+                if (r_groups.error() != nvs::error::not_found) {
+                    ESP_LOGE("KA", "Unable to load the gate groups, the gate is in none.");
+                }
+            }
+            // And the deploy certificates
+            if (const auto r_deploys = _deploys.load(*ns, ka_deploys); not r_deploys and r_deploys.error() != nvs::error::not_found) {
+                ESP_LOGE("KA", "Unable to load the deploy certificates, starting with none.");
             }
         } else if (r_id or r_desc or r_prog_pk or r_sk or r_base_key) {
             ESP_LOGE("KA", "Incomplete stored configuration, rejecting.");
         }
-        return false;
+        sodium_memzero(sk.data(), sk.size());
+        sodium_memzero(base_key.data(), base_key.size());
+        return success;
     }
 
     void gate::log_public_gate_info() const {
@@ -269,4 +777,22 @@ namespace ka {
         }
     }
 
-}// namespace ka
\ No newline at end of file
+}// namespace ka
+
+namespace mlab {
+
+    bin_stream &operator>>(bin_stream &s, ka::gate_key_status &status) {
+        std::uint8_t previous_accepted = 0;
+        s >> mlab::lsb32 >> status.version >> previous_accepted >> mlab::lsb32 >> status.rekey_grants >> mlab::lsb32 >> status.migrated;
+        status.previous_accepted = previous_accepted != 0;
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::gate_key_status const &status) {
+        return bd << mlab::lsb32 << status.version
+                  << std::uint8_t(status.previous_accepted ? 1 : 0)
+                  << mlab::lsb32 << status.rekey_grants
+                  << mlab::lsb32 << status.migrated;
+    }
+
+}// namespace mlab
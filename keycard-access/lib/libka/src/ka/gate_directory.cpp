@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <array>
+#include <ka/gate_directory.hpp>
+
+namespace ka {
+
+    namespace {
+        [[nodiscard]] gate_id location_of(std::uint32_t gid, std::uint8_t app) {
+            return gate_id{std::uint32_t(app) * gate_id::gates_per_app + gid % gate_id::gates_per_app};
+        }
+    }// namespace
+
+    gate_directory::gate_directory() : _table(std::size_t{1} << min_capacity_log2) {}
+
+    std::size_t gate_directory::size() const {
+        return _size;
+    }
+
+    std::size_t gate_directory::capacity() const {
+        return _table.size();
+    }
+
+    std::size_t gate_directory::home_of(std::uint32_t gid) const {
+        // Fibonacci hashing, the top bits are the best mixed
+        return std::size_t((gid * 0x9e3779b9u) >> (32 - _capacity_log2));
+    }
+
+    void gate_directory::place(entry e) {
+        for (std::size_t i = home_of(e.gid);; i = (i + 1) % _table.size()) {
+            if (_table[i].gid == empty) {
+                _table[i] = e;
+                return;
+            }
+        }
+    }
+
+    bool gate_directory::grow() {
+        if (_capacity_log2 >= max_capacity_log2) {
+            return false;
+        }
+        std::vector<entry> old(std::size_t{1} << (++_capacity_log2));
+        std::swap(old, _table);
+        for (auto const &e : old) {
+            if (e.gid != empty) {
+                place(e);
+            }
+        }
+        return true;
+    }
+
+    std::optional<gate_id> gate_directory::find(gate_id gid) const {
+        if (std::uint32_t(gid) == empty) {
+            return std::nullopt;
+        }
+        // The load factor is capped, so there is always an empty slot to stop at
+        for (std::size_t i = home_of(gid);; i = (i + 1) % _table.size()) {
+            if (_table[i].gid == std::uint32_t(gid)) {
+                return location_of(gid, _table[i].app);
+            } else if (_table[i].gid == empty) {
+                return std::nullopt;
+            }
+        }
+    }
+
+    std::optional<gate_id> gate_directory::assign(gate_id gid) {
+        if (const auto loc = find(gid); loc or std::uint32_t(gid) == empty) {
+            return loc;
+        }
+        // Keep the load factor under 3/4
+        if (4 * (_size + 1) > 3 * _table.size() and not grow()) {
+            return std::nullopt;
+        }
+        // Lowest app where the file of this gate is free
+        std::array<bool, 0x100> taken{};
+        for (auto const &e : _table) {
+            if (e.gid != empty and e.gid % gate_id::gates_per_app == gid % gate_id::gates_per_app) {
+                taken[e.app] = true;
+            }
+        }
+        const auto it = std::find(std::begin(taken), std::end(taken), false);
+        if (it == std::end(taken)) {
+            return std::nullopt;
+        }
+        const auto app = std::uint8_t(std::distance(std::begin(taken), it));
+        place({gid, app});
+        ++_size;
+        return location_of(gid, app);
+    }
+
+    std::uint32_t gate_directory::apps() const {
+        std::uint32_t n = 0;
+        for (auto const &e : _table) {
+            if (e.gid != empty) {
+                n = std::max(n, std::uint32_t(e.app) + 1);
+            }
+        }
+        return n;
+    }
+
+    std::vector<gate_id> gate_directory::gates() const {
+        std::vector<gate_id> gates{};
+        gates.reserve(_size);
+        for (auto const &e : _table) {
+            if (e.gid != empty) {
+                gates.emplace_back(e.gid);
+            }
+        }
+        return gates;
+    }
+
+}// namespace ka
+
+namespace mlab {
+
+    bin_stream &operator>>(bin_stream &s, ka::gate_directory &dir) {
+        std::uint8_t version = 0;
+        std::uint8_t capacity_log2 = 0;
+        s >> version >> capacity_log2;
+        if (s.bad() or version != ka::gate_directory::version or
+            capacity_log2 < ka::gate_directory::min_capacity_log2 or capacity_log2 > ka::gate_directory::max_capacity_log2 or
+            s.remaining() < (std::size_t{1} << capacity_log2) * ka::gate_directory::entry_size) {
+            s.set_bad();
+            return s;
+        }
+        ka::gate_directory d{};
+        d._capacity_log2 = capacity_log2;
+        d._table.resize(std::size_t{1} << capacity_log2);
+        for (auto &e : d._table) {
+            s >> mlab::lsb32 >> e.gid >> e.app;
+            if (e.gid != ka::gate_directory::empty) {
+                ++d._size;
+            }
+        }
+        if (4 * d._size > 3 * d._table.size()) {
+            s.set_bad();
+            return s;
+        }
+        dir = std::move(d);
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::gate_directory const &dir) {
+        bd << prealloc(bd.size() + 2 + dir._table.size() * ka::gate_directory::entry_size)
+           << ka::gate_directory::version << dir._capacity_log2;
+        for (auto const &e : dir._table) {
+            bd << mlab::lsb32 << e.gid << e.app;
+        }
+        return bd;
+    }
+
+}// namespace mlab
@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <esp_log.h>
+#include <ka/gate_registry.hpp>
+
+namespace ka {
+
+    namespace {
+        void encode_id(gate_id id, std::uint8_t *dest) {
+            // Big endian, so that byte order is numeric order
+            const auto v = std::uint32_t(id);
+            dest[0] = std::uint8_t(v >> 24);
+            dest[1] = std::uint8_t(v >> 16);
+            dest[2] = std::uint8_t(v >> 8);
+            dest[3] = std::uint8_t(v);
+        }
+
+        [[nodiscard]] gate_id decode_id(std::uint8_t const *src) {
+            return gate_id{(std::uint32_t(src[0]) << 24) | (std::uint32_t(src[1]) << 16) | (std::uint32_t(src[2]) << 8) | std::uint32_t(src[3])};
+        }
+
+        using id_entry = std::array<std::uint8_t, gate_registry::id_entry_size>;
+        using pub_key_entry = std::array<std::uint8_t, gate_registry::pub_key_entry_size>;
+
+        [[nodiscard]] id_entry encode_config(gate_config const &cfg) {
+            id_entry e{};
+            encode_id(cfg.id, e.data());
+            auto it = std::copy(std::begin(cfg.gate_pub_key.raw_pk()), std::end(cfg.gate_pub_key.raw_pk()), std::begin(e) + 4);
+            std::copy(std::begin(cfg.app_base_key), std::end(cfg.app_base_key), it);
+            return e;
+        }
+
+        [[nodiscard]] gate_config decode_config(id_entry const &e) {
+            gate_config cfg{};
+            cfg.id = decode_id(e.data());
+            cfg.gate_pub_key = pub_key{mlab::make_range<std::uint8_t const *>(e.data() + 4, e.data() + 4 + raw_pub_key::array_size)};
+            std::copy_n(std::begin(e) + 4 + raw_pub_key::array_size, gate_base_key::array_size, std::begin(cfg.app_base_key));
+            return cfg;
+        }
+
+        /**
+         * A retired id has an entry with a blank public key, which no gate has.
+         */
+        [[nodiscard]] id_entry encode_retired(gate_id id) {
+            id_entry e{};
+            encode_id(id, e.data());
+            return e;
+        }
+
+        [[nodiscard]] bool is_retired_entry(std::uint8_t const *e) {
+            return std::all_of(e + 4, e + 4 + raw_pub_key::array_size, [](std::uint8_t b) { return b == 0; });
+        }
+
+        [[nodiscard]] pub_key_entry encode_pub_key(pub_key const &pk, gate_id id) {
+            pub_key_entry e{};
+            std::copy_n(std::begin(pk.raw_pk()), gate_registry::pub_key_prefix_size, std::begin(e));
+            encode_id(id, e.data() + gate_registry::pub_key_prefix_size);
+            return e;
+        }
+
+        template <std::size_t N>
+        [[nodiscard]] mlab::range<std::uint8_t const *> view(std::array<std::uint8_t, N> const &a) {
+            return mlab::make_range<std::uint8_t const *>(a.data(), a.data() + a.size());
+        }
+
+        template <std::size_t N>
+        [[nodiscard]] mlab::range<std::uint8_t *> view(std::array<std::uint8_t, N> &a) {
+            return mlab::make_range(a.data(), a.data() + a.size());
+        }
+    }// namespace
+
+    gate_registry::gate_registry()
+        : _cache{},
+          _by_id{id_entry_size, 4, _cache},
+          _by_pk{pub_key_entry_size, pub_key_entry_size, _cache} {}
+
+    bool gate_registry::open(flash_region region) {
+        const std::uint32_t pk_sectors = region.sectors() / 4;
+        if (not _by_id.open(region.subregion(0, region.sectors() - pk_sectors)) or
+            not _by_pk.open(region.subregion(region.sectors() - pk_sectors, pk_sectors))) {
+            ESP_LOGE("KA", "Unable to open the gate registry.");
+            return false;
+        }
+        load_ids();
+        return true;
+    }
+
+    bool gate_registry::is_persistent() const {
+        return _by_id.is_persistent() and _by_pk.is_persistent();
+    }
+
+    void gate_registry::load_ids() {
+        _next_id = gate_id{0};
+        _free.clear();
+        const std::array<std::uint8_t, 4> first{};
+        const bool success = _by_id.scan(view(first), [&](mlab::range<std::uint8_t const *> entry) -> bool {
+            const auto id = decode_id(entry.data());
+            for (auto gap = std::uint32_t(_next_id); gap < std::uint32_t(id); ++gap) {
+                _free.emplace_back(gap);
+            }
+            _next_id = gate_id{std::uint32_t(id) + 1};
+            return true;
+        });
+        if (not success) {
+            ESP_LOGE("KA", "Unable to read the gate ids.");
+        }
+    }
+
+    std::vector<gate_id> const &gate_registry::free_ids() const {
+        return _free;
+    }
+
+    gate_id gate_registry::allocate(std::vector<gate_id> const &affinity) const {
+        const auto block_of = [](gate_id id) -> std::uint32_t { return std::uint32_t(id) / gate_id::gates_per_app; };
+        const auto free_in_block = [&](std::uint32_t block) -> std::optional<gate_id> {
+            const auto it = std::lower_bound(std::begin(_free), std::end(_free), gate_id{block * gate_id::gates_per_app});
+            if (it != std::end(_free) and block_of(*it) == block) {
+                return *it;
+            }
+            if (block_of(_next_id) == block) {
+                return _next_id;
+            }
+            return std::nullopt;
+        };
+        // Blocks holding most of the affine gates first
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> blocks{};
+        for (const auto id : affinity) {
+            const auto block = block_of(id);
+            if (auto it = std::find_if(std::begin(blocks), std::end(blocks), [&](auto const &b) { return b.first == block; }); it != std::end(blocks)) {
+                ++it->second;
+            } else {
+                blocks.emplace_back(block, 1);
+            }
+        }
+        std::stable_sort(std::begin(blocks), std::end(blocks), [](auto const &l, auto const &r) { return l.second > r.second; });
+        for (auto const &[block, count] : blocks) {
+            if (const auto id = free_in_block(block); id) {
+                return *id;
+            }
+        }
+        if (not affinity.empty()) {
+            // Start a fresh block, leaving the rest of the current one to its own group
+            if (std::uint32_t(_next_id) % gate_id::gates_per_app == 0) {
+                return _next_id;
+            }
+            return gate_id{(block_of(_next_id) + 1) * gate_id::gates_per_app};
+        }
+        return _free.empty() ? _next_id : _free.front();
+    }
+
+    void gate_registry::set_master_key(sec_key const *master) {
+        _master = master;
+    }
+
+    gate_id gate_registry::next_id() const {
+        return _next_id;
+    }
+
+    bool gate_registry::insert(gate_config const &cfg) {
+        if (is_retired(cfg.id)) {
+            ESP_LOGE("KA", "Gate id %lu is retired and cannot be reused.", std::uint32_t(cfg.id));
+            return false;
+        }
+        gate_config stored = cfg;
+        if (_master != nullptr and cfg.app_base_key == gate_base_key::derive_from(*_master, cfg.id)) {
+            stored.app_base_key = {};
+        }
+        if (const auto previous = find(cfg.id); previous) {
+            if (previous->gate_pub_key.raw_pk() == cfg.gate_pub_key.raw_pk()) {
+                return _by_id.put(view(encode_config(stored)));
+            }
+            if (not _by_pk.erase(view(encode_pub_key(previous->gate_pub_key, cfg.id)))) {
+                return false;
+            }
+        }
+        if (not _by_id.put(view(encode_config(stored))) or not _by_pk.put(view(encode_pub_key(cfg.gate_pub_key, cfg.id)))) {
+            ESP_LOGE("KA", "Unable to register gate %lu.", std::uint32_t(cfg.id));
+            return false;
+        }
+        if (std::uint32_t(cfg.id) >= std::uint32_t(_next_id)) {
+            for (auto gap = std::uint32_t(_next_id); gap < std::uint32_t(cfg.id); ++gap) {
+                _free.emplace_back(gap);
+            }
+            _next_id = gate_id{std::uint32_t(cfg.id) + 1};
+        } else if (const auto it = std::lower_bound(std::begin(_free), std::end(_free), cfg.id); it != std::end(_free) and *it == cfg.id) {
+            _free.erase(it);
+        }
+        return true;
+    }
+
+    bool gate_registry::erase(gate_id id) {
+        const auto previous = find(id);
+        if (not previous) {
+            return true;
+        }
+        if (not _by_pk.erase(view(encode_pub_key(previous->gate_pub_key, id)))) {
+            ESP_LOGE("KA", "Unable to erase gate %lu.", std::uint32_t(id));
+            return false;
+        }
+        if (_master != nullptr) {
+            // Keep the id taken, see the class documentation
+            if (not _by_id.put(view(encode_retired(id)))) {
+                ESP_LOGE("KA", "Unable to retire gate %lu.", std::uint32_t(id));
+                return false;
+            }
+            return true;
+        }
+        std::array<std::uint8_t, 4> key{};
+        encode_id(id, key.data());
+        if (not _by_id.erase(view(key))) {
+            ESP_LOGE("KA", "Unable to erase gate %lu.", std::uint32_t(id));
+            return false;
+        }
+        if (std::uint32_t(id) + 1 == std::uint32_t(_next_id)) {
+            // Shrink instead, together with the free ids right before it
+            _next_id = id;
+            while (not _free.empty() and std::uint32_t(_free.back()) + 1 == std::uint32_t(_next_id)) {
+                _next_id = _free.back();
+                _free.pop_back();
+            }
+        } else {
+            _free.insert(std::lower_bound(std::begin(_free), std::end(_free), id), id);
+        }
+        return true;
+    }
+
+    bool gate_registry::is_retired(gate_id id) {
+        std::array<std::uint8_t, 4> key{};
+        encode_id(id, key.data());
+        id_entry e{};
+        return _by_id.find(view(key), view(e)) and is_retired_entry(e.data());
+    }
+
+    std::optional<gate_config> gate_registry::find(gate_id id) {
+        std::array<std::uint8_t, 4> key{};
+        encode_id(id, key.data());
+        id_entry e{};
+        if (not _by_id.find(view(key), view(e)) or is_retired_entry(e.data())) {
+            return std::nullopt;
+        }
+        auto cfg = decode_config(e);
+        if (cfg.app_base_key == gate_base_key{}) {
+            if (_master == nullptr) {
+                ESP_LOGE("KA", "Gate %lu has a derived base key, but there is no master key.", std::uint32_t(id));
+                return std::nullopt;
+            }
+            cfg.app_base_key = gate_base_key::derive_from(*_master, id);
+        }
+        return cfg;
+    }
+
+    std::optional<gate_config> gate_registry::find(pub_key const &pk) {
+        // Scan the (few) gates that share the prefix, and check the full key on the primary table
+        const auto from = encode_pub_key(pk, gate_id{0});
+        std::vector<gate_id> candidates{};
+        const bool success = _by_pk.scan(view(from), [&](mlab::range<std::uint8_t const *> entry) -> bool {
+            if (not std::equal(entry.data(), entry.data() + pub_key_prefix_size, from.data())) {
+                return false;
+            }
+            candidates.push_back(decode_id(entry.data() + pub_key_prefix_size));
+            return true;
+        });
+        if (not success) {
+            return std::nullopt;
+        }
+        for (const auto id : candidates) {
+            if (auto cfg = find(id); cfg and cfg->gate_pub_key.raw_pk() == pk.raw_pk()) {
+                return cfg;
+            }
+        }
+        return std::nullopt;
+    }
+
+    bool gate_registry::compact() {
+        return _by_id.compact() and _by_pk.compact();
+    }
+
+    gate_registry_stats gate_registry::stats() const {
+        gate_registry_stats s{};
+        s.by_id = _by_id.stats();
+        s.by_pub_key = _by_pk.stats();
+        s.cache = _cache.stats();
+        return s;
+    }
+
+}// namespace ka
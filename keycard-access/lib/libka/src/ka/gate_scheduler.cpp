@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <desfire/esp32/utils.hpp>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <ka/gate_scheduler.hpp>
+#include <ka/rpc.hpp>
+#include <pn532/p2p.hpp>
+
+namespace ka {
+
+    namespace {
+        [[nodiscard]] std::chrono::milliseconds elapsed_since(std::int64_t start_us) {
+            return std::chrono::milliseconds{(esp_timer_get_time() - start_us) / 1000};
+        }
+
+        /**
+         * Forwards everything to the gate responder, and stops the scanner at the first chance after the deadline.
+         * A card that is being served is never interrupted: the scanner is stopped only when the field is empty.
+         */
+        class windowed_responder final : public pn532::scanner_responder {
+            pn532::scanner_responder &_inner;
+            std::int64_t _deadline;
+
+            void stop_if_expired(pn532::scanner &scanner) const {
+                if (esp_timer_get_time() >= _deadline) {
+                    scanner.stop();
+                }
+            }
+
+        public:
+            windowed_responder(pn532::scanner_responder &inner, std::chrono::milliseconds duration)
+                : _inner{inner}, _deadline{esp_timer_get_time() + std::chrono::microseconds{duration}.count()} {}
+
+            std::vector<pn532::target_type> get_scan_target_types(pn532::scanner &scanner) const override {
+                return _inner.get_scan_target_types(scanner);
+            }
+
+            void on_activation(pn532::scanner &scanner, pn532::scanned_target const &target) override {
+                _inner.on_activation(scanner, target);
+            }
+
+            pn532::post_interaction interact(pn532::scanner &scanner, pn532::scanned_target const &target) override {
+                return _inner.interact(scanner, target);
+            }
+
+            void on_release(pn532::scanner &scanner, pn532::scanned_target const &target) override {
+                _inner.on_release(scanner, target);
+            }
+
+            void on_leaving_rf(pn532::scanner &scanner, pn532::scanned_target const &target) override {
+                _inner.on_leaving_rf(scanner, target);
+                stop_if_expired(scanner);
+            }
+
+            void on_failed_scan(pn532::scanner &scanner, pn532::channel_error err) override {
+                _inner.on_failed_scan(scanner, err);
+                stop_if_expired(scanner);
+            }
+        };
+    }// namespace
+
+    pn532_card_service::pn532_card_service(pn532::controller &ctrl, gate_responder &responder)
+        : _responder{responder}, _scanner{ctrl} {}
+
+    void pn532_card_service::serve(std::chrono::milliseconds duration) {
+        windowed_responder responder{_responder, duration};
+        _scanner.loop(responder, false /* already performed */);
+    }
+
+    void pn532_card_service::stop() {
+        _scanner.stop();
+    }
+
+    gate_scheduler::gate_scheduler(card_service &cards, p2p::dep_target &admin, gate &g, gate_scheduler_options opts)
+        : _cards{cards},
+          _admin{admin},
+          _g{g},
+          _opts{opts},
+          _tickets{std::make_shared<p2p::session_ticket_store>()} {}
+
+    void gate_scheduler::card_window(std::chrono::milliseconds duration) {
+        if (_card_idle_since != 0) {
+            _stats.max_card_wait = std::max(_stats.max_card_wait, elapsed_since(_card_idle_since));
+        }
+        ++_stats.card_windows;
+        _cards.serve(duration);
+        _card_idle_since = esp_timer_get_time();
+    }
+
+    gate_scheduler::admin_outcome gate_scheduler::admin_window(std::chrono::milliseconds activation_timeout) {
+        ++_stats.admin_windows;
+        {
+            desfire::esp32::suppress_log suppress{ESP_LOG_ERROR, {PN532_TAG}};
+            if (not _admin.activate(p2p::fabricate_nfcid(_g), activation_timeout)) {
+                return admin_outcome::nobody;
+            }
+        }
+        if (_admin_pending) {
+            _stats.max_admin_wait = std::max(_stats.max_admin_wait, elapsed_since(_admin_suspended_at));
+        }
+        p2p::secure_target comm{_admin, _g.keys(), _tickets};
+        if (not comm.handshake(_opts.admin_idle_timeout)) {
+            // Whatever was suspended is not coming back on this activation either
+            end_admin_session();
+            return admin_outcome::ended;
+        }
+        if (comm.stats().resumed) {
+            ++_stats.resumed_sessions;
+        } else {
+            // A new session: whatever was suspended is not coming back
+            end_admin_session();
+        }
+        if (not _admin_pending) {
+            ++_stats.admin_sessions;
+            _revoked_before = _g.revoked_tokens().summary();
+            _rekey_grants_before = _g.rekey_grants_revision();
+            _deploys_before = _g.pending_deploys().revision();
+            _admin_pending = true;
+        }
+        rpc::dispatcher d{};
+        p2p::register_gate_handlers(d, _g, comm);
+        mlab::reduce_timeout slice{_opts.admin_slice};
+        while (true) {
+            const auto remaining = slice.remaining();
+            if (remaining <= std::chrono::milliseconds{0}) {
+                break;
+            }
+            // A timeout within the slice is not necessarily the end of the session
+            const bool may_idle_out = _opts.admin_idle_timeout <= remaining;
+            if (const auto r = d.serve_one(comm, std::min(_opts.admin_idle_timeout, remaining)); r) {
+                ++_stats.batches_served;
+            } else if (r.error() != pn532::channel_error::timeout or may_idle_out) {
+                // The keymaker left the field or stopped sending
+                end_admin_session();
+                return admin_outcome::ended;
+            }
+        }
+        ++_stats.preemptions;
+        _admin_suspended_at = esp_timer_get_time();
+        return admin_outcome::suspended;
+    }
+
+    void gate_scheduler::end_admin_session() {
+        if (not _admin_pending) {
+            return;
+        }
+        _admin_pending = false;
+        if (_g.revoked_tokens().summary() != _revoked_before) {
+            _g.token_lists_store();
+        }
+        if (_g.rekey_grants_revision() != _rekey_grants_before) {
+            _g.key_rotation_store();
+        }
+        if (_g.pending_deploys().revision() != _deploys_before) {
+            _g.pending_deploys_store();
+        }
+    }
+
+    void gate_scheduler::loop() {
+        _stop = false;
+        while (not _stop) {
+            if (_admin_pending) {
+                // Serve cards briefly, then give the suspended session a chance to resume
+                card_window(_opts.card_window_during_admin);
+                if (_stop) {
+                    break;
+                }
+                if (admin_window(_opts.admin_resume_window) == admin_outcome::nobody) {
+                    end_admin_session();
+                }
+            } else {
+                card_window(_opts.card_window);
+                if (_stop) {
+                    break;
+                }
+                static_cast<void>(admin_window(_opts.admin_window));
+            }
+        }
+        end_admin_session();
+    }
+
+    void gate_scheduler::stop() {
+        _stop = true;
+        _cards.stop();
+    }
+
+    gate_scheduler_stats const &gate_scheduler::stats() const {
+        return _stats;
+    }
+
+}// namespace ka
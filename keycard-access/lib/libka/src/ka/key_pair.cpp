@@ -2,6 +2,7 @@
 // Created by spak on 10/5/22.
 //
 
+#include <algorithm>
 #include <cstring>
 #include <esp_log.h>
 #include <ka/key_pair.hpp>
@@ -74,7 +75,14 @@ namespace ka {
     }
 
     token_root_key sec_key::derive_token_root_key(token_id const &id) const {
+        const auto raw_key = derive_raw_token_root_key(id);
         desfire::key_body<key_type::size> derived_key_data{};
+        std::copy(std::begin(raw_key), std::end(raw_key), std::begin(derived_key_data));
+        return token_root_key{0, derived_key_data};
+    }
+
+    raw_token_root_key sec_key::derive_raw_token_root_key(token_id const &id) const {
+        raw_token_root_key derived_key_data{};
         if (0 != crypto_kdf_blake2b_derive_from_key(
                          derived_key_data.data(), derived_key_data.size(),
                          util::pack_token_id(id),
@@ -82,11 +90,18 @@ namespace ka {
                          raw_sk().data())) {
             ESP_LOGE("KA", "Unable to derive root key.");
         }
-        return token_root_key{0, derived_key_data};
+        return derived_key_data;
     }
 
     gate_app_master_key sec_key::derive_gate_app_master_key(const token_id &id) const {
+        const auto raw_key = derive_raw_gate_app_master_key(id);
         desfire::key_body<key_type::size> derived_key_data{};
+        std::copy(std::begin(raw_key), std::end(raw_key), std::begin(derived_key_data));
+        return gate_app_master_key{0, derived_key_data};
+    }
+
+    raw_gate_app_master_key sec_key::derive_raw_gate_app_master_key(const token_id &id) const {
+        raw_gate_app_master_key derived_key_data{};
         if (0 != crypto_kdf_blake2b_derive_from_key(
                          derived_key_data.data(), derived_key_data.size(),
                          util::pack_token_id(id),
@@ -94,7 +109,7 @@ namespace ka {
                          raw_sk().data())) {
             ESP_LOGE("KA", "Unable to derive gate app master key.");
         }
-        return gate_app_master_key{0, derived_key_data};
+        return derived_key_data;
     }
 
     key_pair::key_pair(raw_sec_key sec_key_raw) : sec_key{sec_key_raw}, pub_key{} {
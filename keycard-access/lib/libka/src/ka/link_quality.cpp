@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cmath>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <ka/link_quality.hpp>
+
+namespace ka {
+
+    namespace {
+        /**
+         * Beyond this, doubling the timeout only delays detecting a dead link.
+         */
+        constexpr unsigned max_backoff = 4;
+        constexpr float loss_gain = 1.f / 16.f;
+    }// namespace
+
+    rtt_estimator::rtt_estimator(rtt_policy policy) : _policy{policy} {}
+
+    void rtt_estimator::sample(std::chrono::microseconds rtt) {
+        if (not _has_samples) {
+            _srtt = rtt;
+            _rttvar = rtt / 2;
+            _has_samples = true;
+        } else {
+            const auto delta = rtt > _srtt ? rtt - _srtt : _srtt - rtt;
+            _rttvar = (3 * _rttvar + delta) / 4;
+            _srtt = (7 * _srtt + rtt) / 8;
+        }
+    }
+
+    void rtt_estimator::on_success() {
+        _backoff = 0;
+        _loss_rate *= 1.f - loss_gain;
+    }
+
+    void rtt_estimator::on_loss() {
+        _backoff = std::min(_backoff + 1, max_backoff);
+        _loss_rate = _loss_rate * (1.f - loss_gain) + loss_gain;
+    }
+
+    bool rtt_estimator::has_samples() const {
+        return _has_samples;
+    }
+
+    std::chrono::microseconds rtt_estimator::srtt() const {
+        return _srtt;
+    }
+
+    std::chrono::microseconds rtt_estimator::rttvar() const {
+        return _rttvar;
+    }
+
+    float rtt_estimator::loss_rate() const {
+        return _loss_rate;
+    }
+
+    std::chrono::milliseconds rtt_estimator::timeout() const {
+        std::chrono::milliseconds base = _policy.initial_timeout;
+        if (_has_samples) {
+            // Round up, a timeout shorter than the RTT is useless
+            base = std::chrono::ceil<std::chrono::milliseconds>(_srtt + 4 * _rttvar);
+        }
+        return std::clamp(base * (1 << _backoff), _policy.min_timeout, _policy.max_timeout);
+    }
+
+    unsigned rtt_estimator::retries() const {
+        if (_loss_rate <= 0.f) {
+            return _policy.min_retries;
+        } else if (_loss_rate >= 1.f) {
+            return _policy.max_retries;
+        }
+        // Smallest n such that loss^(n + 1) <= target
+        const auto n = std::ceil(std::log(_policy.target_failure) / std::log(_loss_rate)) - 1.f;
+        return std::clamp(unsigned(std::max(n, 0.f)), _policy.min_retries, _policy.max_retries);
+    }
+
+    rtt_policy const &rtt_estimator::policy() const {
+        return _policy;
+    }
+
+    void event_rate::advance(std::int64_t now_us) {
+        const std::int64_t bucket = now_us / bucket_us;
+        // Clear the buckets that have been skipped since the last event
+        for (std::int64_t b = _current + 1; b <= std::min(bucket, _current + std::int64_t(_buckets.size())); ++b) {
+            _buckets[b % _buckets.size()] = 0;
+        }
+        _current = std::max(_current, bucket);
+    }
+
+    void event_rate::record(std::int64_t now_us) {
+        advance(now_us);
+        ++_buckets[_current % _buckets.size()];
+        ++_total;
+    }
+
+    std::uint32_t event_rate::per_minute(std::int64_t now_us) {
+        advance(now_us);
+        std::uint32_t count = 0;
+        for (const auto c : _buckets) {
+            count += c;
+        }
+        return count;
+    }
+
+    std::uint32_t event_rate::total() const {
+        return _total;
+    }
+
+    link_quality::link_quality(rtt_policy policy) : _rtt{policy} {}
+
+    rtt_estimator &link_quality::rtt() {
+        return _rtt;
+    }
+
+    rtt_estimator const &link_quality::rtt() const {
+        return _rtt;
+    }
+
+    void link_quality::record_failed_scan() {
+        _failed_scans.record(esp_timer_get_time());
+    }
+
+    void link_quality::record_retry() {
+        _retries.record(esp_timer_get_time());
+    }
+
+    void link_quality::record_timeout() {
+        _timeouts.record(esp_timer_get_time());
+    }
+
+    link_quality_report link_quality::report() {
+        const auto now = esp_timer_get_time();
+        link_quality_report r{};
+        r.srtt = _rtt.srtt();
+        r.rttvar = _rtt.rttvar();
+        r.timeout = _rtt.timeout();
+        r.retries = _rtt.retries();
+        r.loss_rate = _rtt.loss_rate();
+        r.failed_scans_per_minute = _failed_scans.per_minute(now);
+        r.retries_per_minute = _retries.per_minute(now);
+        r.timeouts_per_minute = _timeouts.per_minute(now);
+        r.failed_scans = _failed_scans.total();
+        r.total_retries = _retries.total();
+        r.timeouts = _timeouts.total();
+        return r;
+    }
+
+    void link_quality::log_report() {
+        const auto r = report();
+        ESP_LOGI("KA", "RTT %lld±%lld us, timeout %lld ms, %d retries, loss %0.1f%%.",
+                 r.srtt.count(), r.rttvar.count(), r.timeout.count(), r.retries, 100.f * r.loss_rate);
+        ESP_LOGI("KA", "Per minute: %lu failed scans, %lu retries, %lu timeouts.",
+                 r.failed_scans_per_minute, r.retries_per_minute, r.timeouts_per_minute);
+    }
+
+}// namespace ka
@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <cstring>
+#include <esp_log.h>
+#include <ka/member_roster.hpp>
+#include <mlab/strutils.hpp>
+
+namespace ka {
+
+    namespace {
+        constexpr std::uint8_t flag_revoked = 0x01;
+
+        using record_entry = std::array<std::uint8_t, member_roster::record_size>;
+        using hash_entry = std::array<std::uint8_t, member_roster::hash_entry_size>;
+        using edge_entry = std::array<std::uint8_t, member_roster::edge_size>;
+
+        void encode_gate(gate_id gid, std::uint8_t *dest) {
+            // Big endian, so that byte order is numeric order
+            const auto v = std::uint32_t(gid);
+            dest[0] = std::uint8_t(v >> 24);
+            dest[1] = std::uint8_t(v >> 16);
+            dest[2] = std::uint8_t(v >> 8);
+            dest[3] = std::uint8_t(v);
+        }
+
+        [[nodiscard]] gate_id decode_gate(std::uint8_t const *src) {
+            return gate_id{(std::uint32_t(src[0]) << 24) | (std::uint32_t(src[1]) << 16) | (std::uint32_t(src[2]) << 8) | std::uint32_t(src[3])};
+        }
+
+        [[nodiscard]] token_id decode_token(std::uint8_t const *src) {
+            token_id id{};
+            std::copy_n(src, token_id::array_size, std::begin(id));
+            return id;
+        }
+
+        [[nodiscard]] record_entry encode_record(member_record const &rec) {
+            record_entry e{};
+            auto it = std::copy(std::begin(rec.who.id), std::end(rec.who.id), std::begin(e));
+            *(it++) = rec.revoked ? flag_revoked : 0;
+            std::copy(std::begin(rec.who.holder), std::end(rec.who.holder), it);
+            std::copy(std::begin(rec.who.publisher), std::end(rec.who.publisher), it + member_roster::max_holder_size);
+            return e;
+        }
+
+        [[nodiscard]] member_record decode_record(std::uint8_t const *src) {
+            member_record rec{};
+            rec.who.id = decode_token(src);
+            rec.revoked = (src[token_id::array_size] & flag_revoked) != 0;
+            auto const *holder = src + token_id::array_size + 1;
+            auto const *publisher = holder + member_roster::max_holder_size;
+            rec.who.holder.assign(reinterpret_cast<const char *>(holder), strnlen(reinterpret_cast<const char *>(holder), member_roster::max_holder_size));
+            rec.who.publisher.assign(reinterpret_cast<const char *>(publisher), strnlen(reinterpret_cast<const char *>(publisher), member_roster::max_publisher_size));
+            return rec;
+        }
+
+        [[nodiscard]] hash_entry encode_hash(hash_type const &hash, token_id const &id) {
+            hash_entry e{};
+            auto it = std::copy_n(std::begin(hash), member_roster::hash_prefix_size, std::begin(e));
+            std::copy(std::begin(id), std::end(id), it);
+            return e;
+        }
+
+        template <std::size_t N>
+        [[nodiscard]] mlab::range<std::uint8_t const *> view(std::array<std::uint8_t, N> const &a) {
+            return mlab::make_range<std::uint8_t const *>(a.data(), a.data() + a.size());
+        }
+
+        template <std::size_t N>
+        [[nodiscard]] mlab::range<std::uint8_t *> view(std::array<std::uint8_t, N> &a) {
+            return mlab::make_range(a.data(), a.data() + a.size());
+        }
+    }// namespace
+
+    float gate_app_usage::apps_per_card() const {
+        return cards > 0 ? float(apps) / float(cards) : 0.f;
+    }
+
+    float gate_app_usage::directory_apps_per_card() const {
+        return cards > 0 ? float(directory_apps) / float(cards) : 0.f;
+    }
+
+    member_roster::member_roster()
+        : _cache{},
+          _records{record_size, token_id::array_size, _cache},
+          _by_hash{hash_entry_size, hash_entry_size, _cache},
+          _gates_by_token{edge_size, edge_size, _cache},
+          _tokens_by_gate{edge_size, edge_size, _cache} {}
+
+    bool member_roster::open(flash_region region) {
+        const std::uint32_t index_sectors = region.sectors() * 7 / 50;
+        const std::uint32_t record_sectors = region.sectors() - 3 * index_sectors;
+        if (not _records.open(region.subregion(0, record_sectors)) or
+            not _by_hash.open(region.subregion(record_sectors, index_sectors)) or
+            not _gates_by_token.open(region.subregion(record_sectors + index_sectors, index_sectors)) or
+            not _tokens_by_gate.open(region.subregion(record_sectors + 2 * index_sectors, index_sectors))) {
+            ESP_LOGE("KA", "Unable to open the member roster.");
+            return false;
+        }
+        _size = 0;
+        const token_id first{};
+        return _records.scan(mlab::make_range<std::uint8_t const *>(first.data(), first.data() + first.size()), [&](mlab::range<std::uint8_t const *>) -> bool {
+            ++_size;
+            return true;
+        });
+    }
+
+    bool member_roster::is_persistent() const {
+        return _records.is_persistent() and _by_hash.is_persistent() and _gates_by_token.is_persistent() and _tokens_by_gate.is_persistent();
+    }
+
+    std::uint32_t member_roster::size() const {
+        return _size;
+    }
+
+    bool member_roster::insert(identity const &who) {
+        if (who.holder.size() > max_holder_size or who.publisher.size() > max_publisher_size) {
+            const auto s_id = mlab::data_to_hex_string(who.id);
+            ESP_LOGE("KA", "Identity of %s does not fit in the roster.", s_id.c_str());
+            return false;
+        }
+        const auto previous = find(who.id);
+        if (previous and previous->who == who) {
+            return true;
+        }
+        member_record rec{who, previous and previous->revoked};
+        if (previous and not _by_hash.erase(view(encode_hash(previous->who.hash(), who.id)))) {
+            return false;
+        }
+        if (not _records.put(view(encode_record(rec))) or not _by_hash.put(view(encode_hash(who.hash(), who.id)))) {
+            return false;
+        }
+        if (not previous) {
+            ++_size;
+        }
+        return true;
+    }
+
+    bool member_roster::erase(token_id const &id) {
+        const auto previous = find(id);
+        if (not previous) {
+            return true;
+        }
+        for (const auto gid : gates_of(id)) {
+            if (not put_edge(id, gid, false)) {
+                return false;
+            }
+        }
+        if (not _by_hash.erase(view(encode_hash(previous->who.hash(), id))) or
+            not _records.erase(mlab::make_range<std::uint8_t const *>(id.data(), id.data() + id.size()))) {
+            return false;
+        }
+        --_size;
+        return true;
+    }
+
+    std::optional<member_record> member_roster::find(token_id const &id) {
+        record_entry e{};
+        if (not _records.find(mlab::make_range<std::uint8_t const *>(id.data(), id.data() + id.size()), view(e))) {
+            return std::nullopt;
+        }
+        return decode_record(e.data());
+    }
+
+    std::optional<member_record> member_roster::find(hash_type const &hash) {
+        // Scan the (few) tokens that share the prefix, and check the full hash on the record
+        const auto from = encode_hash(hash, token_id{});
+        std::vector<token_id> candidates{};
+        const bool success = _by_hash.scan(view(from), [&](mlab::range<std::uint8_t const *> entry) -> bool {
+            if (not std::equal(entry.data(), entry.data() + hash_prefix_size, from.data())) {
+                return false;
+            }
+            candidates.push_back(decode_token(entry.data() + hash_prefix_size));
+            return true;
+        });
+        if (not success) {
+            return std::nullopt;
+        }
+        for (auto const &id : candidates) {
+            if (auto rec = find(id); rec and rec->who.hash() == hash) {
+                return rec;
+            }
+        }
+        return std::nullopt;
+    }
+
+    bool member_roster::set_revoked(token_id const &id, bool revoked) {
+        auto rec = find(id);
+        if (not rec) {
+            return false;
+        }
+        if (rec->revoked == revoked) {
+            return true;
+        }
+        rec->revoked = revoked;
+        return _records.put(view(encode_record(*rec)));
+    }
+
+    bool member_roster::put_edge(token_id const &id, gate_id gid, bool live) {
+        edge_entry by_token{};
+        std::copy(std::begin(id), std::end(id), std::begin(by_token));
+        encode_gate(gid, by_token.data() + token_id::array_size);
+        edge_entry by_gate{};
+        encode_gate(gid, by_gate.data());
+        std::copy(std::begin(id), std::end(id), std::begin(by_gate) + 4);
+        if (live) {
+            return _gates_by_token.put(view(by_token)) and _tokens_by_gate.put(view(by_gate));
+        }
+        return _gates_by_token.erase(view(by_token)) and _tokens_by_gate.erase(view(by_gate));
+    }
+
+    bool member_roster::add_gate(token_id const &id, gate_id gid) {
+        if (not find(id)) {
+            const auto s_id = mlab::data_to_hex_string(id);
+            ESP_LOGE("KA", "Member %s is not in the roster.", s_id.c_str());
+            return false;
+        }
+        return put_edge(id, gid, true);
+    }
+
+    bool member_roster::remove_gate(token_id const &id, gate_id gid) {
+        return put_edge(id, gid, false);
+    }
+
+    std::vector<gate_id> member_roster::gates_of(token_id const &id) {
+        edge_entry from{};
+        std::copy(std::begin(id), std::end(id), std::begin(from));
+        std::vector<gate_id> gates{};
+        const bool success = _gates_by_token.scan(view(from), [&](mlab::range<std::uint8_t const *> entry) -> bool {
+            if (not std::equal(std::begin(id), std::end(id), entry.data())) {
+                return false;
+            }
+            gates.push_back(decode_gate(entry.data() + token_id::array_size));
+            return true;
+        });
+        if (not success) {
+            ESP_LOGE("KA", "Unable to read the gates of a member.");
+        }
+        return gates;
+    }
+
+    std::vector<token_id> member_roster::holders_of(gate_id gid) {
+        edge_entry from{};
+        encode_gate(gid, from.data());
+        std::vector<token_id> holders{};
+        const bool success = _tokens_by_gate.scan(view(from), [&](mlab::range<std::uint8_t const *> entry) -> bool {
+            if (not std::equal(from.data(), from.data() + 4, entry.data())) {
+                return false;
+            }
+            holders.push_back(decode_token(entry.data() + 4));
+            return true;
+        });
+        if (not success) {
+            ESP_LOGE("KA", "Unable to read the holders of gate %lu.", std::uint32_t(gid));
+        }
+        return holders;
+    }
+
+    std::optional<gate_app_usage> member_roster::app_usage() {
+        gate_app_usage usage{};
+        token_id current{};
+        std::uint32_t card_gates = 0;
+        std::uint32_t card_apps = 0;
+        std::array<std::uint32_t, gate_id::gates_per_app> card_files{};
+        desfire::app_id last_app{};
+        const auto close_card = [&] {
+            if (card_gates > 0) {
+                const auto card_directory_apps = *std::max_element(std::begin(card_files), std::end(card_files));
+                ++usage.cards;
+                usage.gates += card_gates;
+                usage.apps += card_apps;
+                usage.max_apps = std::max(usage.max_apps, card_apps);
+                usage.directory_apps += card_directory_apps;
+                usage.max_directory_apps = std::max(usage.max_directory_apps, card_directory_apps);
+                usage.packed_apps += (card_gates + gate_id::gates_per_app - 1) / gate_id::gates_per_app;
+            }
+            card_gates = 0;
+            card_apps = 0;
+            card_files = {};
+        };
+        // Edges are sorted by token and then by gate, and the app of a gate grows with its id
+        const edge_entry from{};
+        const bool success = _gates_by_token.scan(view(from), [&](mlab::range<std::uint8_t const *> entry) -> bool {
+            const auto id = decode_token(entry.data());
+            const auto gid = decode_gate(entry.data() + token_id::array_size);
+            const auto app = gid.app();
+            if (card_gates == 0 or id != current) {
+                close_card();
+                current = id;
+                ++card_apps;
+            } else if (app != last_app) {
+                ++card_apps;
+            }
+            ++card_gates;
+            ++card_files[std::uint32_t(gid) % gate_id::gates_per_app];
+            last_app = app;
+            return true;
+        });
+        if (not success) {
+            ESP_LOGE("KA", "Unable to read the gates of the roster.");
+            return std::nullopt;
+        }
+        close_card();
+        return usage;
+    }
+
+    bool member_roster::for_each(std::function<bool(member_record const &)> const &fn) {
+        const token_id first{};
+        return _records.scan(mlab::make_range<std::uint8_t const *>(first.data(), first.data() + first.size()), [&](mlab::range<std::uint8_t const *> entry) -> bool {
+            return fn(decode_record(entry.data()));
+        });
+    }
+
+    bool member_roster::compact() {
+        return _records.compact() and _by_hash.compact() and _gates_by_token.compact() and _tokens_by_gate.compact();
+    }
+
+    member_roster_stats member_roster::stats() const {
+        member_roster_stats s{};
+        s.members = _size;
+        s.records = _records.stats();
+        s.by_hash = _by_hash.stats();
+        s.gates_by_token = _gates_by_token.stats();
+        s.tokens_by_gate = _tokens_by_gate.stats();
+        s.cache = _cache.stats();
+        return s;
+    }
+
+}// namespace ka
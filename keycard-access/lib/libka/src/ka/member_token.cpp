@@ -5,10 +5,12 @@
 #include <desfire/esp32/utils.hpp>
 #include <desfire/bits.hpp>
 #include <desfire/kdf.hpp>
+#include <ka/deploy_queue.hpp>
 #include <ka/desfire_fs.hpp>
 #include <ka/gate.hpp>
 #include <ka/member_token.hpp>
 #include <ka/p2p_ops.hpp>
+#include <sodium/utils.h>
 
 namespace ka {
     using namespace mlab_literals;
@@ -332,6 +334,145 @@ namespace ka {
         return write_gate_file_internal(gate_id::first_aid, 0x00, mkey, mkey.key_number(), data, check_app);
     }
 
+    r<gate_directory> member_token::read_gate_directory() const {
+        if (_directory) {
+            return *_directory;
+        }
+        TRY_SILENT(silent_select_application(tag(), gate_id::first_aid, false))
+        desfire::esp32::suppress_log suppress{DESFIRE_LOG_PREFIX};
+        if (auto r = tag().read_data(gate_directory::file_id, desfire::comm_mode::plain); not r) {
+            if (r.error() != desfire::error::file_not_found) {
+                DESFIRE_FAIL_MSG("tag().read_data(gate_directory::file_id, desfire::comm_mode::plain)", r);
+                return r.error();
+            }
+            // Deployed before directories, gates are at their fixed location
+            _directory = desfire::error::file_not_found;
+        } else {
+            mlab::bin_stream s{*r};
+            gate_directory dir{};
+            s >> dir;
+            if (s.bad()) {
+                ESP_LOGW("KA", "Malformed gate directory.");
+                return desfire::error::malformed;
+            }
+            _directory = std::move(dir);
+        }
+        return *_directory;
+    }
+
+    r<> member_token::write_gate_directory(gate_app_master_key const &mkey, gate_directory const &dir) {
+        if (mkey.key_number() != 0) {
+            return desfire::error::parameter_error;
+        }
+        TRY_SILENT(silent_select_application(tag(), gate_id::first_aid, false))
+        TRY_RESULT_SILENT(silent_try_authenticate(tag(), mkey)) {
+            if (not *r) {
+                return desfire::error::permission_denied;
+            }
+        }
+        _directory = std::nullopt;
+        mlab::bin_data data{};
+        data << dir;
+        desfire::esp32::suppress_log suppress{DESFIRE_LOG_PREFIX};
+        TRY(desfire::fs::delete_file_if_exists(tag(), gate_directory::file_id))
+        TRY(desfire::fs::create_ro_free_plain_data_file(tag(), gate_directory::file_id, data))
+        _directory = dir;
+        return mlab::result_success;
+    }
+
+    r<revocation_epoch> member_token::read_revocation_epoch() const {
+        TRY_SILENT(silent_select_application(tag(), gate_id::first_aid, false))
+        desfire::esp32::suppress_log suppress{DESFIRE_LOG_PREFIX};
+        TRY_RESULT_SILENT(tag().read_data(revocation_epoch::file_id, desfire::comm_mode::plain)) {
+            mlab::bin_stream s{*r};
+            revocation_epoch epoch{};
+            s >> epoch;
+            if (s.bad()) {
+                ESP_LOGW("KA", "Malformed revocation epoch.");
+                return desfire::error::malformed;
+            }
+            return epoch;
+        }
+    }
+
+    r<revocation_record> member_token::read_revocation_record(revocation_epoch const &epoch) const {
+        TRY_SILENT(silent_select_application(tag(), gate_id::first_aid, false))
+        desfire::esp32::suppress_log suppress{DESFIRE_LOG_PREFIX};
+        TRY_RESULT_SILENT(tag().read_data(revocation_record::delta_file_id, desfire::comm_mode::plain)) {
+            mlab::bin_stream s{*r};
+            revocation_record rec{epoch, {}};
+            std::uint16_t count = 0;
+            s >> mlab::lsb16 >> count;
+            if (s.bad() or count > revocation_record::max_delta) {
+                ESP_LOGW("KA", "Malformed revocation delta.");
+                return desfire::error::malformed;
+            }
+            rec.delta.resize(count);
+            for (list_change &change : rec.delta) {
+                s >> change;
+            }
+            if (s.bad() or s.remaining() > 0) {
+                ESP_LOGW("KA", "Malformed revocation delta.");
+                return desfire::error::malformed;
+            }
+            return rec;
+        }
+    }
+
+    r<> member_token::write_revocation_record(gate_app_master_key const &mkey, revocation_record const &rec) {
+        if (mkey.key_number() != 0) {
+            return desfire::error::parameter_error;
+        }
+        TRY_SILENT(silent_select_application(tag(), gate_id::first_aid, false))
+        TRY_RESULT_SILENT(silent_try_authenticate(tag(), mkey)) {
+            if (not *r) {
+                return desfire::error::permission_denied;
+            }
+        }
+        mlab::bin_data header{};
+        header << rec.header;
+        desfire::esp32::suppress_log suppress{DESFIRE_LOG_PREFIX};
+        TRY(desfire::fs::delete_file_if_exists(tag(), revocation_epoch::file_id))
+        TRY(desfire::fs::delete_file_if_exists(tag(), revocation_record::delta_file_id))
+        TRY(desfire::fs::create_ro_free_plain_data_file(tag(), revocation_record::delta_file_id, rec.delta_file()))
+        TRY(desfire::fs::create_ro_free_plain_data_file(tag(), revocation_epoch::file_id, header))
+        return mlab::result_success;
+    }
+
+    r<gate_id> member_token::locate_gate(gate_id gid) const {
+        if (const auto r = read_gate_directory(); r) {
+            if (const auto loc = r->find(gid); loc) {
+                return *loc;
+            }
+            return desfire::error::file_not_found;
+        } else if (r.error() == desfire::error::file_not_found or r.error() == desfire::error::app_not_found) {
+            // No directory, or not even a master app: the gate can only be at its fixed location
+            return gid;
+        } else {
+            return r.error();
+        }
+    }
+
+    r<gate_id> member_token::assign_gate_location(gate_id gid, gate_app_master_key const &mkey) {
+        auto r_dir = read_gate_directory();
+        if (not r_dir) {
+            if (r_dir.error() == desfire::error::file_not_found) {
+                return gid;
+            }
+            return r_dir.error();
+        }
+        if (const auto loc = r_dir->find(gid); loc) {
+            return *loc;
+        }
+        const auto loc = r_dir->assign(gid);
+        if (not loc) {
+            ESP_LOGE("KA", "Gate directory full, cannot enroll gate %lu.", std::uint32_t(gid));
+            return desfire::error::parameter_error;
+        }
+        TRY_SILENT(write_gate_directory(mkey, *r_dir))
+        return *loc;
+    }
+
     r<token_id> member_token::get_id() const {
         /**
          * @note We do not expect this command to fail at any point.
@@ -405,6 +546,30 @@ namespace ka {
         return mlab::result_success;
     }
 
+    r<> member_token::change_gate_key(gate_id gid, gate_app_master_key const &mkey, gate_token_key const &previous, gate_token_key const &key) {
+        if (mkey.key_number() != 0 or previous.key_number() != gid.key_no() or key.key_number() != gid.key_no()) {
+            return desfire::error::parameter_error;
+        }
+        const auto [aid, fid] = gid.app_and_file();
+        TRY_SILENT(silent_select_application(tag(), aid, false))
+        // Is the key already changed?
+        TRY_RESULT_SILENT(silent_try_authenticate(tag(), key)) {
+            if (*r) {
+                return mlab::result_success;
+            }
+        }
+        TRY_RESULT_SILENT(silent_try_authenticate(tag(), mkey)) {
+            if (not *r) {
+                return desfire::error::permission_denied;
+            }
+        }
+        desfire::esp32::suppress_log suppress{DESFIRE_LOG_PREFIX};
+        if (const auto r = tag().change_key(previous, key); not r) {
+            DESFIRE_FAIL_CMD("tag().change_key(previous, key)", r);
+        }
+        return mlab::result_success;
+    }
+
     template <class Fn>
     r<> member_token::list_gate_apps_internal(bool check_app, Fn &&app_action) const {
         desfire::esp32::suppress_log suppress{DESFIRE_LOG_PREFIX};
@@ -475,6 +640,7 @@ namespace ka {
             TRY(tag().change_app_settings(rights))
             TRY(tag().change_key(rkey))
             if (format) {
+                _directory = std::nullopt;
                 TRY(tag().select_application())
                 TRY(tag().authenticate(rkey))
                 TRY(tag().format_picc())
@@ -516,10 +682,12 @@ namespace ka {
 
     r<token_id> member_token::write_encrypted_gate_file(keymaker const &km, gate_config const &g, identity const &id, bool check_app) {
         TRY_RESULT_AS_SILENT(get_id(), r_id) {
-            const auto [aid, fid] = g.id.app_and_file();
-            const auto mkey = km.keys().derive_gate_app_master_key(*r_id);
-            TRY_SILENT(write_encrypted_gate_file_internal(aid, fid, mkey, g.id.key_no(), km.keys(), g.gate_pub_key, id, check_app));
-            return r_id;
+            TRY_RESULT_AS_SILENT(locate_gate(g.id), r_loc) {
+                const auto [aid, fid] = r_loc->app_and_file();
+                const auto mkey = km.keys().derive_gate_app_master_key(*r_id);
+                TRY_SILENT(write_encrypted_gate_file_internal(aid, fid, mkey, g.id.key_no(), km.keys(), g.gate_pub_key, id, check_app));
+                return r_id;
+            }
         }
     }
 
@@ -580,8 +748,14 @@ namespace ka {
     }
 
     r<bool> member_token::is_gate_enrolled(gate_id gid, bool check_app, bool check_file) const {
-        const auto [aid, fid] = gid.app_and_file();
-        return is_enrolled_internal(aid, fid, gid.key_no(), check_app, check_file);
+        if (const auto r = locate_gate(gid); r) {
+            const auto [aid, fid] = r->app_and_file();
+            return is_enrolled_internal(aid, fid, gid.key_no(), check_app, check_file);
+        } else if (r.error() == desfire::error::file_not_found) {
+            return false;
+        } else {
+            return r.error();
+        }
     }
 
     r<bool> member_token::is_master_enrolled(bool check_app, bool check_file) const {
@@ -590,6 +764,24 @@ namespace ka {
 
     r<std::vector<gate_id>> member_token::list_gates(bool check_app, bool check_file) const {
         std::vector<gate_id> gates;
+        if (const auto r_dir = read_gate_directory(); r_dir) {
+            for (const auto gid : r_dir->gates()) {
+                if (check_app or check_file) {
+                    if (const auto r = is_gate_enrolled(gid, check_app, check_file); not r) {
+                        if (r.error() != desfire::error::app_integrity_error and r.error() != desfire::error::file_integrity_error) {
+                            return r.error();
+                        }
+                        continue;
+                    } else if (not *r) {
+                        continue;
+                    }
+                }
+                gates.emplace_back(gid);
+            }
+            return gates;
+        } else if (r_dir.error() != desfire::error::file_not_found and r_dir.error() != desfire::error::app_not_found) {
+            return r_dir.error();
+        }
         TRY_SILENT(list_gate_apps_internal(check_app, [&](desfire::app_id aid) -> r<> {
             desfire::esp32::suppress_log suppress{DESFIRE_LOG_PREFIX};
             if (const auto r = tag().get_file_ids(); r) {
@@ -643,13 +835,51 @@ namespace ka {
 
     r<identity, token_id> member_token::read_encrypted_gate_file(gate const &g, bool check_app, bool check_file) const {
         TRY_RESULT_AS_SILENT(get_id(), r_id) {
-            const auto [aid, fid] = g.id().app_and_file();
-            const auto key = g.app_base_key().derive_token_key(*r_id, g.id().key_no());
-            return mlab::concat_result(read_encrypted_gate_file_internal(aid, fid, key, g.keys(), g.programmer_pub_key(), check_app, check_file), r_id);
+            TRY_RESULT_AS_SILENT(locate_gate(g.id()), r_loc) {
+                const auto [aid, fid] = r_loc->app_and_file();
+                const auto key = g.app_base_key().derive_token_key(*r_id, g.id().key_no());
+                return mlab::concat_result(read_encrypted_gate_file_internal(aid, fid, key, g.keys(), g.programmer_pub_key(), check_app, check_file), r_id);
+            }
         }
     }
 
 
+    r<identity, token_id> member_token::read_encrypted_gate_file(gate const &g, gate_group const &grp, bool check_app, bool check_file) const {
+        TRY_RESULT_AS_SILENT(get_id(), r_id) {
+            TRY_RESULT_AS_SILENT(locate_gate(grp.id), r_loc) {
+                const auto [aid, fid] = r_loc->app_and_file();
+                const auto key = grp.app_base_key.derive_token_key(*r_id, grp.id.key_no());
+                return mlab::concat_result(read_encrypted_gate_file_internal(aid, fid, key, grp.keys, g.programmer_pub_key(), check_app, check_file), r_id);
+            }
+        }
+    }
+
+    r<identity, token_id> member_token::read_encrypted_gate_file(gate const &g, gate_key_material const &previous, bool check_app, bool check_file) const {
+        TRY_RESULT_AS_SILENT(get_id(), r_id) {
+            TRY_RESULT_AS_SILENT(locate_gate(g.id()), r_loc) {
+                const auto [aid, fid] = r_loc->app_and_file();
+                const auto key = previous.app_base_key.derive_token_key(*r_id, g.id().key_no());
+                auto r_who = read_encrypted_gate_file_internal(aid, fid, key, previous.keys, g.programmer_pub_key(), check_app, check_file);
+                if (not r_who and r_who.error() == desfire::error::crypto_error) {
+                    // The migration stopped after writing the file
+                    r_who = read_encrypted_gate_file_internal(aid, fid, key, g.keys(), g.programmer_pub_key(), false, false);
+                }
+                return mlab::concat_result(r_who, r_id);
+            }
+        }
+    }
+
+    r<> member_token::migrate_gate_file(gate const &g, gate_key_material const &previous, gate_app_master_key const &mkey, token_id const &id, identity const &who) {
+        TRY_RESULT_AS_SILENT(locate_gate(g.id()), r_loc) {
+            const auto [aid, fid] = r_loc->app_and_file();
+            const auto previous_key = previous.app_base_key.derive_token_key(id, g.id().key_no());
+            const auto key = g.app_base_key().derive_token_key(id, g.id().key_no());
+            // File first, the previous key keeps opening it until the key is changed
+            TRY_SILENT(write_encrypted_gate_file_internal(aid, fid, mkey, key.key_number(), g.keys(), g.programmer_pub_key(), who, false))
+            return change_gate_key(*r_loc, mkey, previous_key, key);
+        }
+    }
+
     r<identity, token_id> member_token::read_encrypted_master_file(keymaker const &km, bool check_app, bool check_file) const {
         TRY_RESULT_AS_SILENT(get_id(), r_id) {
             const auto mkey = km.keys().derive_gate_app_master_key(*r_id);
@@ -658,11 +888,13 @@ namespace ka {
     }
 
     [[nodiscard]] r<bool> member_token::check_encrypted_gate_file_internal(gate_token_key const &key, key_pair const &kp, gate_config const &g, identity const &id, bool check_app, bool check_file) const {
-        const auto [aid, fid] = g.id.app_and_file();
-        TRY_RESULT_SILENT(read_gate_file_internal(aid, fid, key, check_app, check_file)) {
-            mlab::bin_data data;
-            data << id;
-            return kp.blind_check_ciphertext(g.gate_pub_key, data, *r);
+        TRY_RESULT_AS_SILENT(locate_gate(g.id), r_loc) {
+            const auto [aid, fid] = r_loc->app_and_file();
+            TRY_RESULT_SILENT(read_gate_file_internal(aid, fid, key, check_app, check_file)) {
+                mlab::bin_data data;
+                data << id;
+                return kp.blind_check_ciphertext(g.gate_pub_key, data, *r);
+            }
         }
     }
 
@@ -675,13 +907,14 @@ namespace ka {
 
     r<bool, token_id> member_token::is_gate_enrolled_correctly(keymaker const &km, gate_config const &g) const {
         TRY_RESULT_AS_SILENT(get_id(), r_id) {
-            const auto [aid, fid] = g.id.app_and_file();
             const auto mkey = km.keys().derive_gate_app_master_key(*r_id);
             TRY_RESULT_AS_SILENT(read_encrypted_gate_file_internal(gate_id::first_aid, 0x00, mkey, km.keys(), km.keys(), true, true), r_exp_id) {
-                const auto key = g.app_base_key.derive_token_key(*r_id, g.id.key_no());
-                // The first app was already tested when reading the master file
-                const bool app_needs_testing = (aid != gate_id::first_aid);
-                return mlab::concat_result(check_encrypted_gate_file_internal(key, km.keys(), g, *r_exp_id, app_needs_testing, true), r_id);
+                TRY_RESULT_AS_SILENT(locate_gate(g.id), r_loc) {
+                    const auto key = g.app_base_key.derive_token_key(*r_id, g.id.key_no());
+                    // The first app was already tested when reading the master file
+                    const bool app_needs_testing = (r_loc->app() != gate_id::first_aid);
+                    return mlab::concat_result(check_encrypted_gate_file_internal(key, km.keys(), g, *r_exp_id, app_needs_testing, true), r_id);
+                }
             }
         }
     }
@@ -689,22 +922,57 @@ namespace ka {
 
     r<token_id> member_token::enroll_gate(keymaker const &km, gate_config const &g, identity const &id) {
         TRY_RESULT_AS_SILENT(get_id(), r_id) {
-            const auto [aid, fid] = g.id.app_and_file();
             const auto mkey = km.keys().derive_gate_app_master_key(*r_id);
             TRY_RESULT_SILENT(read_encrypted_gate_file_internal(gate_id::first_aid, 0x00, mkey, km.keys(), km.keys(), true, true)) {
                 if (*r != id) {
                     return desfire::error::parameter_error;
                 }
             }
-            // At this point we have definitely tested the first app, and we know it exists
+            TRY_RESULT_AS_SILENT(assign_gate_location(g.id, mkey), r_loc) {
+                const auto [aid, fid] = r_loc->app_and_file();
+                // At this point we have definitely tested the first app, and we know it exists
+                if (aid != gate_id::first_aid) {
+                    const auto rkey = km.keys().derive_token_root_key(*r_id);
+                    TRY_SILENT(ensure_gate_app(aid, rkey, mkey))
+                }
+                const auto key = g.app_base_key.derive_token_key(*r_id, g.id.key_no());
+                TRY_SILENT(enroll_gate_key(*r_loc, mkey, key, false))
+                TRY_SILENT(write_encrypted_gate_file_internal(aid, fid, mkey, key.key_number(), km.keys(), g.gate_pub_key, id, false))
+                TRY_SILENT(write_revocation_record(mkey, km.sign_revocations()))
+                return r_id;
+            }
+        }
+    }
+
+    r<> member_token::enroll_gate(prepared_token const &t, prepared_gate const &g) {
+        TRY_RESULT_AS_SILENT(assign_gate_location(g.id, t.mkey), r_loc) {
+            const auto [aid, fid] = r_loc->app_and_file();
             if (aid != gate_id::first_aid) {
-                const auto rkey = km.keys().derive_token_root_key(*r_id);
-                TRY_SILENT(ensure_gate_app(aid, rkey, mkey))
+                TRY_SILENT(ensure_gate_app(aid, t.rkey, t.mkey))
             }
-            const auto key = g.app_base_key.derive_token_key(*r_id, g.id.key_no());
-            TRY_SILENT(enroll_gate_key(g.id, mkey, key, false))
-            TRY_SILENT(write_encrypted_gate_file_internal(aid, fid, mkey, key.key_number(), km.keys(), g.gate_pub_key, id, false))
-            return r_id;
+            TRY_SILENT(enroll_gate_key(*r_loc, t.mkey, g.key, false))
+            return write_gate_file_internal(aid, fid, t.mkey, g.key.key_number(), g.gate_file, false);
+        }
+    }
+
+    r<> member_token::enroll_gate(gate const &g, deploy_certificate const &cert) {
+        desfire::key_body<key_type::size> mkey_data{};
+        std::copy(std::begin(cert.mkey), std::end(cert.mkey), std::begin(mkey_data));
+        const gate_app_master_key mkey{0, mkey_data};
+        sodium_memzero(mkey_data.data(), mkey_data.size());
+        TRY_RESULT_AS_SILENT(assign_gate_location(g.id(), mkey), r_loc) {
+            const auto [aid, fid] = r_loc->app_and_file();
+            if (aid != gate_id::first_aid) {
+                // Creating the app takes the root key, which only the keymaker has
+                TRY_RESULT_SILENT(check_gate_app(aid, false)) {
+                    if (not *r) {
+                        return desfire::error::app_integrity_error;
+                    }
+                }
+            }
+            const auto key = g.app_base_key().derive_token_key(cert.who.id, g.id().key_no());
+            TRY_SILENT(enroll_gate_key(*r_loc, mkey, key, false))
+            return write_encrypted_gate_file_internal(aid, fid, mkey, key.key_number(), g.keys(), g.programmer_pub_key(), cert.who, false);
         }
     }
 
@@ -729,6 +997,8 @@ namespace ka {
             TRY_SILENT(setup_root(rkey, true))
             TRY_SILENT(create_gate_app(gate_id::first_aid, rkey, mkey))
             TRY_SILENT(write_encrypted_gate_file_internal(gate_id::first_aid, 0x00, mkey, 0, km.keys(), km.keys(), id, false))
+            TRY_SILENT(write_gate_directory(mkey, gate_directory{}))
+            TRY_SILENT(write_revocation_record(mkey, km.sign_revocations()))
             return r_id;
         }
     }
@@ -740,8 +1010,17 @@ namespace ka {
             TRY_SILENT(setup_root(rkey, true, previous_rkey))
             TRY_SILENT(create_gate_app(gate_id::first_aid, rkey, mkey))
             TRY_SILENT(write_encrypted_gate_file_internal(gate_id::first_aid, 0x00, mkey, 0, km.keys(), km.keys(), id, false))
+            TRY_SILENT(write_gate_directory(mkey, gate_directory{}))
+            TRY_SILENT(write_revocation_record(mkey, km.sign_revocations()))
             return r_id;
         }
     }
 
+    r<> member_token::deploy(prepared_token const &t) {
+        TRY_SILENT(setup_root(t.rkey, true))
+        TRY_SILENT(create_gate_app(gate_id::first_aid, t.rkey, t.mkey))
+        TRY_SILENT(write_gate_file_internal(gate_id::first_aid, 0x00, t.mkey, 0, t.master_file, false))
+        return write_gate_directory(t.mkey, gate_directory{});
+    }
+
 }// namespace ka
\ No newline at end of file
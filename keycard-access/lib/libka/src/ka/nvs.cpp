@@ -2,10 +2,12 @@
 // Created by spak on 1/8/23.
 //
 
+#include <algorithm>
 #include <cstring>
 #include <esp_err.h>
 #include <esp_log.h>
 #include <ka/nvs.hpp>
+#include <ka/telemetry.hpp>
 #include <nvs_flash.h>
 
 namespace ka::nvs {
@@ -119,6 +121,16 @@ namespace ka::nvs {
         return value;
     }
 
+    template <class U, const_namespc::nvs_sized_getter_t<U> GetFn>
+    [[nodiscard]] r<std::size_t> const_namespc::get_known_sized_type_into(const char *key, U *dest, std::size_t capacity) const {
+        // Nvs will refuse to read if the capacity is too small, so we need a single call
+        std::size_t length = capacity;
+        if (const auto e = GetFn(_hdl, key, dest, &length); e != ESP_OK) {
+            return from_esp_error(e);
+        }
+        return length;
+    }
+
     template <class T, namespc::nvs_setter_t<T> SetFn>
     r<> namespc::set_known_type(const char *key, T const &value) {
         if (const auto e = SetFn(_hdl, key, value); e != ESP_OK) {
@@ -179,6 +191,29 @@ namespace ka::nvs {
     r<mlab::bin_data> const_namespc::get_blob(const char *key) const {
         return get_known_sized_type<mlab::bin_data, void, nvs_get_blob>(key);
     }
+    r<> const_namespc::get_blob_into(const char *key, mlab::range<std::uint8_t *> dest) const {
+        const auto r = get_known_sized_type_into<void, nvs_get_blob>(key, dest.data(), dest.size());
+        if (r and *r == dest.size()) {
+            return mlab::result_success;
+        }
+        // Do not leave partial data around, this could be a key
+        std::fill(std::begin(dest), std::end(dest), 0);
+        return r ? error::invalid_length : r.error();
+    }
+
+    r<std::size_t> const_namespc::get_str_into(const char *key, mlab::range<char *> dest) const {
+        if (dest.size() == 0) {
+            return error::invalid_length;
+        }
+        if (const auto r = get_known_sized_type_into<char, nvs_get_str>(key, dest.data(), dest.size()); r) {
+            // Length includes the nul character
+            return *r > 0 ? *r - 1 : 0;
+        } else {
+            dest.data()[0] = '\0';
+            return r.error();
+        }
+    }
+
     r<> namespc::set_u8(const char *key, std::uint8_t value) {
         return set_known_type<std::uint8_t, nvs_set_u8>(key, value);
     }
@@ -211,6 +246,7 @@ namespace ka::nvs {
     }
 
     r<> namespc::commit() {
+        telemetry::instance().record_nvs_commit();
         if (const auto e = nvs_commit(_hdl); e != ESP_OK) {
             return from_esp_error(e);
         }
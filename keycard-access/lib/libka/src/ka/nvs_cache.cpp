@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_pthread.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <functional>
+#include <ka/nvs_cache.hpp>
+#include <vector>
+
+namespace ka::nvs {
+
+    namespace {
+        struct live_caches {
+            std::mutex mutex;
+            std::vector<write_back_cache *> caches;
+        };
+
+        [[nodiscard]] live_caches &registry() {
+            static live_caches instance{};
+            return instance;
+        }
+
+        void register_cache(write_back_cache &cache) {
+            static std::once_flag shutdown_handler_flag{};
+            std::call_once(shutdown_handler_flag, [] {
+                if (const auto e = esp_register_shutdown_handler(&write_back_cache::flush_all); e != ESP_OK) {
+                    ESP_LOGW("NVS", "Unable to register shutdown handler, pending writes may be lost on restart.");
+                }
+            });
+            auto &reg = registry();
+            std::unique_lock guard{reg.mutex};
+            reg.caches.push_back(&cache);
+        }
+
+        void unregister_cache(write_back_cache &cache) {
+            auto &reg = registry();
+            std::unique_lock guard{reg.mutex};
+            reg.caches.erase(std::remove(std::begin(reg.caches), std::end(reg.caches), &cache), std::end(reg.caches));
+        }
+
+        [[nodiscard]] std::thread spawn_flusher(std::function<void()> fn) {
+            auto cfg = esp_pthread_get_default_config();
+            cfg.thread_name = "nvs_write_back";
+            // Room for the NVS write path
+            cfg.stack_size = 4096;
+            esp_pthread_set_cfg(&cfg);
+            std::thread flusher{std::move(fn)};
+            const auto default_cfg = esp_pthread_get_default_config();
+            esp_pthread_set_cfg(&default_cfg);
+            return flusher;
+        }
+    }// namespace
+
+    float write_back_stats::write_amplification() const {
+        return updates > 0 ? float(writes) / float(updates) : 0.f;
+    }
+
+    std::chrono::microseconds write_back_stats::average_flush_latency() const {
+        return flushes > 0 ? total_flush_latency / flushes : std::chrono::microseconds{0};
+    }
+
+    write_back_cache::write_back_cache(std::shared_ptr<namespc> ns, std::chrono::milliseconds flush_interval)
+        : _ns{std::move(ns)} {
+        register_cache(*this);
+        // Flash writes stall the caller for milliseconds, keep them off the esp_timer task
+        if (flush_interval.count() > 0) {
+            _flusher = spawn_flusher([this, flush_interval] { flusher_loop(flush_interval); });
+        }
+    }
+
+    write_back_cache::~write_back_cache() {
+        {
+            std::unique_lock<std::mutex> lock{_stop_mutex};
+            _stop = true;
+        }
+        _cv.notify_all();
+        // Wait for a flush in progress, after this nothing else refers to this
+        if (_flusher.joinable()) {
+            _flusher.join();
+        }
+        unregister_cache(*this);
+        if (not flush()) {
+            ESP_LOGE("NVS", "Unable to flush %d pending writes.", _dirty.size());
+        }
+    }
+
+    void write_back_cache::flusher_loop(std::chrono::milliseconds flush_interval) {
+        std::unique_lock<std::mutex> lock{_stop_mutex};
+        while (not _cv.wait_for(lock, flush_interval, [&] { return _stop; })) {
+            lock.unlock();
+            void(flush());
+            lock.lock();
+        }
+    }
+
+    void write_back_cache::mark_dirty(const char *key, std::optional<cached_value> value) {
+        std::unique_lock guard{_mutex};
+        _dirty[key] = std::move(value);
+        ++_stats.updates;
+    }
+
+    void write_back_cache::erase(const char *key) {
+        mark_dirty(key, std::nullopt);
+    }
+
+    std::size_t write_back_cache::dirty_count() const {
+        std::unique_lock guard{_mutex};
+        return _dirty.size();
+    }
+
+    write_back_stats write_back_cache::stats() const {
+        std::unique_lock guard{_mutex};
+        return _stats;
+    }
+
+    r<> write_back_cache::flush() {
+        std::unique_lock guard{_mutex};
+        if (_dirty.empty()) {
+            return mlab::result_success;
+        }
+        const auto start = esp_timer_get_time();
+        r<> retval = mlab::result_success;
+        std::vector<decltype(_dirty)::iterator> written{};
+        written.reserve(_dirty.size());
+        for (auto it = std::begin(_dirty); it != std::end(_dirty); ++it) {
+            r<> r_item = mlab::result_success;
+            if (it->second) {
+                r_item = std::visit([&](auto const &value) { return _ns->set(it->first.c_str(), value); }, *it->second);
+            } else if (r_item = _ns->erase(it->first.c_str()); not r_item and r_item.error() == error::not_found) {
+                // Erasing something that is not there is not an error
+                r_item = mlab::result_success;
+            }
+            if (r_item) {
+                ++_stats.writes;
+                written.push_back(it);
+            } else {
+                ESP_LOGW("NVS", "Unable to write back %s.", it->first.c_str());
+                retval = r_item;
+            }
+        }
+        // Until committed, nothing is guaranteed to be on flash; keep everything dirty and write it again next time
+        if (const auto r_commit = _ns->commit(); not r_commit) {
+            ESP_LOGW("NVS", "Unable to commit %d written back values.", written.size());
+            retval = r_commit;
+        } else {
+            for (auto it : written) {
+                _dirty.erase(it);
+            }
+        }
+        const auto latency = std::chrono::microseconds{esp_timer_get_time() - start};
+        ++_stats.flushes;
+        if (not retval) {
+            ++_stats.failed_flushes;
+        }
+        _stats.last_flush_latency = latency;
+        _stats.max_flush_latency = std::max(_stats.max_flush_latency, latency);
+        _stats.total_flush_latency += latency;
+        return retval;
+    }
+
+    void write_back_cache::flush_all() {
+        auto &reg = registry();
+        std::unique_lock guard{reg.mutex};
+        for (write_back_cache *cache : reg.caches) {
+            if (not cache->flush()) {
+                ESP_LOGE("NVS", "Unable to flush a write-back cache.");
+            }
+        }
+    }
+
+}// namespace ka::nvs
@@ -0,0 +1,307 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <ka/ota.hpp>
+#include <sodium/utils.h>
+
+namespace ka {
+
+    namespace {
+        /**
+         * Block size used to hash the image on the keymaker side.
+         */
+        constexpr std::size_t hash_block_size = 256;
+
+        [[nodiscard]] mlab::bin_data signed_message(ota_digest const &digest, std::uint32_t image_size) {
+            mlab::bin_data bd{mlab::prealloc(digest.size() + 4)};
+            bd << digest << mlab::lsb32 << image_size;
+            return bd;
+        }
+    }// namespace
+
+    const char *to_string(ota_error e) {
+        switch (e) {
+            case ota_error::none:
+                return "none";
+            case ota_error::no_partition:
+                return "no OTA partition";
+            case ota_error::invalid_size:
+                return "invalid size";
+            case ota_error::flash_error:
+                return "flash error";
+            case ota_error::invalid_signature:
+                return "invalid signature";
+            case ota_error::invalid_image:
+                return "invalid image";
+            default:
+                return "UNKNOWN";
+        }
+    }
+
+    signed_image_source::signed_image_source(p2p::stream_source &image, key_pair const &keymaker_keys, pub_key gate_pk)
+        : _image{image}, _keys{keymaker_keys}, _gate_pk{gate_pk} {}
+
+    bool signed_image_source::prepare() {
+        crypto_hash_sha512_state state{};
+        crypto_hash_sha512_init(&state);
+        std::array<std::uint8_t, hash_block_size> block{};
+        for (std::uint32_t offset = 0; offset < _image.size(); offset += block.size()) {
+            const auto length = std::min<std::uint32_t>(block.size(), _image.size() - offset);
+            if (not _image.read(offset, mlab::make_range(block.data(), block.data() + length))) {
+                ESP_LOGE("KA", "Unable to read image at offset %lu.", offset);
+                return false;
+            }
+            crypto_hash_sha512_update(&state, block.data(), length);
+        }
+        ota_digest digest{};
+        crypto_hash_sha512_final(&state, digest.data());
+        _signature = signed_message(digest, _image.size());
+        if (not _keys.encrypt_for(_gate_pk, _signature) or _signature.size() != ota_signature_size) {
+            _signature.clear();
+            return false;
+        }
+        _transfer_id = std::uint32_t(digest[0]) | (std::uint32_t(digest[1]) << 8) | (std::uint32_t(digest[2]) << 16) | (std::uint32_t(digest[3]) << 24);
+        return true;
+    }
+
+    std::uint32_t signed_image_source::transfer_id() const {
+        return _transfer_id;
+    }
+
+    std::uint32_t signed_image_source::size() const {
+        return _image.size() + _signature.size();
+    }
+
+    bool signed_image_source::read(std::uint32_t offset, mlab::range<std::uint8_t *> dest) {
+        if (_signature.empty() or offset + dest.size() > size()) {
+            return false;
+        }
+        // Part of the image, then part of the signature
+        const auto image_length = offset < _image.size() ? std::min<std::uint32_t>(dest.size(), _image.size() - offset) : 0;
+        if (image_length > 0 and not _image.read(offset, mlab::make_range(dest.data(), dest.data() + image_length))) {
+            return false;
+        }
+        const auto sig_offset = offset + image_length - _image.size();
+        std::copy_n(std::begin(_signature) + sig_offset, dest.size() - image_length, dest.data() + image_length);
+        return true;
+    }
+
+    partition_source::partition_source(esp_partition_t const &part, std::uint32_t size)
+        : _part{part}, _size{std::min<std::uint32_t>(size, part.size)} {}
+
+    std::uint32_t partition_source::transfer_id() const {
+        return _part.address ^ _size;
+    }
+
+    std::uint32_t partition_source::size() const {
+        return _size;
+    }
+
+    bool partition_source::read(std::uint32_t offset, mlab::range<std::uint8_t *> dest) {
+        if (offset + dest.size() > _size) {
+            return false;
+        }
+        return esp_partition_read(&_part, offset, dest.data(), dest.size()) == ESP_OK;
+    }
+
+    ota_sink::ota_sink(gate const &g, bool activate)
+        : _g{g}, _activate{activate}, _writer{[this] { writer_loop(); }} {}
+
+    ota_sink::~ota_sink() {
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            _stop = true;
+        }
+        _cv.notify_all();
+        _writer.join();
+        abort_update();
+    }
+
+    void ota_sink::writer_loop() {
+        std::unique_lock<std::mutex> lock{_mutex};
+        while (true) {
+            _cv.wait(lock, [&] { return _stop or _queued > 0; });
+            if (_stop) {
+                return;
+            }
+            chunk const &c = _chunks[_first_queued];
+            // The buffer stays reserved until popped, write without holding the lock
+            lock.unlock();
+            const auto start = esp_timer_get_time();
+            const auto e = esp_ota_write(_handle, c.data.data(), c.data.size());
+            const auto elapsed = std::chrono::microseconds{esp_timer_get_time() - start};
+            lock.lock();
+            if (e != ESP_OK) {
+                ESP_LOGE("KA", "Unable to write OTA chunk at %lu: %s", c.offset, esp_err_to_name(e));
+                _error = ota_error::flash_error;
+            } else {
+                _stats.bytes_written += c.data.size();
+                _stats.flash_time += elapsed;
+            }
+            _first_queued = (_first_queued + 1) % _chunks.size();
+            --_queued;
+            _cv.notify_all();
+        }
+    }
+
+    void ota_sink::wait_idle(std::unique_lock<std::mutex> &lock) {
+        _cv.wait(lock, [&] { return _queued == 0; });
+    }
+
+    void ota_sink::abort_update() {
+        if (_begun) {
+            esp_ota_abort(_handle);
+            _begun = false;
+        }
+    }
+
+    void ota_sink::restart(std::uint32_t transfer_id, std::uint32_t total_size) {
+        abort_update();
+        _transfer_id = transfer_id;
+        _received = 0;
+        _image_size = 0;
+        _succeeded = false;
+        _stats = {};
+        _error = ota_error::none;
+        crypto_hash_sha512_init(&_hash);
+        _part = esp_ota_get_next_update_partition(nullptr);
+        if (_part == nullptr) {
+            ESP_LOGE("KA", "No OTA partition available.");
+            _error = ota_error::no_partition;
+        } else if (total_size <= ota_signature_size or total_size - ota_signature_size > _part->size) {
+            ESP_LOGE("KA", "Image of %lu bytes does not fit partition %s.", total_size, _part->label);
+            _error = ota_error::invalid_size;
+        } else if (const auto e = esp_ota_begin(_part, OTA_WITH_SEQUENTIAL_WRITES, &_handle); e != ESP_OK) {
+            ESP_LOGE("KA", "Unable to begin OTA: %s", esp_err_to_name(e));
+            _error = ota_error::flash_error;
+        } else {
+            _begun = true;
+            _image_size = total_size - ota_signature_size;
+            ESP_LOGI("KA", "Receiving %lu bytes into %s.", _image_size, _part->label);
+        }
+    }
+
+    std::uint32_t ota_sink::resume_offset(std::uint32_t transfer_id, std::uint32_t total_size) {
+        std::unique_lock<std::mutex> lock{_mutex};
+        wait_idle(lock);
+        if (_begun and _error == ota_error::none and transfer_id == _transfer_id and total_size == _image_size + ota_signature_size) {
+            ESP_LOGI("KA", "Resuming OTA at %lu.", _received);
+            return _received;
+        }
+        restart(transfer_id, total_size);
+        return 0;
+    }
+
+    p2p::sink_status ota_sink::write(std::uint32_t offset, mlab::range<std::uint8_t const *> data) {
+        std::unique_lock<std::mutex> lock{_mutex};
+        if (not _begun or _error != ota_error::none or offset > _received) {
+            return p2p::sink_status::abort;
+        }
+        // A resumed segment may start before what we have, skip what was already received
+        auto first = data.data() + std::min<std::size_t>(_received - offset, data.size());
+        auto const last = data.data() + data.size();
+        if (first == last) {
+            return p2p::sink_status::accepted;
+        }
+        if (_received < _image_size) {
+            const auto image_last = std::min(last, first + (_image_size - _received));
+            crypto_hash_sha512_update(&_hash, first, image_last - first);
+            _cv.wait(lock, [&] { return _queued < _chunks.size(); });
+            chunk &c = _chunks[(_first_queued + _queued) % _chunks.size()];
+            c.offset = _received;
+            c.data.clear();
+            c.data << mlab::make_range(first, image_last);
+            ++_queued;
+            _cv.notify_all();
+            _received += image_last - first;
+            first = image_last;
+        }
+        if (first != last) {
+            std::copy(first, last, std::begin(_signature) + (_received - _image_size));
+            _received += last - first;
+        }
+        return p2p::sink_status::accepted;
+    }
+
+    std::uint8_t ota_sink::credit() const {
+        std::unique_lock<std::mutex> lock{_mutex};
+        return std::uint8_t(_chunks.size() - _queued);
+    }
+
+    bool ota_sink::finish(std::uint32_t transfer_id) {
+        std::unique_lock<std::mutex> lock{_mutex};
+        wait_idle(lock);
+        if (not _begun or _error != ota_error::none or transfer_id != _transfer_id or _received != _image_size + ota_signature_size) {
+            return false;
+        }
+        ota_digest digest{};
+        crypto_hash_sha512_final(&_hash, digest.data());
+        mlab::bin_data message = mlab::bin_data::chain(_signature);
+        if (not _g.keys().decrypt_from(_g.programmer_pub_key(), message) or
+            message.size() != digest.size() + 4 or
+            0 != sodium_memcmp(message.data(), signed_message(digest, _image_size).data(), message.size())) {
+            ESP_LOGE("KA", "The OTA image is not signed by the programmer.");
+            _error = ota_error::invalid_signature;
+            abort_update();
+            return false;
+        }
+        _begun = false;
+        if (const auto e = esp_ota_end(_handle); e != ESP_OK) {
+            ESP_LOGE("KA", "Invalid OTA image: %s", esp_err_to_name(e));
+            _error = ota_error::invalid_image;
+            return false;
+        }
+        if (_activate) {
+            if (const auto e = esp_ota_set_boot_partition(_part); e != ESP_OK) {
+                ESP_LOGE("KA", "Unable to select %s for boot: %s", _part->label, esp_err_to_name(e));
+                _error = ota_error::flash_error;
+                return false;
+            }
+        }
+        ESP_LOGI("KA", "OTA image verified, %lu bytes written in %lld ms.", _stats.bytes_written,
+                 std::chrono::duration_cast<std::chrono::milliseconds>(_stats.flash_time).count());
+        _succeeded = true;
+        return true;
+    }
+
+    bool ota_sink::succeeded() const {
+        std::unique_lock<std::mutex> lock{_mutex};
+        return _succeeded;
+    }
+
+    ota_error ota_sink::error() const {
+        std::unique_lock<std::mutex> lock{_mutex};
+        return _error;
+    }
+
+    ota_stats ota_sink::stats() const {
+        std::unique_lock<std::mutex> lock{_mutex};
+        return _stats;
+    }
+
+}// namespace ka
+
+namespace ka::p2p {
+
+    result<stream_stats> send_firmware_update(secure_initiator &comm, keymaker const &km, stream_source &image, stream_options const &opts) {
+        if (not comm.did_handshake()) {
+            TRY(comm.handshake(opts.timeout));
+        }
+        signed_image_source source{image, km.keys(), pub_key{comm.peer_pub_key()}};
+        if (not source.prepare()) {
+            return pn532::channel_error::app_error;
+        }
+        return send_stream(comm, source, opts);
+    }
+
+    result<stream_stats> receive_firmware_update(gate const &g, secure_target &comm, ota_sink &sink, stream_options const &opts) {
+        if (not comm.did_handshake()) {
+            TRY(comm.handshake(opts.timeout));
+        }
+        if (not g.is_configured() or comm.peer_pub_key() != g.programmer_pub_key().raw_pk()) {
+            ESP_LOGE("KA", "Only the programmer can update the firmware.");
+            return pn532::channel_error::app_error;
+        }
+        return receive_stream(comm, sink, opts);
+    }
+
+}// namespace ka::p2p
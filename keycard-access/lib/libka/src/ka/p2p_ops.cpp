@@ -2,40 +2,125 @@
 // Created by spak on 1/20/23.
 //
 
+#include <algorithm>
+#include <ctime>
 #include <desfire/esp32/utils.hpp>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <ka/desfire_fs.hpp>
 #include <ka/gate.hpp>
+#include <ka/nvs.hpp>
 #include <ka/p2p_ops.hpp>
 #include <ka/secure_p2p.hpp>
 #include <mlab/strutils.hpp>
 #include <pn532/controller.hpp>
 #include <pn532/p2p.hpp>
+#include <sdkconfig.h>
+#include <sodium/randombytes.h>
+#include <sodium/utils.h>
 
 
-namespace ka::p2p {
-    namespace bits {
-        static constexpr std::uint8_t command_code_configure = 0xcf;
+namespace ka {
+    namespace {
+        constexpr auto km_namespc = "ka-keymaker";
+        constexpr auto km_revoked_version = "revoked-version";
+
+#ifdef CONFIG_NVS_ENCRYPTION
+        constexpr bool nvs_encrypted = true;
+#else
+        constexpr bool nvs_encrypted = false;
+#endif
+    }// namespace
+
+    bool keymaker::open_store(const char *label) {
+        const auto region = flash_region::find(label);
+        const std::uint32_t gate_sectors = region.sectors() / 6;
+        if (not _gates.open(region.subregion(0, gate_sectors)) or
+            not _members.open(region.subregion(gate_sectors, region.sectors() - gate_sectors))) {
+            return false;
+        }
+        std::vector<token_id> revoked{};
+        if (not _members.for_each([&](member_record const &rec) {
+                if (rec.revoked) {
+                    revoked.push_back(rec.who.id);
+                }
+                return true;
+            })) {
+            ESP_LOGE("KA", "Unable to read the revoked members.");
+            return false;
+        }
+        std::uint32_t version = 0;
+        nvs::nvs nvs{};
+        if (auto partition = nvs.open_partition(NVS_DEFAULT_PART_NAME, nvs_encrypted); partition != nullptr) {
+            if (auto ns = partition->open_const_namespc(km_namespc); ns != nullptr) {
+                if (const auto r = ns->get<std::uint32_t>(km_revoked_version); r) {
+                    version = *r;
+                }
+            }
+        }
+        if (version == 0 and not revoked.empty()) {
+            ESP_LOGE("KA", "Revocation list version is missing, gates may ignore it until the next revocation.");
+        }
+        _revoked.restore(std::move(revoked), version);
+        return true;
     }
 
-    namespace {
-        [[nodiscard]] pn532::nfcid_3t fabricate_nfcid(gate const &g) {
-            return {
-                    std::uint8_t(g.id() & 0xff),
-                    std::uint8_t((g.id() >> 8) & 0xff),
-                    std::uint8_t((g.id() >> 16) & 0xff),
-                    std::uint8_t((g.id() >> 24) & 0xff),
-                    0x6a, 0x7e, 0xde, 0xad, 0xbe, 0xef /* L33T garbage */
-            };
+    bool keymaker::revoke(token_id const &id) {
+        if (const auto rec = _members.find(id); not rec) {
+            return false;
+        } else if (rec->revoked and _revoked.list().contains(id)) {
+            return true;
+        }
+        if (_members.is_persistent()) {
+            nvs::nvs nvs{};
+            auto partition = nvs.open_partition(NVS_DEFAULT_PART_NAME, nvs_encrypted);
+            auto ns = partition != nullptr ? partition->open_namespc(km_namespc) : nullptr;
+            if (ns == nullptr or not ns->set<std::uint32_t>(km_revoked_version, _revoked.version() + 1) or not ns->commit()) {
+                ESP_LOGE("KA", "Unable to save the revocation list version.");
+                return false;
+            }
+        }
+        if (not _members.set_revoked(id, true)) {
+            return false;
         }
+        _revoked.add(id);
+        return true;
+    }
+
+}// namespace ka
+
+namespace ka::p2p {
+    namespace {
+        /**
+         * Number of list entries per command, so that a batch fits a single frame of the secure channel.
+         */
+        constexpr std::size_t list_delta_chunk_size = 24;
+        constexpr std::size_t list_snapshot_chunk_size = 27;
+        constexpr std::size_t rekey_grant_chunk_size = 8;
+        /**
+         * Certificates take up to 95 bytes, with the longest holder and publisher.
+         */
+        constexpr std::size_t deploy_certificate_chunk_size = 2;
 
+        [[nodiscard]] token_list *find_list(gate &g, token_list_id id) {
+            switch (id) {
+                case token_list_id::revoked:
+                    return &g.revoked_tokens();
+                default:
+                    return nullptr;
+            }
+        }
 
         class configure_gate_responder final : public pn532::scanner_responder {
             keymaker &_km;
             std::string const &_desc;
+            std::vector<gate_id> const &_affinity;
             bool _success;
 
         public:
-            configure_gate_responder(keymaker &km, std::string const &desc) : _km{km}, _desc{desc}, _success{false} {}
+            configure_gate_responder(keymaker &km, std::string const &desc, std::vector<gate_id> const &affinity)
+                : _km{km}, _desc{desc}, _affinity{affinity}, _success{false} {}
 
             [[nodiscard]] inline bool success() const { return _success; }
 
@@ -44,7 +129,7 @@ namespace ka::p2p {
             }
 
             pn532::post_interaction interact(pn532::scanner &scanner, const pn532::scanned_target &target) override {
-                if (configure_gate_in_rf(scanner.ctrl(), target.index, _km, _desc)) {
+                if (configure_gate_in_rf(scanner.ctrl(), target.index, _km, _desc, _affinity)) {
                     _success = true;
                 }
                 return pn532::post_interaction::abort;
@@ -53,57 +138,633 @@ namespace ka::p2p {
 
     }// namespace
 
-    void configure_gate_loop(pn532::controller &ctrl, gate &g) {
-        pn532::p2p::pn532_target raw_comm{ctrl};
-        while (not g.is_configured()) {
-            // Make sure you get fresh new keys
-            g.regenerate_keys();
-            while (not g.is_configured()) {
-                desfire::esp32::suppress_log suppress{ESP_LOG_ERROR, {PN532_TAG}};
-                if (raw_comm.init_as_dep_target(fabricate_nfcid(g))) {
-                    suppress.restore();
-                    if (configure_gate_in_rf(ctrl, g)) {
-                        return;
-                    }
+    pn532::nfcid_3t fabricate_nfcid(gate const &g) {
+        return {
+                std::uint8_t(g.id() & 0xff),
+                std::uint8_t((g.id() >> 8) & 0xff),
+                std::uint8_t((g.id() >> 16) & 0xff),
+                std::uint8_t((g.id() >> 24) & 0xff),
+                0x6a, 0x7e, 0xde, 0xad, 0xbe, 0xef /* L33T garbage */
+        };
+    }
+
+    pn532_dep_target::pn532_dep_target(pn532::controller &ctrl) : _raw{ctrl} {}
+
+    pn532::result<> pn532_dep_target::activate(pn532::nfcid_3t const &nfcid, ms timeout) {
+        if (const auto r = _raw.init_as_dep_target(nfcid, timeout); not r) {
+            return r.error();
+        }
+        return mlab::result_success;
+    }
+
+    pn532::result<mlab::bin_data> pn532_dep_target::receive(ms timeout) {
+        return _raw.receive(timeout);
+    }
+
+    pn532::result<> pn532_dep_target::send(mlab::bin_data const &data, ms timeout) {
+        return _raw.send(data, timeout);
+    }
+
+    namespace {
+        /**
+         * Run time of the idle tasks of all cores. Neither the listener nor the key generation is pinned, so the idle
+         * time of a single core would depend on where they happened to run.
+         */
+        [[nodiscard]] std::uint32_t idle_run_time() {
+            std::uint32_t total = 0;
+            for (UBaseType_t core = 0; core < portNUM_PROCESSORS; ++core) {
+                TaskStatus_t status{};
+                vTaskGetInfo(xTaskGetIdleTaskHandleForCPU(core), &status, pdFALSE, eRunning);
+                total += status.ulRunTimeCounter;
+            }
+            return total;
+        }
+
+        /**
+         * Measures how busy the cores are, from the run time of their idle tasks.
+         * @note The counters are 32 bits of microseconds, so spans longer than ~71 minutes wrap around.
+         */
+        class cpu_meter {
+            std::int64_t _wall_start = esp_timer_get_time();
+            std::uint32_t _idle_start = idle_run_time();
+
+        public:
+            [[nodiscard]] float utilization() const {
+                const auto wall = (esp_timer_get_time() - _wall_start) * portNUM_PROCESSORS;
+                const std::uint32_t idle = idle_run_time() - _idle_start;
+                if (wall <= 0) {
+                    return 0.f;
+                }
+                return std::clamp(1.f - float(idle) / float(wall), 0.f, 1.f);
+            }
+        };
+    }// namespace
+
+    configure_listener::configure_listener(dep_target &comm, gate &g, configure_listener_options opts)
+        : _comm{comm}, _g{g}, _opts{opts} {}
+
+    configure_listener::~configure_listener() {
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            _stop = true;
+        }
+        _cv.notify_all();
+        if (_keygen.joinable()) {
+            _keygen.join();
+        }
+    }
+
+    void configure_listener::keygen_loop() {
+        std::unique_lock<std::mutex> lock{_mutex};
+        while (true) {
+            _cv.wait(lock, [&] { return _stop or not _candidate; });
+            if (_stop) {
+                return;
+            }
+            // Key generation does not need the lock, and the listener can meanwhile wait for an activation
+            lock.unlock();
+            const auto start = esp_timer_get_time();
+            gate candidate{};
+            candidate.regenerate_keys();
+            const auto elapsed = std::chrono::microseconds{esp_timer_get_time() - start};
+            lock.lock();
+            _candidate = std::move(candidate);
+            _key_generation += std::chrono::duration_cast<std::chrono::milliseconds>(elapsed);
+            _cv.notify_all();
+        }
+    }
+
+    gate configure_listener::take_candidate() {
+        std::unique_lock<std::mutex> lock{_mutex};
+        _cv.wait(lock, [&] { return bool(_candidate); });
+        gate g = std::move(*_candidate);
+        _candidate = std::nullopt;
+        // Start generating the next one right away
+        _cv.notify_all();
+        return g;
+    }
+
+    configure_listener_stats configure_listener::run() {
+        configure_listener_stats stats{};
+        if (_g.is_configured()) {
+            return stats;
+        }
+        const cpu_meter meter{};
+        const auto start = esp_timer_get_time();
+        if (not _keygen.joinable()) {
+            _keygen = std::thread{[this] { keygen_loop(); }};
+        }
+        _g = take_candidate();
+        while (not _g.is_configured()) {
+            ++stats.wakeups;
+            desfire::esp32::suppress_log suppress{ESP_LOG_ERROR, {PN532_TAG}};
+            // The PN532 waits for an initiator in hardware, while this task sleeps on the serial line
+            if (const auto r = _comm.activate(fabricate_nfcid(_g), _opts.activation_timeout); r) {
+                suppress.restore();
+                ++stats.activations;
+                secure_target comm{_comm, _g.keys()};
+                if (not configure_gate_exchange(_g, comm)) {
+                    ++stats.failed_attempts;
+                    // The public key has been exposed, switch to the keys generated in the meantime
+                    _g = take_candidate();
                 }
+            } else if (r.error() != pn532::channel_error::timeout) {
+                ++stats.controller_errors;
+                std::this_thread::sleep_for(_opts.error_backoff);
             }
         }
+        stats.time_to_configure = std::chrono::milliseconds{(esp_timer_get_time() - start) / 1000};
+        stats.cpu_utilization = meter.utilization();
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            stats.key_generation = _key_generation;
+        }
+        return stats;
+    }
+
+    void configure_gate_loop(pn532::controller &ctrl, gate &g) {
+        if (g.is_configured()) {
+            return;
+        }
+        pn532_dep_target comm{ctrl};
+        configure_listener listener{comm, g};
+        const auto stats = listener.run();
+        ESP_LOGI("KA", "Configured in %lld ms, %lu activations over %lu wakeups, %lu failed, %lu controller errors.",
+                 stats.time_to_configure.count(), stats.activations, stats.wakeups, stats.failed_attempts, stats.controller_errors);
+        ESP_LOGI("KA", "CPU utilization while listening: %0.1f%%, %lld ms spent generating keys.",
+                 100.f * stats.cpu_utilization, stats.key_generation.count());
     }
 
-    bool configure_gate_loop(pn532::controller &ctrl, keymaker &km, std::string const &gate_description) {
-        configure_gate_responder responder{km, gate_description};
+    bool configure_gate_loop(pn532::controller &ctrl, keymaker &km, std::string const &gate_description, std::vector<gate_id> const &affinity) {
+        configure_gate_responder responder{km, gate_description, affinity};
         pn532::scanner scanner{ctrl};
         scanner.loop(responder, false);
         return responder.success();
     }
 
+    void register_gate_handlers(rpc::dispatcher &d, gate &g, secure_target const &comm) {
+        const auto is_programmer = [&]() -> bool {
+            return g.is_configured() and g.programmer_pub_key().raw_pk() == comm.peer_pub_key();
+        };
+
+        d.register_handler<cmd::configure>([&, is_programmer](cmd::configure::request const &req) -> rpc::r<gate_base_key> {
+            if (g.is_configured() and not is_programmer()) {
+                ESP_LOGE("KA", "Only the programmer can reconfigure the gate.");
+                return rpc::status::unauthorized;
+            }
+            g.configure(req.id, req.description, pub_key{comm.peer_pub_key()});
+            g.log_public_gate_info();
+            return g.app_base_key();
+        });
+
+        d.register_handler<cmd::configure_with_key>([&, is_programmer](cmd::configure_with_key::request const &req) -> rpc::r<gate_base_key> {
+            if (g.is_configured() and not is_programmer()) {
+                ESP_LOGE("KA", "Only the programmer can reconfigure the gate.");
+                return rpc::status::unauthorized;
+            }
+            if (req.base_key == gate_base_key{}) {
+                return rpc::status::malformed_request;
+            }
+            g.configure(req.id, req.description, pub_key{comm.peer_pub_key()}, req.base_key);
+            g.log_public_gate_info();
+            return g.app_base_key();
+        });
+
+        d.register_handler<cmd::join_group>([&, is_programmer](cmd::join_group::request const &req) -> rpc::r<raw_pub_key> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            const gate_group grp{req.id, key_pair{req.secret_key}, req.base_key};
+            if (not grp.keys.is_valid() or grp.app_base_key == gate_base_key{}) {
+                return rpc::status::malformed_request;
+            } else if (not g.join_group(grp)) {
+                return rpc::status::failed;
+            }
+            g.groups_store();
+            return grp.keys.raw_pk();
+        });
+
+        d.register_handler<cmd::leave_group>([&, is_programmer](cmd::leave_group::request const &req) -> rpc::r<rpc::none> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            } else if (not g.leave_group(req.id)) {
+                return rpc::status::failed;
+            }
+            g.groups_store();
+            return rpc::none{};
+        });
+
+        d.register_handler<cmd::key_status>([&, is_programmer](rpc::none const &) -> rpc::r<gate_key_status> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            return g.key_status();
+        });
+
+        d.register_handler<cmd::rotate_keys>([&, is_programmer](cmd::rotate_keys::request const &req) -> rpc::r<raw_pub_key> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            } else if (req.base_key == gate_base_key{}) {
+                return rpc::status::malformed_request;
+            } else if (not g.rotate_keys(req.version, req.base_key)) {
+                return rpc::status::failed;
+            }
+            // The gate has a new identity, which must survive a reboot
+            g.config_store();
+            return g.keys().raw_pk();
+        });
+
+        d.register_handler<cmd::grant_rekey>([&, is_programmer](cmd::grant_rekey::request const &req) -> rpc::r<gate_key_status> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            for (auto const &[id, mkey] : req.grants) {
+                if (not g.grant_rekey(id, mkey)) {
+                    ESP_LOGW("KA", "Too many rekey grants, holding %lu.", g.key_status().rekey_grants);
+                    return rpc::status::failed;
+                }
+            }
+            return g.key_status();
+        });
+
+        d.register_handler<cmd::retire_keys>([&, is_programmer](rpc::none const &) -> rpc::r<gate_key_status> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            g.retire_previous_keys();
+            g.key_rotation_store();
+            return g.key_status();
+        });
+
+        d.register_handler<cmd::queue_deploys>([&, is_programmer](cmd::queue_deploys::request const &req) -> rpc::r<deploy_queue_status> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            g.pending_deploys().advance_clock(req.now);
+            for (deploy_certificate const &cert : req.certificates) {
+                if (not g.pending_deploys().insert(cert)) {
+                    ESP_LOGW("KA", "Deploy certificate rejected, holding %d.", g.pending_deploys().size());
+                    return rpc::status::failed;
+                }
+            }
+            return g.pending_deploys().status();
+        });
+
+        d.register_handler<cmd::list_status>([&, is_programmer](cmd::list_status::request const &req) -> rpc::r<list_summary> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            } else if (token_list const *list = find_list(g, req.list); list != nullptr) {
+                return list->summary();
+            }
+            return rpc::status::malformed_request;
+        });
+
+        d.register_handler<cmd::list_delta>([&, is_programmer](cmd::list_delta::request const &req) -> rpc::r<list_summary> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            token_list *list = find_list(g, req.list);
+            if (list == nullptr) {
+                return rpc::status::malformed_request;
+            } else if (list->version() != req.base_version) {
+                ESP_LOGW("KA", "Cannot apply delta from version %lu to list at version %lu.", req.base_version, list->version());
+                return rpc::status::failed;
+            }
+            const auto adds = std::count_if(std::begin(req.changes), std::end(req.changes), [](list_change const &change) { return change.op == list_op::add; });
+            if (list->size() + std::size_t(adds) > token_list::max_size) {
+                ESP_LOGW("KA", "Refusing a delta that could grow the list past %d ids.", token_list::max_size);
+                return rpc::status::failed;
+            }
+            for (list_change const &change : req.changes) {
+                list->apply(change);
+            }
+            list->set_version(req.base_version + std::uint32_t(req.changes.size()));
+            return list->summary();
+        });
+
+        d.register_handler<cmd::set_epoch_key>([&, is_programmer](epoch_pub_key const &key) -> rpc::r<rpc::none> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            g.set_epoch_key(key);
+            g.token_lists_store();
+            return rpc::none{};
+        });
+
+        d.register_handler<cmd::read_telemetry>([&, is_programmer](rpc::none const &) -> rpc::r<telemetry_snapshot> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            return telemetry::instance().snapshot();
+        });
+
+        // Snapshots are received in chunks, and the list is replaced only once the last one has arrived
+        auto pending = std::make_shared<std::vector<token_id>>();
+        d.register_handler<cmd::list_snapshot>([&, is_programmer, pending](cmd::list_snapshot::request const &req) -> rpc::r<list_summary> {
+            if (not is_programmer()) {
+                return rpc::status::unauthorized;
+            }
+            token_list *list = find_list(g, req.list);
+            if (list == nullptr) {
+                return rpc::status::malformed_request;
+            }
+            if (req.total > token_list::max_size) {
+                ESP_LOGW("KA", "Refusing a snapshot of %lu ids, at most %d fit.", req.total, token_list::max_size);
+                pending->clear();
+                return rpc::status::malformed_request;
+            } else if (req.offset == 0) {
+                pending->clear();
+                pending->reserve(req.total);
+            } else if (req.offset != pending->size()) {
+                ESP_LOGW("KA", "Snapshot chunk at %lu, expected %d.", req.offset, pending->size());
+                return rpc::status::failed;
+            }
+            pending->insert(std::end(*pending), std::begin(req.ids), std::end(req.ids));
+            if (pending->size() > req.total) {
+                pending->clear();
+                return rpc::status::malformed_request;
+            } else if (pending->size() == req.total) {
+                list->assign(std::move(*pending), req.version);
+                pending->clear();
+            }
+            return list->summary();
+        });
+    }
+
+    pn532::result<> serve_gate_admin(gate &g, secure_target &comm, ms idle_timeout) {
+        TRY(comm.handshake(idle_timeout));
+        const auto revoked_before = g.revoked_tokens().summary();
+        const auto grants_before = g.rekey_grants_revision();
+        const auto deploys_before = g.pending_deploys().revision();
+        rpc::dispatcher d{};
+        register_gate_handlers(d, g, comm);
+        pn532::result<> r = mlab::result_success;
+        // The session ends when the initiator stops sending or leaves the field
+        while ((r = d.serve_one(comm, idle_timeout))) {
+        }
+        if (g.revoked_tokens().summary() != revoked_before) {
+            g.token_lists_store();
+        }
+        if (g.rekey_grants_revision() != grants_before) {
+            g.key_rotation_store();
+        }
+        if (g.pending_deploys().revision() != deploys_before) {
+            g.pending_deploys_store();
+        }
+        if (r.error() == pn532::channel_error::timeout) {
+            return mlab::result_success;
+        }
+        return r;
+    }
+
+    pn532::result<list_sync_stats> sync_token_list(secure_initiator &comm, token_list_id id, versioned_token_list const &list) {
+        list_sync_stats stats{};
+        const list_summary expected = list.list().summary();
+
+        // Fetches the response to a list command, on failure stops with an error
+        const auto update_stats = [&](auto const &r_call) -> pn532::result<bool> {
+            ++stats.round_trips;
+            if (not r_call) {
+                return r_call.error();
+            } else if (not *r_call) {
+                ESP_LOGW("KA", "List sync command failed: %s.", rpc::to_string(r_call->error()));
+                return false;
+            }
+            stats.after = **r_call;
+            return true;
+        };
+
+        if (const auto r = update_stats(rpc::call<cmd::list_status>(comm, {id})); not r) {
+            return r.error();
+        } else if (not *r) {
+            return pn532::channel_error::app_error;
+        }
+        stats.before = stats.after;
+        if (stats.before == expected) {
+            return stats;
+        }
+
+        if (const auto delta = list.delta_since(stats.before.version); delta) {
+            for (std::size_t offset = 0; offset < delta->size(); offset += list_delta_chunk_size) {
+                const auto first = std::next(std::begin(*delta), offset);
+                const auto last = std::next(first, std::min(list_delta_chunk_size, delta->size() - offset));
+                const cmd::list_delta::request req{id, stats.before.version + std::uint32_t(offset), {first, last}};
+                if (const auto r = update_stats(rpc::call<cmd::list_delta>(comm, req)); not r) {
+                    return r.error();
+                } else if (not *r) {
+                    break;
+                }
+                stats.changes_sent += std::uint32_t(req.changes.size());
+            }
+            if (stats.after == expected) {
+                return stats;
+            }
+            ESP_LOGW("KA", "The gate list diverged from version %lu, sending a snapshot.", stats.before.version);
+        }
+
+        stats.used_snapshot = true;
+        auto const &items = list.list().items();
+        std::size_t offset = 0;
+        do {
+            const auto first = std::next(std::begin(items), offset);
+            const auto last = std::next(first, std::min(list_snapshot_chunk_size, items.size() - offset));
+            const cmd::list_snapshot::request req{id, expected.version, std::uint32_t(offset), std::uint32_t(items.size()), {first, last}};
+            if (const auto r = update_stats(rpc::call<cmd::list_snapshot>(comm, req)); not r) {
+                return r.error();
+            } else if (not *r) {
+                return pn532::channel_error::app_error;
+            }
+            offset += req.ids.size();
+            stats.ids_sent += std::uint32_t(req.ids.size());
+        } while (offset < items.size());
+
+        if (stats.after != expected) {
+            ESP_LOGE("KA", "The gate list does not match after a full snapshot.");
+            return pn532::channel_error::app_error;
+        }
+        return stats;
+    }
+
+    pn532::result<telemetry_snapshot> pull_telemetry(secure_initiator &comm) {
+        if (const auto r = rpc::call<cmd::read_telemetry>(comm); not r) {
+            return r.error();
+        } else if (not *r) {
+            ESP_LOGE("KA", "Unable to read telemetry: %s.", rpc::to_string(r->error()));
+            return pn532::channel_error::app_error;
+        } else {
+            return **r;
+        }
+    }
+
+    pn532::result<> add_gate_to_group(secure_initiator &comm, gate_group const &grp) {
+        if (const auto r = rpc::call<cmd::join_group>(comm, {grp.id, grp.keys.raw_sk(), grp.app_base_key}); not r) {
+            return r.error();
+        } else if (not *r) {
+            ESP_LOGE("KA", "Unable to add the gate to group %lu: %s.", std::uint32_t(grp.id), rpc::to_string(r->error()));
+            return pn532::channel_error::app_error;
+        } else if (**r != grp.keys.raw_pk()) {
+            ESP_LOGE("KA", "The gate derived a different key for group %lu.", std::uint32_t(grp.id));
+            return pn532::channel_error::malformed;
+        }
+        return mlab::result_success;
+    }
+
+    pn532::result<> push_epoch_key(keymaker const &km, secure_initiator &comm) {
+        if (const auto r = rpc::call<cmd::set_epoch_key>(comm, km.derive_epoch_signer().pub_key()); not r) {
+            return r.error();
+        } else if (not *r) {
+            ESP_LOGE("KA", "Unable to set the epoch key: %s.", rpc::to_string(r->error()));
+            return pn532::channel_error::app_error;
+        }
+        return mlab::result_success;
+    }
+
+    pn532::result<> remove_gate_from_group(secure_initiator &comm, gate_id group_id) {
+        if (const auto r = rpc::call<cmd::leave_group>(comm, {group_id}); not r) {
+            return r.error();
+        } else if (not *r) {
+            ESP_LOGE("KA", "Unable to remove the gate from group %lu: %s.", std::uint32_t(group_id), rpc::to_string(r->error()));
+            return pn532::channel_error::app_error;
+        }
+        return mlab::result_success;
+    }
+
+    pn532::result<key_rotation_stats> rotate_gate_keys(keymaker &km, secure_initiator &comm, gate_id id) {
+        key_rotation_stats stats{};
+        if (const auto r = rpc::call<cmd::key_status>(comm); not r) {
+            return r.error();
+        } else if (not *r) {
+            ESP_LOGE("KA", "Unable to read the key status: %s.", rpc::to_string(r->error()));
+            return pn532::channel_error::app_error;
+        } else {
+            stats.before = stats.after = **r;
+        }
+
+        // Grant first, so that tokens are migrated as soon as the keys are rotated
+        const auto holders = km.members().holders_of(id);
+        for (std::size_t offset = 0; offset < holders.size(); offset += rekey_grant_chunk_size) {
+            cmd::grant_rekey::request req{};
+            for (std::size_t i = offset; i < std::min(offset + rekey_grant_chunk_size, holders.size()); ++i) {
+                req.grants.emplace_back(holders[i], km.keys().derive_raw_gate_app_master_key(holders[i]));
+            }
+            const auto r = rpc::call<cmd::grant_rekey>(comm, req);
+            for (auto &[token, mkey] : req.grants) {
+                sodium_memzero(mkey.data(), mkey.size());
+            }
+            if (not r) {
+                return r.error();
+            } else if (not *r) {
+                // The tokens left out are still accepted, they are only not migrated
+                ESP_LOGW("KA", "Gate %lu did not accept all the grants: %s.", std::uint32_t(id), rpc::to_string(r->error()));
+                break;
+            }
+            stats.after = **r;
+            stats.grants_sent += std::uint32_t(req.grants.size());
+        }
+
+        const auto version = stats.before.version + 1;
+        gate_base_key base_key{};
+        if (km.derives_gate_keys()) {
+            base_key = gate_base_key::derive_from(km.keys(), id, version);
+        } else {
+            randombytes_buf(base_key.data(), base_key.size());
+        }
+        if (const auto r = rpc::call<cmd::rotate_keys>(comm, {version, base_key}); not r) {
+            return r.error();
+        } else if (not *r) {
+            ESP_LOGE("KA", "Unable to rotate the keys of gate %lu: %s.", std::uint32_t(id), rpc::to_string(r->error()));
+            return pn532::channel_error::app_error;
+        } else if (not km.gates().insert({id, pub_key{**r}, base_key})) {
+            ESP_LOGE("KA", "Unable to store the new keys of gate %lu.", std::uint32_t(id));
+            return pn532::channel_error::app_error;
+        }
+        stats.after.version = version;
+        stats.after.previous_accepted = true;
+        stats.after.migrated = 0;
+        return stats;
+    }
+
+    pn532::result<gate_key_status> retire_gate_keys(secure_initiator &comm) {
+        if (const auto r = rpc::call<cmd::retire_keys>(comm); not r) {
+            return r.error();
+        } else if (not *r) {
+            ESP_LOGE("KA", "Unable to retire the previous keys: %s.", rpc::to_string(r->error()));
+            return pn532::channel_error::app_error;
+        } else {
+            return **r;
+        }
+    }
+
+    pn532::result<deploy_queue_status> issue_deploy_certificates(keymaker &km, secure_initiator &comm, gate_id id, std::vector<token_id> const &tokens, std::chrono::seconds validity) {
+        const auto now = std::uint32_t(std::time(nullptr));
+        std::vector<deploy_certificate> certs{};
+        certs.reserve(tokens.size());
+        for (token_id const &token : tokens) {
+            if (const auto rec = km.members().find(token); not rec) {
+                const auto s_id = mlab::data_to_hex_string(token);
+                ESP_LOGW("KA", "Token %s is not a member, skipping.", s_id.c_str());
+            } else if (rec->revoked) {
+                ESP_LOGW("KA", "Token of %s has been revoked, skipping.", rec->who.holder.c_str());
+            } else {
+                certs.push_back({rec->who, now + std::uint32_t(validity.count()), km.keys().derive_raw_gate_app_master_key(token)});
+            }
+        }
+        pn532::result<deploy_queue_status> retval = deploy_queue_status{};
+        std::size_t issued = 0;
+        for (std::size_t offset = 0; offset < certs.size(); offset += deploy_certificate_chunk_size) {
+            cmd::queue_deploys::request req{now, {}};
+            for (std::size_t i = offset; i < std::min(offset + deploy_certificate_chunk_size, certs.size()); ++i) {
+                req.certificates.push_back(certs[i]);
+            }
+            const auto r = rpc::call<cmd::queue_deploys>(comm, req);
+            for (auto &cert : req.certificates) {
+                sodium_memzero(cert.mkey.data(), cert.mkey.size());
+            }
+            if (not r) {
+                retval = r.error();
+                break;
+            } else if (not *r) {
+                ESP_LOGW("KA", "Gate %lu did not accept all the certificates: %s.", std::uint32_t(id), rpc::to_string(r->error()));
+                break;
+            }
+            retval = **r;
+            for (std::size_t i = offset; i < std::min(offset + deploy_certificate_chunk_size, certs.size()); ++i) {
+                if (not km.members().add_gate(certs[i].who.id, id)) {
+                    ESP_LOGW("KA", "Unable to record gate %lu for %s.", std::uint32_t(id), certs[i].who.holder.c_str());
+                }
+                ++issued;
+            }
+        }
+        for (auto &cert : certs) {
+            sodium_memzero(cert.mkey.data(), cert.mkey.size());
+        }
+        ESP_LOGI("KA", "Issued %d of %d deploy certificates for gate %lu.", issued, tokens.size(), std::uint32_t(id));
+        return retval;
+    }
+
+    void log_telemetry(gate_id id, telemetry_snapshot const &snapshot) {
+        mlab::bin_data bd{};
+        bd << snapshot;
+        const auto s_data = mlab::data_to_hex_string(bd);
+        ESP_LOGI("KA", "Telemetry of gate %lu: %s", std::uint32_t(id), s_data.c_str());
+    }
+
     pn532::result<> configure_gate_exchange(gate &g, secure_target &comm) {
         TRY(comm.handshake());
         ESP_LOGI("KA", "Comm opened, peer's public key:");
         ESP_LOG_BUFFER_HEX_LEVEL("KA", comm.peer_pub_key().data(), comm.peer_pub_key().size(), ESP_LOG_INFO);
 
-        TRY_RESULT(comm.receive(1s)) {
-            std::uint32_t new_id = g.id();
-            mlab::bin_stream s{*r};
-            if (s.pop() != bits::command_code_configure) {
-                s.set_bad();
-            }
-            s >> mlab::lsb32 >> new_id;
-            std::string new_desc = mlab::data_to_string(s.peek());
-            if (s.bad()) {
-                ESP_LOGE("KA", "Invalid configure command received.");
-                return pn532::channel_error::malformed;
-            }
-
-            // Finally:
-            g.configure(gate_id{new_id}, std::move(new_desc), pub_key{comm.peer_pub_key()});
-            g.log_public_gate_info();
-            TRY(comm.send(mlab::bin_data::chain(g.app_base_key()), 1s))
+        rpc::dispatcher d{};
+        register_gate_handlers(d, g, comm);
+        TRY(d.serve_one(comm, 1s));
+        if (not g.is_configured()) {
+            ESP_LOGE("KA", "Invalid configure command received.");
+            return pn532::channel_error::malformed;
         }
         return mlab::result_success;
     }
 
-    pn532::result<> configure_gate_exchange(keymaker &km, secure_initiator &comm, std::string const &gate_description) {
+    pn532::result<> configure_gate_exchange(keymaker &km, secure_initiator &comm, std::string const &gate_description, std::vector<gate_id> const &affinity) {
         TRY(comm.handshake());
         ESP_LOGI("KA", "Comm opened, peer's public key:");
         ESP_LOG_BUFFER_HEX_LEVEL("KA", comm.peer_pub_key().data(), comm.peer_pub_key().size(), ESP_LOG_INFO);
@@ -111,17 +772,32 @@ namespace ka::p2p {
         /**
          * @todo Return the ID if needed.
          */
-        const auto gid = km.allocate_gate_id();
-        mlab::bin_data msg{mlab::prealloc(6 + gate_description.size())};
-        msg << bits::command_code_configure << mlab::lsb32 << std::uint32_t(gid) << mlab::data_view_from_string(gate_description);
-        TRY_RESULT(comm.communicate(msg, 1s)) {
-            if (r->size() != gate_base_key::array_size) {
-                ESP_LOGE("KA", "Invalid configure response received.");
+        const auto gid = km.allocate_gate_id(affinity);
+        if (km.derives_gate_keys()) {
+            const auto base_key = km.derive_gate_base_key(gid);
+            rpc::batch b{};
+            const auto i_configure = b.add<cmd::configure_with_key>({gid, base_key, gate_description});
+            TRY_RESULT(b.send(comm, 1s)) {
+                if (const auto r_configure = r->get<cmd::configure_with_key>(i_configure); not r_configure) {
+                    ESP_LOGE("KA", "Invalid configure response received: %s.", rpc::to_string(r_configure.error()));
+                    return pn532::channel_error::malformed;
+                } else if (*r_configure != base_key) {
+                    ESP_LOGE("KA", "The gate did not accept the derived base key.");
+                    return pn532::channel_error::malformed;
+                }
+                km.register_gate({gid, pub_key{comm.peer_pub_key()}, base_key});
+            }
+            return mlab::result_success;
+        }
+        rpc::batch b{};
+        const auto i_configure = b.add<cmd::configure>({gid, gate_description});
+        TRY_RESULT(b.send(comm, 1s)) {
+            if (const auto r_configure = r->get<cmd::configure>(i_configure); not r_configure) {
+                ESP_LOGE("KA", "Invalid configure response received: %s.", rpc::to_string(r_configure.error()));
                 return pn532::channel_error::malformed;
+            } else {
+                km.register_gate({gid, pub_key{comm.peer_pub_key()}, *r_configure});
             }
-            gate_base_key base_key{};
-            std::copy(std::begin(*r), std::end(*r), std::begin(base_key));
-            km.register_gate({gid, pub_key{comm.peer_pub_key()}, base_key});
         }
 
         return mlab::result_success;
@@ -133,9 +809,203 @@ namespace ka::p2p {
         return bool(configure_gate_exchange(g, dynamic_cast<secure_target &>(comm)));
     }
 
-    bool configure_gate_in_rf(pn532::controller &ctrl, std::uint8_t logical_index, keymaker &km, std::string const &gate_description) {
+    bool configure_gate_in_rf(pn532::controller &ctrl, std::uint8_t logical_index, keymaker &km, std::string const &gate_description, std::vector<gate_id> const &affinity) {
         pn532::p2p::pn532_initiator raw_comm{ctrl, logical_index};
         secure_initiator comm{raw_comm, km.keys()};
-        return bool(configure_gate_exchange(km, comm, gate_description));
+        comm.set_link_quality(&km.link());
+        return bool(configure_gate_exchange(km, comm, gate_description, affinity));
+    }
+}// namespace ka::p2p
+
+namespace mlab {
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::configure::request &req) {
+        std::uint32_t id = 0;
+        s >> mlab::lsb32 >> id;
+        if (s.bad()) {
+            return s;
+        }
+        req.id = ka::gate_id{id};
+        req.description = data_to_string(s.read(s.remaining()));
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::configure::request const &req) {
+        const auto desc_view = data_view_from_string(req.description);
+        return bd << prealloc(bd.size() + 4 + desc_view.size())
+                  << mlab::lsb32 << std::uint32_t(req.id)
+                  << desc_view;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::configure_with_key::request &req) {
+        std::uint32_t id = 0;
+        s >> mlab::lsb32 >> id >> req.base_key;
+        if (s.bad()) {
+            return s;
+        }
+        req.id = ka::gate_id{id};
+        req.description = data_to_string(s.read(s.remaining()));
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::configure_with_key::request const &req) {
+        const auto desc_view = data_view_from_string(req.description);
+        return bd << prealloc(bd.size() + 4 + req.base_key.size() + desc_view.size())
+                  << mlab::lsb32 << std::uint32_t(req.id)
+                  << req.base_key
+                  << desc_view;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::join_group::request &req) {
+        std::uint32_t id = 0;
+        s >> mlab::lsb32 >> id >> req.secret_key >> req.base_key;
+        req.id = ka::gate_id{id};
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::join_group::request const &req) {
+        return bd << prealloc(bd.size() + 4 + req.secret_key.size() + req.base_key.size())
+                  << mlab::lsb32 << std::uint32_t(req.id)
+                  << req.secret_key
+                  << req.base_key;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::leave_group::request &req) {
+        std::uint32_t id = 0;
+        s >> mlab::lsb32 >> id;
+        req.id = ka::gate_id{id};
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::leave_group::request const &req) {
+        return bd << mlab::lsb32 << std::uint32_t(req.id);
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::rotate_keys::request &req) {
+        return s >> mlab::lsb32 >> req.version >> req.base_key;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::rotate_keys::request const &req) {
+        return bd << prealloc(bd.size() + 4 + req.base_key.size())
+                  << mlab::lsb32 << req.version
+                  << req.base_key;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::grant_rekey::request &req) {
+        if (s.remaining() < 1) {
+            s.set_bad();
+            return s;
+        }
+        const std::size_t count = s.pop();
+        if (s.remaining() < count * (ka::token_id::array_size + ka::raw_gate_app_master_key::array_size)) {
+            s.set_bad();
+            return s;
+        }
+        req.grants.resize(count);
+        for (auto &[id, mkey] : req.grants) {
+            s >> id >> mkey;
+        }
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::grant_rekey::request const &req) {
+        bd << prealloc(bd.size() + 1 + req.grants.size() * (ka::token_id::array_size + ka::raw_gate_app_master_key::array_size))
+           << std::uint8_t(req.grants.size());
+        for (auto const &[id, mkey] : req.grants) {
+            bd << id << mkey;
+        }
+        return bd;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::queue_deploys::request &req) {
+        s >> mlab::lsb32 >> req.now;
+        if (s.bad() or s.remaining() < 1) {
+            s.set_bad();
+            return s;
+        }
+        const std::size_t count = s.pop();
+        req.certificates.resize(count);
+        for (auto &cert : req.certificates) {
+            s >> cert;
+        }
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::queue_deploys::request const &req) {
+        bd << mlab::lsb32 << req.now << std::uint8_t(req.certificates.size());
+        for (auto const &cert : req.certificates) {
+            bd << cert;
+        }
+        return bd;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::list_status::request &req) {
+        if (s.remaining() < 1) {
+            s.set_bad();
+            return s;
+        }
+        req.list = static_cast<ka::token_list_id>(s.pop());
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::list_status::request const &req) {
+        return bd << std::uint8_t(req.list);
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::list_delta::request &req) {
+        if (s.remaining() < 6) {
+            s.set_bad();
+            return s;
+        }
+        req.list = static_cast<ka::token_list_id>(s.pop());
+        s >> mlab::lsb32 >> req.base_version;
+        req.changes.resize(s.pop());
+        for (ka::list_change &change : req.changes) {
+            s >> change;
+        }
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::list_delta::request const &req) {
+        bd << prealloc(bd.size() + 6 + req.changes.size() * (1 + ka::token_id::array_size))
+           << std::uint8_t(req.list)
+           << mlab::lsb32 << req.base_version
+           << std::uint8_t(req.changes.size());
+        for (ka::list_change const &change : req.changes) {
+            bd << change;
+        }
+        return bd;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::p2p::cmd::list_snapshot::request &req) {
+        if (s.remaining() < 14) {
+            s.set_bad();
+            return s;
+        }
+        req.list = static_cast<ka::token_list_id>(s.pop());
+        s >> mlab::lsb32 >> req.version >> mlab::lsb32 >> req.offset >> mlab::lsb32 >> req.total;
+        const std::size_t count = s.pop();
+        if (s.remaining() < count * ka::token_id::array_size) {
+            s.set_bad();
+            return s;
+        }
+        req.ids.resize(count);
+        for (ka::token_id &id : req.ids) {
+            s >> id;
+        }
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::p2p::cmd::list_snapshot::request const &req) {
+        bd << prealloc(bd.size() + 14 + req.ids.size() * ka::token_id::array_size)
+           << std::uint8_t(req.list)
+           << mlab::lsb32 << req.version
+           << mlab::lsb32 << req.offset
+           << mlab::lsb32 << req.total
+           << std::uint8_t(req.ids.size());
+        for (ka::token_id const &id : req.ids) {
+            bd << id;
+        }
+        return bd;
     }
-}// namespace ka::p2p
\ No newline at end of file
+}// namespace mlab
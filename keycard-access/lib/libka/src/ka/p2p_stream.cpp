@@ -0,0 +1,399 @@
+#include <esp_log.h>
+#include <ka/p2p_stream.hpp>
+#include <sodium/utils.h>
+#include <thread>
+
+namespace ka::p2p {
+
+    namespace bits {
+        static constexpr std::uint8_t frame_open = 0x01;
+        static constexpr std::uint8_t frame_chunk = 0x02;
+        static constexpr std::uint8_t frame_probe = 0x03;
+        static constexpr std::uint8_t frame_close = 0x04;
+        static constexpr std::uint8_t frame_pull = 0x05;
+        static constexpr std::uint8_t frame_ack = 0x80;
+    }// namespace bits
+
+    namespace {
+        using stream_key = std::array<std::uint8_t, crypto_secretstream_xchacha20poly1305_KEYBYTES>;
+        using clock = std::chrono::steady_clock;
+
+        /**
+         * Frame type and offset; the offset is also the additional data of the chunk.
+         */
+        constexpr std::size_t chunk_header_size = 5;
+
+        enum struct ack_status : std::uint8_t {
+            ok = 0,
+            busy = 1,
+            abort = 2,
+            complete = 3
+        };
+
+        struct ack {
+            ack_status status = ack_status::abort;
+            std::uint32_t next_offset = 0;
+            std::uint8_t credit = 0;
+        };
+
+        [[nodiscard]] mlab::bin_data make_ack(ack const &a) {
+            mlab::bin_data frame{};
+            frame << mlab::prealloc(7) << bits::frame_ack << static_cast<std::uint8_t>(a.status);
+            frame << mlab::lsb32 << a.next_offset;
+            frame << a.credit;
+            return frame;
+        }
+
+        [[nodiscard]] bool parse_ack(mlab::bin_data const &frame, ack &a) {
+            mlab::bin_stream s{frame};
+            std::uint8_t type = 0;
+            std::uint8_t status = 0;
+            s >> type >> status;
+            s >> mlab::lsb32 >> a.next_offset;
+            s >> a.credit;
+            if (s.bad() or not s.eof() or type != bits::frame_ack or status > static_cast<std::uint8_t>(ack_status::complete)) {
+                return false;
+            }
+            a.status = static_cast<ack_status>(status);
+            return true;
+        }
+
+        void make_open_frame(mlab::bin_data &frame, crypto_secretstream_xchacha20poly1305_state &st,
+                             std::uint32_t transfer_id, std::uint32_t total_size, std::uint16_t chunk_size) {
+            stream_key key{};
+            std::array<std::uint8_t, crypto_secretstream_xchacha20poly1305_HEADERBYTES> hdr{};
+            crypto_secretstream_xchacha20poly1305_keygen(key.data());
+            crypto_secretstream_xchacha20poly1305_init_push(&st, hdr.data(), key.data());
+            frame.clear();
+            frame << mlab::prealloc(11 + key.size() + hdr.size()) << bits::frame_open;
+            frame << mlab::lsb32 << transfer_id;
+            frame << mlab::lsb32 << total_size;
+            frame << mlab::lsb16 << chunk_size;
+            frame << key << hdr;
+            sodium_memzero(key.data(), key.size());
+        }
+
+        void make_chunk_frame(mlab::bin_data &frame, crypto_secretstream_xchacha20poly1305_state &st,
+                              std::uint32_t offset, mlab::bin_data const &payload, bool last) {
+            frame.clear();
+            frame << mlab::prealloc(chunk_header_size + payload.size() + crypto_secretstream_xchacha20poly1305_ABYTES)
+                  << bits::frame_chunk;
+            frame << mlab::lsb32 << offset;
+            frame.resize(chunk_header_size + payload.size() + crypto_secretstream_xchacha20poly1305_ABYTES);
+            crypto_secretstream_xchacha20poly1305_push(
+                    &st, frame.data() + chunk_header_size, nullptr, payload.data(), payload.size(),
+                    frame.data() + 1, chunk_header_size - 1,
+                    last ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : crypto_secretstream_xchacha20poly1305_TAG_MESSAGE);
+        }
+
+        enum struct sent_frame {
+            open,
+            probe,
+            chunk
+        };
+
+        template <class Exchange>
+        [[nodiscard]] result<stream_stats> run_sender(Exchange &&exchange, stream_source &source, stream_options const &opts) {
+            const auto start = clock::now();
+            const std::uint32_t total = source.size();
+            const std::uint16_t chunk_size = std::max<std::uint16_t>(1, opts.chunk_size);
+            stream_stats stats{};
+            crypto_secretstream_xchacha20poly1305_state st{};
+            mlab::bin_data frame{};
+            mlab::bin_data payload{};
+            std::uint32_t offset = 0;
+            bool need_open = true;
+            bool first_open = true;
+            unsigned busy_polls = 0;
+            ack last_ack{};
+            while (true) {
+                sent_frame sent = sent_frame::open;
+                std::uint32_t length = 0;
+                if (need_open) {
+                    make_open_frame(frame, st, source.transfer_id(), total, chunk_size);
+                    sent = sent_frame::open;
+                } else if (last_ack.status == ack_status::busy or last_ack.credit == 0) {
+                    if (++busy_polls > opts.max_busy_polls) {
+                        ESP_LOGE("KA", "Stream receiver has been busy for too long.");
+                        return pn532::channel_error::timeout;
+                    }
+                    ++stats.busy_polls;
+                    std::this_thread::sleep_for(opts.busy_backoff);
+                    frame = mlab::bin_data{bits::frame_probe};
+                    sent = sent_frame::probe;
+                } else {
+                    busy_polls = 0;
+                    length = std::min<std::uint32_t>(chunk_size, total - offset);
+                    payload.resize(length);
+                    if (not source.read(offset, mlab::make_range(payload.data(), payload.data() + length))) {
+                        ESP_LOGE("KA", "Unable to read stream source at offset %lu.", offset);
+                        return pn532::channel_error::app_error;
+                    }
+                    make_chunk_frame(frame, st, offset, payload, offset + length == total);
+                    sent = sent_frame::chunk;
+                }
+                const auto r = exchange(frame);
+                if (not r) {
+                    return r.error();
+                } else if (not parse_ack(*r, last_ack)) {
+                    ESP_LOGE("KA", "Invalid stream acknowledgement.");
+                    return pn532::channel_error::malformed;
+                } else if (last_ack.status == ack_status::abort) {
+                    ESP_LOGE("KA", "Stream aborted by the receiver at offset %lu.", last_ack.next_offset);
+                    return pn532::channel_error::app_error;
+                } else if (last_ack.status == ack_status::complete) {
+                    if (sent == sent_frame::chunk) {
+                        stats.bytes += length;
+                        ++stats.chunks;
+                    }
+                    stats.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start);
+                    return stats;
+                } else if (last_ack.next_offset > total) {
+                    ESP_LOGE("KA", "Invalid stream offset %lu.", last_ack.next_offset);
+                    return pn532::channel_error::malformed;
+                }
+                switch (sent) {
+                    case sent_frame::open:
+                        need_open = false;
+                        offset = last_ack.next_offset;
+                        if (first_open) {
+                            stats.resumed_from = offset;
+                            first_open = false;
+                        }
+                        break;
+                    case sent_frame::chunk:
+                        if (last_ack.next_offset == offset + length) {
+                            offset += length;
+                            stats.bytes += length;
+                            ++stats.chunks;
+                            break;
+                        }
+                        [[fallthrough]];
+                    case sent_frame::probe:
+                        // If the receiver did not consume what we sealed, our stream state is ahead: start a new segment
+                        need_open = last_ack.next_offset != offset or sent == sent_frame::chunk;
+                        break;
+                }
+            }
+        }
+
+        class stream_receiver {
+            stream_sink &_sink;
+            crypto_secretstream_xchacha20poly1305_state _st{};
+            bool _open = false;
+            bool _succeeded = false;
+            std::uint32_t _transfer_id = 0;
+            std::uint32_t _total = 0;
+            std::uint32_t _next = 0;
+            std::uint16_t _chunk_size = 0;
+            mlab::bin_data _payload{};
+            stream_stats _stats{};
+            clock::time_point _start{};
+
+            [[nodiscard]] mlab::bin_data reply(ack_status status) const {
+                return make_ack({status, _next, _sink.credit()});
+            }
+
+            [[nodiscard]] mlab::bin_data handle_open(mlab::bin_data const &frame) {
+                mlab::bin_stream s{frame};
+                std::uint8_t type = 0;
+                std::uint32_t transfer_id = 0;
+                std::uint32_t total = 0;
+                std::uint16_t chunk_size = 0;
+                stream_key key{};
+                std::array<std::uint8_t, crypto_secretstream_xchacha20poly1305_HEADERBYTES> hdr{};
+                s >> type;
+                s >> mlab::lsb32 >> transfer_id;
+                s >> mlab::lsb32 >> total;
+                s >> mlab::lsb16 >> chunk_size;
+                s >> key >> hdr;
+                if (s.bad() or not s.eof() or chunk_size == 0) {
+                    ESP_LOGE("KA", "Invalid stream open frame.");
+                    return reply(ack_status::abort);
+                }
+                // Reopening the same transfer resumes from what we have; a new transfer may resume from the sink
+                if (not _open or transfer_id != _transfer_id or total != _total) {
+                    _stats = {};
+                    _start = clock::now();
+                    _next = std::min(_sink.resume_offset(transfer_id, total), total);
+                    _stats.resumed_from = _next;
+                }
+                _next -= _next % chunk_size;
+                _transfer_id = transfer_id;
+                _total = total;
+                _chunk_size = chunk_size;
+                _open = true;
+                crypto_secretstream_xchacha20poly1305_init_pull(&_st, hdr.data(), key.data());
+                sodium_memzero(key.data(), key.size());
+                return reply(ack_status::ok);
+            }
+
+            [[nodiscard]] mlab::bin_data handle_chunk(mlab::bin_data const &frame, bool &done) {
+                if (not _open or frame.size() < chunk_header_size + crypto_secretstream_xchacha20poly1305_ABYTES) {
+                    ESP_LOGE("KA", "Invalid stream chunk.");
+                    done = true;
+                    return reply(ack_status::abort);
+                }
+                mlab::bin_stream s{frame};
+                std::uint8_t type = 0;
+                std::uint32_t offset = 0;
+                s >> type;
+                s >> mlab::lsb32 >> offset;
+                if (offset != _next or _sink.credit() == 0) {
+                    // Do not consume the stream, the sender will reopen at the right offset
+                    return reply(_sink.credit() == 0 ? ack_status::busy : ack_status::ok);
+                }
+                const auto ciphertext_size = frame.size() - chunk_header_size;
+                unsigned long long length = 0;
+                std::uint8_t tag = 0;
+                _payload.resize(ciphertext_size - crypto_secretstream_xchacha20poly1305_ABYTES);
+                if (0 != crypto_secretstream_xchacha20poly1305_pull(
+                                 &_st, _payload.data(), &length, &tag, frame.data() + chunk_header_size, ciphertext_size,
+                                 frame.data() + 1, chunk_header_size - 1)) {
+                    ESP_LOGE("KA", "Unable to authenticate stream chunk at offset %lu.", offset);
+                    done = true;
+                    return reply(ack_status::abort);
+                }
+                const bool last = tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+                const auto expected_length = std::min<std::uint32_t>(_chunk_size, _total - offset);
+                if (length != expected_length or last != (offset + length == _total)) {
+                    ESP_LOGE("KA", "Invalid stream chunk length %llu at offset %lu.", length, offset);
+                    done = true;
+                    return reply(ack_status::abort);
+                }
+                if (_sink.write(offset, mlab::make_range(_payload.data(), _payload.data() + length)) != sink_status::accepted) {
+                    done = true;
+                    return reply(ack_status::abort);
+                }
+                _next += length;
+                _stats.bytes += length;
+                ++_stats.chunks;
+                if (last) {
+                    done = true;
+                    _open = false;
+                    _succeeded = _sink.finish(_transfer_id);
+                    _stats.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - _start);
+                    return reply(_succeeded ? ack_status::complete : ack_status::abort);
+                }
+                return reply(ack_status::ok);
+            }
+
+        public:
+            explicit stream_receiver(stream_sink &sink) : _sink{sink} {}
+
+            [[nodiscard]] mlab::bin_data handle(mlab::bin_data const &frame, bool &done) {
+                done = false;
+                if (frame.empty()) {
+                    done = true;
+                    return reply(ack_status::abort);
+                }
+                switch (frame.front()) {
+                    case bits::frame_open:
+                        return handle_open(frame);
+                    case bits::frame_chunk:
+                        return handle_chunk(frame, done);
+                    case bits::frame_probe:
+                        return reply(_sink.credit() == 0 ? ack_status::busy : ack_status::ok);
+                    default:
+                        ESP_LOGE("KA", "Unexpected stream frame %02x.", frame.front());
+                        done = true;
+                        return reply(ack_status::abort);
+                }
+            }
+
+            [[nodiscard]] result<stream_stats> get_result() const {
+                if (_succeeded) {
+                    return _stats;
+                }
+                return pn532::channel_error::app_error;
+            }
+        };
+    }// namespace
+
+    float stream_stats::throughput_kilobytes_per_s() const {
+        return elapsed.count() > 0 ? float(bytes) / float(elapsed.count()) : 0.f;
+    }
+
+    callback_sink::callback_sink(std::function<sink_status(std::uint32_t, mlab::range<std::uint8_t const *>)> fn)
+        : _fn{std::move(fn)} {}
+
+    sink_status callback_sink::write(std::uint32_t offset, mlab::range<std::uint8_t const *> data) {
+        return _fn ? _fn(offset, data) : sink_status::abort;
+    }
+
+    data_source::data_source(mlab::bin_data const &data, std::uint32_t transfer_id)
+        : _data{data}, _transfer_id{transfer_id} {}
+
+    std::uint32_t data_source::transfer_id() const {
+        return _transfer_id;
+    }
+
+    std::uint32_t data_source::size() const {
+        return _data.size();
+    }
+
+    bool data_source::read(std::uint32_t offset, mlab::range<std::uint8_t *> dest) {
+        if (offset + dest.size() > _data.size()) {
+            return false;
+        }
+        std::copy_n(std::begin(_data) + offset, dest.size(), std::begin(dest));
+        return true;
+    }
+
+    result<stream_stats> send_stream(initiator &comm, stream_source &source, stream_options const &opts) {
+        return run_sender([&](mlab::bin_data const &frame) { return comm.communicate(frame, opts.timeout); }, source, opts);
+    }
+
+    result<stream_stats> send_stream(target &comm, stream_source &source, stream_options const &opts) {
+        // The initiator drives the exchange, and starts by pulling
+        if (const auto r = comm.receive(opts.timeout); not r) {
+            return r.error();
+        } else if (r->size() != 1 or r->front() != bits::frame_pull) {
+            ESP_LOGE("KA", "Expected a stream pull request.");
+            return pn532::channel_error::malformed;
+        }
+        const auto r = run_sender(
+                [&](mlab::bin_data const &frame) -> result<mlab::bin_data> {
+                    if (const auto r_send = comm.send(frame, opts.timeout); not r_send) {
+                        return r_send.error();
+                    }
+                    return comm.receive(opts.timeout);
+                },
+                source, opts);
+        if (r or r.error() == pn532::channel_error::app_error) {
+            // The last acknowledgement is still waiting for an answer
+            void(comm.send(mlab::bin_data{bits::frame_close}, opts.timeout));
+        }
+        return r;
+    }
+
+    result<stream_stats> receive_stream(target &comm, stream_sink &sink, stream_options const &opts) {
+        stream_receiver rx{sink};
+        bool done = false;
+        while (not done) {
+            const auto r = comm.receive(opts.timeout);
+            if (not r) {
+                return r.error();
+            }
+            if (const auto r_send = comm.send(rx.handle(*r, done), opts.timeout); not r_send) {
+                return r_send.error();
+            }
+        }
+        return rx.get_result();
+    }
+
+    result<stream_stats> receive_stream(initiator &comm, stream_sink &sink, stream_options const &opts) {
+        stream_receiver rx{sink};
+        bool done = false;
+        auto r = comm.communicate(mlab::bin_data{bits::frame_pull}, opts.timeout);
+        while (r and not done) {
+            // When done, this delivers the last acknowledgement, and the sender answers by closing
+            r = comm.communicate(rx.handle(*r, done), opts.timeout);
+        }
+        if (not r) {
+            return r.error();
+        }
+        return rx.get_result();
+    }
+
+}// namespace ka::p2p
@@ -0,0 +1,747 @@
+#include <algorithm>
+#include <cstring>
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <ka/paged_table.hpp>
+
+namespace ka {
+
+    namespace {
+        constexpr std::uint32_t header_magic = 0x4254414b;// 'KATB'
+        /**
+         * Magic, CRC, generation, log epoch, entry size, key size, page count.
+         */
+        constexpr std::uint32_t header_fixed_size = 4 + 4 + 4 + 4 + 2 + 2 + 2;
+        /**
+         * Log epoch (low 16 bits), kind and CRC8 of each log slot.
+         */
+        constexpr std::uint32_t log_slot_header_size = 4;
+
+        constexpr std::uint8_t kind_live = 0x5a;
+        constexpr std::uint8_t kind_tombstone = 0xa5;
+
+        [[nodiscard]] std::uint8_t slot_crc(std::uint8_t kind, mlab::range<std::uint8_t const *> entry) {
+            return esp_rom_crc8_le(esp_rom_crc8_le(0, &kind, 1), entry.data(), entry.size());
+        }
+    }// namespace
+
+    flash_region flash_region::find(const char *label) {
+        esp_partition_t const *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+        if (part == nullptr) {
+            ESP_LOGE("KA", "Partition %s not found.", label);
+            return {};
+        }
+        flash_region r{};
+        r.partition = part;
+        r.size = part->size - part->size % sector_size;
+        return r;
+    }
+
+    bool flash_region::empty() const {
+        return partition == nullptr or size == 0;
+    }
+
+    std::uint32_t flash_region::sectors() const {
+        return size / sector_size;
+    }
+
+    flash_region flash_region::subregion(std::uint32_t first_sector, std::uint32_t num_sectors) const {
+        if (first_sector >= sectors()) {
+            return {};
+        }
+        flash_region r{};
+        r.partition = partition;
+        r.offset = offset + first_sector * sector_size;
+        r.size = std::min(num_sectors, sectors() - first_sector) * sector_size;
+        return r;
+    }
+
+    bool flash_region::read(std::uint32_t addr, mlab::range<std::uint8_t *> dest) const {
+        if (empty() or addr + dest.size() > size) {
+            return false;
+        }
+        return esp_partition_read(partition, offset + addr, dest.data(), dest.size()) == ESP_OK;
+    }
+
+    bool flash_region::write(std::uint32_t addr, mlab::range<std::uint8_t const *> src) const {
+        if (empty() or addr + src.size() > size) {
+            return false;
+        }
+        if (const auto e = esp_partition_write(partition, offset + addr, src.data(), src.size()); e != ESP_OK) {
+            ESP_LOGE("KA", "Flash write at %lu failed: %s", offset + addr, esp_err_to_name(e));
+            return false;
+        }
+        return true;
+    }
+
+    bool flash_region::erase_sector(std::uint32_t sector) const {
+        if (empty() or sector >= sectors()) {
+            return false;
+        }
+        if (const auto e = esp_partition_erase_range(partition, offset + sector * sector_size, sector_size); e != ESP_OK) {
+            ESP_LOGE("KA", "Flash erase at %lu failed: %s", offset + sector * sector_size, esp_err_to_name(e));
+            return false;
+        }
+        return true;
+    }
+
+    page_cache::page_cache(std::size_t capacity) : _blocks(std::max<std::size_t>(capacity, 1)) {}
+
+    page_cache::block const *page_cache::fetch(esp_partition_t const *partition, std::uint32_t addr) {
+        ++_clock;
+        auto it = std::find_if(std::begin(_blocks), std::end(_blocks), [&](block const &b) {
+            return b.partition == partition and b.addr == addr;
+        });
+        if (it != std::end(_blocks)) {
+            ++_stats.hits;
+            it->last_use = _clock;
+            return &*it;
+        }
+        ++_stats.misses;
+        it = std::min_element(std::begin(_blocks), std::end(_blocks), [](block const &l, block const &r) {
+            return l.last_use < r.last_use;
+        });
+        if (esp_partition_read(partition, addr, it->data.data(), it->data.size()) != ESP_OK) {
+            it->partition = nullptr;
+            return nullptr;
+        }
+        it->partition = partition;
+        it->addr = addr;
+        it->last_use = _clock;
+        return &*it;
+    }
+
+    bool page_cache::read(flash_region const &region, std::uint32_t addr, mlab::range<std::uint8_t *> dest) {
+        if (region.empty() or addr + dest.size() > region.size) {
+            return false;
+        }
+        std::uint32_t abs_addr = region.offset + addr;
+        for (auto *out = dest.data(); out != dest.data() + dest.size();) {
+            const std::uint32_t block_addr = abs_addr - abs_addr % block_size;
+            block const *b = fetch(region.partition, block_addr);
+            if (b == nullptr) {
+                return false;
+            }
+            const auto length = std::min<std::size_t>(block_size - (abs_addr - block_addr), dest.data() + dest.size() - out);
+            std::copy_n(std::begin(b->data) + (abs_addr - block_addr), length, out);
+            out += length;
+            abs_addr += length;
+        }
+        return true;
+    }
+
+    void page_cache::invalidate() {
+        for (auto &b : _blocks) {
+            b.partition = nullptr;
+        }
+    }
+
+    page_cache_stats const &page_cache::stats() const {
+        return _stats;
+    }
+
+    paged_table::paged_table(std::uint16_t entry_size, std::uint16_t key_size, page_cache &cache)
+        : _entry_size{entry_size}, _key_size{key_size}, _cache{cache} {}
+
+    bool paged_table::is_persistent() const {
+        return not _region.empty();
+    }
+
+    std::uint16_t paged_table::entry_size() const {
+        return _entry_size;
+    }
+
+    std::uint16_t paged_table::key_size() const {
+        return _key_size;
+    }
+
+    std::uint32_t paged_table::entries_per_page() const {
+        return flash_region::sector_size / _entry_size;
+    }
+
+    std::uint32_t paged_table::log_slot_size() const {
+        return log_slot_header_size + _entry_size;
+    }
+
+    std::uint32_t paged_table::log_capacity() const {
+        return log_sectors * flash_region::sector_size / log_slot_size();
+    }
+
+    std::uint32_t paged_table::max_pages() const {
+        return (flash_region::sector_size - header_fixed_size) / (4 + _key_size);
+    }
+
+    std::uint32_t paged_table::first_page_sector() const {
+        return 2 + log_sectors;
+    }
+
+    std::uint32_t paged_table::spare_sectors() const {
+        // Repacking needs room for the whole log, plus the run tail, plus the page being merged
+        return 2 + (log_capacity() + entries_per_page() - 1) / entries_per_page();
+    }
+
+    std::uint32_t paged_table::max_entries() const {
+        const std::uint32_t reserved = first_page_sector() + spare_sectors();
+        return _region.sectors() > reserved ? (_region.sectors() - reserved) * entries_per_page() : 0;
+    }
+
+    std::vector<bool> paged_table::used_sectors() const {
+        std::vector<bool> used(_region.sectors(), false);
+        std::fill_n(std::begin(used), std::min<std::size_t>(first_page_sector(), used.size()), true);
+        for (auto const &page : _pages) {
+            used[page.sector] = true;
+        }
+        return used;
+    }
+
+    int paged_table::compare_key(std::uint8_t const *lhs, std::uint8_t const *rhs) const {
+        return std::memcmp(lhs, rhs, _key_size);
+    }
+
+    std::vector<paged_table::log_item>::iterator paged_table::log_lower_bound(std::uint8_t const *key) {
+        return std::lower_bound(std::begin(_log), std::end(_log), key, [&](log_item const &item, std::uint8_t const *k) {
+            return compare_key(item.entry.data(), k) < 0;
+        });
+    }
+
+    std::size_t paged_table::page_of(std::uint8_t const *key) const {
+        if (_pages.empty()) {
+            return 0;
+        }
+        // First page whose fence is greater than key, the one before contains it
+        const auto it = std::upper_bound(std::begin(_pages), std::end(_pages), key, [&](std::uint8_t const *k, page_ref const &page) {
+            return compare_key(k, page.fence.data()) < 0;
+        });
+        return it == std::begin(_pages) ? 0 : std::distance(std::begin(_pages), it) - 1;
+    }
+
+    bool paged_table::read_entry(page_ref const &page, std::uint32_t index, mlab::range<std::uint8_t *> dest) {
+        return _cache.read(_region, page.sector * flash_region::sector_size + index * _entry_size, dest);
+    }
+
+    bool paged_table::page_lower_bound(page_ref const &page, std::uint8_t const *key, std::uint32_t &index) {
+        std::vector<std::uint8_t> probe(_key_size);
+        std::uint32_t lo = 0;
+        std::uint32_t hi = page.count;
+        while (lo < hi) {
+            const std::uint32_t mid = lo + (hi - lo) / 2;
+            if (not read_entry(page, mid, mlab::make_range(probe.data(), probe.data() + probe.size()))) {
+                return false;
+            }
+            if (compare_key(probe.data(), key) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        index = lo;
+        return true;
+    }
+
+    bool paged_table::find(mlab::range<std::uint8_t const *> key, mlab::range<std::uint8_t *> entry) {
+        if (key.size() < _key_size or entry.size() != _entry_size) {
+            return false;
+        }
+        if (const auto it = log_lower_bound(key.data()); it != std::end(_log) and compare_key(it->entry.data(), key.data()) == 0) {
+            if (it->live) {
+                std::copy(std::begin(it->entry), std::end(it->entry), entry.data());
+            }
+            return it->live;
+        }
+        if (_pages.empty()) {
+            return false;
+        }
+        page_ref const &page = _pages[page_of(key.data())];
+        std::uint32_t index = 0;
+        if (not page_lower_bound(page, key.data(), index) or index >= page.count) {
+            return false;
+        }
+        if (not read_entry(page, index, entry)) {
+            return false;
+        }
+        return compare_key(entry.data(), key.data()) == 0;
+    }
+
+    void paged_table::log_insert(bool live, mlab::range<std::uint8_t const *> entry) {
+        auto it = log_lower_bound(entry.data());
+        const bool exists = it != std::end(_log) and compare_key(it->entry.data(), entry.data()) == 0;
+        if (not live and not is_persistent()) {
+            // Nothing on flash to hide
+            if (exists) {
+                _log.erase(it);
+            }
+            return;
+        }
+        if (not exists) {
+            it = _log.insert(it, log_item{});
+        }
+        it->live = live;
+        it->entry.assign(entry.data(), entry.data() + entry.size());
+    }
+
+    bool paged_table::append(bool live, mlab::range<std::uint8_t const *> entry) {
+        if (not is_persistent()) {
+            log_insert(live, entry);
+            return true;
+        }
+        if (live) {
+            // Refuse inserts before compaction could run out of space, so that erasing is always possible
+            std::uint32_t entries = _log.size();
+            for (auto const &page : _pages) {
+                entries += page.count;
+            }
+            if (entries >= max_entries()) {
+                ESP_LOGE("KA", "Table full: %lu entries.", entries);
+                return false;
+            }
+        }
+        if (_log_used >= log_capacity() and not compact()) {
+            return false;
+        }
+        const std::uint8_t kind = live ? kind_live : kind_tombstone;
+        mlab::bin_data slot{mlab::prealloc(log_slot_size())};
+        slot << mlab::lsb16 << std::uint16_t(_log_epoch & 0xffff) << kind << slot_crc(kind, entry) << entry;
+        const std::uint32_t addr = 2 * flash_region::sector_size + _log_used * log_slot_size();
+        if (not _region.write(addr, mlab::make_range<std::uint8_t const *>(slot.data(), slot.data() + slot.size()))) {
+            return false;
+        }
+        ++_log_used;
+        log_insert(live, entry);
+        return true;
+    }
+
+    bool paged_table::put(mlab::range<std::uint8_t const *> entry) {
+        if (entry.size() != _entry_size) {
+            return false;
+        }
+        return append(true, entry);
+    }
+
+    bool paged_table::erase(mlab::range<std::uint8_t const *> key) {
+        if (key.size() < _key_size) {
+            return false;
+        }
+        std::vector<std::uint8_t> entry(_entry_size, 0);
+        if (not find(key, mlab::make_range(entry.data(), entry.data() + entry.size()))) {
+            // Nothing to erase
+            return true;
+        }
+        std::fill(std::begin(entry) + _key_size, std::end(entry), 0);
+        return append(false, mlab::make_range<std::uint8_t const *>(entry.data(), entry.data() + entry.size()));
+    }
+
+    bool paged_table::scan(mlab::range<std::uint8_t const *> from, std::function<bool(mlab::range<std::uint8_t const *>)> const &fn) {
+        if (from.size() < _key_size) {
+            return false;
+        }
+        auto log_it = log_lower_bound(from.data());
+        std::size_t page = page_of(from.data());
+        std::uint32_t index = 0;
+        if (page < _pages.size() and not page_lower_bound(_pages[page], from.data(), index)) {
+            return false;
+        }
+        std::vector<std::uint8_t> buffer(_entry_size);
+        const auto view = mlab::make_range(buffer.data(), buffer.data() + buffer.size());
+        const auto const_view = mlab::make_range<std::uint8_t const *>(buffer.data(), buffer.data() + buffer.size());
+        while (true) {
+            while (page < _pages.size() and index >= _pages[page].count) {
+                ++page;
+                index = 0;
+            }
+            const bool has_page = page < _pages.size();
+            const bool has_log = log_it != std::end(_log);
+            if (not has_page and not has_log) {
+                return true;
+            }
+            if (has_page and not read_entry(_pages[page], index, view)) {
+                return false;
+            }
+            int cmp = has_page ? -1 : 1;
+            if (has_page and has_log) {
+                cmp = compare_key(buffer.data(), log_it->entry.data());
+            }
+            bool keep_going = true;
+            if (cmp < 0) {
+                keep_going = fn(const_view);
+                ++index;
+            } else {
+                if (log_it->live) {
+                    keep_going = fn(mlab::make_range<std::uint8_t const *>(log_it->entry.data(), log_it->entry.data() + log_it->entry.size()));
+                }
+                if (cmp == 0) {
+                    // The log overrides the page
+                    ++index;
+                }
+                ++log_it;
+            }
+            if (not keep_going) {
+                return true;
+            }
+        }
+    }
+
+    bool paged_table::last(mlab::range<std::uint8_t *> entry) {
+        if (entry.size() != _entry_size) {
+            return false;
+        }
+        bool found = false;
+        for (auto it = _log.rbegin(); it != _log.rend(); ++it) {
+            if (it->live) {
+                std::copy(std::begin(it->entry), std::end(it->entry), entry.data());
+                found = true;
+                break;
+            }
+        }
+        // Largest entry in the pages that the log does not erase
+        std::vector<std::uint8_t> buffer(_entry_size);
+        const auto view = mlab::make_range(buffer.data(), buffer.data() + buffer.size());
+        for (std::size_t p = _pages.size(); p-- > 0;) {
+            for (std::uint32_t i = _pages[p].count; i-- > 0;) {
+                if (not read_entry(_pages[p], i, view)) {
+                    return found;
+                }
+                if (const auto it = log_lower_bound(buffer.data()); it != std::end(_log) and not it->live and compare_key(it->entry.data(), buffer.data()) == 0) {
+                    continue;
+                }
+                if (not found or compare_key(buffer.data(), entry.data()) > 0) {
+                    std::copy(std::begin(buffer), std::end(buffer), entry.data());
+                }
+                return true;
+            }
+        }
+        return found;
+    }
+
+    bool paged_table::load_header(std::uint32_t sector) {
+        mlab::bin_data data{};
+        data.resize(flash_region::sector_size);
+        if (not _region.read(sector * flash_region::sector_size, mlab::make_range(data.data(), data.data() + data.size()))) {
+            return false;
+        }
+        mlab::bin_stream s{data};
+        std::uint32_t magic = 0;
+        std::uint32_t crc = 0;
+        std::uint32_t generation = 0;
+        std::uint32_t log_epoch = 0;
+        std::uint16_t entry_size = 0;
+        std::uint16_t key_size = 0;
+        std::uint16_t page_count = 0;
+        s >> mlab::lsb32 >> magic >> mlab::lsb32 >> crc >> mlab::lsb32 >> generation >> mlab::lsb32 >> log_epoch;
+        s >> mlab::lsb16 >> entry_size >> mlab::lsb16 >> key_size >> mlab::lsb16 >> page_count;
+        if (s.bad() or magic != header_magic or entry_size != _entry_size or key_size != _key_size or page_count > max_pages()) {
+            return false;
+        }
+        const std::uint32_t body_size = header_fixed_size - 8 + page_count * (4 + _key_size);
+        if (crc != esp_rom_crc32_le(0, data.data() + 8, body_size)) {
+            ESP_LOGW("KA", "Corrupted table header in sector %lu.", sector);
+            return false;
+        }
+        if (generation <= _generation) {
+            return true;
+        }
+        std::vector<page_ref> pages(page_count);
+        for (auto &page : pages) {
+            s >> mlab::lsb16 >> page.sector >> mlab::lsb16 >> page.count;
+            const auto fence = s.read(_key_size);
+            page.fence.assign(std::begin(fence), std::end(fence));
+            if (page.sector < first_page_sector() or page.sector >= _region.sectors() or page.count == 0 or page.count > entries_per_page()) {
+                ESP_LOGE("KA", "Invalid page in table header.");
+                return false;
+            }
+        }
+        _generation = generation;
+        _log_epoch = log_epoch;
+        _pages = std::move(pages);
+        return true;
+    }
+
+    bool paged_table::write_header(std::uint32_t generation, std::uint32_t log_epoch, std::vector<page_ref> const &pages) {
+        if (pages.size() > max_pages()) {
+            ESP_LOGE("KA", "Table full: %d pages, at most %lu.", pages.size(), max_pages());
+            return false;
+        }
+        mlab::bin_data body{mlab::prealloc(header_fixed_size + pages.size() * (4 + _key_size))};
+        body << mlab::lsb32 << generation << mlab::lsb32 << log_epoch << mlab::lsb16 << _entry_size << mlab::lsb16 << _key_size << mlab::lsb16 << std::uint16_t(pages.size());
+        for (auto const &page : pages) {
+            body << mlab::lsb16 << page.sector << mlab::lsb16 << page.count << mlab::make_range<std::uint8_t const *>(page.fence.data(), page.fence.data() + page.fence.size());
+        }
+        mlab::bin_data header{mlab::prealloc(body.size() + 8)};
+        header << mlab::lsb32 << header_magic << mlab::lsb32 << esp_rom_crc32_le(0, body.data(), body.size()) << body;
+        // Generations alternate between the two header sectors, the current one is never overwritten
+        const std::uint32_t sector = generation % 2;
+        if (not _region.erase_sector(sector) or not _region.write(sector * flash_region::sector_size, mlab::make_range<std::uint8_t const *>(header.data(), header.data() + header.size()))) {
+            return false;
+        }
+        _generation = generation;
+        _log_epoch = log_epoch;
+        _pages = pages;
+        return true;
+    }
+
+    bool paged_table::erase_log() {
+        // Last sector first: if interrupted, the first slot still reveals a stale log
+        for (std::uint32_t i = log_sectors; i-- > 0;) {
+            if (not _region.erase_sector(2 + i)) {
+                return false;
+            }
+        }
+        _log_used = 0;
+        return true;
+    }
+
+    bool paged_table::load_log() {
+        std::vector<std::uint8_t> slot(log_slot_size());
+        const auto view = mlab::make_range(slot.data(), slot.data() + slot.size());
+        for (std::uint32_t i = 0; i < log_capacity(); ++i) {
+            if (not _region.read(2 * flash_region::sector_size + i * log_slot_size(), view)) {
+                return false;
+            }
+            if (std::all_of(std::begin(slot), std::begin(slot) + log_slot_header_size, [](std::uint8_t b) { return b == 0xff; })) {
+                _log_used = i;
+                return true;
+            }
+            const std::uint16_t log_epoch = std::uint16_t(slot[0]) | (std::uint16_t(slot[1]) << 8);
+            const std::uint8_t kind = slot[2];
+            const auto entry = mlab::make_range<std::uint8_t const *>(slot.data() + log_slot_header_size, slot.data() + slot.size());
+            if ((kind != kind_live and kind != kind_tombstone) or slot[3] != slot_crc(kind, entry)) {
+                // Torn write: keep what precedes it, and start over with an empty log
+                ESP_LOGW("KA", "Truncated table log at slot %lu.", i);
+                _log_used = i;
+                return compact();
+            }
+            if (log_epoch != (_log_epoch & 0xffff)) {
+                // A compaction completed but did not get to erase the log, which is already merged
+                _log.clear();
+                return erase_log();
+            }
+            log_insert(kind == kind_live, entry);
+        }
+        _log_used = log_capacity();
+        return true;
+    }
+
+    bool paged_table::open(flash_region region) {
+        if (_key_size == 0 or _key_size > _entry_size or _entry_size > flash_region::sector_size) {
+            ESP_LOGE("KA", "Invalid table layout.");
+            return false;
+        }
+        if (region.empty() or region.sectors() <= first_page_sector() + spare_sectors()) {
+            ESP_LOGE("KA", "Region too small for a table.");
+            return false;
+        }
+        _region = region;
+        _generation = 0;
+        _log_epoch = 0;
+        _pages.clear();
+        _log.clear();
+        _log_used = 0;
+        _cache.invalidate();
+        static_cast<void>(load_header(0));
+        static_cast<void>(load_header(1));
+        if (_generation == 0) {
+            ESP_LOGW("KA", "Formatting table at %lu.", region.offset);
+            if (not erase_log() or not write_header(1, 1, {})) {
+                _region = {};
+                return false;
+            }
+            return true;
+        }
+        if (not load_log()) {
+            _region = {};
+            _log.clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool paged_table::write_page(mlab::range<std::uint8_t const *> entries, std::vector<bool> &used, std::vector<page_ref> &out) {
+        if (entries.size() == 0) {
+            return true;
+        }
+        const auto it = std::find(std::begin(used) + first_page_sector(), std::end(used), false);
+        if (it == std::end(used)) {
+            ESP_LOGE("KA", "Table full: no free sectors.");
+            return false;
+        }
+        const auto sector = std::uint16_t(std::distance(std::begin(used), it));
+        if (not _region.erase_sector(sector) or not _region.write(sector * flash_region::sector_size, entries)) {
+            return false;
+        }
+        *it = true;
+        out.push_back(page_ref{sector, std::uint16_t(entries.size() / _entry_size), std::vector<std::uint8_t>(entries.data(), entries.data() + _key_size)});
+        return true;
+    }
+
+    bool paged_table::flush_run(std::vector<std::uint8_t> &run, bool all, std::vector<bool> &used, std::vector<page_ref> &out) {
+        const std::size_t page_bytes = entries_per_page() * _entry_size;
+        std::size_t written = 0;
+        while (run.size() - written >= page_bytes) {
+            if (not write_page(mlab::make_range<std::uint8_t const *>(run.data() + written, run.data() + written + page_bytes), used, out)) {
+                return false;
+            }
+            written += page_bytes;
+        }
+        if (all) {
+            if (not write_page(mlab::make_range<std::uint8_t const *>(run.data() + written, run.data() + run.size()), used, out)) {
+                return false;
+            }
+            written = run.size();
+        }
+        run.erase(std::begin(run), std::begin(run) + written);
+        return true;
+    }
+
+    bool paged_table::compact() {
+        if (not is_persistent()) {
+            return true;
+        }
+        if (_log.empty() and _log_used == 0) {
+            return true;
+        }
+        // write_header replaces _pages at every checkpoint
+        const std::vector<page_ref> old_pages = _pages;
+        std::vector<bool> used = used_sectors();
+        std::vector<page_ref> new_pages{};
+        new_pages.reserve(old_pages.size() + 1);
+        std::vector<std::uint8_t> page_data(flash_region::sector_size);
+        // Merged entries of consecutive pages that receive changes, not written yet
+        std::vector<std::uint8_t> run{};
+        std::size_t log_first = 0;
+
+        const auto merge_log_item = [&](std::size_t i) {
+            if (_log[i].live) {
+                run.insert(std::end(run), std::begin(_log[i].entry), std::end(_log[i].entry));
+            }
+        };
+
+        const auto free_sectors = [&]() -> std::size_t {
+            return std::count(std::begin(used), std::end(used), false);
+        };
+
+        // Runs leave a partially filled page behind them. When running out of space, repack everything that follows
+        bool repack = free_sectors() < 2 * spare_sectors();
+
+        const auto has_room = [&](std::size_t n) {
+            const std::size_t needed = (run.size() / _entry_size + n + entries_per_page() - 1) / entries_per_page();
+            return free_sectors() >= needed + (repack ? 0 : spare_sectors());
+        };
+
+        // Makes room for n more entries. If there is not enough, commits the pages merged so far together with the
+        // old pages from p onwards: the pages that have been replaced become free. The log is kept, replaying it on
+        // the merged pages is harmless.
+        const auto reserve = [&](std::size_t p, std::size_t n) -> bool {
+            if (has_room(n)) {
+                return true;
+            }
+            if (not flush_run(run, true, used, new_pages)) {
+                return false;
+            }
+            std::vector<page_ref> checkpoint = new_pages;
+            checkpoint.insert(std::end(checkpoint), std::begin(old_pages) + p, std::end(old_pages));
+            if (not write_header(_generation + 1, _log_epoch, checkpoint)) {
+                return false;
+            }
+            _cache.invalidate();
+            used = used_sectors();
+            // Take the last, partial page back into the run, otherwise every checkpoint leaves one behind
+            if (not new_pages.empty() and new_pages.back().count < entries_per_page()) {
+                const page_ref tail = new_pages.back();
+                new_pages.pop_back();
+                run.resize(tail.count * _entry_size);
+                if (not _region.read(tail.sector * flash_region::sector_size, mlab::make_range(run.data(), run.data() + run.size()))) {
+                    return false;
+                }
+            }
+            if (not has_room(n)) {
+                // No margin left for splitting pages
+                repack = true;
+            }
+            if (not has_room(n)) {
+                ESP_LOGE("KA", "Table full: no free sectors.");
+                return false;
+            }
+            return true;
+        };
+
+        for (std::size_t p = 0; p < old_pages.size(); ++p) {
+            // Log items that fall into this page
+            std::size_t log_last = log_first;
+            while (log_last < _log.size() and
+                   (p + 1 == old_pages.size() or compare_key(_log[log_last].entry.data(), old_pages[p + 1].fence.data()) < 0)) {
+                ++log_last;
+            }
+            page_ref const &page = old_pages[p];
+            if (log_last == log_first and not repack and (run.empty() or run.size() / _entry_size + page.count > entries_per_page())) {
+                // Unchanged, and it would not fit in the tail of the current run, which it closes
+                if (not flush_run(run, true, used, new_pages)) {
+                    return false;
+                }
+                new_pages.push_back(page);
+                continue;
+            }
+            const auto live_items = std::count_if(std::begin(_log) + log_first, std::begin(_log) + log_last, [](log_item const &item) {
+                return item.live;
+            });
+            if (not reserve(p, page.count + live_items)) {
+                return false;
+            }
+            if (not _region.read(page.sector * flash_region::sector_size, mlab::make_range(page_data.data(), page_data.data() + page.count * _entry_size))) {
+                return false;
+            }
+            std::uint32_t i = 0;
+            while (i < page.count or log_first < log_last) {
+                auto const *page_entry = page_data.data() + i * _entry_size;
+                int cmp = i < page.count ? -1 : 1;
+                if (i < page.count and log_first < log_last) {
+                    cmp = compare_key(page_entry, _log[log_first].entry.data());
+                }
+                if (cmp < 0) {
+                    run.insert(std::end(run), page_entry, page_entry + _entry_size);
+                    ++i;
+                } else {
+                    merge_log_item(log_first);
+                    if (cmp == 0) {
+                        ++i;
+                    }
+                    ++log_first;
+                }
+            }
+            if (not flush_run(run, false, used, new_pages)) {
+                return false;
+            }
+        }
+        if (old_pages.empty()) {
+            if (not reserve(0, _log.size())) {
+                return false;
+            }
+            for (std::size_t i = 0; i < _log.size(); ++i) {
+                merge_log_item(i);
+            }
+        }
+        if (not flush_run(run, true, used, new_pages) or not write_header(_generation + 1, _log_epoch + 1, new_pages)) {
+            return false;
+        }
+        _cache.invalidate();
+        _log.clear();
+        ++_compactions;
+        return erase_log();
+    }
+
+    paged_table_stats paged_table::stats() const {
+        paged_table_stats s{};
+        s.pages = _pages.size();
+        for (auto const &page : _pages) {
+            s.page_entries += page.count;
+        }
+        s.log_entries = _log.size();
+        if (is_persistent()) {
+            s.log_capacity = log_capacity();
+            const auto used = used_sectors();
+            s.free_sectors = std::count(std::begin(used), std::end(used), false);
+        }
+        s.compactions = _compactions;
+        s.generation = _generation;
+        return s;
+    }
+
+}// namespace ka
@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <ka/production_line.hpp>
+#include <mlab/strutils.hpp>
+
+namespace ka {
+
+    namespace {
+        [[nodiscard]] std::chrono::milliseconds elapsed_since(std::int64_t start_us) {
+            return std::chrono::milliseconds{(esp_timer_get_time() - start_us) / 1000};
+        }
+
+        [[nodiscard]] std::chrono::milliseconds lap(std::int64_t &start_us) {
+            const auto now = esp_timer_get_time();
+            const std::chrono::milliseconds retval{(now - start_us) / 1000};
+            start_us = now;
+            return retval;
+        }
+    }// namespace
+
+    float production_line_stats::cards_per_minute() const {
+        if (elapsed.count() <= 0) {
+            return 0.f;
+        }
+        return float(issued) * 60000.f / float(elapsed.count());
+    }
+
+    production_line::production_line(keymaker &km) : _km{km}, _pipeline{km}, _plan{km} {}
+
+    bool production_line::enqueue(issuance_job job) {
+        if (job.holder.size() > member_roster::max_holder_size or job.publisher.size() > member_roster::max_publisher_size) {
+            ESP_LOGE("LINE", "Holder or publisher of %s too long.", job.holder.c_str());
+            return false;
+        }
+        std::unique_lock<std::mutex> lock{_mutex};
+        if (_batch_complete) {
+            // A new batch
+            _stats = {};
+            _batch_start = 0;
+            _batch_complete = false;
+        }
+        _jobs.push_back(std::move(job));
+        return true;
+    }
+
+    bool production_line::open_plan(flash_region region) {
+        if (not _plan.open(region)) {
+            return false;
+        }
+        std::uint32_t left = 0;
+        const bool success = _plan.for_each([&](token_id const &id) -> bool {
+            if (not _km.members().find(id)) {
+                ++left;
+            }
+            return true;
+        });
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            _planned_left = left;
+        }
+        ESP_LOGI("LINE", "%lu planned cards left to issue.", left);
+        return success;
+    }
+
+    std::size_t production_line::pending() const {
+        std::unique_lock<std::mutex> lock{_mutex};
+        return _jobs.size() + _planned_left;
+    }
+
+    production_line_stats production_line::stats() const {
+        std::unique_lock<std::mutex> lock{_mutex};
+        auto s = _stats;
+        s.pipeline = _pipeline.stats();
+        return s;
+    }
+
+    void production_line::log_summary() const {
+        const auto s = stats();
+        ESP_LOGI("LINE", "Batch: %lu issued, %lu failed, %lu duplicates in %lld s, %.1f cards/min.",
+                 s.issued, s.failed, s.duplicates, s.elapsed.count() / 1000, s.cards_per_minute());
+        if (s.issued > 0) {
+            ESP_LOGI("LINE", "Average per card: identify %lld ms, deploy %lld ms, enroll %lld ms, record %lld ms, total %lld ms; slowest %lld ms.",
+                     s.issued_time.identify.count() / s.issued, s.issued_time.deploy.count() / s.issued,
+                     s.issued_time.enroll.count() / s.issued, s.issued_time.record.count() / s.issued,
+                     s.issued_time.total.count() / s.issued, s.slowest.count());
+        }
+        ESP_LOGI("LINE", "Crypto on the second core: %lld ms, RF waited for it %lld ms.",
+                 s.pipeline.crypto.count(), s.pipeline.stalled.count());
+    }
+
+    void production_line::on_issued(identity const &who, issuance_timings const &timings) {
+        const auto s_id = mlab::data_to_hex_string(who.id);
+        ESP_LOGI("LINE", "Issued %s to %s in %lld ms (identify %lld, deploy %lld, enroll %lld, record %lld); %.1f cards/min, %d left.",
+                 s_id.c_str(), who.holder.c_str(), timings.total.count(), timings.identify.count(), timings.deploy.count(),
+                 timings.enroll.count(), timings.record.count(), stats().cards_per_minute(), pending());
+    }
+
+    void production_line::on_failed(desfire::error e) {
+        ESP_LOGE("LINE", "Issuing failed: %s. Present a card again.", member_token::describe(e));
+    }
+
+    void production_line::on_duplicate(token_id const &id) {
+        const auto s_id = mlab::data_to_hex_string(id);
+        ESP_LOGW("LINE", "Card %s was already issued, remove it.", s_id.c_str());
+    }
+
+    void production_line::on_batch_complete(pn532::scanner &scanner) {
+        log_summary();
+        scanner.stop();
+    }
+
+    void production_line::on_activation(pn532::scanner &, pn532::scanned_target const &) {
+        std::unique_lock<std::mutex> lock{_mutex};
+        _activated_at = esp_timer_get_time();
+        if (_batch_start == 0 and (not _jobs.empty() or _planned_left > 0)) {
+            _batch_start = _activated_at;
+        }
+    }
+
+    void production_line::on_leaving_rf(pn532::scanner &scanner, pn532::scanned_target const &) {
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            if (_batch_complete or not _jobs.empty() or _planned_left > 0 or _stats.issued == 0) {
+                return;
+            }
+            _batch_complete = true;
+        }
+        on_batch_complete(scanner);
+    }
+
+    revocation_record const &production_line::revocations() {
+        if (not _revocations or _revocations->header.epoch != _km.revoked_tokens().version()) {
+            _revocations = _km.sign_revocations();
+        }
+        return *_revocations;
+    }
+
+    r<> production_line::issue(member_token &token, identity const &who, std::vector<gate_id> const &gates, issuance_timings &timings) {
+        std::int64_t t = esp_timer_get_time();
+        const auto r_token = _pipeline.take_token();
+        if (not r_token) {
+            return r_token.error();
+        }
+        if (const auto r = token.deploy(*r_token); not r) {
+            return r.error();
+        }
+        timings.deploy = lap(t);
+        for (std::size_t i = 0; i < gates.size(); ++i) {
+            const auto r_gate = _pipeline.take_gate();
+            if (not r_gate) {
+                return r_gate.error();
+            }
+            if (const auto r = token.enroll_gate(*r_token, *r_gate); not r) {
+                return r.error();
+            }
+        }
+        if (const auto r = token.write_revocation_record(r_token->mkey, revocations()); not r) {
+            return r.error();
+        }
+        timings.enroll = lap(t);
+        bool recorded = _km.members().insert(who);
+        for (const auto gid : gates) {
+            recorded = recorded and _km.members().add_gate(who.id, gid);
+        }
+        if (not recorded) {
+            // The card works, but will not be recognized as a duplicate
+            ESP_LOGE("LINE", "Card of %s issued but not recorded.", who.holder.c_str());
+        }
+        timings.record = lap(t);
+        return mlab::result_success;
+    }
+
+    pn532::post_interaction production_line::interact_with_token(member_token &token) {
+        std::int64_t t = esp_timer_get_time();
+        issuance_timings timings{};
+        const auto r_id = token.get_id();
+        if (not r_id) {
+            on_failed(r_id.error());
+            return pn532::post_interaction::reject;
+        }
+        if (_km.members().find(*r_id)) {
+            {
+                std::unique_lock<std::mutex> lock{_mutex};
+                ++_stats.duplicates;
+            }
+            on_duplicate(*r_id);
+            return pn532::post_interaction::reject;
+        }
+        std::optional<issuance_job> job = std::nullopt;
+        identity who{};
+        std::vector<gate_id> gates{};
+        if (auto card = _plan.find(*r_id); card) {
+            // Files were encrypted on the host, and find derived the keys
+            who = std::move(card->who);
+            for (auto const &pg : card->gates) {
+                gates.push_back(pg.id);
+            }
+            _pipeline.start(std::move(card->token), std::move(card->gates));
+        } else {
+            {
+                std::unique_lock<std::mutex> lock{_mutex};
+                if (_jobs.empty()) {
+                    ESP_LOGW("LINE", "No pending jobs.");
+                    return pn532::post_interaction::reject;
+                }
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+            who = identity{*r_id, job->holder, job->publisher};
+            for (auto const &g : job->gates) {
+                gates.push_back(g.id);
+            }
+            // The second core starts deriving and encrypting while this one talks to the card
+            _pipeline.start(who, job->gates);
+        }
+        timings.identify = lap(t);
+        if (const auto r = issue(token, who, gates, timings); not r) {
+            _pipeline.cancel();
+            {
+                std::unique_lock<std::mutex> lock{_mutex};
+                if (job) {
+                    _jobs.push_front(std::move(*job));
+                }
+                ++_stats.failed;
+            }
+            on_failed(r.error());
+            return pn532::post_interaction::reject;
+        }
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            if (_batch_start == 0) {
+                // The job was queued while the card was already in the field
+                _batch_start = _activated_at;
+            }
+            timings.total = elapsed_since(_activated_at);
+            if (not job and _planned_left > 0) {
+                --_planned_left;
+            }
+            ++_stats.issued;
+            _stats.issued_time.identify += timings.identify;
+            _stats.issued_time.deploy += timings.deploy;
+            _stats.issued_time.enroll += timings.enroll;
+            _stats.issued_time.record += timings.record;
+            _stats.issued_time.total += timings.total;
+            _stats.slowest = std::max(_stats.slowest, timings.total);
+            _stats.elapsed = elapsed_since(_batch_start);
+        }
+        on_issued(who, timings);
+        return pn532::post_interaction::reject;
+    }
+
+}// namespace ka
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <ka/p2p_ops.hpp>
+#include <ka/provisioning_plan.hpp>
+#include <mlab/strutils.hpp>
+#include <sodium/crypto_box.h>
+
+namespace ka {
+
+    namespace {
+        constexpr std::array<std::uint8_t, 4> plan_magic = {'K', 'A', 'P', 'L'};
+
+        [[nodiscard]] mlab::range<std::uint8_t *> view(mlab::bin_data &data) {
+            return mlab::make_range(data.data(), data.data() + data.size());
+        }
+
+        /**
+         * @brief Reads @p size bytes at @p addr, or nothing if they are out of the region.
+         */
+        [[nodiscard]] std::optional<mlab::bin_data> read_chunk(flash_region const &region, std::uint32_t addr, std::size_t size) {
+            mlab::bin_data data{};
+            data.resize(size);
+            if (not region.read(addr, view(data))) {
+                return std::nullopt;
+            }
+            return data;
+        }
+    }// namespace
+
+    provisioning_plan::provisioning_plan(keymaker &km) : _km{km} {}
+
+    bool provisioning_plan::is_open() const {
+        return not _region.empty();
+    }
+
+    std::uint32_t provisioning_plan::size() const {
+        return _cards;
+    }
+
+    std::uint32_t provisioning_plan::index_offset() const {
+        return header_size + _gates.size() * gate_entry_size;
+    }
+
+    bool provisioning_plan::open(flash_region region) {
+        _region = {};
+        _cards = 0;
+        _gates.clear();
+        const auto header = read_chunk(region, 0, header_size);
+        if (not header) {
+            ESP_LOGE("KA", "Unable to read the provisioning plan.");
+            return false;
+        }
+        mlab::bin_stream s{*header};
+        std::array<std::uint8_t, 4> magic{};
+        std::uint8_t plan_version = 0;
+        raw_pub_key km_pk{};
+        std::uint16_t gate_count = 0;
+        std::uint32_t card_count = 0;
+        std::uint32_t body_size = 0;
+        std::uint32_t crc = 0;
+        s >> magic >> plan_version >> km_pk >> _nonce_prefix;
+        s >> mlab::lsb32 >> card_count >> mlab::lsb16 >> gate_count >> mlab::lsb32 >> body_size >> mlab::lsb32 >> crc;
+        if (s.bad() or magic != plan_magic) {
+            ESP_LOGW("KA", "No provisioning plan.");
+            return false;
+        }
+        if (plan_version != version or body_size > region.size - header_size or
+            body_size < gate_count * gate_entry_size + card_count * index_entry_size) {
+            ESP_LOGE("KA", "Unsupported or truncated provisioning plan.");
+            return false;
+        }
+        if (km_pk != _km.keys().raw_pk()) {
+            ESP_LOGE("KA", "The provisioning plan was compiled for another keymaker.");
+            return false;
+        }
+        // Check the whole body before trusting any offset in it
+        std::uint32_t body_crc = 0;
+        for (std::uint32_t addr = 0; addr < body_size; addr += page_cache::block_size) {
+            const auto chunk = read_chunk(region, header_size + addr, std::min<std::uint32_t>(page_cache::block_size, body_size - addr));
+            if (not chunk) {
+                return false;
+            }
+            body_crc = esp_rom_crc32_le(body_crc, chunk->data(), chunk->size());
+        }
+        if (body_crc != crc) {
+            ESP_LOGE("KA", "Corrupted provisioning plan.");
+            return false;
+        }
+        const auto table = read_chunk(region, header_size, gate_count * gate_entry_size);
+        if (not table) {
+            return false;
+        }
+        mlab::bin_stream ts{*table};
+        std::vector<gate_config> gates{};
+        gates.reserve(gate_count);
+        for (std::uint16_t i = 0; i < gate_count; ++i) {
+            std::uint32_t id = 0;
+            raw_pub_key pk{};
+            ts >> mlab::lsb32 >> id >> pk;
+            const auto cfg = _km.gates().find(gate_id{id});
+            if (not cfg) {
+                ESP_LOGE("KA", "The provisioning plan targets gate %lu, which is not registered.", id);
+                return false;
+            }
+            if (cfg->gate_pub_key.raw_pk() != pk) {
+                ESP_LOGE("KA", "The provisioning plan was compiled for gate %lu with a different key.", id);
+                return false;
+            }
+            gates.push_back(*cfg);
+        }
+        _region = region;
+        _cards = card_count;
+        _gates = std::move(gates);
+        ESP_LOGI("KA", "Provisioning plan with %lu cards and %d gates.", _cards, _gates.size());
+        return true;
+    }
+
+    bool provisioning_plan::read_index(std::uint32_t pos, token_id &id, std::uint32_t &record) const {
+        const auto entry = read_chunk(_region, index_offset() + pos * index_entry_size, index_entry_size);
+        if (not entry) {
+            return false;
+        }
+        mlab::bin_stream s{*entry};
+        s >> id >> mlab::lsb32 >> record;
+        return not s.bad();
+    }
+
+    bool provisioning_plan::for_each(std::function<bool(token_id const &)> const &fn) const {
+        token_id id{};
+        std::uint32_t record = 0;
+        for (std::uint32_t pos = 0; pos < _cards; ++pos) {
+            if (not read_index(pos, id, record)) {
+                return false;
+            }
+            if (not fn(id)) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    std::optional<planned_card> provisioning_plan::find(token_id const &id) const {
+        if (not is_open()) {
+            return std::nullopt;
+        }
+        // Binary search in the index
+        std::uint32_t lo = 0;
+        std::uint32_t hi = _cards;
+        std::uint32_t record = 0;
+        token_id probe{};
+        while (lo < hi) {
+            const std::uint32_t mid = lo + (hi - lo) / 2;
+            if (not read_index(mid, probe, record)) {
+                return std::nullopt;
+            }
+            if (probe < id) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo >= _cards or not read_index(lo, probe, record) or probe != id) {
+            return std::nullopt;
+        }
+        const std::uint32_t card_pos = lo;
+        const std::uint32_t addr = header_size + record;
+        // The record is streamed in two parts, its size depends on the identity and number of gates
+        const auto r_size = read_chunk(_region, addr, 2);
+        if (not r_size) {
+            return std::nullopt;
+        }
+        const std::size_t n = std::size_t((*r_size)[0]) | (std::size_t((*r_size)[1]) << 8);
+        const std::size_t file_size = n + crypto_box_MACBYTES;
+        const auto head = read_chunk(_region, addr + 2, n + file_size + 1);
+        if (not head) {
+            return std::nullopt;
+        }
+        const std::size_t gate_count = (*head)[head->size() - 1];
+        const auto tail = read_chunk(_region, addr + 2 + head->size(), gate_count * (2 + file_size));
+        if (not tail) {
+            return std::nullopt;
+        }
+        const auto s_id = mlab::data_to_hex_string(id);
+        mlab::bin_stream s{*head};
+        planned_card card{};
+        s >> card.who;
+        if (s.bad() or card.who.id != id) {
+            ESP_LOGE("KA", "Malformed plan record for %s.", s_id.c_str());
+            return std::nullopt;
+        }
+        const auto nonce = [&](std::uint32_t slot) -> mlab::bin_data {
+            mlab::bin_data data{mlab::prealloc(crypto_box_NONCEBYTES)};
+            data << _nonce_prefix << mlab::lsb32 << card_pos << mlab::lsb32 << slot;
+            return data;
+        };
+        card.token = prepared_token{id, _km.keys().derive_token_root_key(id), _km.keys().derive_gate_app_master_key(id), {}};
+        card.token.master_file << mlab::prealloc(file_size + crypto_box_NONCEBYTES) << s.read(file_size) << nonce(0);
+        if (s.bad()) {
+            ESP_LOGE("KA", "Malformed plan record for %s.", s_id.c_str());
+            return std::nullopt;
+        }
+        mlab::bin_stream ts{*tail};
+        for (std::uint32_t slot = 1; slot <= gate_count; ++slot) {
+            std::uint16_t gate_idx = 0;
+            ts >> mlab::lsb16 >> gate_idx;
+            if (ts.bad() or gate_idx >= _gates.size()) {
+                ESP_LOGE("KA", "Malformed plan record for %s.", s_id.c_str());
+                return std::nullopt;
+            }
+            auto const &g = _gates[gate_idx];
+            prepared_gate pg{g.id, g.app_base_key.derive_token_key(id, g.id.key_no()), {}};
+            pg.gate_file << mlab::prealloc(file_size + crypto_box_NONCEBYTES) << ts.read(file_size) << nonce(slot);
+            card.gates.push_back(std::move(pg));
+        }
+        if (ts.bad()) {
+            ESP_LOGE("KA", "Malformed plan record for %s.", s_id.c_str());
+            return std::nullopt;
+        }
+        return card;
+    }
+
+}// namespace ka
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <esp_log.h>
+#include <ka/revocation_record.hpp>
+#include <sodium/crypto_generichash.h>
+#include <sodium/crypto_kdf_blake2b.h>
+#include <sodium/crypto_sign.h>
+#include <sodium/utils.h>
+
+namespace ka {
+
+    namespace {
+        constexpr std::array<char, crypto_kdf_blake2b_CONTEXTBYTES> epoch_key_context{"revepoch"};
+
+        static_assert(epoch_pub_key::array_size == crypto_sign_PUBLICKEYBYTES);
+        static_assert(epoch_sec_key::array_size == crypto_sign_SECRETKEYBYTES);
+        static_assert(epoch_signature::array_size == crypto_sign_BYTES);
+    }// namespace
+
+    mlab::bin_data revocation_epoch::signed_data() const {
+        mlab::bin_data bd{mlab::prealloc(size - signature.size())};
+        bd << version << mlab::lsb32 << epoch << mlab::lsb32 << base_epoch << list_digest << delta_digest;
+        return bd;
+    }
+
+    mlab::bin_data revocation_record::delta_file() const {
+        mlab::bin_data bd{mlab::prealloc(2 + delta.size() * (1 + token_id::array_size))};
+        bd << mlab::lsb16 << std::uint16_t(delta.size());
+        for (list_change const &change : delta) {
+            bd << change;
+        }
+        return bd;
+    }
+
+    bool revocation_record::verify(epoch_pub_key const &pk) const {
+        const auto file = delta_file();
+        list_hash h{};
+        crypto_generichash(h.data(), h.size(), file.data(), file.size(), nullptr, 0);
+        if (h != header.delta_digest) {
+            return false;
+        }
+        const auto data = header.signed_data();
+        return 0 == crypto_sign_verify_detached(header.signature.data(), data.data(), data.size(), pk.data());
+    }
+
+    bool revocation_record::apply_to(token_list &list) const {
+        if (header.epoch <= list.version() or header.base_epoch > list.version() or
+            delta.size() != header.epoch - header.base_epoch) {
+            return false;
+        }
+        token_list updated = list;
+        for (auto it = std::next(std::begin(delta), list.version() - header.base_epoch); it != std::end(delta); ++it) {
+            updated.apply(*it);
+        }
+        updated.set_version(header.epoch);
+        if (updated.hash() != header.list_digest) {
+            return false;
+        }
+        list = std::move(updated);
+        return true;
+    }
+
+    epoch_signer::~epoch_signer() {
+        sodium_memzero(_sk.data(), _sk.size());
+    }
+
+    epoch_signer epoch_signer::derive_from(sec_key const &master) {
+        std::array<std::uint8_t, crypto_sign_SEEDBYTES> seed{};
+        if (0 != crypto_kdf_blake2b_derive_from_key(
+                         seed.data(), seed.size(),
+                         0,
+                         epoch_key_context.data(),
+                         master.raw_sk().data())) {
+            ESP_LOGE("KA", "Unable to derive epoch signing key.");
+        }
+        epoch_signer signer{};
+        if (0 != crypto_sign_seed_keypair(signer._pk.data(), signer._sk.data(), seed.data())) {
+            ESP_LOGE("KA", "Unable to generate epoch signing key.");
+        }
+        sodium_memzero(seed.data(), seed.size());
+        return signer;
+    }
+
+    epoch_pub_key const &epoch_signer::pub_key() const {
+        return _pk;
+    }
+
+    revocation_record epoch_signer::sign(versioned_token_list const &list) const {
+        revocation_record rec{};
+        rec.header.epoch = list.version();
+        rec.header.base_epoch = std::max(list.first_logged_version(), list.version() - std::min(list.version(), std::uint32_t(revocation_record::max_delta)));
+        if (auto delta = list.delta_since(rec.header.base_epoch); delta) {
+            rec.delta = std::move(*delta);
+        }
+        rec.header.list_digest = list.list().hash();
+        const auto file = rec.delta_file();
+        crypto_generichash(rec.header.delta_digest.data(), rec.header.delta_digest.size(), file.data(), file.size(), nullptr, 0);
+        const auto data = rec.header.signed_data();
+        if (0 != crypto_sign_detached(rec.header.signature.data(), nullptr, data.data(), data.size(), _sk.data())) {
+            ESP_LOGE("KA", "Unable to sign the revocation record.");
+        }
+        return rec;
+    }
+
+}// namespace ka
+
+namespace mlab {
+
+    bin_stream &operator>>(bin_stream &s, ka::revocation_epoch &epoch) {
+        if (s.remaining() < ka::revocation_epoch::size or s.pop() != ka::revocation_epoch::version) {
+            s.set_bad();
+            return s;
+        }
+        return s >> mlab::lsb32 >> epoch.epoch >> mlab::lsb32 >> epoch.base_epoch
+                 >> epoch.list_digest >> epoch.delta_digest >> epoch.signature;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::revocation_epoch const &epoch) {
+        return bd << prealloc(bd.size() + ka::revocation_epoch::size)
+                  << ka::revocation_epoch::version
+                  << mlab::lsb32 << epoch.epoch
+                  << mlab::lsb32 << epoch.base_epoch
+                  << epoch.list_digest
+                  << epoch.delta_digest
+                  << epoch.signature;
+    }
+
+}// namespace mlab
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <ka/rpc.hpp>
+
+namespace ka::rpc {
+
+    namespace {
+        [[nodiscard]] std::chrono::microseconds now() {
+            return std::chrono::microseconds{esp_timer_get_time()};
+        }
+
+        void record(opcode_stats &stats, std::chrono::microseconds latency, bool success) {
+            ++stats.calls;
+            if (not success) {
+                ++stats.failures;
+            }
+            stats.last_latency = latency;
+            stats.max_latency = std::max(stats.max_latency, latency);
+            stats.total_latency += latency;
+        }
+    }// namespace
+
+    const char *to_string(status s) {
+        switch (s) {
+            case status::ok:
+                return "ok";
+            case status::unknown_opcode:
+                return "unknown opcode";
+            case status::malformed_request:
+                return "malformed request";
+            case status::malformed_response:
+                return "malformed response";
+            case status::unauthorized:
+                return "unauthorized";
+            case status::failed:
+                return "failed";
+            case status::missing:
+                return "missing";
+            default:
+                return "UNKNOWN";
+        }
+    }
+
+    std::chrono::microseconds opcode_stats::average_latency() const {
+        return calls > 0 ? total_latency / calls : std::chrono::microseconds{0};
+    }
+
+    void dispatcher::register_raw_handler(opcode code, raw_handler handler) {
+        _handlers[code] = std::move(handler);
+    }
+
+    bool dispatcher::has_handler(opcode code) const {
+        return _handlers.find(code) != std::end(_handlers);
+    }
+
+    std::map<opcode, opcode_stats> const &dispatcher::stats() const {
+        return _stats;
+    }
+
+    mlab::bin_data dispatcher::dispatch(mlab::bin_data const &batch) {
+        mlab::bin_stream s{batch};
+        mlab::bin_data reply{};
+        mlab::bin_data response{};
+        const std::uint8_t count = s.pop();
+        reply << count;
+        for (std::uint8_t i = 0; i < count; ++i) {
+            opcode code = 0;
+            std::uint16_t length = 0;
+            s >> code >> mlab::lsb16 >> length;
+            if (s.bad() or s.remaining() < length) {
+                ESP_LOGE("KA", "Malformed RPC batch at command %d.", i);
+                // Cannot find the next command, mark all the remaining ones
+                for (; i < count; ++i) {
+                    reply << code << std::uint8_t(status::malformed_request) << mlab::lsb16 << std::uint16_t{0};
+                }
+                break;
+            }
+            _payload.clear();
+            _payload << s.read(length);
+            response.clear();
+            status result = status::unknown_opcode;
+            const auto start = now();
+            if (const auto it = _handlers.find(code); it != std::end(_handlers)) {
+                mlab::bin_stream payload_s{_payload};
+                result = it->second(payload_s, response);
+                record(_stats[code], now() - start, result == status::ok);
+            } else {
+                ESP_LOGW("KA", "Unknown RPC opcode %02x.", code);
+            }
+            if (result != status::ok) {
+                response.clear();
+            }
+            reply << code << std::uint8_t(result) << mlab::lsb16 << std::uint16_t(response.size()) << response;
+        }
+        return reply;
+    }
+
+    pn532::result<> dispatcher::serve_one(p2p::secure_target &comm, ms timeout) {
+        mlab::reduce_timeout rt{timeout};
+        if (const auto r = comm.receive(rt.remaining()); not r) {
+            return r.error();
+        } else if (r->empty()) {
+            ESP_LOGE("KA", "Empty RPC batch received.");
+            return pn532::channel_error::malformed;
+        } else {
+            return comm.send(dispatch(*r), rt.remaining());
+        }
+    }
+
+    batch_reply::batch_reply(std::vector<item> items, std::chrono::microseconds latency)
+        : _items{std::move(items)}, _latency{latency} {}
+
+    pn532::result<batch_reply> batch_reply::parse(mlab::bin_data const &data, std::vector<opcode> const &expected, std::chrono::microseconds latency) {
+        mlab::bin_stream s{data};
+        const std::uint8_t count = s.pop();
+        if (s.bad() or count != expected.size()) {
+            ESP_LOGE("KA", "Invalid RPC reply: %d responses for %d commands.", count, expected.size());
+            return pn532::channel_error::malformed;
+        }
+        std::vector<item> items(count);
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            std::uint8_t result = 0;
+            std::uint16_t length = 0;
+            s >> items[i].code >> result >> mlab::lsb16 >> length;
+            items[i].result = static_cast<status>(result);
+            if (s.bad() or s.remaining() < length or items[i].code != expected[i]) {
+                ESP_LOGE("KA", "Invalid RPC reply at command %d.", i);
+                return pn532::channel_error::malformed;
+            }
+            items[i].payload << s.read(length);
+        }
+        return batch_reply{std::move(items), latency};
+    }
+
+    std::size_t batch_reply::size() const {
+        return _items.size();
+    }
+
+    status batch_reply::status_of(std::size_t index) const {
+        return index < _items.size() ? _items[index].result : status::missing;
+    }
+
+    bool batch_reply::all_ok() const {
+        return std::all_of(std::begin(_items), std::end(_items), [](item const &it) { return it.result == status::ok; });
+    }
+
+    std::chrono::microseconds batch_reply::latency() const {
+        return _latency;
+    }
+
+    batch::batch() : _data{mlab::bin_data::chain(std::uint8_t{0})} {}
+
+    void batch::append(opcode code, mlab::bin_data const &payload) {
+        if (_codes.size() >= max_commands or payload.size() > std::numeric_limits<std::uint16_t>::max()) {
+            // Keep the indices of later commands consistent, but do not let the count or the length wrap
+            ESP_LOGE("KA", "RPC command %d does not fit in the batch.", _codes.size());
+            _oversized = true;
+        } else {
+            _data << code << mlab::lsb16 << std::uint16_t(payload.size()) << payload;
+            _data.front() = std::uint8_t(_codes.size() + 1);
+        }
+        _codes.push_back(code);
+    }
+
+    std::size_t batch::size() const {
+        return _codes.size();
+    }
+
+    bool batch::empty() const {
+        return _codes.empty();
+    }
+
+    mlab::bin_data const &batch::encoded() const {
+        return _data;
+    }
+
+    pn532::result<batch_reply> batch::send(p2p::secure_initiator &comm, ms timeout) const {
+        if (_oversized) {
+            ESP_LOGE("KA", "Refusing to send an RPC batch of %d commands.", _codes.size());
+            return pn532::channel_error::app_error;
+        }
+        const auto start = now();
+        if (const auto r = comm.communicate(_data, timeout); not r) {
+            return r.error();
+        } else {
+            return batch_reply::parse(*r, _codes, now() - start);
+        }
+    }
+
+}// namespace ka::rpc
@@ -2,8 +2,12 @@
 // Created by spak on 1/16/23.
 //
 
+#include <algorithm>
+#include <esp_timer.h>
 #include <ka/secure_p2p.hpp>
+#include <sodium/crypto_generichash.h>
 #include <sodium/crypto_kx.h>
+#include <sodium/utils.h>
 
 namespace ka::p2p {
     static_assert(tx_key::array_size == crypto_kx_SESSIONKEYBYTES);
@@ -11,31 +15,285 @@ namespace ka::p2p {
     static_assert(raw_pub_key::array_size == crypto_kx_PUBLICKEYBYTES);
     static_assert(raw_sec_key::array_size == crypto_kx_SECRETKEYBYTES);
 
+    namespace {
+        /**
+         * Sequence number, secretstream tag and MAC around each message.
+         */
+        constexpr std::size_t message_overhead = 1 + crypto_secretstream_xchacha20poly1305_ABYTES;
+        /**
+         * Initiator public key, initiator header, first message.
+         */
+        constexpr std::size_t fast_handshake_min_size = raw_pub_key::array_size + header::array_size + message_overhead;
+        /**
+         * Target header, first reply.
+         */
+        constexpr std::size_t fast_handshake_reply_min_size = header::array_size + message_overhead;
+        /**
+         * Initiator public key, ticket id, initiator header.
+         */
+        constexpr std::size_t resume_size = raw_pub_key::array_size + ticket_id::array_size + header::array_size;
+
+        static_assert(fast_handshake_min_size > raw_pub_key::array_size, "A fast handshake must be distinguishable from a full one.");
+        static_assert(fast_handshake_min_size > resume_size, "A fast handshake must be distinguishable from a resumption.");
+        static_assert(fast_handshake_reply_min_size != raw_pub_key::array_size, "A fast handshake reply must be distinguishable from a fallback.");
+        static_assert(header::array_size != raw_pub_key::array_size, "A resumption reply must be distinguishable from a fallback.");
+
+        constexpr char ticket_kdf_context[crypto_kdf_CONTEXTBYTES + 1] = "katicket";
+        constexpr char resume_kdf_context[crypto_kdf_CONTEXTBYTES + 1] = "karesume";
+
+        [[nodiscard]] session_ticket make_ticket(std::uint8_t const *master, raw_pub_key const &peer_pk) {
+            session_ticket ticket{};
+            crypto_kdf_derive_from_key(ticket.id.data(), ticket.id.size(), 1, ticket_kdf_context, master);
+            crypto_kdf_derive_from_key(ticket.secret.data(), ticket.secret.size(), 2, ticket_kdf_context, master);
+            ticket.peer_pk = peer_pk;
+            ticket.expires_at = esp_timer_get_time() + std::chrono::duration_cast<std::chrono::microseconds>(session_ticket::lifetime).count();
+            return ticket;
+        }
+
+        /**
+         * Both sides derive the same ticket, @p i2t is the initiator tx key and the target rx key.
+         */
+        [[nodiscard]] session_ticket ticket_from_session_keys(std::uint8_t const *i2t, std::uint8_t const *t2i, raw_pub_key const &peer_pk) {
+            std::array<std::uint8_t, crypto_kdf_KEYBYTES> master{};
+            crypto_generichash_state state{};
+            crypto_generichash_init(&state, nullptr, 0, master.size());
+            crypto_generichash_update(&state, i2t, crypto_kx_SESSIONKEYBYTES);
+            crypto_generichash_update(&state, t2i, crypto_kx_SESSIONKEYBYTES);
+            crypto_generichash_final(&state, master.data(), master.size());
+            auto ticket = make_ticket(master.data(), peer_pk);
+            sodium_memzero(master.data(), master.size());
+            return ticket;
+        }
+
+        /**
+         * Derives the session keys of a resumed session, and replaces @p ticket with the next one.
+         */
+        void resume_from_ticket(session_ticket &ticket, std::uint8_t *i2t, std::uint8_t *t2i) {
+            std::array<std::uint8_t, crypto_kdf_KEYBYTES> master{};
+            crypto_kdf_derive_from_key(i2t, crypto_kx_SESSIONKEYBYTES, 1, resume_kdf_context, ticket.secret.data());
+            crypto_kdf_derive_from_key(t2i, crypto_kx_SESSIONKEYBYTES, 2, resume_kdf_context, ticket.secret.data());
+            crypto_kdf_derive_from_key(master.data(), master.size(), 3, resume_kdf_context, ticket.secret.data());
+            sodium_memzero(ticket.secret.data(), ticket.secret.size());
+            ticket = make_ticket(master.data(), ticket.peer_pk);
+            sodium_memzero(master.data(), master.size());
+        }
+
+        [[nodiscard]] result<> open_message(crypto_secretstream_xchacha20poly1305_state &rx, mlab::bin_data &dest,
+                                            std::uint8_t const *frame, std::size_t frame_size) {
+            if (frame_size < message_overhead) {
+                ESP_LOGE("KA", "Invalid %s size %d.", "received msg", frame_size);
+                return pn532::channel_error::malformed;
+            }
+            dest.resize(frame_size - message_overhead);
+            // The sequence number is authenticated as additional data
+            if (0 != crypto_secretstream_xchacha20poly1305_pull(
+                             &rx, dest.data(), nullptr, nullptr, frame + 1, frame_size - 1, frame, 1)) {
+                ESP_LOGE("KA", "Failed decrypting incoming message.");
+                return pn532::channel_error::app_error;
+            }
+            return mlab::result_success;
+        }
+
+        /**
+         * Decrypts in place a frame laid out as in @ref message_buffer.
+         */
+        [[nodiscard]] result<mlab::range<std::uint8_t const *>> open_in_place(crypto_secretstream_xchacha20poly1305_state &rx, mlab::bin_data &frame) {
+            if (frame.size() < message_overhead) {
+                ESP_LOGE("KA", "Invalid %s size %d.", "received msg", frame.size());
+                return pn532::channel_error::malformed;
+            }
+            std::uint8_t *payload = frame.data() + message_buffer::headroom;
+            const std::size_t payload_size = frame.size() - message_overhead;
+            // Pull checks the MAC before decrypting, and writes the plaintext exactly over the ciphertext
+            if (0 != crypto_secretstream_xchacha20poly1305_pull(
+                             &rx, payload, nullptr, nullptr, frame.data() + 1, frame.size() - 1, frame.data(), 1)) {
+                ESP_LOGE("KA", "Failed decrypting incoming message.");
+                return pn532::channel_error::app_error;
+            }
+            return mlab::make_range<std::uint8_t const *>(payload, payload + payload_size);
+        }
+
+        /**
+         * Encrypts in place the payload of @p buffer.
+         */
+        void seal_in_place(crypto_secretstream_xchacha20poly1305_state &tx, message_buffer &buffer, std::uint8_t seq) {
+            auto &frame = buffer.frame();
+            const std::size_t payload_size = frame.size() - message_overhead;
+            frame.front() = seq;
+            // Push writes the ciphertext exactly over the payload, which starts after the sequence number and tag byte
+            crypto_secretstream_xchacha20poly1305_push(
+                    &tx, frame.data() + 1, nullptr, frame.data() + message_buffer::headroom, payload_size, frame.data(), 1, 0);
+        }
+
+        void seal_message(crypto_secretstream_xchacha20poly1305_state &tx, mlab::bin_data &dest, std::size_t offset,
+                          std::uint8_t seq, mlab::bin_data const &message) {
+            dest.resize(offset + message.size() + message_overhead);
+            dest[offset] = seq;
+            crypto_secretstream_xchacha20poly1305_push(&tx, dest.data() + offset + 1, nullptr, message.data(), message.size(), dest.data() + offset, 1, 0);
+        }
+
+        [[nodiscard]] bool is_transient(pn532::channel_error e) {
+            return e == pn532::channel_error::timeout or e == pn532::channel_error::malformed;
+        }
+    }// namespace
+
+    bool session_ticket::is_valid() const {
+        return expires_at > esp_timer_get_time();
+    }
+
+    void session_ticket_store::insert(session_ticket const &ticket) {
+        auto it = std::min_element(std::begin(_tickets), std::end(_tickets), [](auto const &l, auto const &r) {
+            return l.expires_at < r.expires_at;
+        });
+        sodium_memzero(it->secret.data(), it->secret.size());
+        *it = ticket;
+    }
+
+    std::optional<session_ticket> session_ticket_store::take(ticket_id const &id) {
+        for (auto &ticket : _tickets) {
+            if (ticket.expires_at != 0 and ticket.id == id) {
+                std::optional<session_ticket> retval = std::nullopt;
+                if (ticket.is_valid()) {
+                    retval = ticket;
+                }
+                sodium_memzero(ticket.secret.data(), ticket.secret.size());
+                ticket = session_ticket{};
+                return retval;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void session_ticket_store::clear() {
+        for (auto &ticket : _tickets) {
+            sodium_memzero(ticket.secret.data(), ticket.secret.size());
+            ticket = session_ticket{};
+        }
+    }
+
+    message_buffer::message_buffer(std::size_t payload_capacity) {
+        _frame.reserve(headroom + payload_capacity + tailroom);
+    }
+
+    mlab::range<std::uint8_t *> message_buffer::prepare(std::size_t length) {
+        _frame.resize(headroom + length + tailroom);
+        return payload();
+    }
+
+    mlab::range<std::uint8_t *> message_buffer::payload() {
+        if (_frame.size() < headroom + tailroom) {
+            _frame.resize(headroom + tailroom);
+        }
+        return mlab::make_range(_frame.data() + headroom, _frame.data() + _frame.size() - tailroom);
+    }
+
+    std::size_t message_buffer::payload_capacity() const {
+        return _frame.capacity() > headroom + tailroom ? _frame.capacity() - headroom - tailroom : 0;
+    }
+
+    mlab::bin_data &message_buffer::frame() {
+        return _frame;
+    }
+
     secure_initiator::secure_initiator(initiator &raw_layer, key_pair kp)
         : _raw_layer{&raw_layer}, _tx{}, _rx{}, _hdr{}, _did_handshake{false}, _kp{kp} {}
 
-    secure_target::secure_target(target &raw_layer, key_pair kp)
-        : _raw_layer{&raw_layer}, _tx{}, _rx{}, _hdr{}, _did_handshake{false}, _kp{kp} {}
+    secure_initiator::secure_initiator(initiator &raw_layer, key_pair kp, pub_key const &known_peer)
+        : secure_initiator{raw_layer, kp} {
+        _peer_pk = known_peer.raw_pk();
+        _has_known_peer = true;
+    }
 
-    result<raw_pub_key> secure_target::handshake(ms timeout) {
-        if (_did_handshake) {
-            return peer_pub_key();
-        } else if (_raw_layer == nullptr) {
-            return pn532::channel_error::app_error;
-        }
-        mlab::reduce_timeout rt{timeout};
+    secure_initiator::secure_initiator(initiator &raw_layer, key_pair kp, session_ticket const &ticket)
+        : secure_initiator{raw_layer, kp} {
+        _peer_pk = ticket.peer_pk;
+        _ticket = ticket;
+    }
+
+    secure_target::secure_target(target &raw_layer, key_pair kp, std::shared_ptr<session_ticket_store> tickets)
+        : _raw_layer{&raw_layer}, _tx{}, _rx{}, _hdr{}, _did_handshake{false}, _kp{kp}, _tickets{std::move(tickets)} {}
+
+    bool secure_target::derive_keys(header const &initiator_header) {
         tx_key tx{};
         rx_key rx{};
+        if (0 != crypto_kx_client_session_keys(
+                         rx.data(), tx.data(), _kp.raw_pk().data(), _kp.raw_sk().data(), _peer_pk.data())) {
+            ESP_LOGE("KA", "Suspicious %s public key!", "initiator");
+            return false;
+        }
+        if (_tickets != nullptr) {
+            _pending_ticket = ticket_from_session_keys(rx.data(), tx.data(), _peer_pk);
+        }
+        crypto_secretstream_xchacha20poly1305_init_push(&_tx, _hdr.data(), tx.data());
+        crypto_secretstream_xchacha20poly1305_init_pull(&_rx, initiator_header.data(), rx.data());
+        ESP_LOG_BUFFER_HEX_LEVEL("RX KEY", rx.data(), 32, ESP_LOG_DEBUG);
+        ESP_LOG_BUFFER_HEX_LEVEL("TX KEY", tx.data(), 32, ESP_LOG_DEBUG);
+        sodium_memzero(rx.data(), rx.size());
+        sodium_memzero(tx.data(), tx.size());
+        return true;
+    }
+
+    void secure_target::store_pending_ticket() {
+        if (_tickets != nullptr and _pending_ticket.is_valid()) {
+            _tickets->insert(_pending_ticket);
+        }
+        sodium_memzero(_pending_ticket.secret.data(), _pending_ticket.secret.size());
+        _pending_ticket = session_ticket{};
+    }
+
+    bool secure_target::is_handshake_retransmission(mlab::bin_data const &frame) const {
+        constexpr auto message_offset = raw_pub_key::array_size + header::array_size;
+        return _last_reply_is_handshake and frame.size() >= fast_handshake_min_size and
+               std::equal(std::begin(_peer_pk), std::end(_peer_pk), std::begin(frame)) and
+               frame[message_offset] == _reply_seq;
+    }
+
+    bool secure_target::try_fast_handshake(mlab::bin_data const &frame) {
         header initiator_header{};
-        // Retrieve public key
-        if (const auto r = _raw_layer->receive(rt.remaining()); not r) {
-            return r.error();
-        } else if (r->size() != raw_pub_key::array_size) {
-            ESP_LOGE("KA", "Invalid %s size %d.", "initiator pubkey", r->size());
-            return pn532::channel_error::malformed;
-        } else {
-            std::copy_n(std::begin(*r), raw_pub_key::array_size, std::begin(_peer_pk));
+        auto it = std::copy_n(std::begin(frame), raw_pub_key::array_size, std::begin(_peer_pk));
+        std::copy_n(it, header::array_size, std::begin(initiator_header));
+        if (not derive_keys(initiator_header)) {
+            return false;
+        }
+        constexpr auto message_offset = raw_pub_key::array_size + header::array_size;
+        if (not open_message(_rx, _buffer, frame.data() + message_offset, frame.size() - message_offset)) {
+            ESP_LOGW("KA", "Unable to use the single round trip handshake, falling back.");
+            return false;
         }
+        _reply_seq = frame[message_offset];
+        _rx_seq = _reply_seq + 1;
+        return true;
+    }
+
+    bool secure_target::try_resume(mlab::bin_data const &frame) {
+        ticket_id id{};
+        header initiator_header{};
+        auto it = std::copy_n(std::begin(frame), raw_pub_key::array_size, std::begin(_peer_pk));
+        it = std::copy_n(it, ticket_id::array_size, std::begin(id));
+        std::copy_n(it, header::array_size, std::begin(initiator_header));
+        std::optional<session_ticket> ticket = std::nullopt;
+        if (_tickets != nullptr) {
+            ticket = _tickets->take(id);
+        }
+        if (not ticket or ticket->peer_pk != _peer_pk) {
+            ESP_LOGW("KA", "Unknown or expired session ticket, falling back.");
+            return false;
+        }
+        tx_key tx{};
+        rx_key rx{};
+        resume_from_ticket(*ticket, rx.data(), tx.data());
+        _tickets->insert(*ticket);
+        sodium_memzero(ticket->secret.data(), ticket->secret.size());
+        crypto_secretstream_xchacha20poly1305_init_push(&_tx, _hdr.data(), tx.data());
+        crypto_secretstream_xchacha20poly1305_init_pull(&_rx, initiator_header.data(), rx.data());
+        sodium_memzero(rx.data(), rx.size());
+        sodium_memzero(tx.data(), tx.size());
+        return true;
+    }
+
+    result<> secure_target::full_handshake_from_pub_key(ms timeout) {
+        mlab::reduce_timeout rt{timeout};
+        header initiator_header{};
         // Send our public key
         if (const auto r = _raw_layer->send(mlab::bin_data::chain(_kp.raw_pk()), rt.remaining()); not r) {
             return r.error();
@@ -45,25 +303,143 @@ namespace ka::p2p {
             return r.error();
         } else if (r->size() != header::array_size) {
             ESP_LOGE("KA", "Invalid %s size %d.", "initiator header", r->size());
+            return pn532::channel_error::malformed;
         } else {
             std::copy_n(std::begin(*r), header::array_size, std::begin(initiator_header));
         }
         // Derive the keys
-        if (0 != crypto_kx_client_session_keys(
-                         rx.data(), tx.data(), _kp.raw_pk().data(), _kp.raw_sk().data(), _peer_pk.data())) {
-            ESP_LOGE("KA", "Suspicious %s public key!", "initiator");
+        if (not derive_keys(initiator_header)) {
             return pn532::channel_error::app_error;
         }
-        crypto_secretstream_xchacha20poly1305_init_push(&_tx, _hdr.data(), tx.data());
-        crypto_secretstream_xchacha20poly1305_init_pull(&_rx, initiator_header.data(), rx.data());
         // Send our header
-        if (const auto r = _raw_layer->send(mlab::bin_data::chain(_hdr), rt.remaining()); r) {
-            ESP_LOG_BUFFER_HEX_LEVEL("RX KEY", rx.data(), 32, ESP_LOG_DEBUG);
-            ESP_LOG_BUFFER_HEX_LEVEL("TX KEY", tx.data(), 32, ESP_LOG_DEBUG);
-            _did_handshake = true;
+        if (const auto r = _raw_layer->send(mlab::bin_data::chain(_hdr), rt.remaining()); not r) {
+            return r.error();
+        }
+        return mlab::result_success;
+    }
+
+    result<raw_pub_key> secure_target::handshake(ms timeout) {
+        if (_did_handshake) {
             return peer_pub_key();
+        } else if (_raw_layer == nullptr) {
+            return pn532::channel_error::app_error;
+        }
+        mlab::reduce_timeout rt{timeout};
+        // The first frame is either the initiator public key, public key, header and first message, or a resumption
+        if (const auto r = _raw_layer->receive(rt.remaining()); not r) {
+            return r.error();
+        } else if (r->size() >= fast_handshake_min_size) {
+            if (try_fast_handshake(*r)) {
+                store_pending_ticket();
+                _did_handshake = true;
+                _has_pending_rx = true;
+                _reply_needs_header = true;
+                return peer_pub_key();
+            }
+            // The initiator public key has been stored, proceed as in the full handshake
+        } else if (r->size() == resume_size) {
+            if (try_resume(*r)) {
+                if (const auto r_send = _raw_layer->send(mlab::bin_data::chain(_hdr), rt.remaining()); not r_send) {
+                    return r_send.error();
+                }
+                _did_handshake = true;
+                _stats.resumed = true;
+                return peer_pub_key();
+            }
+            // The initiator public key has been stored, proceed as in the full handshake
+        } else if (r->size() == raw_pub_key::array_size) {
+            std::copy_n(std::begin(*r), raw_pub_key::array_size, std::begin(_peer_pk));
+        } else {
+            ESP_LOGE("KA", "Invalid %s size %d.", "initiator pubkey", r->size());
+            return pn532::channel_error::malformed;
+        }
+        if (const auto r = full_handshake_from_pub_key(rt.remaining()); not r) {
+            return r.error();
+        }
+        store_pending_ticket();
+        _did_handshake = true;
+        return peer_pub_key();
+    }
+
+    bool secure_initiator::setup_tx(raw_pub_key const &peer_pk) {
+        tx_key tx{};
+        if (0 != crypto_kx_server_session_keys(
+                         _pending_rx_key.data(), tx.data(), _kp.raw_pk().data(), _kp.raw_sk().data(), peer_pk.data())) {
+            ESP_LOGE("KA", "Suspicious %s public key!", "target");
+            return false;
+        }
+        _peer_pk = peer_pk;
+        _ticket = ticket_from_session_keys(tx.data(), _pending_rx_key.data(), _peer_pk);
+        crypto_secretstream_xchacha20poly1305_init_push(&_tx, _hdr.data(), tx.data());
+        ESP_LOG_BUFFER_HEX_LEVEL("TX KEY", tx.data(), 32, ESP_LOG_DEBUG);
+        sodium_memzero(tx.data(), tx.size());
+        return true;
+    }
+
+    void secure_initiator::setup_resumed_tx() {
+        tx_key tx{};
+        _peer_pk = _ticket.peer_pk;
+        resume_from_ticket(_ticket, tx.data(), _pending_rx_key.data());
+        crypto_secretstream_xchacha20poly1305_init_push(&_tx, _hdr.data(), tx.data());
+        sodium_memzero(tx.data(), tx.size());
+    }
+
+    void secure_initiator::setup_rx(header const &target_header) {
+        crypto_secretstream_xchacha20poly1305_init_pull(&_rx, target_header.data(), _pending_rx_key.data());
+        ESP_LOG_BUFFER_HEX_LEVEL("RX KEY", _pending_rx_key.data(), 32, ESP_LOG_DEBUG);
+        sodium_memzero(_pending_rx_key.data(), _pending_rx_key.size());
+    }
+
+    result<> secure_initiator::exchange_headers(ms timeout) {
+        if (const auto r = _raw_layer->communicate(mlab::bin_data::chain(_hdr), timeout); not r) {
+            return r.error();
+        } else if (r->size() != header::array_size) {
+            ESP_LOGE("KA", "Invalid %s size %d.", "target header", r->size());
+            return pn532::channel_error::malformed;
         } else {
+            header target_header{};
+            std::copy_n(std::begin(*r), header::array_size, std::begin(target_header));
+            setup_rx(target_header);
+        }
+        return mlab::result_success;
+    }
+
+    result<> secure_initiator::complete_from_target_pub_key(mlab::bin_data const &reply, ms timeout) {
+        // The target could not use our first frame, it sent its public key and expects the rest of the full handshake
+        raw_pub_key target_pk{};
+        std::copy_n(std::begin(reply), raw_pub_key::array_size, std::begin(target_pk));
+        // Falling back must not let a different target in, the peer was pinned by the caller
+        if (target_pk != _peer_pk) {
+            ESP_LOGE("KA", "The target public key differs from the expected one.");
+            return pn532::channel_error::app_error;
+        }
+        if (not setup_tx(target_pk)) {
+            return pn532::channel_error::app_error;
+        }
+        return exchange_headers(timeout);
+    }
+
+    result<> secure_initiator::resume(ms timeout) {
+        mlab::reduce_timeout rt{timeout};
+        const ticket_id id = _ticket.id;
+        // This consumes the ticket, and replaces it with the next one
+        setup_resumed_tx();
+        mlab::bin_data frame{};
+        frame << mlab::prealloc(resume_size) << _kp.raw_pk() << id << _hdr;
+        if (const auto r = _raw_layer->communicate(frame, rt.remaining()); not r) {
             return r.error();
+        } else if (r->size() == header::array_size) {
+            header target_header{};
+            std::copy_n(std::begin(*r), header::array_size, std::begin(target_header));
+            setup_rx(target_header);
+            _stats.resumed = true;
+            return mlab::result_success;
+        } else if (r->size() == raw_pub_key::array_size) {
+            ESP_LOGW("KA", "Session ticket rejected, falling back.");
+            return complete_from_target_pub_key(*r, rt.remaining());
+        } else {
+            ESP_LOGE("KA", "Invalid %s size %d.", "target reply", r->size());
+            return pn532::channel_error::malformed;
         }
     }
 
@@ -74,9 +450,14 @@ namespace ka::p2p {
             return pn532::channel_error::app_error;
         }
         mlab::reduce_timeout rt{timeout};
-        tx_key tx{};
-        rx_key rx{};
-        header target_header{};
+        if (_ticket.is_valid()) {
+            if (const auto r = resume(rt.remaining()); not r) {
+                return r.error();
+            }
+            _did_handshake = true;
+            return peer_pub_key();
+        }
+        raw_pub_key target_pk{};
         // Send our public key and retrieve the target's
         if (const auto r = _raw_layer->communicate(mlab::bin_data::chain(_kp.raw_pk()), rt.remaining()); not r) {
             return r.error();
@@ -84,58 +465,166 @@ namespace ka::p2p {
             ESP_LOGE("KA", "Invalid %s size %d.", "target pubkey", r->size());
             return pn532::channel_error::malformed;
         } else {
-            std::copy_n(std::begin(*r), raw_pub_key::array_size, std::begin(_peer_pk));
+            std::copy_n(std::begin(*r), raw_pub_key::array_size, std::begin(target_pk));
         }
-        // Derive the keys
-        if (0 != crypto_kx_server_session_keys(
-                         rx.data(), tx.data(), _kp.raw_pk().data(), _kp.raw_sk().data(), _peer_pk.data())) {
-            ESP_LOGE("KA", "Suspicious %s public key!", "initiator");
+        // Derive the keys, set up tx, and exchange headers to set up rx
+        if (not setup_tx(target_pk)) {
             return pn532::channel_error::app_error;
         }
-        // Setup up only tx, and exchange headers
-        crypto_secretstream_xchacha20poly1305_init_push(&_tx, _hdr.data(), tx.data());
-        if (const auto r = _raw_layer->communicate(mlab::bin_data::chain(_hdr), rt.remaining()); not r) {
+        if (const auto r = exchange_headers(rt.remaining()); not r) {
             return r.error();
-        } else if (r->size() != header::array_size) {
-            ESP_LOGE("KA", "Invalid %s size %d.", "target header", r->size());
-        } else {
-            std::copy_n(std::begin(*r), header::array_size, std::begin(target_header));
         }
-        // Can now set up rx
-        crypto_secretstream_xchacha20poly1305_init_pull(&_rx, target_header.data(), rx.data());
         _did_handshake = true;
-        ESP_LOG_BUFFER_HEX_LEVEL("RX KEY", rx.data(), 32, ESP_LOG_DEBUG);
-        ESP_LOG_BUFFER_HEX_LEVEL("TX KEY", tx.data(), 32, ESP_LOG_DEBUG);
         return peer_pub_key();
     }
 
+    result<mlab::bin_data> secure_initiator::communicate_with_fast_handshake(mlab::bin_data const &data, ms timeout) {
+        mlab::reduce_timeout rt{timeout};
+        if (not setup_tx(_peer_pk)) {
+            return pn532::channel_error::app_error;
+        }
+        // Public key, header and first message in a single frame
+        constexpr auto message_offset = raw_pub_key::array_size + header::array_size;
+        seal_message(_tx, _buffer, message_offset, _tx_seq, data);
+        std::copy(std::begin(_hdr), std::end(_hdr), std::copy(std::begin(_kp.raw_pk()), std::end(_kp.raw_pk()), std::begin(_buffer)));
+        // The target answers a retransmitted frame with the same reply, see secure_target::receive_view
+        const unsigned attempts = 1 + (_link != nullptr ? _link->rtt().retries() : _max_retransmissions);
+        result<mlab::bin_data> r = pn532::channel_error::timeout;
+        for (unsigned attempt = 0; attempt < attempts; ++attempt) {
+            if (attempt > 0) {
+                ++_stats.retransmissions;
+                ESP_LOGW("KA", "Retransmitting the handshake (%d/%d).", attempt, attempts - 1);
+            }
+            r = _raw_layer->communicate(_buffer, rt.remaining() / (attempts - attempt));
+            if (r or not is_transient(r.error())) {
+                break;
+            }
+        }
+        if (not r) {
+            return r.error();
+        } else if (r->size() == raw_pub_key::array_size) {
+            if (const auto r_hs = complete_from_target_pub_key(*r, rt.remaining()); not r_hs) {
+                return r_hs.error();
+            }
+            _did_handshake = true;
+            return communicate(data, rt.remaining());
+        } else if (r->size() < fast_handshake_reply_min_size) {
+            ESP_LOGE("KA", "Invalid %s size %d.", "target reply", r->size());
+            return pn532::channel_error::malformed;
+        }
+        header target_header{};
+        std::copy_n(std::begin(*r), header::array_size, std::begin(target_header));
+        setup_rx(target_header);
+        _did_handshake = true;
+        if ((*r)[header::array_size] != _tx_seq) {
+            ESP_LOGE("KA", "Message out of sequence: expected %d, got %d.", _tx_seq, (*r)[header::array_size]);
+            return pn532::channel_error::malformed;
+        }
+        if (const auto r_open = open_message(_rx, _buffer, r->data() + header::array_size, r->size() - header::array_size); not r_open) {
+            return r_open.error();
+        }
+        ++_tx_seq;
+        return _buffer;
+    }
+
+    result<mlab::range<std::uint8_t const *>> secure_initiator::transmit(message_buffer &buffer, ms timeout) {
+        mlab::reduce_timeout rt{timeout};
+        const std::uint8_t seq = _tx_seq;
+        seal_in_place(_tx, buffer, seq);
+        pn532::channel_error last_error = pn532::channel_error::timeout;
+        const unsigned retransmissions = _link != nullptr ? _link->rtt().retries() : _max_retransmissions;
+        const unsigned attempts = 1 + retransmissions;
+        for (unsigned attempt = 0; attempt < attempts; ++attempt) {
+            if (attempt > 0) {
+                ++_stats.retransmissions;
+                if (_link != nullptr) {
+                    _link->record_retry();
+                    _link->rtt().on_loss();
+                }
+                ESP_LOGW("KA", "Retransmitting message %d (%d/%d).", seq, attempt, retransmissions);
+            }
+            // Either the estimated timeout, or split the remaining time among the remaining attempts
+            const auto attempt_timeout = _link != nullptr ? std::min(rt.remaining(), _link->rtt().timeout())
+                                                          : rt.remaining() / (attempts - attempt);
+            const auto start = esp_timer_get_time();
+            if (auto r = _raw_layer->communicate(buffer.frame(), attempt_timeout); not r) {
+                if (not is_transient(r.error())) {
+                    return r.error();
+                }
+                if (_link != nullptr and r.error() == pn532::channel_error::timeout) {
+                    _link->record_timeout();
+                }
+                last_error = r.error();
+                continue;
+            } else {
+                // Take ownership of the raw layer's buffer, no copy
+                _rx_frame = std::move(*r);
+            }
+            if (_rx_frame.empty() or _rx_frame.front() != seq) {
+                ESP_LOGW("KA", "Discarding a reply out of sequence.");
+                last_error = pn532::channel_error::malformed;
+                continue;
+            }
+            // A corrupted reply does not advance the rx state, so we can just ask again
+            if (auto r_open = open_in_place(_rx, _rx_frame); r_open) {
+                ++_tx_seq;
+                if (_link != nullptr) {
+                    // Karn's algorithm: a retransmitted round trip cannot be attributed to either attempt
+                    if (attempt == 0) {
+                        _link->rtt().sample(std::chrono::microseconds{esp_timer_get_time() - start});
+                    }
+                    _link->rtt().on_success();
+                }
+                return r_open;
+            } else {
+                last_error = r_open.error();
+            }
+        }
+        if (_link != nullptr) {
+            _link->rtt().on_loss();
+        }
+        return last_error;
+    }
+
     result<mlab::bin_data> secure_initiator::communicate(const mlab::bin_data &data, ms timeout) {
         if (_raw_layer == nullptr) {
             return pn532::channel_error::app_error;
         }
         mlab::reduce_timeout rt{timeout};
+        if (not _did_handshake and _has_known_peer) {
+            return communicate_with_fast_handshake(data, rt.remaining());
+        }
         if (const auto r = handshake(rt.remaining()); not r) {
             return r.error();
         }
-        _buffer.resize(data.size() + crypto_secretstream_xchacha20poly1305_ABYTES);
-        crypto_secretstream_xchacha20poly1305_push(&_tx, _buffer.data(), nullptr, data.data(), data.size(), nullptr, 0, 0);
-        if (const auto r = _raw_layer->communicate(_buffer, rt.remaining()); not r) {
+        const auto payload = _tx_buffer.prepare(data.size());
+        std::copy(std::begin(data), std::end(data), std::begin(payload));
+        if (const auto r = transmit(_tx_buffer, rt.remaining()); not r) {
             return r.error();
-        } else if (r->size() < crypto_secretstream_xchacha20poly1305_ABYTES) {
-            ESP_LOGE("KA", "Invalid %s size %d.", "received msg", r->size());
-            return pn532::channel_error::malformed;
         } else {
-            _buffer.resize(r->size() - crypto_secretstream_xchacha20poly1305_ABYTES);
-            if (0 != crypto_secretstream_xchacha20poly1305_pull(
-                             &_rx, _buffer.data(), nullptr, nullptr, r->data(), r->size(), nullptr, 0)) {
-                ESP_LOGE("KA", "Failed decrypting incoming message.");
-                return pn532::channel_error::app_error;
+            return mlab::bin_data::chain(*r);
+        }
+    }
+
+    result<mlab::range<std::uint8_t const *>> secure_initiator::communicate(message_buffer &buffer, ms timeout) {
+        if (_raw_layer == nullptr) {
+            return pn532::channel_error::app_error;
+        }
+        mlab::reduce_timeout rt{timeout};
+        if (not _did_handshake) {
+            // The handshake happens once per session, no need to optimize it: go through the copying version
+            const auto payload = buffer.payload();
+            if (auto r = communicate(mlab::bin_data::chain(payload), rt.remaining()); not r) {
+                return r.error();
+            } else {
+                _rx_frame = std::move(*r);
+                return mlab::make_range<std::uint8_t const *>(_rx_frame.data(), _rx_frame.data() + _rx_frame.size());
             }
-            return _buffer;
         }
+        return transmit(buffer, rt.remaining());
     }
 
-    result<mlab::bin_data> secure_target::receive(ms timeout) {
+    result<mlab::range<std::uint8_t const *>> secure_target::receive_view(ms timeout) {
         if (_raw_layer == nullptr) {
             return pn532::channel_error::app_error;
         }
@@ -143,19 +632,73 @@ namespace ka::p2p {
         if (const auto r = handshake(rt.remaining()); not r) {
             return r.error();
         }
-        if (const auto r = _raw_layer->receive(rt.remaining()); not r) {
+        if (_has_pending_rx) {
+            // Already received and decrypted during the handshake
+            _has_pending_rx = false;
+            return mlab::make_range<std::uint8_t const *>(_buffer.data(), _buffer.data() + _buffer.size());
+        }
+        while (true) {
+            if (auto r = _raw_layer->receive(rt.remaining()); not r) {
+                return r.error();
+            } else {
+                _rx_frame = std::move(*r);
+            }
+            if (_rx_frame.empty()) {
+                ESP_LOGE("KA", "Invalid %s size %d.", "received msg", 0);
+                return pn532::channel_error::malformed;
+            }
+            if (is_handshake_retransmission(_rx_frame)) {
+                // The initiator did not get the reply to the single round trip handshake
+                ++_stats.duplicates;
+                if (const auto r_send = _raw_layer->send(_last_reply, rt.remaining()); not r_send) {
+                    return r_send.error();
+                }
+            } else if (const std::uint8_t seq = _rx_frame.front(); seq == _rx_seq) {
+                if (auto r_open = open_in_place(_rx, _rx_frame); r_open) {
+                    _reply_seq = seq;
+                    ++_rx_seq;
+                    _last_reply_is_handshake = false;
+                    return r_open;
+                }
+                // Corrupted in transit: the initiator gets no reply, and will retransmit
+            } else if (_has_last_reply and seq == _reply_seq) {
+                // The initiator did not get our last reply
+                ++_stats.duplicates;
+                if (const auto r_send = _raw_layer->send(_last_reply, rt.remaining()); not r_send) {
+                    return r_send.error();
+                }
+            } else {
+                ESP_LOGE("KA", "Message out of sequence: expected %d, got %d.", _rx_seq, seq);
+                return pn532::channel_error::malformed;
+            }
+        }
+    }
+
+    result<> secure_target::send(message_buffer &buffer, ms timeout) {
+        if (_reply_needs_header) {
+            // Only the first reply after a single round trip handshake, go through the copying version
+            const auto payload = buffer.payload();
+            return send(mlab::bin_data::chain(payload), timeout);
+        }
+        if (_raw_layer == nullptr) {
+            return pn532::channel_error::app_error;
+        }
+        mlab::reduce_timeout rt{timeout};
+        if (const auto r = handshake(rt.remaining()); not r) {
+            return r.error();
+        }
+        seal_in_place(_tx, buffer, _reply_seq);
+        // Keep the reply for retransmissions by swapping storage with the caller, who gets the previous reply's
+        _last_reply.swap(buffer.frame());
+        _has_last_reply = true;
+        return _raw_layer->send(_last_reply, rt.remaining());
+    }
+
+    result<mlab::bin_data> secure_target::receive(ms timeout) {
+        if (auto r = receive_view(timeout); not r) {
             return r.error();
-        } else if (r->size() < crypto_secretstream_xchacha20poly1305_ABYTES) {
-            ESP_LOGE("KA", "Invalid %s size %d.", "received msg", r->size());
-            return pn532::channel_error::malformed;
         } else {
-            _buffer.resize(r->size() - crypto_secretstream_xchacha20poly1305_ABYTES);
-            if (0 != crypto_secretstream_xchacha20poly1305_pull(
-                             &_rx, _buffer.data(), nullptr, nullptr, r->data(), r->size(), nullptr, 0)) {
-                ESP_LOGE("KA", "Failed decrypting incoming message.");
-                return pn532::channel_error::app_error;
-            }
-            return _buffer;
+            return mlab::bin_data::chain(*r);
         }
     }
 
@@ -167,11 +710,19 @@ namespace ka::p2p {
         if (const auto r = handshake(rt.remaining()); not r) {
             return r.error();
         }
-        _buffer.resize(data.size() + crypto_secretstream_xchacha20poly1305_ABYTES);
-        crypto_secretstream_xchacha20poly1305_push(&_tx, _buffer.data(), nullptr, data.data(), data.size(), nullptr, 0, 0);
-        if (const auto r = _raw_layer->send(_buffer, rt.remaining()); not r) {
-            return r.error();
+        if (not _reply_needs_header) {
+            const auto payload = _tx_buffer.prepare(data.size());
+            std::copy(std::begin(data), std::end(data), std::begin(payload));
+            return send(_tx_buffer, rt.remaining());
         }
-        return mlab::result_success;
+        // After a single round trip handshake, the first reply carries our header
+        seal_message(_tx, _buffer, header::array_size, _reply_seq, data);
+        std::copy(std::begin(_hdr), std::end(_hdr), std::begin(_buffer));
+        // Keep it for retransmissions like any other reply
+        _last_reply = _buffer;
+        _has_last_reply = true;
+        _last_reply_is_handshake = true;
+        _reply_needs_header = false;
+        return _raw_layer->send(_last_reply, rt.remaining());
     }
-}// namespace ka::p2p
\ No newline at end of file
+}// namespace ka::p2p
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <cmath>
+#include <esp_heap_caps.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <ka/telemetry.hpp>
+#include <limits>
+
+namespace ka {
+
+    namespace {
+        constexpr auto relaxed = std::memory_order_relaxed;
+
+        void write_varint(mlab::bin_data &bd, std::uint32_t v) {
+            while (v >= 0x80) {
+                bd << std::uint8_t((v & 0x7f) | 0x80);
+                v >>= 7;
+            }
+            bd << std::uint8_t(v);
+        }
+
+        [[nodiscard]] std::uint32_t read_varint(mlab::bin_stream &s) {
+            std::uint32_t v = 0;
+            for (unsigned shift = 0; shift < 35; shift += 7) {
+                const std::uint8_t b = s.pop();
+                if (s.bad()) {
+                    return 0;
+                }
+                v |= std::uint32_t(b & 0x7f) << shift;
+                if ((b & 0x80) == 0) {
+                    return v;
+                }
+            }
+            s.set_bad();
+            return 0;
+        }
+
+        template <class K>
+        void write_counters(mlab::bin_data &bd, std::vector<std::pair<K, std::uint32_t>> const &counters) {
+            // Up to 256 keys can be nonzero, which does not fit a byte
+            write_varint(bd, std::uint32_t(counters.size()));
+            for (auto const &[key, count] : counters) {
+                bd << std::uint8_t(key);
+                write_varint(bd, count);
+            }
+        }
+
+        template <class K>
+        void read_counters(mlab::bin_stream &s, std::vector<std::pair<K, std::uint32_t>> &counters) {
+            const auto size = read_varint(s);
+            // Each entry takes at least two bytes
+            if (s.bad() or size > s.remaining() / 2) {
+                s.set_bad();
+                counters.clear();
+                return;
+            }
+            counters.resize(size);
+            for (auto &[key, count] : counters) {
+                key = static_cast<K>(s.pop());
+                count = read_varint(s);
+            }
+        }
+    }// namespace
+
+    std::size_t latency_buckets::index_of(std::chrono::microseconds latency) {
+        const auto v = std::uint32_t(std::clamp<std::int64_t>(latency.count(), 0, std::numeric_limits<std::uint32_t>::max()));
+        if (v < 4) {
+            return v;
+        }
+        // Position of the most significant bit, and the two bits right after it
+        const unsigned msb = 31 - __builtin_clz(v);
+        const std::size_t index = 4 * (msb - 1) + ((v >> (msb - 2)) & 0b11);
+        return std::min(index, count - 1);
+    }
+
+    std::chrono::microseconds latency_buckets::lower_bound(std::size_t index) {
+        if (index < 4) {
+            return std::chrono::microseconds{index};
+        }
+        const std::size_t msb = index / 4 + 1;
+        return std::chrono::microseconds{std::int64_t(4 + index % 4) << (msb - 2)};
+    }
+
+    std::uint32_t telemetry_snapshot::taps() const {
+        std::uint32_t total = taps_ok;
+        for (auto const &[e, count] : tap_failures) {
+            total += count;
+        }
+        return total;
+    }
+
+    std::uint32_t telemetry_snapshot::failures_of(desfire::error e) const {
+        const auto it = std::find_if(std::begin(tap_failures), std::end(tap_failures), [&](auto const &p) { return p.first == e; });
+        return it != std::end(tap_failures) ? it->second : 0;
+    }
+
+    std::chrono::microseconds telemetry_snapshot::latency_percentile(float q) const {
+        std::uint32_t total = 0;
+        for (auto const &[index, count] : tap_latency) {
+            total += count;
+        }
+        if (total == 0) {
+            return std::chrono::microseconds{0};
+        }
+        const auto threshold = std::uint32_t(std::ceil(std::clamp(q, 0.f, 1.f) * float(total)));
+        std::uint32_t cumulative = 0;
+        for (auto const &[index, count] : tap_latency) {
+            cumulative += count;
+            if (cumulative >= threshold) {
+                return latency_buckets::lower_bound(index + 1);
+            }
+        }
+        return latency_buckets::lower_bound(tap_latency.back().first + 1);
+    }
+
+    telemetry &telemetry::instance() {
+        static telemetry _instance{};
+        return _instance;
+    }
+
+    void telemetry::record_tap(std::chrono::microseconds latency) {
+        _taps_ok.fetch_add(1, relaxed);
+        _tap_latency[latency_buckets::index_of(latency)].fetch_add(1, relaxed);
+    }
+
+    void telemetry::record_tap(std::chrono::microseconds latency, desfire::error e) {
+        _tap_failures[std::uint8_t(e)].fetch_add(1, relaxed);
+        _tap_latency[latency_buckets::index_of(latency)].fetch_add(1, relaxed);
+    }
+
+    void telemetry::record_failed_scan(pn532::channel_error e) {
+        _failed_scans[std::min(std::size_t(e), max_channel_errors - 1)].fetch_add(1, relaxed);
+    }
+
+    void telemetry::record_nvs_commit() {
+        _nvs_commits.fetch_add(1, relaxed);
+    }
+
+    telemetry_snapshot telemetry::snapshot(const char *nvs_partition) const {
+        telemetry_snapshot s{};
+        s.uptime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::microseconds{esp_timer_get_time()});
+        s.free_heap = esp_get_free_heap_size();
+        s.min_free_heap = esp_get_minimum_free_heap_size();
+        s.largest_free_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        // Not fatal, e.g. if NVS was never initialized
+        if (nvs_stats_t nvs_stats{}; nvs_get_stats(nvs_partition, &nvs_stats) == ESP_OK) {
+            s.nvs_used_entries = nvs_stats.used_entries;
+            s.nvs_free_entries = nvs_stats.free_entries;
+        }
+        s.nvs_commits = _nvs_commits.load(relaxed);
+        s.taps_ok = _taps_ok.load(relaxed);
+        for (std::size_t i = 0; i < _tap_failures.size(); ++i) {
+            if (const auto count = _tap_failures[i].load(relaxed); count > 0) {
+                s.tap_failures.emplace_back(static_cast<desfire::error>(i), count);
+            }
+        }
+        for (std::size_t i = 0; i < _failed_scans.size(); ++i) {
+            if (const auto count = _failed_scans[i].load(relaxed); count > 0) {
+                s.failed_scans.emplace_back(static_cast<pn532::channel_error>(i), count);
+            }
+        }
+        for (std::size_t i = 0; i < _tap_latency.size(); ++i) {
+            if (const auto count = _tap_latency[i].load(relaxed); count > 0) {
+                s.tap_latency.emplace_back(std::uint8_t(i), count);
+            }
+        }
+        return s;
+    }
+
+    void telemetry::reset() {
+        _taps_ok.store(0, relaxed);
+        _nvs_commits.store(0, relaxed);
+        for (auto &c : _tap_failures) {
+            c.store(0, relaxed);
+        }
+        for (auto &c : _failed_scans) {
+            c.store(0, relaxed);
+        }
+        for (auto &c : _tap_latency) {
+            c.store(0, relaxed);
+        }
+    }
+
+}// namespace ka
+
+namespace mlab {
+
+    bin_stream &operator>>(bin_stream &s, ka::telemetry_snapshot &snapshot) {
+        if (s.pop() != ka::telemetry_snapshot::format_version) {
+            s.set_bad();
+            return s;
+        }
+        snapshot.uptime = std::chrono::seconds{ka::read_varint(s)};
+        snapshot.free_heap = ka::read_varint(s);
+        snapshot.min_free_heap = ka::read_varint(s);
+        snapshot.largest_free_block = ka::read_varint(s);
+        snapshot.nvs_used_entries = ka::read_varint(s);
+        snapshot.nvs_free_entries = ka::read_varint(s);
+        snapshot.nvs_commits = ka::read_varint(s);
+        snapshot.taps_ok = ka::read_varint(s);
+        ka::read_counters(s, snapshot.tap_failures);
+        ka::read_counters(s, snapshot.failed_scans);
+        ka::read_counters(s, snapshot.tap_latency);
+        return s;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::telemetry_snapshot const &snapshot) {
+        bd << ka::telemetry_snapshot::format_version;
+        for (const std::uint32_t v : {std::uint32_t(snapshot.uptime.count()),
+                                      snapshot.free_heap, snapshot.min_free_heap, snapshot.largest_free_block,
+                                      snapshot.nvs_used_entries, snapshot.nvs_free_entries, snapshot.nvs_commits,
+                                      snapshot.taps_ok}) {
+            ka::write_varint(bd, v);
+        }
+        ka::write_counters(bd, snapshot.tap_failures);
+        ka::write_counters(bd, snapshot.failed_scans);
+        ka::write_counters(bd, snapshot.tap_latency);
+        return bd;
+    }
+}// namespace mlab
@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <esp_log.h>
+#include <ka/token_list.hpp>
+#include <sodium/crypto_generichash.h>
+
+namespace ka {
+
+    bool list_summary::operator==(list_summary const &other) const {
+        return version == other.version and size == other.size and hash == other.hash;
+    }
+
+    bool list_summary::operator!=(list_summary const &other) const {
+        return not operator==(other);
+    }
+
+    std::uint32_t token_list::version() const {
+        return _version;
+    }
+
+    std::size_t token_list::size() const {
+        return _items.size();
+    }
+
+    bool token_list::empty() const {
+        return _items.empty();
+    }
+
+    std::vector<token_id> const &token_list::items() const {
+        return _items;
+    }
+
+    bool token_list::contains(token_id const &id) const {
+        return std::binary_search(std::begin(_items), std::end(_items), id);
+    }
+
+    list_hash token_list::hash() const {
+        if (not _hash) {
+            list_hash h{};
+            crypto_generichash_state state{};
+            crypto_generichash_init(&state, nullptr, 0, h.size());
+            for (token_id const &id : _items) {
+                crypto_generichash_update(&state, id.data(), id.size());
+            }
+            crypto_generichash_final(&state, h.data(), h.size());
+            _hash = h;
+        }
+        return *_hash;
+    }
+
+    list_summary token_list::summary() const {
+        return {version(), std::uint32_t(size()), hash()};
+    }
+
+    bool token_list::apply(list_change const &change) {
+        const auto it = std::lower_bound(std::begin(_items), std::end(_items), change.id);
+        const bool present = it != std::end(_items) and *it == change.id;
+        if (change.op == list_op::add and not present) {
+            _items.insert(it, change.id);
+        } else if (change.op == list_op::remove and present) {
+            _items.erase(it);
+        } else {
+            return false;
+        }
+        _hash = std::nullopt;
+        return true;
+    }
+
+    void token_list::set_version(std::uint32_t version) {
+        _version = version;
+    }
+
+    void token_list::assign(std::vector<token_id> items, std::uint32_t version) {
+        _items = std::move(items);
+        std::sort(std::begin(_items), std::end(_items));
+        _items.erase(std::unique(std::begin(_items), std::end(_items)), std::end(_items));
+        _version = version;
+        _hash = std::nullopt;
+    }
+
+    void token_list::clear() {
+        assign({}, 0);
+    }
+
+    nvs::r<> token_list::store(nvs::namespc &ns, const char *key) const {
+        mlab::bin_data bd{mlab::prealloc(4 + _items.size() * token_id::array_size)};
+        bd << mlab::lsb32 << _version;
+        for (token_id const &id : _items) {
+            bd << id;
+        }
+        return ns.set<mlab::bin_data>(key, bd);
+    }
+
+    nvs::r<> token_list::load(nvs::const_namespc const &ns, const char *key) {
+        const auto r = ns.get<mlab::bin_data>(key);
+        if (not r) {
+            return r.error();
+        }
+        if (r->size() < 4 or (r->size() - 4) % token_id::array_size != 0 or (r->size() - 4) / token_id::array_size > max_size) {
+            ESP_LOGE("KA", "Invalid %s size.", key);
+            return nvs::error::invalid_length;
+        }
+        mlab::bin_stream s{*r};
+        std::uint32_t version = 0;
+        s >> mlab::lsb32 >> version;
+        std::vector<token_id> items{};
+        items.resize(s.remaining() / token_id::array_size);
+        for (token_id &id : items) {
+            s >> id;
+        }
+        assign(std::move(items), version);
+        return mlab::result_success;
+    }
+
+    versioned_token_list::versioned_token_list(std::size_t max_changelog) : _max_changelog{max_changelog} {}
+
+    void versioned_token_list::record(list_change const &change) {
+        _list.set_version(_list.version() + 1);
+        _changelog.push_back(change);
+        if (_changelog.size() > _max_changelog) {
+            _changelog.pop_front();
+        }
+    }
+
+    bool versioned_token_list::add(token_id const &id) {
+        const list_change change{list_op::add, id};
+        if (_list.apply(change)) {
+            record(change);
+            return true;
+        }
+        return false;
+    }
+
+    bool versioned_token_list::remove(token_id const &id) {
+        const list_change change{list_op::remove, id};
+        if (_list.apply(change)) {
+            record(change);
+            return true;
+        }
+        return false;
+    }
+
+    void versioned_token_list::restore(std::vector<token_id> items, std::uint32_t version) {
+        _list.assign(std::move(items), version);
+        _changelog.clear();
+    }
+
+    token_list const &versioned_token_list::list() const {
+        return _list;
+    }
+
+    std::uint32_t versioned_token_list::version() const {
+        return _list.version();
+    }
+
+    std::uint32_t versioned_token_list::first_logged_version() const {
+        return version() - std::uint32_t(_changelog.size());
+    }
+
+    std::optional<std::vector<list_change>> versioned_token_list::delta_since(std::uint32_t version) const {
+        if (version < first_logged_version() or version > this->version()) {
+            return std::nullopt;
+        }
+        const auto first = std::next(std::begin(_changelog), version - first_logged_version());
+        return std::vector<list_change>{first, std::end(_changelog)};
+    }
+
+}// namespace ka
+
+namespace mlab {
+
+    bin_stream &operator>>(bin_stream &s, ka::list_change &change) {
+        if (s.remaining() < 1 + ka::token_id::array_size) {
+            s.set_bad();
+            return s;
+        }
+        const auto op = s.pop();
+        if (op != std::uint8_t(ka::list_op::add) and op != std::uint8_t(ka::list_op::remove)) {
+            s.set_bad();
+            return s;
+        }
+        change.op = static_cast<ka::list_op>(op);
+        return s >> change.id;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::list_change const &change) {
+        return bd << std::uint8_t(change.op) << change.id;
+    }
+
+    bin_stream &operator>>(bin_stream &s, ka::list_summary &summary) {
+        return s >> mlab::lsb32 >> summary.version >> mlab::lsb32 >> summary.size >> summary.hash;
+    }
+
+    bin_data &operator<<(bin_data &bd, ka::list_summary const &summary) {
+        return bd << mlab::lsb32 << summary.version << mlab::lsb32 << summary.size << summary.hash;
+    }
+}// namespace mlab
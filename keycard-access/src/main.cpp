@@ -4,6 +4,7 @@
 #include <freertos/task.h>
 #include <ka/config.hpp>
 #include <ka/gate.hpp>
+#include <ka/gate_scheduler.hpp>
 #include <ka/p2p_ops.hpp>
 #include <mlab/strutils.hpp>
 #include <pn532/controller.hpp>
@@ -14,6 +15,7 @@
 #include <neo/any_fx.hpp>
 #include <neo/timer.hpp>
 #include <pn532/esp32/irq_assert.hpp>
+#include <atomic>
 #include <thread>
 
 static constexpr rmt_channel_t rmt_channel = RMT_CHANNEL_0;
@@ -217,21 +219,22 @@ struct fiera_gate_responder final : public ka::gate_responder {
 
 struct fiera_keymaker_responder final : public ka::member_token_responder {
     ka::keymaker &km;
-    unsigned token_idx;
     ka::gate_config cfg;
     neopx_status &s;
 
-    explicit fiera_keymaker_responder(ka::keymaker &km_, ka::gate_config cfg_, neopx_status &s_) : km{km_}, token_idx{0}, cfg{cfg_}, s{s_} {}
+    explicit fiera_keymaker_responder(ka::keymaker &km_, ka::gate_config cfg_, neopx_status &s_) : km{km_}, cfg{cfg_}, s{s_} {}
 
     desfire::result<> interact_with_token_internal(ka::member_token &token) {
         ka::identity who;
         TRY_RESULT(token.get_id()) {
             who.id = *r;
         }
-        who.publisher = "Mittelab";
-        {
+        if (const auto known = km.members().find(who.id); known) {
+            who = known->who;
+        } else {
+            who.publisher = "Mittelab";
             char buffer[16];
-            std::sprintf(buffer, "Token%d", token_idx);
+            std::snprintf(buffer, sizeof(buffer), "Token%d", int(km.members().size()));
             who.holder = buffer;
         }
         ESP_LOGI(LOG_PFX, "Programming token as: %s", who.holder.c_str());
@@ -243,7 +246,9 @@ struct fiera_keymaker_responder final : public ka::member_token_responder {
         TRY(token.deploy(km, who))
         TRY(token.enroll_gate(km, cfg, who))
         ESP_LOGI(LOG_PFX, "Enrolled correctly!");
-        ++token_idx;
+        if (not km.members().insert(who) or not km.members().add_gate(who.id, cfg.id)) {
+            ESP_LOGW(LOG_PFX, "Could not record %s in the roster.", who.holder.c_str());
+        }
 
         return mlab::result_success;
     }
@@ -264,7 +269,7 @@ struct fiera_keymaker_responder final : public ka::member_token_responder {
     }
 
     void on_leaving_rf(pn532::scanner &scanner, pn532::scanned_target const &target) override {
-        s.set_pulse_gradient(default_gradients[token_idx % default_gradients.size()], 0.2, 0.6);
+        s.set_pulse_gradient(default_gradients[km.members().size() % default_gradients.size()], 0.2, 0.6);
     }
 };
 
@@ -291,6 +296,9 @@ extern "C" void app_main() {
 
     ka::keymaker km{};
     km._kp.generate_from_pwhash("foobar");
+    if (not km.open_store()) {
+        ESP_LOGW(LOG_PFX, "No keymaker store, members will be forgotten at restart.");
+    }
     ka::gate g{};
     g.configure_demo_from_pwhash("foobar2", ka::gate_id{0}, "Fiera", ka::pub_key{km.keys().raw_pk()});
 
@@ -306,11 +314,16 @@ extern "C" void app_main() {
     ESP_LOGI(LOG_PFX, "Waiting 2s to ensure the serial is attached and visible...");
     vTaskDelay(pdMS_TO_TICKS(2000));
 
+    std::atomic<ka::gate_scheduler *> active_scheduler{nullptr};
+
     auto switch_activated = [&]() {
         for (bool asserted = irq(1s); true; asserted = irq(1s)) {
             if (asserted) {
                 ESP_LOGI(LOG_PFX, "Asserted interrupt.");
                 scanner.stop();
+                if (auto *scheduler = active_scheduler.load(); scheduler != nullptr) {
+                    scheduler->stop();
+                }
             } else {
                 ESP_LOGI(LOG_PFX, "Not asserted.");
             }
@@ -323,8 +336,13 @@ extern "C" void app_main() {
         if (gpio_get_level(switch_read) == 0) {
             std::printf("Acting as gate.\n");
             fiera_gate_responder responder{g, s};
+            ka::pn532_card_service cards{controller, responder};
+            ka::p2p::pn532_dep_target admin{controller};
+            ka::gate_scheduler scheduler{cards, admin, g};
             s.set_spinner(0xaaaaaa_rgb);
-            scanner.loop(responder, false /* already performed */);
+            active_scheduler = &scheduler;
+            scheduler.loop();
+            active_scheduler = nullptr;
         } else {
             std::printf("Acting as keymaker.\n");
             s.set_pulse_gradient(default_gradients[0], 0.2, 0.6);
@@ -1,14 +1,40 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <desfire/esp32/cipher_provider.hpp>
 #include <desfire/esp32/utils.hpp>
+#include <esp_heap_trace.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include <functional>
 #include <ka/config.hpp>
 #include <ka/desfire_fs.hpp>
+#include <ka/enrollment_pipeline.hpp>
 #include <ka/gate.hpp>
+#include <ka/gate_directory.hpp>
+#include <ka/gate_registry.hpp>
+#include <ka/gate_scheduler.hpp>
 #include <ka/key_pair.hpp>
+#include <ka/link_quality.hpp>
+#include <ka/member_roster.hpp>
 #include <ka/member_token.hpp>
 #include <ka/nvs.hpp>
+#include <ka/nvs_cache.hpp>
+#include <ka/ota.hpp>
 #include <ka/p2p_ops.hpp>
+#include <ka/p2p_stream.hpp>
+#include <ka/production_line.hpp>
+#include <ka/provisioning_plan.hpp>
+#include <ka/revocation_record.hpp>
+#include <ka/rpc.hpp>
+#include <ka/secure_p2p.hpp>
+#include <ka/telemetry.hpp>
 #include <pn532/esp32/hsu.hpp>
+#include <mutex>
+#include <optional>
+#include <sodium/crypto_box.h>
+#include <sodium/randombytes.h>
 #include <thread>
 #include <unity.h>
 
@@ -124,6 +150,227 @@ namespace ut {
         bool warn_before_formatting = true;
     } instance{};
 
+    /**
+     * @brief In-memory stand-in for a PN532 DEP link, so that the P2P layers can be tested without hardware.
+     */
+    struct loopback_link {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::optional<mlab::bin_data> to_target;
+        std::optional<mlab::bin_data> to_initiator;
+        std::atomic<unsigned> round_trips{0};
+        /**
+         * Each frame is copied once into the link, which allocates.
+         */
+        std::atomic<unsigned> frame_copies{0};
+        /**
+         * Number of upcoming replies from the target that are lost.
+         */
+        std::atomic<unsigned> replies_to_drop{0};
+    };
+
+    class loopback_initiator final : public pn532::p2p::initiator {
+        loopback_link &_link;
+
+    public:
+        explicit loopback_initiator(loopback_link &link) : _link{link} {}
+
+        pn532::result<mlab::bin_data> communicate(mlab::bin_data const &data, std::chrono::milliseconds timeout) override {
+            std::unique_lock lock{_link.mutex};
+            _link.to_target = data;
+            ++_link.round_trips;
+            ++_link.frame_copies;
+            _link.cv.notify_all();
+            if (not _link.cv.wait_for(lock, timeout, [&] { return _link.to_initiator.has_value(); })) {
+                _link.to_target.reset();
+                return pn532::channel_error::timeout;
+            }
+            mlab::bin_data retval = std::move(*_link.to_initiator);
+            _link.to_initiator.reset();
+            return retval;
+        }
+    };
+
+    class loopback_target final : public pn532::p2p::target {
+        loopback_link &_link;
+
+    public:
+        explicit loopback_target(loopback_link &link) : _link{link} {}
+
+        pn532::result<mlab::bin_data> receive(std::chrono::milliseconds timeout) override {
+            std::unique_lock lock{_link.mutex};
+            if (not _link.cv.wait_for(lock, timeout, [&] { return _link.to_target.has_value(); })) {
+                return pn532::channel_error::timeout;
+            }
+            mlab::bin_data retval = std::move(*_link.to_target);
+            _link.to_target.reset();
+            return retval;
+        }
+
+        pn532::result<> send(mlab::bin_data const &data, std::chrono::milliseconds) override {
+            std::unique_lock lock{_link.mutex};
+            if (_link.replies_to_drop > 0) {
+                --_link.replies_to_drop;
+                return mlab::result_success;
+            }
+            _link.to_initiator = data;
+            ++_link.frame_copies;
+            _link.cv.notify_all();
+            return mlab::result_success;
+        }
+    };
+
+    /**
+     * @brief A gate serving @ref p2p::register_gate_handlers to a keymaker over a @ref loopback_link, on its own thread.
+     * The server stops when the keymaker stays silent for 500 ms; call @ref stop before checking what it served.
+     */
+    class loopback_gate_session {
+        loopback_link _link{};
+        loopback_initiator _raw_initiator{_link};
+        loopback_target _raw_target{_link};
+        p2p::secure_target _target;
+        p2p::secure_initiator _initiator;
+        rpc::dispatcher _dispatcher{};
+        std::atomic<unsigned> _batches_served{0};
+        std::thread _server;
+
+    public:
+        /**
+         * @param extra_handlers Registers more handlers on the dispatcher, before the server starts.
+         */
+        loopback_gate_session(gate &g, keymaker const &km, std::function<void(rpc::dispatcher &)> const &extra_handlers = {})
+            : _target{_raw_target, g.keys()},
+              _initiator{_raw_initiator, km.keys(), pub_key{g.keys().raw_pk()}} {
+            p2p::register_gate_handlers(_dispatcher, g, _target);
+            if (extra_handlers) {
+                extra_handlers(_dispatcher);
+            }
+            _server = std::thread{[&] {
+                while (_dispatcher.serve_one(_target, 500ms)) {
+                    ++_batches_served;
+                }
+            }};
+        }
+
+        loopback_gate_session(loopback_gate_session const &) = delete;
+        loopback_gate_session &operator=(loopback_gate_session const &) = delete;
+
+        ~loopback_gate_session() { stop(); }
+
+        void stop() {
+            if (_server.joinable()) {
+                _server.join();
+            }
+        }
+
+        [[nodiscard]] p2p::secure_initiator &initiator() { return _initiator; }
+        [[nodiscard]] loopback_link &link() { return _link; }
+        [[nodiscard]] rpc::dispatcher const &dispatcher() const { return _dispatcher; }
+        [[nodiscard]] unsigned batches_served() const { return _batches_served; }
+    };
+
+    /**
+     * @brief A @ref p2p::dep_target on a @ref loopback_link, whose activations follow a script: each entry is the error
+     * returned, or `std::nullopt` for an initiator showing up. Past the end of the script, every activation succeeds.
+     */
+    class scripted_dep_target final : public p2p::dep_target {
+        loopback_target _raw;
+        std::vector<std::optional<pn532::channel_error>> _script;
+        std::function<void(std::size_t)> _on_activation;
+        std::size_t _activations = 0;
+
+    public:
+        /**
+         * @param on_activation Called with the 1-based count of the activation, before it succeeds.
+         */
+        scripted_dep_target(loopback_link &link, std::vector<std::optional<pn532::channel_error>> script, std::function<void(std::size_t)> on_activation = {})
+            : _raw{link}, _script{std::move(script)}, _on_activation{std::move(on_activation)} {}
+
+        pn532::result<> activate(pn532::nfcid_3t const &, std::chrono::milliseconds) override {
+            const auto n = ++_activations;
+            if (n <= _script.size() and _script[n - 1]) {
+                return *_script[n - 1];
+            }
+            if (_on_activation) {
+                _on_activation(n);
+            }
+            return mlab::result_success;
+        }
+
+        pn532::result<mlab::bin_data> receive(std::chrono::milliseconds timeout) override {
+            return _raw.receive(timeout);
+        }
+
+        pn532::result<> send(mlab::bin_data const &data, std::chrono::milliseconds timeout) override {
+            return _raw.send(data, timeout);
+        }
+
+        [[nodiscard]] std::size_t activations() const { return _activations; }
+    };
+
+    /**
+     * @brief A @ref p2p::dep_target on a @ref loopback_link that is activated only after @ref summon, like a PN532 that
+     * sees an initiator only while a keymaker is held on it.
+     */
+    class summoned_dep_target final : public p2p::dep_target {
+        loopback_target _raw;
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        bool _summoned = false;
+        std::atomic<unsigned> _activations{0};
+
+    public:
+        explicit summoned_dep_target(loopback_link &link) : _raw{link} {}
+
+        /**
+         * @brief The next (or current) call to @ref activate succeeds.
+         */
+        void summon() {
+            {
+                std::lock_guard lock{_mutex};
+                _summoned = true;
+            }
+            _cv.notify_all();
+        }
+
+        pn532::result<> activate(pn532::nfcid_3t const &, std::chrono::milliseconds timeout) override {
+            std::unique_lock lock{_mutex};
+            if (not _cv.wait_for(lock, timeout, [&] { return _summoned; })) {
+                return pn532::channel_error::timeout;
+            }
+            _summoned = false;
+            ++_activations;
+            return mlab::result_success;
+        }
+
+        pn532::result<mlab::bin_data> receive(std::chrono::milliseconds timeout) override {
+            return _raw.receive(timeout);
+        }
+
+        pn532::result<> send(mlab::bin_data const &data, std::chrono::milliseconds timeout) override {
+            return _raw.send(data, timeout);
+        }
+
+        [[nodiscard]] unsigned activations() const { return _activations; }
+    };
+
+    /**
+     * @brief A @ref card_service with an empty field: each window just elapses.
+     */
+    class empty_field_card_service final : public card_service {
+        std::atomic<unsigned> _windows{0};
+
+    public:
+        void serve(std::chrono::milliseconds duration) override {
+            ++_windows;
+            std::this_thread::sleep_for(duration);
+        }
+
+        void stop() override {}
+
+        [[nodiscard]] unsigned windows() const { return _windows; }
+    };
+
     void test_wake_channel() {
         TEST_ASSERT(instance.channel != nullptr);
         TEST_ASSERT(instance.controller != nullptr);
@@ -713,6 +960,1794 @@ namespace ut {
 
         TEST_ASSERT_EQUAL(r_data->size(), sample_data.size());
         TEST_ASSERT_EQUAL_HEX8_ARRAY(sample_data.data(), r_data->data(), sample_data.size());
+
+        // Allocation-free getters
+        const auto is_invalid_length = [](auto const &r) { return not r and r.error() == nvs::error::invalid_length; };
+        TEST_ASSERT(ns->set("foo", sample_data));
+        TEST_ASSERT(ns->set<std::string>("bar", "baz"));
+        TEST_ASSERT(ns->commit());
+        std::array<std::uint8_t, 16> exact_buffer{};
+        std::array<std::uint8_t, 8> short_buffer{};
+        std::array<std::uint8_t, 32> long_buffer{};
+        TEST_ASSERT(ns->get_into("foo", exact_buffer));
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(sample_data.data(), exact_buffer.data(), exact_buffer.size());
+        TEST_ASSERT(is_invalid_length(ns->get_into("foo", short_buffer)));
+        TEST_ASSERT(is_invalid_length(ns->get_into("foo", long_buffer)));
+        TEST_ASSERT(std::all_of(std::begin(long_buffer), std::end(long_buffer), [](auto b) { return b == 0; }));
+        std::array<char, 8> str_buffer{};
+        std::array<char, 3> tight_str_buffer{};
+        const auto r_str = ns->get_into("bar", str_buffer);
+        TEST_ASSERT(r_str);
+        TEST_ASSERT(r_str and *r_str == "baz");
+        TEST_ASSERT(is_invalid_length(ns->get_into("bar", tight_str_buffer)));
+        TEST_ASSERT(ns->erase("foo"));
+        TEST_ASSERT(ns->erase("bar"));
+        TEST_ASSERT(ns->commit());
+    }
+
+    void test_nvs_write_back() {
+        nvs::nvs root{};
+        auto part = root.open_partition(NVS_DEFAULT_PART_NAME, false);
+        TEST_ASSERT(part != nullptr);
+        auto ns = part->open_namespc("ka");
+        TEST_ASSERT(ns != nullptr);
+        {
+            nvs::write_back_cache cache{ns, 0ms};
+            for (std::uint32_t i = 0; i < 10; ++i) {
+                cache.set<std::uint32_t>("foo", i);
+            }
+            TEST_ASSERT_EQUAL(1, cache.dirty_count());
+            // Pending values are visible before flushing, but not in NVS
+            const auto r_cached = cache.get<std::uint32_t>("foo");
+            TEST_ASSERT(r_cached and *r_cached == 9);
+            TEST_ASSERT(cache.flush());
+            TEST_ASSERT_EQUAL(0, cache.dirty_count());
+            const auto r_stored = ns->get<std::uint32_t>("foo");
+            TEST_ASSERT(r_stored and *r_stored == 9);
+
+            const auto stats = cache.stats();
+            TEST_ASSERT_EQUAL(10, stats.updates);
+            TEST_ASSERT_EQUAL(1, stats.writes);
+            ESP_LOGI("TEST", "Write amplification: %0.2f, flush latency: %lld us.",
+                     stats.write_amplification(), stats.last_flush_latency.count());
+
+            // Pending erase is flushed on destruction
+            cache.erase("foo");
+        }
+        TEST_ASSERT_FALSE(ns->get<std::uint32_t>("foo"));
+        {
+            // The background thread flushes by itself, and is joined on destruction
+            nvs::write_back_cache cache{ns, 50ms};
+            cache.set<std::uint32_t>("foo", 42);
+            std::this_thread::sleep_for(300ms);
+            TEST_ASSERT_EQUAL(0, cache.dirty_count());
+            const auto r_stored = ns->get<std::uint32_t>("foo");
+            TEST_ASSERT(r_stored and *r_stored == 42);
+            cache.erase("foo");
+        }
+        TEST_ASSERT_FALSE(ns->get<std::uint32_t>("foo"));
+    }
+
+    void test_gate_registry() {
+        // Deterministic pseudo-random keys, so that they need not be kept in RAM
+        const auto make_config = [](std::uint32_t i) {
+            gate_config cfg{};
+            cfg.id = gate_id{i};
+            std::uint32_t x = 0x9e3779b9 * (i + 1);
+            raw_pub_key pk{};
+            for (auto &b : pk) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                b = std::uint8_t(x);
+            }
+            cfg.gate_pub_key = pub_key{pk};
+            for (auto &b : cfg.app_base_key) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                b = std::uint8_t(x);
+            }
+            return cfg;
+        };
+
+        {
+            // Without a partition, the registry lives in RAM
+            gate_registry volatile_reg{};
+            TEST_ASSERT_FALSE(volatile_reg.is_persistent());
+            for (std::uint32_t i = 0; i < 3; ++i) {
+                TEST_ASSERT(volatile_reg.insert(make_config(i)));
+            }
+            TEST_ASSERT_EQUAL(3, std::uint32_t(volatile_reg.next_id()));
+            const auto r = volatile_reg.find(make_config(1).gate_pub_key);
+            TEST_ASSERT(r and r->id == gate_id{1});
+            // Without a master key, erased ids are reused
+            TEST_ASSERT(volatile_reg.erase(gate_id{2}));
+            TEST_ASSERT_FALSE(volatile_reg.is_retired(gate_id{2}));
+            TEST_ASSERT_EQUAL(2, std::uint32_t(volatile_reg.next_id()));
+        }
+
+        const auto region = flash_region::find(ka_store_partition);
+        TEST_ASSERT_FALSE(region.empty());
+        if (region.empty()) {
+            return;
+        }
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(region.partition, region.offset, region.size));
+
+        static constexpr std::uint32_t num_gates = 10000;
+        static constexpr std::uint32_t num_lookups = 1000;
+        {
+            gate_registry reg{};
+            TEST_ASSERT(reg.open(region));
+            TEST_ASSERT_EQUAL(0, std::uint32_t(reg.next_id()));
+
+            const auto insert_start = esp_timer_get_time();
+            for (std::uint32_t i = 0; i < num_gates; ++i) {
+                if (not reg.insert(make_config(i))) {
+                    TEST_FAIL_MESSAGE("Unable to insert gate.");
+                    return;
+                }
+            }
+            const auto insert_us = esp_timer_get_time() - insert_start;
+
+            const auto id_start = esp_timer_get_time();
+            for (std::uint32_t i = 0; i < num_lookups; ++i) {
+                const auto id = (i * 7919) % num_gates;
+                const auto r = reg.find(gate_id{id});
+                TEST_ASSERT(r and r->gate_pub_key.raw_pk() == make_config(id).gate_pub_key.raw_pk());
+            }
+            const auto id_us = esp_timer_get_time() - id_start;
+
+            const auto pk_start = esp_timer_get_time();
+            for (std::uint32_t i = 0; i < num_lookups; ++i) {
+                const auto id = (i * 7919) % num_gates;
+                const auto r = reg.find(make_config(id).gate_pub_key);
+                TEST_ASSERT(r and r->id == gate_id{id});
+            }
+            const auto pk_us = esp_timer_get_time() - pk_start;
+
+            const auto stats = reg.stats();
+            ESP_LOGI("TEST", "%lu gates: insert %lld us/gate, find by id %lld us, by key %lld us.",
+                     num_gates, insert_us / num_gates, id_us / num_lookups, pk_us / num_lookups);
+            ESP_LOGI("TEST", "Pages: %lu by id, %lu by key; %lu free sectors; %lu + %lu compactions; cache %lu hits, %lu misses.",
+                     stats.by_id.pages, stats.by_pub_key.pages, stats.by_id.free_sectors + stats.by_pub_key.free_sectors,
+                     stats.by_id.compactions, stats.by_pub_key.compactions, stats.cache.hits, stats.cache.misses);
+
+            // Changing the key of a gate drops the old key from the index
+            auto rekeyed = make_config(42);
+            rekeyed.gate_pub_key = make_config(num_gates + 1).gate_pub_key;
+            TEST_ASSERT(reg.insert(rekeyed));
+            TEST_ASSERT_FALSE(reg.find(make_config(42).gate_pub_key));
+            const auto r_rekeyed = reg.find(rekeyed.gate_pub_key);
+            TEST_ASSERT(r_rekeyed and r_rekeyed->id == gate_id{42});
+        }
+        {
+            // Everything survives a reboot, including what was still in the logs
+            gate_registry reg{};
+            TEST_ASSERT(reg.open(region));
+            TEST_ASSERT_EQUAL(num_gates, std::uint32_t(reg.next_id()));
+            const auto r_last = reg.find(gate_id{num_gates - 1});
+            TEST_ASSERT(r_last and r_last->app_base_key == make_config(num_gates - 1).app_base_key);
+            TEST_ASSERT_FALSE(reg.find(make_config(42).gate_pub_key));
+            TEST_ASSERT(reg.compact());
+            TEST_ASSERT_EQUAL(0, reg.stats().by_id.log_entries);
+            TEST_ASSERT(reg.find(gate_id{42}));
+        }
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(region.partition, region.offset, region.size));
+    }
+
+    void test_gate_id_allocation() {
+        keymaker km{};
+        const auto register_gate = [&](gate_id id) {
+            gate_config cfg{id, pub_key{key_pair{randomize}.raw_pk()}, gate_base_key{}};
+            cfg.app_base_key[0] = 0xba;
+            km.register_gate(cfg);
+            TEST_ASSERT(km.gates().find(id));
+        };
+        const auto ids = [](std::initializer_list<std::uint32_t> l) {
+            std::vector<gate_id> v{};
+            for (const auto id : l) {
+                v.emplace_back(id);
+            }
+            return v;
+        };
+
+        // Without affinity, ids are handed out in order
+        for (std::uint32_t i = 0; i < 3; ++i) {
+            TEST_ASSERT_EQUAL(i, std::uint32_t(km.allocate_gate_id()));
+            register_gate(km.allocate_gate_id());
+        }
+        // Affine gates fill the block of the gates they go with...
+        while (std::uint32_t(km.gates().next_id()) < gate_id::gates_per_app) {
+            register_gate(km.allocate_gate_id(ids({1})));
+        }
+        // ...and a new group starts a fresh block instead of sharing one
+        register_gate(km.allocate_gate_id());
+        TEST_ASSERT_EQUAL(14, std::uint32_t(km.gates().next_id()));
+        const auto lab = km.allocate_gate_id(ids({5}));
+        TEST_ASSERT_EQUAL(2 * gate_id::gates_per_app, std::uint32_t(lab));
+        register_gate(lab);
+        TEST_ASSERT_EQUAL(gate_id::gates_per_app - 1, km.gates().free_ids().size());
+        TEST_ASSERT(lab.app() == km.allocate_gate_id(ids({std::uint32_t(lab), 5})).app());
+
+        // Skipped ids are reused by gates without affinity
+        TEST_ASSERT_EQUAL(14, std::uint32_t(km.allocate_gate_id()));
+        register_gate(km.allocate_gate_id());
+        TEST_ASSERT_EQUAL(15, std::uint32_t(km.allocate_gate_id()));
+
+        // Decommissioned ids are retired, since a gate with the same id would derive the same keys, and members lose the gate
+        const identity who{token_id{0x04, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06}, "Member", "Mittelab"};
+        const identity other{token_id{0x04, 0x01, 0x02, 0x03, 0x04, 0x05, 0x07}, "Other member", "Mittelab"};
+        TEST_ASSERT(km.members().insert(who));
+        TEST_ASSERT(km.members().insert(other));
+        for (const auto gid : ids({0, 3, 5, 13, 14})) {
+            TEST_ASSERT(km.members().add_gate(who.id, gid));
+        }
+        TEST_ASSERT(km.members().add_gate(other.id, lab));
+        TEST_ASSERT(km.decommission_gate(gate_id{3}));
+        TEST_ASSERT_FALSE(km.gates().find(gate_id{3}));
+        TEST_ASSERT(km.gates().is_retired(gate_id{3}));
+        TEST_ASSERT_EQUAL(4, km.members().gates_of(who.id).size());
+        TEST_ASSERT_EQUAL(15, std::uint32_t(km.allocate_gate_id()));
+        TEST_ASSERT_NOT_EQUAL(3, std::uint32_t(km.allocate_gate_id(ids({0, 5}))));
+        TEST_ASSERT_FALSE(km.gates().insert(gate_config{gate_id{3}, pub_key{key_pair{randomize}.raw_pk()}, km.derive_gate_base_key(gate_id{3})}));
+
+        // The last gate too keeps its id
+        TEST_ASSERT(km.members().remove_gate(other.id, lab));
+        TEST_ASSERT(km.decommission_gate(lab));
+        TEST_ASSERT_EQUAL(std::uint32_t(lab) + 1, std::uint32_t(km.gates().next_id()));
+
+        // Gates 0, 5 in the first app, 13, 14 in the second; with a directory 0 and 13 share the file, so still two apps
+        // The other member has gates 1 and 1000 in apps 0 and 76; with a directory both fit the first app
+        TEST_ASSERT(km.members().add_gate(other.id, gate_id{1}));
+        TEST_ASSERT(km.members().add_gate(other.id, gate_id{1000}));
+        const auto usage = km.members().app_usage();
+        TEST_ASSERT(usage);
+        if (usage) {
+            TEST_ASSERT_EQUAL(2, usage->cards);
+            TEST_ASSERT_EQUAL(6, usage->gates);
+            TEST_ASSERT_EQUAL(4, usage->apps);
+            TEST_ASSERT_EQUAL(2, usage->max_apps);
+            TEST_ASSERT_EQUAL(3, usage->directory_apps);
+            TEST_ASSERT_EQUAL(2, usage->max_directory_apps);
+            TEST_ASSERT_EQUAL(2, usage->packed_apps);
+            TEST_ASSERT_EQUAL_FLOAT(2.f, usage->apps_per_card());
+            TEST_ASSERT_EQUAL_FLOAT(1.5f, usage->directory_apps_per_card());
+        }
+    }
+
+    void test_gate_directory() {
+        gate_directory dir{};
+        TEST_ASSERT_EQUAL(0, dir.size());
+        TEST_ASSERT_FALSE(dir.find(gate_id{150000}));
+
+        // Sparse ids land in the first apps, keeping their file and key number
+        std::vector<gate_id> gids{};
+        for (std::uint32_t i = 0; i < 2 * gate_id::gates_per_app; ++i) {
+            gids.emplace_back(150000 + 7919 * i);
+        }
+        for (const auto gid : gids) {
+            const auto loc = dir.assign(gid);
+            TEST_ASSERT(loc);
+            if (loc) {
+                TEST_ASSERT_EQUAL(gid.file(), loc->file());
+                TEST_ASSERT_EQUAL(gid.key_no(), loc->key_no());
+                TEST_ASSERT(gate_id::is_gate_app(loc->app()));
+            }
+        }
+        TEST_ASSERT_EQUAL(gids.size(), dir.size());
+        TEST_ASSERT_EQUAL(2, dir.apps());
+        TEST_ASSERT(dir.capacity() * 3 >= dir.size() * 4);
+        // Assigning again does not move a gate
+        TEST_ASSERT(dir.assign(gids.front()) == dir.find(gids.front()));
+        TEST_ASSERT_EQUAL(gids.size(), dir.size());
+
+        // Every location is used once
+        std::vector<std::uint32_t> locations{};
+        for (const auto gid : gids) {
+            const auto loc = dir.find(gid);
+            TEST_ASSERT(loc);
+            if (loc) {
+                locations.push_back(std::uint32_t(*loc));
+            }
+        }
+        std::sort(std::begin(locations), std::end(locations));
+        TEST_ASSERT(std::adjacent_find(std::begin(locations), std::end(locations)) == std::end(locations));
+        TEST_ASSERT_FALSE(dir.find(gate_id{7}));
+
+        // Round trip through the file format
+        mlab::bin_data bd{};
+        bd << dir;
+        TEST_ASSERT_EQUAL(2 + dir.capacity() * gate_directory::entry_size, bd.size());
+        gate_directory read_back{};
+        mlab::bin_stream s{bd};
+        s >> read_back;
+        TEST_ASSERT_FALSE(s.bad());
+        TEST_ASSERT_EQUAL(dir.size(), read_back.size());
+        for (const auto gid : gids) {
+            TEST_ASSERT(read_back.find(gid) == dir.find(gid));
+        }
+        auto gates = read_back.gates();
+        std::sort(std::begin(gates), std::end(gates));
+        TEST_ASSERT(gates == gids);
+
+        // Truncated or unknown files are rejected
+        mlab::bin_data truncated_bd = bd;
+        truncated_bd.resize(bd.size() - 1);
+        mlab::bin_stream truncated{truncated_bd};
+        truncated >> read_back;
+        TEST_ASSERT(truncated.bad());
+        bd[0] = gate_directory::version + 1;
+        mlab::bin_stream unknown{bd};
+        unknown >> read_back;
+        TEST_ASSERT(unknown.bad());
+    }
+
+    void test_member_roster() {
+        const auto make_identity = [](std::uint32_t i) {
+            identity who{};
+            // Token ids in increasing order, like a sorted bulk import
+            who.id = token_id{0x04, 0x00, 0x00, std::uint8_t(i >> 24), std::uint8_t(i >> 16), std::uint8_t(i >> 8), std::uint8_t(i)};
+            who.holder = "Member " + std::to_string(i);
+            who.publisher = "Mittelab";
+            return who;
+        };
+        static constexpr std::uint32_t num_gates = 50;
+
+        {
+            // Without a partition, the roster lives in RAM
+            member_roster volatile_roster{};
+            TEST_ASSERT_FALSE(volatile_roster.is_persistent());
+            TEST_ASSERT(volatile_roster.insert(make_identity(0)));
+            TEST_ASSERT(volatile_roster.add_gate(make_identity(0).id, gate_id{3}));
+            TEST_ASSERT_FALSE(volatile_roster.add_gate(make_identity(1).id, gate_id{3}));
+            TEST_ASSERT_EQUAL(1, volatile_roster.holders_of(gate_id{3}).size());
+            identity too_long = make_identity(1);
+            too_long.holder = std::string(member_roster::max_holder_size + 1, 'x');
+            TEST_ASSERT_FALSE(volatile_roster.insert(too_long));
+        }
+
+        const auto region = flash_region::find(ka_store_partition);
+        TEST_ASSERT_FALSE(region.empty());
+        if (region.empty()) {
+            return;
+        }
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(region.partition, region.offset, region.size));
+
+        static constexpr std::uint32_t num_members = 10000;
+        static constexpr std::uint32_t num_lookups = 1000;
+        {
+            member_roster roster{};
+            TEST_ASSERT(roster.open(region));
+
+            const auto insert_start = esp_timer_get_time();
+            for (std::uint32_t i = 0; i < num_members; ++i) {
+                const auto who = make_identity(i);
+                if (not roster.insert(who) or not roster.add_gate(who.id, gate_id{i % num_gates})) {
+                    TEST_FAIL_MESSAGE("Unable to insert member.");
+                    return;
+                }
+            }
+            const auto insert_us = esp_timer_get_time() - insert_start;
+            TEST_ASSERT_EQUAL(num_members, roster.size());
+
+            const auto id_start = esp_timer_get_time();
+            for (std::uint32_t i = 0; i < num_lookups; ++i) {
+                const auto who = make_identity((i * 7919) % num_members);
+                const auto r = roster.find(who.id);
+                TEST_ASSERT(r and r->who == who and not r->revoked);
+            }
+            const auto id_us = esp_timer_get_time() - id_start;
+
+            const auto hash_start = esp_timer_get_time();
+            for (std::uint32_t i = 0; i < num_lookups; ++i) {
+                const auto who = make_identity((i * 7919) % num_members);
+                const auto r = roster.find(who.hash());
+                TEST_ASSERT(r and r->who == who);
+            }
+            const auto hash_us = esp_timer_get_time() - hash_start;
+
+            const auto gate_start = esp_timer_get_time();
+            const auto holders = roster.holders_of(gate_id{7});
+            const auto gate_us = esp_timer_get_time() - gate_start;
+            TEST_ASSERT_EQUAL(num_members / num_gates, holders.size());
+            TEST_ASSERT(std::all_of(std::begin(holders), std::end(holders), [&](token_id const &id) {
+                return roster.gates_of(id) == std::vector<gate_id>{gate_id{7}};
+            }));
+
+            const auto stats = roster.stats();
+            ESP_LOGI("TEST", "%lu members: insert %lld us/member, find by id %lld us, by hash %lld us, holders of a gate %lld us.",
+                     num_members, insert_us / num_members, id_us / num_lookups, hash_us / num_lookups, gate_us);
+            ESP_LOGI("TEST", "Pages: %lu records, %lu by hash, %lu + %lu gates; cache %lu hits, %lu misses.",
+                     stats.records.pages, stats.by_hash.pages, stats.gates_by_token.pages, stats.tokens_by_gate.pages,
+                     stats.cache.hits, stats.cache.misses);
+
+            // Revocation, moving between gates and removal
+            TEST_ASSERT(roster.set_revoked(make_identity(42).id, true));
+            TEST_ASSERT(roster.add_gate(make_identity(43).id, gate_id{49}));
+            TEST_ASSERT(roster.remove_gate(make_identity(43).id, gate_id{43}));
+            TEST_ASSERT(roster.erase(make_identity(44).id));
+        }
+        {
+            // Everything survives a reboot, including what was still in the logs
+            member_roster roster{};
+            TEST_ASSERT(roster.open(region));
+            TEST_ASSERT_EQUAL(num_members - 1, roster.size());
+            const auto r_revoked = roster.find(make_identity(42).id);
+            TEST_ASSERT(r_revoked and r_revoked->revoked);
+            TEST_ASSERT(roster.gates_of(make_identity(43).id) == std::vector<gate_id>{gate_id{49}});
+            TEST_ASSERT_FALSE(roster.find(make_identity(44).id));
+            TEST_ASSERT_FALSE(roster.find(make_identity(44).hash()));
+            TEST_ASSERT_EQUAL(num_members / num_gates - 1, roster.holders_of(gate_id{44}).size());
+            std::uint32_t revoked = 0;
+            TEST_ASSERT(roster.for_each([&](member_record const &rec) {
+                revoked += rec.revoked ? 1 : 0;
+                return true;
+            }));
+            TEST_ASSERT_EQUAL(1, revoked);
+        }
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(region.partition, region.offset, region.size));
+    }
+
+    void test_keymaker_revocation_store() {
+        const auto make_id = [](std::uint8_t i) {
+            return token_id{0x04, 0x5e, 0x70, 0x12, 0x34, 0x56, i};
+        };
+        const auto region = flash_region::find(ka_store_partition);
+        TEST_ASSERT_FALSE(region.empty());
+        if (region.empty()) {
+            return;
+        }
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(region.partition, region.offset, region.size));
+
+        std::uint32_t version = 0;
+        {
+            keymaker km{};
+            TEST_ASSERT(km.open_store());
+            for (std::uint8_t i = 0; i < 4; ++i) {
+                TEST_ASSERT(km.members().insert(identity{make_id(i), "Holder", "Mittelab"}));
+            }
+            TEST_ASSERT(km.revoke(make_id(1)));
+            TEST_ASSERT(km.revoke(make_id(3)));
+            TEST_ASSERT_FALSE(km.revoke(make_id(9)));
+            version = km.revoked_tokens().version();
+        }
+
+        // After a reboot the list is rebuilt from the roster, and its version does not go back
+        keymaker km{};
+        TEST_ASSERT(km.open_store());
+        TEST_ASSERT_EQUAL(2, km.revoked_tokens().list().size());
+        TEST_ASSERT(km.revoked_tokens().list().contains(make_id(1)));
+        TEST_ASSERT(km.revoked_tokens().list().contains(make_id(3)));
+        TEST_ASSERT_EQUAL(version, km.revoked_tokens().version());
+        TEST_ASSERT(km.revoke(make_id(2)));
+        TEST_ASSERT_GREATER_THAN(version, km.revoked_tokens().version());
+
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(region.partition, region.offset, region.size));
+    }
+
+    void test_production_line_queue() {
+        keymaker km{};
+        production_line line{km};
+        TEST_ASSERT_EQUAL(0, line.pending());
+
+        issuance_job job{};
+        job.holder = "Member 0";
+        job.publisher = "Mittelab";
+        job.gates.push_back(gate_config{gate_id{0}, pub_key{}, gate_base_key{}});
+        TEST_ASSERT(line.enqueue(job));
+        job.holder = std::string(member_roster::max_holder_size + 1, 'x');
+        TEST_ASSERT_FALSE(line.enqueue(job));
+        TEST_ASSERT_EQUAL(1, line.pending());
+
+        production_line_stats stats{};
+        TEST_ASSERT_EQUAL_FLOAT(0.f, stats.cards_per_minute());
+        stats.issued = 30;
+        stats.elapsed = std::chrono::milliseconds{90000};
+        TEST_ASSERT_EQUAL_FLOAT(20.f, stats.cards_per_minute());
+    }
+
+    void test_enrollment_pipeline() {
+        const identity who{{0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07}, "Test user", "Test deployer"};
+        const std::vector<gate_config> gates{bundle.g0_cfg, bundle.g13_cfg, bundle.g0_cfg, bundle.g13_cfg, bundle.g0_cfg};
+        const auto decode = [](key_pair const &recipient, pub_key const &sender, mlab::bin_data data) -> std::optional<identity> {
+            if (not recipient.decrypt_from(sender, data)) {
+                return std::nullopt;
+            }
+            mlab::bin_stream s{data};
+            identity id{};
+            s >> id;
+            if (not s.eof() or s.bad()) {
+                return std::nullopt;
+            }
+            return id;
+        };
+
+        enrollment_pipeline pipeline{bundle.km, 2};
+        TEST_ASSERT(is_err<desfire::error::parameter_error>(pipeline.take_token()));
+        TEST_ASSERT(is_err<desfire::error::parameter_error>(pipeline.take_gate()));
+
+        pipeline.start(who, gates);
+        const auto r_token = pipeline.take_token();
+        TEST_ASSERT(r_token);
+        if (not r_token) {
+            return;
+        }
+        TEST_ASSERT(r_token->id == who.id);
+        TEST_ASSERT_EQUAL(0, r_token->mkey.key_number());
+        const auto master = decode(bundle.km.keys(), bundle.km.keys(), r_token->master_file);
+        TEST_ASSERT(master and *master == who);
+
+        for (auto const &g : gates) {
+            // Give the worker time to fill the queue, it must not go past the depth
+            std::this_thread::sleep_for(50ms);
+            const auto r_gate = pipeline.take_gate();
+            TEST_ASSERT(r_gate);
+            if (not r_gate) {
+                return;
+            }
+            TEST_ASSERT(r_gate->id == g.id);
+            TEST_ASSERT_EQUAL(g.id.key_no(), r_gate->key.key_number());
+            key_pair const &gate_keys = g.id == bundle.g0_cfg.id ? bundle.g0.keys() : bundle.g13.keys();
+            const auto enrolled = decode(gate_keys, bundle.km.keys(), r_gate->gate_file);
+            TEST_ASSERT(enrolled and *enrolled == who);
+        }
+        TEST_ASSERT(is_err<desfire::error::parameter_error>(pipeline.take_gate()));
+
+        // Starting again drops what was prepared, cancelling unblocks the RF side
+        pipeline.start(who, gates);
+        TEST_ASSERT(pipeline.take_token());
+        pipeline.cancel();
+        TEST_ASSERT(is_err<desfire::error::parameter_error>(pipeline.take_gate()));
+        TEST_ASSERT(is_err<desfire::error::parameter_error>(pipeline.take_token()));
+
+        const auto stats = pipeline.stats();
+        TEST_ASSERT_GREATER_OR_EQUAL(2, stats.tokens);
+        TEST_ASSERT_GREATER_OR_EQUAL(gates.size(), stats.gates);
+        TEST_ASSERT(stats.crypto.count() > 0);
+        ESP_LOGI("TEST", "Pipeline: %lu tokens and %lu gates prepared in %lld ms, RF side stalled for %lld ms.",
+                 stats.tokens, stats.gates, stats.crypto.count(), stats.stalled.count());
+    }
+
+    void test_provisioning_plan() {
+        keymaker km{};
+        TEST_ASSERT(km.gates().insert(bundle.g0_cfg));
+        TEST_ASSERT(km.gates().insert(bundle.g13_cfg));
+        const auto region = flash_region::find(ka_plan_partition);
+        TEST_ASSERT_FALSE(region.empty());
+
+        // Same layout as misc/compile-plan.py, two cards in token order
+        const std::array<identity, 2> cards{identity{{0x01, 0, 0, 0, 0, 0, 0}, "Member 0", "Mittelab"},
+                                            identity{{0x02, 0, 0, 0, 0, 0, 0}, "Member 1", "Mittelab"}};
+        const std::array<std::vector<std::uint16_t>, 2> card_gates{std::vector<std::uint16_t>{0, 1}, std::vector<std::uint16_t>{1}};
+        const std::array<gate_config, 2> gate_table{bundle.g0_cfg, bundle.g13_cfg};
+        std::array<std::uint8_t, provisioning_plan::nonce_prefix_size> prefix{};
+        randombytes_buf(prefix.data(), prefix.size());
+        const auto seal = [&](mlab::bin_data const &msg, pub_key const &pk, std::uint32_t card, std::uint32_t slot) -> mlab::bin_data {
+            mlab::bin_data nonce{};
+            nonce << prefix << mlab::lsb32 << card << mlab::lsb32 << slot;
+            mlab::bin_data ct{};
+            ct.resize(msg.size() + crypto_box_MACBYTES);
+            TEST_ASSERT_EQUAL(0, crypto_box_easy(ct.data(), msg.data(), msg.size(), nonce.data(), pk.raw_pk().data(), km.keys().raw_sk().data()));
+            return ct;
+        };
+        mlab::bin_data records{};
+        mlab::bin_data index{};
+        const std::uint32_t records_offset = gate_table.size() * provisioning_plan::gate_entry_size + cards.size() * provisioning_plan::index_entry_size;
+        for (std::uint32_t i = 0; i < cards.size(); ++i) {
+            index << cards[i].id << mlab::lsb32 << std::uint32_t(records_offset + records.size());
+            mlab::bin_data encoded{};
+            encoded << cards[i];
+            records << mlab::lsb16 << std::uint16_t(encoded.size()) << encoded << seal(encoded, km.keys(), i, 0);
+            records << std::uint8_t(card_gates[i].size());
+            for (std::uint32_t slot = 1; slot <= card_gates[i].size(); ++slot) {
+                const auto gate_idx = card_gates[i][slot - 1];
+                records << mlab::lsb16 << gate_idx << seal(encoded, gate_table[gate_idx].gate_pub_key, i, slot);
+            }
+        }
+        mlab::bin_data body{};
+        for (auto const &g : gate_table) {
+            body << mlab::lsb32 << std::uint32_t(g.id) << g.gate_pub_key.raw_pk();
+        }
+        body << index << records;
+        mlab::bin_data plan{};
+        plan << std::array<std::uint8_t, 4>{'K', 'A', 'P', 'L'} << provisioning_plan::version << km.keys().raw_pk() << prefix;
+        plan << mlab::lsb32 << std::uint32_t(cards.size()) << mlab::lsb16 << std::uint16_t(gate_table.size());
+        plan << mlab::lsb32 << std::uint32_t(body.size()) << mlab::lsb32 << esp_rom_crc32_le(0, body.data(), body.size()) << body;
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(region.partition, region.offset, region.size));
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_write(region.partition, region.offset, plan.data(), plan.size()));
+
+        provisioning_plan pp{km};
+        TEST_ASSERT(pp.open(region));
+        TEST_ASSERT_EQUAL(cards.size(), pp.size());
+        std::uint32_t listed = 0;
+        TEST_ASSERT(pp.for_each([&](token_id const &id) -> bool {
+            TEST_ASSERT(id == cards[listed++].id);
+            return true;
+        }));
+        TEST_ASSERT_EQUAL(cards.size(), listed);
+        TEST_ASSERT_FALSE(pp.find(token_id{0x03, 0, 0, 0, 0, 0, 0}));
+
+        const auto check_file = [&](key_pair const &recipient, mlab::bin_data data, identity const &expected) {
+            TEST_ASSERT(recipient.decrypt_from(km.keys(), data));
+            mlab::bin_stream s{data};
+            identity id{};
+            s >> id;
+            TEST_ASSERT(s.eof() and not s.bad());
+            TEST_ASSERT(id == expected);
+        };
+        for (std::uint32_t i = 0; i < cards.size(); ++i) {
+            const auto card = pp.find(cards[i].id);
+            TEST_ASSERT(card);
+            if (not card) {
+                continue;
+            }
+            TEST_ASSERT(card->who == cards[i]);
+            TEST_ASSERT(card->token.id == cards[i].id);
+            TEST_ASSERT_EQUAL(0, card->token.mkey.key_number());
+            check_file(km.keys(), card->token.master_file, cards[i]);
+            TEST_ASSERT_EQUAL(card_gates[i].size(), card->gates.size());
+            for (std::size_t j = 0; j < card->gates.size() and j < card_gates[i].size(); ++j) {
+                auto const &g = gate_table[card_gates[i][j]];
+                TEST_ASSERT(card->gates[j].id == g.id);
+                TEST_ASSERT_EQUAL(g.id.key_no(), card->gates[j].key.key_number());
+                check_file(g.id == bundle.g0_cfg.id ? bundle.g0.keys() : bundle.g13.keys(), card->gates[j].gate_file, cards[i]);
+            }
+        }
+
+        // Another keymaker, or a corrupted plan, are rejected
+        keymaker other_km{};
+        TEST_ASSERT(other_km.gates().insert(bundle.g0_cfg));
+        TEST_ASSERT(other_km.gates().insert(bundle.g13_cfg));
+        provisioning_plan other{other_km};
+        TEST_ASSERT_FALSE(other.open(region));
+        const std::uint8_t zero = 0;
+        const std::size_t corrupt_at = plan.size() - 1;
+        if (plan[corrupt_at] != 0) {
+            TEST_ASSERT_EQUAL(ESP_OK, esp_partition_write(region.partition, region.offset + corrupt_at, &zero, 1));
+            TEST_ASSERT_FALSE(pp.open(region));
+        }
+        TEST_ASSERT_EQUAL(ESP_OK, esp_partition_erase_range(region.partition, region.offset, region.size));
+        TEST_ASSERT_FALSE(pp.open(region));
+    }
+
+    void test_secure_p2p_fast_handshake() {
+        loopback_link link{};
+        loopback_initiator raw_initiator{link};
+        loopback_target raw_target{link};
+        const key_pair initiator_kp{randomize};
+        const key_pair target_kp{randomize};
+        const key_pair stale_kp{randomize};
+        const auto message = mlab::bin_data::chain(plaintext);
+
+        for (bool stale_peer_key : {false, true}) {
+            link.round_trips = 0;
+            p2p::secure_target target{raw_target, target_kp};
+            bool echoed = false;
+            std::thread echo{[&] {
+                if (const auto r = target.receive(1s); r) {
+                    echoed = bool(target.send(*r, 1s));
+                }
+            }};
+            const pub_key known_peer{stale_peer_key ? stale_kp.raw_pk() : target_kp.raw_pk()};
+            p2p::secure_initiator initiator{raw_initiator, initiator_kp, known_peer};
+            const auto r = initiator.communicate(message, 1s);
+            echo.join();
+            TEST_ASSERT_EQUAL(1, link.round_trips.load());
+            if (stale_peer_key) {
+                // The target is not the expected one, and the handshake does not fall back to it
+                TEST_ASSERT_FALSE(r);
+                TEST_ASSERT_FALSE(echoed);
+                continue;
+            }
+            TEST_ASSERT(echoed);
+            TEST_ASSERT(r);
+            if (r) {
+                TEST_ASSERT_EQUAL(message.size(), r->size());
+                TEST_ASSERT_EQUAL_HEX8_ARRAY(message.data(), r->data(), std::min(message.size(), r->size()));
+            }
+            TEST_ASSERT(initiator.peer_pub_key() == target_kp.raw_pk());
+            TEST_ASSERT(target.peer_pub_key() == initiator_kp.raw_pk());
+        }
+    }
+
+    void test_secure_p2p_resumption() {
+        loopback_link link{};
+        loopback_initiator raw_initiator{link};
+        loopback_target raw_target{link};
+        const key_pair initiator_kp{randomize};
+        const key_pair target_kp{randomize};
+        const auto tickets = std::make_shared<p2p::session_ticket_store>();
+        const auto message = mlab::bin_data::chain(plaintext);
+
+        const auto echo = [&](p2p::secure_target &target, std::size_t n) {
+            return std::thread{[&target, n] {
+                for (std::size_t i = 0; i < n; ++i) {
+                    if (const auto r = target.receive(2s); not r or not target.send(*r, 1s)) {
+                        break;
+                    }
+                }
+            }};
+        };
+
+        const auto check_echo = [&](p2p::secure_initiator &initiator) {
+            const auto r = initiator.communicate(message, 1s);
+            TEST_ASSERT(r);
+            if (r) {
+                TEST_ASSERT_EQUAL(message.size(), r->size());
+                TEST_ASSERT_EQUAL_HEX8_ARRAY(message.data(), r->data(), std::min(message.size(), r->size()));
+            }
+        };
+
+        p2p::session_ticket ticket{};
+        {
+            // A lost reply is recovered by retransmitting the same frame, also the one of the handshake
+            p2p::secure_target target{raw_target, target_kp, tickets};
+            p2p::secure_initiator initiator{raw_initiator, initiator_kp, pub_key{target_kp.raw_pk()}};
+            auto echo_thread = echo(target, 3);
+            link.replies_to_drop = 1;
+            check_echo(initiator);
+            link.replies_to_drop = 1;
+            check_echo(initiator);
+            check_echo(initiator);
+            echo_thread.join();
+            TEST_ASSERT_EQUAL(2, initiator.stats().retransmissions);
+            TEST_ASSERT_EQUAL(2, target.stats().duplicates);
+            ticket = initiator.ticket();
+            TEST_ASSERT(ticket.is_valid());
+        }
+        {
+            // The peer comes back and resumes without a key exchange
+            link.round_trips = 0;
+            p2p::secure_target target{raw_target, target_kp, tickets};
+            p2p::secure_initiator initiator{raw_initiator, initiator_kp, ticket};
+            auto echo_thread = echo(target, 1);
+            check_echo(initiator);
+            echo_thread.join();
+            TEST_ASSERT(initiator.stats().resumed);
+            TEST_ASSERT(target.stats().resumed);
+            TEST_ASSERT_EQUAL(2, link.round_trips.load());
+            TEST_ASSERT(target.peer_pub_key() == initiator_kp.raw_pk());
+        }
+        {
+            // Tickets are single use: a replayed ticket falls back to the full handshake
+            link.round_trips = 0;
+            p2p::secure_target target{raw_target, target_kp, tickets};
+            p2p::secure_initiator initiator{raw_initiator, initiator_kp, ticket};
+            auto echo_thread = echo(target, 1);
+            check_echo(initiator);
+            echo_thread.join();
+            TEST_ASSERT_FALSE(initiator.stats().resumed);
+            TEST_ASSERT_FALSE(target.stats().resumed);
+            TEST_ASSERT_EQUAL(3, link.round_trips.load());
+            TEST_ASSERT(initiator.peer_pub_key() == target_kp.raw_pk());
+        }
+    }
+
+    namespace test_cmd {
+        struct get_base_key {
+            static constexpr rpc::opcode code = 0x01;
+            using request = rpc::none;
+            using response = gate_base_key;
+        };
+        struct always_fails {
+            static constexpr rpc::opcode code = 0x02;
+            using request = rpc::none;
+            using response = rpc::none;
+        };
+        struct not_registered {
+            static constexpr rpc::opcode code = 0x7f;
+            using request = rpc::none;
+            using response = rpc::none;
+        };
+    }// namespace test_cmd
+
+    void test_link_quality() {
+        rtt_estimator rtt{};
+        TEST_ASSERT(rtt.timeout() == rtt.policy().initial_timeout);
+        for (unsigned i = 0; i < 32; ++i) {
+            rtt.sample(10ms);
+            rtt.on_success();
+        }
+        // Converges to a steady RTT, and the timeout shrinks down to the minimum
+        TEST_ASSERT(rtt.srtt() == 10ms);
+        TEST_ASSERT(rtt.timeout() == rtt.policy().min_timeout);
+        TEST_ASSERT_EQUAL(rtt.policy().min_retries, rtt.retries());
+
+        // Jitter widens the timeout
+        rtt.sample(60ms);
+        const auto jittery_timeout = rtt.timeout();
+        TEST_ASSERT(jittery_timeout > 60ms);
+
+        // Losses back off exponentially and call for more retries
+        rtt.on_loss();
+        TEST_ASSERT(rtt.timeout() == 2 * jittery_timeout);
+        for (unsigned i = 0; i < 20; ++i) {
+            rtt.on_loss();
+        }
+        TEST_ASSERT(rtt.timeout() == rtt.policy().max_timeout);
+        TEST_ASSERT_EQUAL(rtt.policy().max_retries, rtt.retries());
+        rtt.on_success();
+        TEST_ASSERT(rtt.timeout() == jittery_timeout);
+
+        event_rate rate{};
+        rate.record(0);
+        rate.record(15'000'000);
+        rate.record(30'000'000);
+        TEST_ASSERT_EQUAL(3, rate.per_minute(59'000'000));
+        TEST_ASSERT_EQUAL(2, rate.per_minute(65'000'000));
+        TEST_ASSERT_EQUAL(0, rate.per_minute(600'000'000));
+        TEST_ASSERT_EQUAL(3, rate.total());
+
+        // Over the secure channel, a lost reply costs one estimated timeout instead of a share of the whole budget
+        loopback_link link{};
+        loopback_initiator raw_initiator{link};
+        loopback_target raw_target{link};
+        const key_pair initiator_kp{randomize};
+        const key_pair target_kp{randomize};
+        const auto message = mlab::bin_data::chain(plaintext);
+        link_quality quality{};
+
+        p2p::secure_target target{raw_target, target_kp};
+        p2p::secure_initiator initiator{raw_initiator, initiator_kp, pub_key{target_kp.raw_pk()}};
+        initiator.set_link_quality(&quality);
+        std::thread echo{[&] {
+            for (std::size_t i = 0; i < 6; ++i) {
+                if (const auto r = target.receive(2s); not r or not target.send(*r, 1s)) {
+                    break;
+                }
+            }
+        }};
+        for (std::size_t i = 0; i < 5; ++i) {
+            TEST_ASSERT(initiator.communicate(message, 3s));
+        }
+        link.replies_to_drop = 1;
+        const auto start = std::chrono::steady_clock::now();
+        TEST_ASSERT(initiator.communicate(message, 3s));
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        echo.join();
+
+        TEST_ASSERT(elapsed < 500ms);
+        const auto report = quality.report();
+        TEST_ASSERT_EQUAL(1, report.total_retries);
+        TEST_ASSERT_EQUAL(1, report.timeouts);
+        TEST_ASSERT_EQUAL(1, report.retries_per_minute);
+        TEST_ASSERT(quality.rtt().has_samples());
+        quality.log_report();
+    }
+
+    void test_rpc_batch() {
+        gate g{};
+        g.regenerate_keys();
+        keymaker km{};
+
+        loopback_gate_session session{g, km, [&](rpc::dispatcher &d) {
+            d.register_handler<test_cmd::get_base_key>([&](rpc::none const &) -> rpc::r<gate_base_key> { return g.app_base_key(); });
+            d.register_handler<test_cmd::always_fails>([](rpc::none const &) -> rpc::r<rpc::none> { return rpc::status::failed; });
+        }};
+        auto &initiator = session.initiator();
+        rpc::batch b{};
+        const auto i_configure = b.add<p2p::cmd::configure>({gate_id{7}, "Batched gate"});
+        const auto i_key = b.add<test_cmd::get_base_key>();
+        const auto i_fail = b.add<test_cmd::always_fails>();
+        const auto i_unknown = b.add<test_cmd::not_registered>();
+        const auto r = b.send(initiator, 1s);
+        session.stop();
+
+        // Handshake and the whole batch in a single round trip
+        TEST_ASSERT_EQUAL(1, session.batches_served());
+        TEST_ASSERT_EQUAL(1, session.link().round_trips.load());
+        TEST_ASSERT(r);
+        if (not r) {
+            return;
+        }
+        TEST_ASSERT_EQUAL(4, r->size());
+        TEST_ASSERT_FALSE(r->all_ok());
+        const auto r_configure = r->get<p2p::cmd::configure>(i_configure);
+        const auto r_key = r->get<test_cmd::get_base_key>(i_key);
+        TEST_ASSERT(r_configure);
+        TEST_ASSERT(r_key);
+        if (r_configure and r_key) {
+            TEST_ASSERT(*r_configure == g.app_base_key());
+            TEST_ASSERT(*r_key == g.app_base_key());
+        }
+        TEST_ASSERT(rpc::status::failed == r->status_of(i_fail));
+        TEST_ASSERT(rpc::status::unknown_opcode == r->status_of(i_unknown));
+        TEST_ASSERT(rpc::status::malformed_response == r->get<test_cmd::get_base_key>(i_configure).error());
+
+        TEST_ASSERT(g.is_configured());
+        TEST_ASSERT_EQUAL(7, std::uint32_t(g.id()));
+        TEST_ASSERT_EQUAL_STRING("Batched gate", g.description().c_str());
+        TEST_ASSERT(g.programmer_pub_key().raw_pk() == km.keys().raw_pk());
+
+        const auto &stats = session.dispatcher().stats();
+        TEST_ASSERT_EQUAL(1, stats.at(p2p::cmd::configure::code).calls);
+        TEST_ASSERT_EQUAL(1, stats.at(test_cmd::always_fails::code).failures);
+        TEST_ASSERT(stats.find(test_cmd::not_registered::code) == std::end(stats));
+        for (auto const &[code, op_stats] : stats) {
+            ESP_LOGI("TEST", "Opcode %02x: %lu calls, %lld us average.", code, op_stats.calls, op_stats.average_latency().count());
+        }
+        ESP_LOGI("TEST", "Batch of %d commands: %lld us.", r->size(), r->latency().count());
+
+        // The count does not wrap, an oversized batch is refused before anything is sent
+        rpc::batch oversized{};
+        for (std::size_t i = 0; i <= rpc::batch::max_commands; ++i) {
+            oversized.add<test_cmd::get_base_key>();
+        }
+        TEST_ASSERT_EQUAL(rpc::batch::max_commands, oversized.encoded().front());
+        const auto round_trips = session.link().round_trips.load();
+        TEST_ASSERT_FALSE(oversized.send(initiator, 1s));
+        TEST_ASSERT_EQUAL(round_trips, session.link().round_trips.load());
+    }
+
+    void test_derived_gate_keys() {
+        keymaker km{};
+        km.set_derive_gate_keys(true);
+        const auto configure = [&](gate &g, std::string const &desc) {
+            loopback_link link{};
+            loopback_initiator raw_initiator{link};
+            loopback_target raw_target{link};
+            p2p::secure_target target{raw_target, g.keys()};
+            p2p::secure_initiator initiator{raw_initiator, km.keys()};
+            bool served = false;
+            std::thread server{[&] { served = bool(p2p::configure_gate_exchange(g, target)); }};
+            TEST_ASSERT(p2p::configure_gate_exchange(km, initiator, desc));
+            server.join();
+            TEST_ASSERT(served);
+        };
+
+        gate g0{};
+        g0.regenerate_keys();
+        const auto random_key = g0.app_base_key();
+        configure(g0, "Derived gate");
+        TEST_ASSERT(g0.is_configured());
+        TEST_ASSERT_EQUAL(0, std::uint32_t(g0.id()));
+        TEST_ASSERT(g0.app_base_key() == km.derive_gate_base_key(gate_id{0}));
+        TEST_ASSERT(g0.app_base_key() != random_key);
+
+        // Derived keys depend on the gate and on the keymaker
+        const keymaker other_km{};
+        TEST_ASSERT(km.derive_gate_base_key(gate_id{0}) != km.derive_gate_base_key(gate_id{1}));
+        TEST_ASSERT(km.derive_gate_base_key(gate_id{0}) != other_km.derive_gate_base_key(gate_id{0}));
+
+        // Gates configured without derivation keep their own key
+        km.set_derive_gate_keys(false);
+        gate g1{};
+        g1.regenerate_keys();
+        configure(g1, "Random gate");
+        TEST_ASSERT(g1.app_base_key() != km.derive_gate_base_key(gate_id{1}));
+
+        for (auto const *g : {&g0, &g1}) {
+            const auto by_id = km.gates().find(g->id());
+            const auto by_pk = km.gates().find(pub_key{g->keys().raw_pk()});
+            TEST_ASSERT(by_id);
+            TEST_ASSERT(by_pk);
+            if (by_id and by_pk) {
+                TEST_ASSERT(by_id->app_base_key == g->app_base_key());
+                TEST_ASSERT(by_pk->app_base_key == g->app_base_key());
+            }
+        }
+
+    }
+
+    void test_configure_listener() {
+        loopback_link link{};
+        loopback_initiator raw_initiator{link};
+        keymaker km{};
+        gate g{};
+        bool km_configured = false;
+        std::thread km_side{};
+        raw_pub_key exposed_pk{};
+        // Nobody, a controller error, an initiator that never talks, then the keymaker
+        scripted_dep_target comm{link, {pn532::channel_error::timeout, pn532::channel_error::malformed, std::nullopt}, [&](std::size_t n) {
+            if (n == 3) {
+                exposed_pk = g.keys().raw_pk();
+            } else if (n == 4) {
+                km_side = std::thread{[&] {
+                    p2p::secure_initiator initiator{raw_initiator, km.keys()};
+                    km_configured = bool(p2p::configure_gate_exchange(km, initiator, "Listening gate"));
+                }};
+            }
+        }};
+
+        p2p::configure_listener_options opts{};
+        opts.error_backoff = 10ms;
+        const auto stats = p2p::configure_listener{comm, g, opts}.run();
+        if (km_side.joinable()) {
+            km_side.join();
+        }
+        TEST_ASSERT(km_configured);
+        TEST_ASSERT(g.is_configured());
+        TEST_ASSERT_EQUAL(4, stats.wakeups);
+        TEST_ASSERT_EQUAL(2, stats.activations);
+        TEST_ASSERT_EQUAL(1, stats.failed_attempts);
+        TEST_ASSERT_EQUAL(1, stats.controller_errors);
+        TEST_ASSERT_GREATER_THAN(0, stats.time_to_configure.count());
+        TEST_ASSERT_GREATER_THAN(0, stats.key_generation.count());
+        TEST_ASSERT(stats.cpu_utilization >= 0.f and stats.cpu_utilization <= 1.f);
+        ESP_LOGI("TEST", "Configured in %lld ms, %lld ms generating keys, CPU utilization %0.1f%%.",
+                 stats.time_to_configure.count(), stats.key_generation.count(), 100.f * stats.cpu_utilization);
+        // The keys exposed in the failed attempt were replaced, and the keymaker registered the new ones
+        TEST_ASSERT(g.keys().raw_pk() != exposed_pk);
+        const auto cfg = km.gates().find(g.id());
+        TEST_ASSERT(cfg);
+        if (cfg) {
+            TEST_ASSERT(cfg->gate_pub_key.raw_pk() == g.keys().raw_pk());
+        }
+
+        // A configured gate is left alone
+        const auto pk = g.keys().raw_pk();
+        const auto id = g.id();
+        const auto again = p2p::configure_listener{comm, g, opts}.run();
+        TEST_ASSERT_EQUAL(0, again.wakeups);
+        TEST_ASSERT_EQUAL(4, comm.activations());
+        TEST_ASSERT(g.keys().raw_pk() == pk);
+        TEST_ASSERT_EQUAL(std::uint32_t(id), std::uint32_t(g.id()));
+    }
+
+    void test_gate_groups() {
+        keymaker km{};
+        const auto grp = km.register_gate_group();
+        TEST_ASSERT(grp);
+        if (not grp) {
+            return;
+        }
+        // Derived from the keymaker secret, registered like a gate
+        TEST_ASSERT(grp->keys.raw_pk() == gate_group::derive_from(km.keys(), grp->id).keys.raw_pk());
+        TEST_ASSERT(grp->app_base_key == km.derive_gate_base_key(grp->id));
+        const auto found = km.find_gate_group(grp->id);
+        TEST_ASSERT(found);
+        if (found) {
+            TEST_ASSERT(found->keys.raw_pk() == grp->keys.raw_pk());
+            TEST_ASSERT(found->app_base_key == grp->app_base_key);
+        }
+        const auto cfg = km.gates().find(grp->id);
+        TEST_ASSERT(cfg);
+        if (cfg) {
+            TEST_ASSERT(cfg->gate_pub_key.raw_pk() == grp->keys.raw_pk());
+        }
+
+        // A plain gate is not a group
+        gate g{};
+        g.regenerate_keys();
+        g.configure(km.allocate_gate_id(), "Grouped gate", pub_key{km.keys().raw_pk()});
+        km.register_gate({g.id(), pub_key{g.keys().raw_pk()}, g.app_base_key()});
+        TEST_ASSERT_NOT_EQUAL(std::uint32_t(grp->id), std::uint32_t(g.id()));
+        TEST_ASSERT_FALSE(km.find_gate_group(g.id()));
+
+        loopback_gate_session session{g, km};
+        auto &initiator = session.initiator();
+
+        TEST_ASSERT(p2p::add_gate_to_group(initiator, *grp));
+        TEST_ASSERT_EQUAL(1, g.groups().size());
+        if (not g.groups().empty()) {
+            TEST_ASSERT_EQUAL(std::uint32_t(grp->id), std::uint32_t(g.groups().front().id));
+            TEST_ASSERT(g.groups().front().keys.raw_pk() == grp->keys.raw_pk());
+            TEST_ASSERT(g.groups().front().app_base_key == grp->app_base_key);
+        }
+        // Joining again only updates the credentials
+        TEST_ASSERT(p2p::add_gate_to_group(initiator, *grp));
+        TEST_ASSERT_EQUAL(1, g.groups().size());
+
+        TEST_ASSERT(p2p::remove_gate_from_group(initiator, grp->id));
+        TEST_ASSERT(g.groups().empty());
+        TEST_ASSERT_FALSE(p2p::remove_gate_from_group(initiator, grp->id));
+        session.stop();
+
+        // Bounded number of groups per gate
+        for (std::uint32_t i = 0; i < gate::max_groups; ++i) {
+            TEST_ASSERT(g.join_group(gate_group::derive_from(km.keys(), gate_id{100 + i})));
+        }
+        TEST_ASSERT_FALSE(g.join_group(gate_group::derive_from(km.keys(), gate_id{200})));
+        TEST_ASSERT(g.join_group(gate_group::derive_from(km.keys(), gate_id{100})));
+        TEST_ASSERT_EQUAL(gate::max_groups, g.groups().size());
+    }
+
+    void test_gate_key_rotation() {
+        keymaker km{};
+        km.set_derive_gate_keys(true);
+        gate g{};
+        g.regenerate_keys();
+        const auto gid = km.allocate_gate_id();
+        g.configure(gid, "Rotated gate", pub_key{km.keys().raw_pk()}, km.derive_gate_base_key(gid));
+        km.register_gate({gid, pub_key{g.keys().raw_pk()}, g.app_base_key()});
+        const auto old_pk = g.keys().raw_pk();
+        const auto old_base_key = g.app_base_key();
+
+        // Version 0 is the key the gate was configured with
+        TEST_ASSERT(gate_base_key::derive_from(km.keys(), gid, 0) == km.derive_gate_base_key(gid));
+        TEST_ASSERT(gate_base_key::derive_from(km.keys(), gid, 1) != km.derive_gate_base_key(gid));
+
+        constexpr std::uint32_t holders = 20;
+        for (std::uint32_t i = 0; i < holders; ++i) {
+            const identity who{{0x05, 0x00, std::uint8_t(i), 0xba, 0xbe, 0x00, 0x00}, "Holder " + std::to_string(i), "Mittelab"};
+            TEST_ASSERT(km.members().insert(who));
+            TEST_ASSERT(km.members().add_gate(who.id, gid));
+        }
+
+        loopback_gate_session session{g, km};
+        auto &initiator = session.initiator();
+
+        const auto r = p2p::rotate_gate_keys(km, initiator, gid);
+        TEST_ASSERT(r);
+        if (r) {
+            TEST_ASSERT_EQUAL(0, r->before.version);
+            TEST_ASSERT_EQUAL(1, r->after.version);
+            TEST_ASSERT_EQUAL(holders, r->grants_sent);
+        }
+        TEST_ASSERT_EQUAL(1, g.key_version());
+        TEST_ASSERT(g.keys().raw_pk() != old_pk);
+        TEST_ASSERT(g.app_base_key() == gate_base_key::derive_from(km.keys(), gid, 1));
+        TEST_ASSERT(g.app_base_key() != old_base_key);
+        const auto status = g.key_status();
+        TEST_ASSERT(status.previous_accepted);
+        TEST_ASSERT_EQUAL(holders, status.rekey_grants);
+
+        // Replacing a grant keeps the count, but the revision tells the session to save it
+        const auto revision = g.rekey_grants_revision();
+        const token_id first_holder{0x05, 0x00, 0x00, 0xba, 0xbe, 0x00, 0x00};
+        TEST_ASSERT(g.grant_rekey(first_holder, km.keys().derive_raw_gate_app_master_key(first_holder)));
+        TEST_ASSERT_EQUAL(holders, g.key_status().rekey_grants);
+        TEST_ASSERT_NOT_EQUAL(revision, g.rekey_grants_revision());
+
+        // The registry follows the gate
+        const auto cfg = km.gates().find(gid);
+        TEST_ASSERT(cfg);
+        if (cfg) {
+            TEST_ASSERT(cfg->gate_pub_key.raw_pk() == g.keys().raw_pk());
+            TEST_ASSERT(cfg->app_base_key == g.app_base_key());
+        }
+        TEST_ASSERT(km.gates().find(pub_key{g.keys().raw_pk()}));
+
+        const auto r_retire = p2p::retire_gate_keys(initiator);
+        TEST_ASSERT(r_retire);
+        if (r_retire) {
+            TEST_ASSERT_FALSE(r_retire->previous_accepted);
+            TEST_ASSERT_EQUAL(0, r_retire->rekey_grants);
+            TEST_ASSERT_EQUAL(1, r_retire->version);
+        }
+        session.stop();
+
+        // Versions must follow each other
+        TEST_ASSERT_FALSE(g.rotate_keys(3, gate_base_key::derive_from(km.keys(), gid, 3)));
+        TEST_ASSERT(g.rotate_keys(2, gate_base_key::derive_from(km.keys(), gid, 2)));
+        gate::config_clear();
+    }
+
+    void test_deploy_certificates() {
+        const auto make_cert = [](std::uint8_t i, std::uint32_t expires_at) {
+            deploy_certificate cert{};
+            cert.who = identity{{0x06, 0x00, i, 0xde, 0xad, 0x00, 0x00}, "Deployed " + std::to_string(i), "Mittelab"};
+            cert.expires_at = expires_at;
+            cert.mkey.fill(i);
+            return cert;
+        };
+
+        deploy_queue q{4};
+        const auto t = q.now();
+        TEST_ASSERT(q.insert(make_cert(0, t + 100)));
+        TEST_ASSERT(q.insert(make_cert(1, t + 10)));
+        TEST_ASSERT_FALSE(q.insert(make_cert(2, t)));
+        TEST_ASSERT(q.insert(make_cert(1, t + 200)));
+        TEST_ASSERT_EQUAL(2, q.size());
+        TEST_ASSERT(q.contains(make_cert(1, 0).who.id));
+        const auto taken = q.take(make_cert(1, 0).who.id);
+        TEST_ASSERT(taken);
+        if (taken) {
+            TEST_ASSERT(taken->who == make_cert(1, 0).who);
+            TEST_ASSERT_EQUAL(t + 200, taken->expires_at);
+            TEST_ASSERT(taken->mkey == make_cert(1, 0).mkey);
+        }
+        TEST_ASSERT_FALSE(q.take(make_cert(1, 0).who.id));
+        TEST_ASSERT_EQUAL(1, q.size());
+
+        // Bounded, but expired certificates make room
+        TEST_ASSERT(q.insert(make_cert(3, t + 50)));
+        TEST_ASSERT(q.insert(make_cert(4, t + 300)));
+        TEST_ASSERT(q.insert(make_cert(5, t + 300)));
+        TEST_ASSERT_FALSE(q.insert(make_cert(6, t + 300)));
+        q.advance_clock(t + 60);
+        TEST_ASSERT_GREATER_OR_EQUAL(t + 60, q.now());
+        TEST_ASSERT(q.insert(make_cert(6, t + 300)));
+        TEST_ASSERT_FALSE(q.contains(make_cert(3, 0).who.id));
+        TEST_ASSERT_EQUAL(4, q.size());
+        TEST_ASSERT_EQUAL(0, q.purge_expired());
+        // An expired certificate is not handed out
+        q.advance_clock(t + 150);
+        TEST_ASSERT(q.contains(make_cert(0, 0).who.id));
+        TEST_ASSERT_FALSE(q.take(make_cert(0, 0).who.id));
+        TEST_ASSERT_EQUAL(3, q.size());
+        // The clock never goes back
+        q.advance_clock(t);
+        TEST_ASSERT_GREATER_OR_EQUAL(t + 150, q.now());
+
+        keymaker km{};
+        gate g{};
+        g.regenerate_keys();
+        const auto gid = km.allocate_gate_id();
+        g.configure(gid, "Self-enrolling gate", pub_key{km.keys().raw_pk()});
+        km.register_gate({gid, pub_key{g.keys().raw_pk()}, g.app_base_key()});
+
+        std::vector<token_id> tokens{};
+        for (std::uint8_t i = 0; i < 5; ++i) {
+            const identity who{{0x07, 0x00, i, 0xbe, 0xef, 0x00, 0x00}, "Member " + std::to_string(i), "Mittelab"};
+            TEST_ASSERT(km.members().insert(who));
+            tokens.push_back(who.id);
+        }
+        TEST_ASSERT(km.revoke(tokens[4]));
+        // Not a member
+        tokens.push_back(token_id{std::array<std::uint8_t, 7>{0x07, 0xff, 0xff, 0xbe, 0xef, 0x00, 0x00}});
+
+        loopback_gate_session session{g, km};
+        auto &initiator = session.initiator();
+
+        const auto r = p2p::issue_deploy_certificates(km, initiator, gid, tokens, std::chrono::hours{24});
+        session.stop();
+        TEST_ASSERT(r);
+        if (r) {
+            TEST_ASSERT_EQUAL(4, r->pending);
+            TEST_ASSERT_EQUAL(gate::max_deploy_certificates, r->capacity);
+        }
+        for (std::size_t i = 0; i < 4; ++i) {
+            TEST_ASSERT(g.pending_deploys().contains(tokens[i]));
+            const auto gates = km.members().gates_of(tokens[i]);
+            TEST_ASSERT(std::find(std::begin(gates), std::end(gates), gid) != std::end(gates));
+        }
+        TEST_ASSERT_FALSE(g.pending_deploys().contains(tokens[4]));
+        TEST_ASSERT(km.members().gates_of(tokens[4]).empty());
+
+        // The certificates carry the gate app master key of their token, and nothing that opens the root
+        const auto cert = g.pending_deploys().take(tokens[0]);
+        TEST_ASSERT(cert);
+        if (cert) {
+            TEST_ASSERT(cert->mkey == km.keys().derive_raw_gate_app_master_key(tokens[0]));
+        }
+
+        // And survive a reboot
+        const auto stored_at = g.pending_deploys().now();
+        g.config_store();
+        gate reloaded = gate::load_from_config();
+        TEST_ASSERT_EQUAL(3, reloaded.pending_deploys().size());
+        for (std::size_t i = 1; i < 4; ++i) {
+            TEST_ASSERT(reloaded.pending_deploys().contains(tokens[i]));
+        }
+        TEST_ASSERT_GREATER_OR_EQUAL(stored_at, reloaded.pending_deploys().now());
+        gate::config_clear();
+    }
+
+    void test_revocation_record() {
+        const auto make_id = [](std::uint32_t i) {
+            return token_id{std::array<std::uint8_t, 7>{0x08, std::uint8_t(i >> 16), std::uint8_t(i >> 8), std::uint8_t(i), 0xe9, 0x0c, 0x00}};
+        };
+        const auto ids_up_to = [&](std::uint32_t n) {
+            std::vector<token_id> ids{};
+            for (std::uint32_t i = 0; i < n; ++i) {
+                ids.push_back(make_id(i));
+            }
+            return ids;
+        };
+
+        keymaker km{};
+        for (std::uint32_t i = 0; i < 40; ++i) {
+            km.revoked_tokens().add(make_id(i));
+        }
+        // The signer is derived, the keymaker does not store it
+        const auto signer = km.derive_epoch_signer();
+        TEST_ASSERT(signer.pub_key() == km.derive_epoch_signer().pub_key());
+        const auto rec = km.sign_revocations();
+        TEST_ASSERT_EQUAL(40, rec.header.epoch);
+        TEST_ASSERT_EQUAL(40 - revocation_record::max_delta, rec.header.base_epoch);
+        TEST_ASSERT_EQUAL(revocation_record::max_delta, rec.delta.size());
+        TEST_ASSERT(rec.verify(signer.pub_key()));
+
+        // The header round-trips in a fixed size
+        mlab::bin_data bd{};
+        bd << rec.header;
+        TEST_ASSERT_EQUAL(revocation_epoch::size, bd.size());
+        mlab::bin_stream s{bd};
+        revocation_epoch header{};
+        s >> header;
+        TEST_ASSERT_FALSE(s.bad());
+        TEST_ASSERT_EQUAL(rec.header.epoch, header.epoch);
+        TEST_ASSERT_EQUAL(rec.header.base_epoch, header.base_epoch);
+        TEST_ASSERT(rec.header.signature == header.signature);
+
+        // Forged records are rejected
+        keymaker other{};
+        TEST_ASSERT_FALSE(rec.verify(other.derive_epoch_signer().pub_key()));
+        auto tampered = rec;
+        tampered.delta.back().op = list_op::remove;
+        TEST_ASSERT_FALSE(tampered.verify(signer.pub_key()));
+        tampered = rec;
+        tampered.header.epoch = 41;
+        TEST_ASSERT_FALSE(tampered.verify(signer.pub_key()));
+
+        // A gate a few versions behind catches up
+        token_list list{};
+        list.assign(ids_up_to(35), 35);
+        TEST_ASSERT(rec.apply_to(list));
+        TEST_ASSERT_EQUAL(40, list.version());
+        TEST_ASSERT(list.hash() == km.revoked_tokens().list().hash());
+        // But not twice
+        TEST_ASSERT_FALSE(rec.apply_to(list));
+
+        // Too far behind, it needs the keymaker
+        list.assign(ids_up_to(2), 2);
+        TEST_ASSERT_FALSE(rec.apply_to(list));
+        TEST_ASSERT_EQUAL(2, list.version());
+
+        // As does a gate that diverged, which is left untouched
+        auto diverged = ids_up_to(34);
+        diverged.push_back(make_id(100));
+        list.assign(diverged, 35);
+        TEST_ASSERT_FALSE(rec.apply_to(list));
+        TEST_ASSERT_EQUAL(35, list.version());
+        TEST_ASSERT(list.contains(make_id(100)));
+
+        // The gate gets the public key over the secure channel, and keeps it
+        gate g{};
+        g.regenerate_keys();
+        g.configure(gate_id{5}, "Offline gate", pub_key{km.keys().raw_pk()});
+        TEST_ASSERT_FALSE(g.epoch_key());
+
+        loopback_gate_session session{g, km};
+        auto &initiator = session.initiator();
+        TEST_ASSERT(p2p::push_epoch_key(km, initiator));
+        session.stop();
+        TEST_ASSERT(g.epoch_key());
+        if (g.epoch_key()) {
+            TEST_ASSERT(*g.epoch_key() == signer.pub_key());
+        }
+
+        g.config_store();
+        gate reloaded = gate::load_from_config();
+        TEST_ASSERT(reloaded.epoch_key());
+        if (reloaded.epoch_key()) {
+            TEST_ASSERT(*reloaded.epoch_key() == signer.pub_key());
+        }
+        gate::config_clear();
+    }
+
+    void test_token_list_sync() {
+        keymaker km{};
+        gate g{};
+        g.regenerate_keys();
+        g.configure(gate_id{3}, "Synced gate", pub_key{km.keys().raw_pk()});
+
+        const auto make_id = [](std::uint32_t i) {
+            return token_id{std::array<std::uint8_t, 7>{0x04, std::uint8_t(i >> 16), std::uint8_t(i >> 8), std::uint8_t(i), 0xca, 0xfe, 0x00}};
+        };
+
+        loopback_gate_session session{g, km};
+        auto &initiator = session.initiator();
+
+        // First sync from an empty list goes through the changelog
+        for (std::uint32_t i = 0; i < 40; ++i) {
+            km.revoked_tokens().add(make_id(i));
+        }
+        auto r = p2p::sync_token_list(initiator, token_list_id::revoked, km.revoked_tokens());
+        TEST_ASSERT(r);
+        if (r) {
+            TEST_ASSERT_FALSE(r->used_snapshot);
+            TEST_ASSERT_EQUAL(40, r->changes_sent);
+            TEST_ASSERT(r->after == km.revoked_tokens().list().summary());
+        }
+
+        // Small changes only send the delta
+        km.revoked_tokens().remove(make_id(5));
+        km.revoked_tokens().add(make_id(100));
+        r = p2p::sync_token_list(initiator, token_list_id::revoked, km.revoked_tokens());
+        TEST_ASSERT(r);
+        if (r) {
+            TEST_ASSERT_FALSE(r->used_snapshot);
+            TEST_ASSERT_EQUAL(2, r->changes_sent);
+            TEST_ASSERT_EQUAL(2, r->round_trips);
+        }
+        TEST_ASSERT(g.revoked_tokens().contains(make_id(100)));
+        TEST_ASSERT_FALSE(g.revoked_tokens().contains(make_id(5)));
+
+        // Nothing to send when up to date
+        r = p2p::sync_token_list(initiator, token_list_id::revoked, km.revoked_tokens());
+        TEST_ASSERT(r);
+        if (r) {
+            TEST_ASSERT_EQUAL(1, r->round_trips);
+            TEST_ASSERT_EQUAL(0, r->changes_sent + r->ids_sent);
+        }
+
+        // A gap larger than the changelog falls back to a snapshot
+        for (std::uint32_t i = 200; i < 200 + versioned_token_list::default_max_changelog + 10; ++i) {
+            km.revoked_tokens().add(make_id(i));
+        }
+        r = p2p::sync_token_list(initiator, token_list_id::revoked, km.revoked_tokens());
+        TEST_ASSERT(r);
+        if (r) {
+            TEST_ASSERT(r->used_snapshot);
+            TEST_ASSERT_EQUAL(km.revoked_tokens().list().size(), r->ids_sent);
+        }
+
+        // A gate that diverged at the same version is detected by the hash, and repaired
+        g.revoked_tokens().apply({list_op::add, make_id(999)});
+        r = p2p::sync_token_list(initiator, token_list_id::revoked, km.revoked_tokens());
+        TEST_ASSERT(r);
+        if (r) {
+            TEST_ASSERT(r->used_snapshot);
+        }
+        TEST_ASSERT(g.revoked_tokens().summary() == km.revoked_tokens().list().summary());
+        TEST_ASSERT_FALSE(g.revoked_tokens().contains(make_id(999)));
+
+        // Oversized snapshots are refused before anything is allocated
+        const auto before = g.revoked_tokens().summary();
+        p2p::cmd::list_snapshot::request huge{};
+        huge.version = km.revoked_tokens().version() + 1;
+        huge.total = std::uint32_t(token_list::max_size + 1);
+        huge.ids = {make_id(1000)};
+        const auto r_huge = rpc::call<p2p::cmd::list_snapshot>(initiator, huge);
+        TEST_ASSERT(r_huge);
+        if (r_huge) {
+            TEST_ASSERT_FALSE(*r_huge);
+            TEST_ASSERT(r_huge->error() == rpc::status::malformed_request);
+        }
+        TEST_ASSERT(g.revoked_tokens().summary() == before);
+
+        session.stop();
+    }
+
+    void test_gate_scheduler() {
+        keymaker km{};
+        gate g{};
+        g.regenerate_keys();
+        g.configure(gate_id{6}, "Scheduled gate", pub_key{km.keys().raw_pk()});
+        g.config_store();
+
+        const auto make_id = [](std::uint32_t i) {
+            return token_id{std::array<std::uint8_t, 7>{0x04, std::uint8_t(i >> 16), std::uint8_t(i >> 8), std::uint8_t(i), 0x5c, 0xed, 0x00}};
+        };
+        const auto persisted_revoked = [] {
+            return gate::load_from_config().revoked_tokens().summary();
+        };
+        const auto initial = g.revoked_tokens().summary();
+
+        loopback_link link{};
+        loopback_initiator raw_initiator{link};
+        summoned_dep_target admin{link};
+        empty_field_card_service cards{};
+        gate_scheduler_options opts{};
+        opts.card_window = 20ms;
+        opts.admin_window = 50ms;
+        opts.admin_slice = 500ms;
+        opts.card_window_during_admin = 20ms;
+        opts.admin_resume_window = 3s;
+        // Longer than the slice, so that a quiet keymaker is preempted rather than timed out
+        opts.admin_idle_timeout = 800ms;
+        gate_scheduler scheduler{cards, admin, g, opts};
+        std::thread scheduler_thread{[&] { scheduler.loop(); }};
+
+        // A session that outlives its slice is suspended, and nothing is persisted yet
+        p2p::session_ticket ticket{};
+        {
+            admin.summon();
+            p2p::secure_initiator initiator{raw_initiator, km.keys(), pub_key{g.keys().raw_pk()}};
+            for (std::uint32_t i = 0; i < 10; ++i) {
+                km.revoked_tokens().add(make_id(i));
+            }
+            TEST_ASSERT(p2p::sync_token_list(initiator, token_list_id::revoked, km.revoked_tokens()));
+            ticket = initiator.ticket();
+            TEST_ASSERT(ticket.is_valid());
+        }
+        std::this_thread::sleep_for(opts.admin_slice + 200ms);
+        TEST_ASSERT(g.revoked_tokens().summary() == km.revoked_tokens().list().summary());
+        TEST_ASSERT(persisted_revoked() == initial);
+
+        // The keymaker comes back after the card window and resumes from its ticket, still without persisting
+        {
+            admin.summon();
+            p2p::secure_initiator initiator{raw_initiator, km.keys(), ticket};
+            km.revoked_tokens().add(make_id(100));
+            TEST_ASSERT(p2p::sync_token_list(initiator, token_list_id::revoked, km.revoked_tokens()));
+            TEST_ASSERT(initiator.stats().resumed);
+        }
+        std::this_thread::sleep_for(opts.admin_slice + 200ms);
+        TEST_ASSERT(persisted_revoked() == initial);
+
+        // An initiator that never completes the handshake ends the suspended session: it is persisted right away,
+        // not after the resume window
+        admin.summon();
+        std::this_thread::sleep_for(opts.admin_idle_timeout + 300ms);
+        TEST_ASSERT(persisted_revoked() == km.revoked_tokens().list().summary());
+
+        scheduler.stop();
+        scheduler_thread.join();
+        const auto &stats = scheduler.stats();
+        TEST_ASSERT_EQUAL(3, admin.activations());
+        TEST_ASSERT_EQUAL(1, stats.admin_sessions);
+        TEST_ASSERT_EQUAL(2, stats.preemptions);
+        TEST_ASSERT_EQUAL(1, stats.resumed_sessions);
+        TEST_ASSERT_GREATER_OR_EQUAL(2, stats.batches_served);
+        TEST_ASSERT_EQUAL(cards.windows(), stats.card_windows);
+        ESP_LOGI("TEST", "Longest card wait %lld ms, longest admin wait %lld ms.",
+                 stats.max_card_wait.count(), stats.max_admin_wait.count());
+        gate::config_clear();
+    }
+
+    void test_telemetry() {
+        auto &t = telemetry::instance();
+        t.reset();
+        for (unsigned i = 1; i <= 98; ++i) {
+            t.record_tap(std::chrono::microseconds{1000 * i});
+        }
+        t.record_tap(2s, desfire::error::crypto_error);
+        t.record_tap(3s, desfire::error::permission_denied);
+        t.record_failed_scan(pn532::channel_error::timeout);
+        t.record_failed_scan(pn532::channel_error::timeout);
+
+        // Buckets are at most 25% wide
+        for (const auto us : {1, 3, 4, 7, 100, 1000, 123456, 9999999}) {
+            const auto latency = std::chrono::microseconds{us};
+            const auto index = latency_buckets::index_of(latency);
+            TEST_ASSERT(latency_buckets::lower_bound(index) <= latency);
+            TEST_ASSERT(latency_buckets::lower_bound(index + 1) > latency);
+        }
+
+        const auto snapshot = t.snapshot();
+        TEST_ASSERT_EQUAL(100, snapshot.taps());
+        TEST_ASSERT_EQUAL(98, snapshot.taps_ok);
+        TEST_ASSERT_EQUAL(1, snapshot.failures_of(desfire::error::crypto_error));
+        TEST_ASSERT_EQUAL(1, snapshot.failures_of(desfire::error::permission_denied));
+        TEST_ASSERT_EQUAL(0, snapshot.failures_of(desfire::error::app_not_found));
+        TEST_ASSERT_EQUAL(1, snapshot.failed_scans.size());
+        const auto p50 = snapshot.latency_percentile(0.5f);
+        const auto p99 = snapshot.latency_percentile(0.99f);
+        TEST_ASSERT(p50 >= 50ms and p50 < 63ms);
+        TEST_ASSERT(p99 >= 2s and p99 < 3s);
+        TEST_ASSERT_LESS_OR_EQUAL(snapshot.free_heap, snapshot.min_free_heap);
+
+        // Pulled by the programmer in a single round trip
+        keymaker km{};
+        gate g{};
+        g.regenerate_keys();
+        g.configure(gate_id{4}, "Monitored gate", pub_key{km.keys().raw_pk()});
+
+        loopback_gate_session session{g, km};
+        const auto r = p2p::pull_telemetry(session.initiator());
+        session.stop();
+
+        TEST_ASSERT_EQUAL(1, session.batches_served());
+        TEST_ASSERT_EQUAL(1, session.link().round_trips.load());
+        TEST_ASSERT(r);
+        if (r) {
+            TEST_ASSERT_EQUAL(snapshot.taps(), r->taps());
+            TEST_ASSERT_EQUAL(1, r->failures_of(desfire::error::crypto_error));
+            TEST_ASSERT(snapshot.tap_latency == r->tap_latency);
+            TEST_ASSERT(snapshot.failed_scans == r->failed_scans);
+            TEST_ASSERT(r->uptime >= snapshot.uptime);
+            p2p::log_telemetry(g.id(), *r);
+        }
+        mlab::bin_data encoded{};
+        encoded << snapshot;
+        ESP_LOGI("TEST", "Telemetry snapshot of %d taps: %d bytes.", snapshot.taps(), encoded.size());
+
+        // Every error code can be nonzero at once, one more than a byte can count
+        telemetry_snapshot full{};
+        for (unsigned i = 0; i < 0x100; ++i) {
+            full.tap_failures.emplace_back(static_cast<desfire::error>(i), i + 1);
+        }
+        encoded.clear();
+        encoded << full;
+        mlab::bin_stream s{encoded};
+        telemetry_snapshot decoded{};
+        s >> decoded;
+        TEST_ASSERT_FALSE(s.bad());
+        TEST_ASSERT(decoded.tap_failures == full.tap_failures);
+    }
+
+    void test_p2p_stream() {
+        struct buffer_sink final : p2p::stream_sink {
+            mlab::bin_data data{};
+            std::uint32_t abort_at = std::numeric_limits<std::uint32_t>::max();
+
+            std::uint32_t resume_offset(std::uint32_t, std::uint32_t) override {
+                return data.size();
+            }
+
+            p2p::sink_status write(std::uint32_t offset, mlab::range<std::uint8_t const *> chunk) override {
+                if (offset >= abort_at or offset != data.size()) {
+                    return p2p::sink_status::abort;
+                }
+                data << chunk;
+                return p2p::sink_status::accepted;
+            }
+        };
+
+        loopback_link link{};
+        loopback_initiator raw_initiator{link};
+        loopback_target raw_target{link};
+        const key_pair initiator_kp{randomize};
+        const key_pair target_kp{randomize};
+
+        mlab::bin_data payload{};
+        payload.resize(16 * 1024);
+        randombytes_buf(payload.data(), payload.size());
+        p2p::data_source source{payload, 0x5eed};
+        buffer_sink sink{};
+
+        const auto run_session = [&]() -> std::pair<pn532::result<p2p::stream_stats>, pn532::result<p2p::stream_stats>> {
+            p2p::secure_target target{raw_target, target_kp};
+            p2p::secure_initiator initiator{raw_initiator, initiator_kp, pub_key{target_kp.raw_pk()}};
+            pn532::result<p2p::stream_stats> r_rx = pn532::channel_error::timeout;
+            std::thread receiver{[&] { r_rx = p2p::receive_stream(target, sink); }};
+            auto r_tx = p2p::send_stream(initiator, source);
+            receiver.join();
+            return {r_tx, r_rx};
+        };
+
+        // First session is interrupted halfway through
+        sink.abort_at = payload.size() / 2;
+        const auto [r_tx_1, r_rx_1] = run_session();
+        TEST_ASSERT_FALSE(r_tx_1);
+        TEST_ASSERT_FALSE(r_rx_1);
+        TEST_ASSERT_GREATER_THAN(0, sink.data.size());
+
+        // Second session resumes from the last acknowledged chunk
+        sink.abort_at = std::numeric_limits<std::uint32_t>::max();
+        const auto [r_tx_2, r_rx_2] = run_session();
+        TEST_ASSERT(r_tx_2);
+        TEST_ASSERT(r_rx_2);
+        TEST_ASSERT_EQUAL(payload.size(), sink.data.size());
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(payload.data(), sink.data.data(), std::min(payload.size(), sink.data.size()));
+        if (r_tx_2) {
+            TEST_ASSERT_GREATER_THAN(0, r_tx_2->resumed_from);
+            TEST_ASSERT_EQUAL(payload.size() - r_tx_2->resumed_from, r_tx_2->bytes);
+            ESP_LOGI("TEST", "Streamed %lu bytes in %lu chunks, %lld ms: %0.2f kB/s over loopback.",
+                     r_tx_2->bytes, r_tx_2->chunks, r_tx_2->elapsed.count(), r_tx_2->throughput_kilobytes_per_s());
+        }
+    }
+
+    void test_ota_stream() {
+        /**
+         * Stops providing data past @ref cut, as if the keymaker left the field.
+         */
+        struct interrupted_source final : p2p::stream_source {
+            p2p::data_source &source;
+            std::uint32_t cut = std::numeric_limits<std::uint32_t>::max();
+
+            explicit interrupted_source(p2p::data_source &source_) : source{source_} {}
+
+            [[nodiscard]] std::uint32_t transfer_id() const override { return source.transfer_id(); }
+            [[nodiscard]] std::uint32_t size() const override { return source.size(); }
+            [[nodiscard]] bool read(std::uint32_t offset, mlab::range<std::uint8_t *> dest) override {
+                return offset + dest.size() <= cut and source.read(offset, dest);
+            }
+        };
+
+        loopback_link link{};
+        loopback_initiator raw_initiator{link};
+        loopback_target raw_target{link};
+        keymaker km{};
+        gate g{};
+        g.regenerate_keys();
+        g.configure(gate_id{5}, "Updated gate", pub_key{km.keys().raw_pk()});
+
+        mlab::bin_data image{};
+        image.resize(32 * 1024);
+        randombytes_buf(image.data(), image.size());
+        p2p::data_source image_source{image, 0};
+        interrupted_source source{image_source};
+        // Do not boot into random data
+        ota_sink sink{g, false};
+
+        const auto run_session = [&](keymaker const &sender) -> std::pair<pn532::result<p2p::stream_stats>, pn532::result<p2p::stream_stats>> {
+            p2p::secure_target target{raw_target, g.keys()};
+            p2p::secure_initiator initiator{raw_initiator, sender.keys(), pub_key{g.keys().raw_pk()}};
+            pn532::result<p2p::stream_stats> r_rx = pn532::channel_error::timeout;
+            std::thread receiver{[&] { r_rx = p2p::receive_firmware_update(g, target, sink); }};
+            auto r_tx = p2p::send_firmware_update(initiator, sender, source);
+            receiver.join();
+            return {r_tx, r_rx};
+        };
+
+        // The keymaker is pulled away halfway through
+        source.cut = image.size() / 2;
+        const auto [r_tx_1, r_rx_1] = run_session(km);
+        TEST_ASSERT_FALSE(r_tx_1);
+        TEST_ASSERT_FALSE(r_rx_1);
+        TEST_ASSERT(ota_error::none == sink.error());
+
+        // Only the programmer is accepted
+        source.cut = std::numeric_limits<std::uint32_t>::max();
+        const keymaker other_km{};
+        const auto [r_tx_other, r_rx_other] = run_session(other_km);
+        TEST_ASSERT_FALSE(r_tx_other);
+        TEST_ASSERT_FALSE(r_rx_other);
+
+        // Resumes, and the signature is verified; random data is then rejected as an image by the bootloader checks
+        const auto [r_tx_2, r_rx_2] = run_session(km);
+        if (r_tx_2) {
+            TEST_FAIL_MESSAGE("Random data should not be accepted as a firmware image.");
+        } else {
+            TEST_ASSERT(ota_error::invalid_image == sink.error());
+        }
+        TEST_ASSERT_EQUAL(image.size(), sink.stats().bytes_written);
+        TEST_ASSERT_FALSE(sink.succeeded());
+        ESP_LOGI("TEST", "OTA: %lu bytes, %lld ms spent writing flash.", sink.stats().bytes_written,
+                 std::chrono::duration_cast<std::chrono::milliseconds>(sink.stats().flash_time).count());
+    }
+
+    void test_secure_p2p_zero_copy() {
+        constexpr std::size_t round_trips = 64;
+        constexpr std::size_t message_size = 128;
+
+        loopback_link link{};
+        loopback_initiator raw_initiator{link};
+        loopback_target raw_target{link};
+        const key_pair initiator_kp{randomize};
+        const key_pair target_kp{randomize};
+        p2p::secure_target target{raw_target, target_kp};
+        p2p::secure_initiator initiator{raw_initiator, initiator_kp, pub_key{target_kp.raw_pk()}};
+        p2p::message_buffer tx_buffer{message_size};
+
+        // Echo server using only the zero-copy API
+        std::size_t echoed = 0;
+        std::thread echo{[&] {
+            p2p::message_buffer rx_buffer{message_size};
+            for (std::size_t i = 0; i < 2 * round_trips + 2; ++i) {
+                const auto r = target.receive_view(1s);
+                if (not r) {
+                    break;
+                }
+                const auto payload = rx_buffer.prepare(r->size());
+                std::copy(std::begin(*r), std::end(*r), std::begin(payload));
+                if (not target.send(rx_buffer, 1s)) {
+                    break;
+                }
+                ++echoed;
+            }
+        }};
+
+        const auto exchange = [&](auto &&communicate_fn) {
+            for (std::size_t i = 0; i < round_trips; ++i) {
+                auto payload = tx_buffer.prepare(message_size);
+                std::fill(std::begin(payload), std::end(payload), std::uint8_t(i));
+                if (const auto r = communicate_fn(); not r or r->size() != message_size or *std::begin(*r) != std::uint8_t(i)) {
+                    TEST_FAIL_MESSAGE("Zero-copy echo failed.");
+                    return;
+                }
+            }
+        };
+
+        // Warm up: handshake, and let every buffer reach its final capacity
+        TEST_ASSERT(initiator.communicate(tx_buffer, 1s));
+        TEST_ASSERT(initiator.communicate(tx_buffer, 1s));
+
+#ifdef CONFIG_HEAP_TRACING_STANDALONE
+        static std::array<heap_trace_record_t, 4 * round_trips> trace_records{};
+        const auto count_allocations = [&](auto &&fn) -> std::size_t {
+            TEST_ASSERT_EQUAL(ESP_OK, heap_trace_init_standalone(trace_records.data(), trace_records.size()));
+            TEST_ASSERT_EQUAL(ESP_OK, heap_trace_start(HEAP_TRACE_ALL));
+            fn();
+            TEST_ASSERT_EQUAL(ESP_OK, heap_trace_stop());
+            return heap_trace_get_count();
+        };
+        // The raw loopback layer copies each frame once per direction; the secure layer must not add anything
+        const unsigned copies_before = link.frame_copies;
+        const auto allocs = count_allocations([&] { exchange([&] { return initiator.communicate(tx_buffer, 1s); }); });
+        const unsigned raw_allocs = link.frame_copies - copies_before;
+        ESP_LOGI("TEST", "Allocations over %d round trips: %d in total, %u by the raw layer.", round_trips, allocs, raw_allocs);
+        TEST_ASSERT_EQUAL(raw_allocs, allocs);
+#else
+        // Still run the same number of messages, the echo server expects them
+        exchange([&] { return initiator.communicate(tx_buffer, 1s); });
+#endif
+
+        mlab::timer t{};
+        exchange([&] { return initiator.communicate(tx_buffer, 1s); });
+        ESP_LOGI("TEST", "Zero-copy round trip of %d bytes: %lld us.", message_size,
+                 std::chrono::duration_cast<std::chrono::microseconds>(t.elapsed()).count() / round_trips);
+        echo.join();
+        TEST_ASSERT_EQUAL(2 * round_trips + 2, echoed);
+#ifndef CONFIG_HEAP_TRACING_STANDALONE
+        // Report it as ignored rather than passed, the allocation check is the point of this test
+        TEST_IGNORE_MESSAGE("CONFIG_HEAP_TRACING_STANDALONE is disabled, allocations were not checked.");
+#endif
     }
 
     void test_regular_flow() {
@@ -791,6 +2826,320 @@ namespace ut {
         TEST_ASSERT(token.is_gate_enrolled_correctly(bundle.km, bundle.g13_cfg));
     }
 
+    /**
+     * @brief Records what @ref gate::try_authenticate reported. Neither is set when the token is not enrolled.
+     */
+    struct tap_outcome final : gate_auth_responder {
+        std::optional<identity> authenticated = std::nullopt;
+        std::optional<desfire::error> failure = std::nullopt;
+
+        void on_authentication_success(identity const &id) override { authenticated = id; }
+        void on_authentication_fail(desfire::error auth_error, bool) override { failure = auth_error; }
+    };
+
+    [[nodiscard]] tap_outcome tap(gate &g, member_token &token) {
+        tap_outcome outcome{};
+        g.try_authenticate(token, outcome);
+        return outcome;
+    }
+
+    /**
+     * @brief Formats the tag and deploys it again for @p km, which must have the keys of @ref bundle, so that the root
+     * key stays the one @ref test_regular_flow left.
+     * @return The identity in the master file, carrying the id of the tag.
+     */
+    [[nodiscard]] std::optional<identity> redeploy(member_token &token, keymaker const &km, std::string holder) {
+        const auto r_id = token.get_id();
+        TEST_ASSERT(r_id);
+        if (not r_id) {
+            return std::nullopt;
+        }
+        TEST_ASSERT(ok_and<true>(token.check_root(bundle.kp.derive_token_root_key(*r_id))));
+        TEST_ASSERT(token.tag().format_picc());
+        identity who{*r_id, std::move(holder), "Test deployer"};
+        TEST_ASSERT(token.deploy(km, who));
+        return who;
+    }
+
+    void test_gate_directory_flow() {
+        TEST_ASSERT(instance.tag != nullptr);
+        if (instance.tag == nullptr) {
+            return;
+        }
+
+        member_token token{*instance.tag};
+        const auto who = redeploy(token, bundle.km, "Directory user");
+        if (not who) {
+            return;
+        }
+
+        // Far apart ids, whose fixed locations would need one app each; the last one shares the file of the first
+        std::array<gate, 4> sparse{};
+        const std::array<std::uint32_t, 4> gids = {150000, 150000 + 7919, 150000 + 2 * 7919, 150000 + 1000 * gate_id::gates_per_app};
+        for (std::size_t i = 0; i < sparse.size(); ++i) {
+            sparse[i].regenerate_keys();
+            sparse[i].configure(gate_id{gids[i]}, "Sparse gate " + std::to_string(i), pub_key{bundle.km.keys().raw_pk()});
+            TEST_ASSERT(token.enroll_gate(bundle.km, {sparse[i].id(), pub_key{sparse[i].keys().raw_pk()}, sparse[i].app_base_key()}, *who));
+        }
+
+        // A new session reads the directory back from the tag
+        member_token fresh{*instance.tag};
+        const auto r_dir = fresh.read_gate_directory();
+        TEST_ASSERT(r_dir);
+        if (r_dir) {
+            TEST_ASSERT_EQUAL(sparse.size(), r_dir->size());
+            TEST_ASSERT_EQUAL(2, r_dir->apps());
+        }
+        for (std::size_t i = 0; i < sparse.size(); ++i) {
+            const auto r_loc = fresh.locate_gate(sparse[i].id());
+            TEST_ASSERT(r_loc);
+            if (r_loc) {
+                TEST_ASSERT(r_loc->app() != sparse[i].id().app());
+                TEST_ASSERT_EQUAL(sparse[i].id().file(), r_loc->file());
+                TEST_ASSERT(r_loc->app() == (i + 1 < sparse.size() ? gate_id::first_aid : gate_id{gate_id::gates_per_app}.app()));
+            }
+            TEST_ASSERT(fresh.is_gate_enrolled_correctly(bundle.km, {sparse[i].id(), pub_key{sparse[i].keys().raw_pk()}, sparse[i].app_base_key()}));
+            const auto outcome = tap(sparse[i], fresh);
+            TEST_ASSERT(outcome.authenticated);
+            if (outcome.authenticated) {
+                TEST_ASSERT(*outcome.authenticated == *who);
+            }
+        }
+        const auto r_gates = fresh.list_gates(true, true);
+        TEST_ASSERT(r_gates);
+        if (r_gates) {
+            TEST_ASSERT_EQUAL(sparse.size(), r_gates->size());
+        }
+
+        // A gate that is not in the directory is not enrolled, wherever its fixed location is
+        TEST_ASSERT(ok_and<false>(fresh.is_gate_enrolled(gate_id{gids[0] + 1}, true, true)));
+        TEST_ASSERT(is_err<desfire::error::file_not_found>(fresh.locate_gate(gate_id{gids[0] + 1})));
+    }
+
+    void test_gate_group_flow() {
+        TEST_ASSERT(instance.tag != nullptr);
+        if (instance.tag == nullptr) {
+            return;
+        }
+
+        keymaker km{};
+        km._kp = bundle.kp;
+        member_token token{*instance.tag};
+        const auto who = redeploy(token, km, "Group member");
+        if (not who) {
+            return;
+        }
+        const auto grp = km.register_gate_group();
+        TEST_ASSERT(grp);
+        const auto grp_cfg = grp ? km.gates().find(grp->id) : std::nullopt;
+        TEST_ASSERT(grp_cfg);
+        if (not grp or not grp_cfg) {
+            return;
+        }
+        TEST_ASSERT(token.enroll_gate(km, *grp_cfg, *who));
+
+        // One file on the tag opens every gate of the group, none of which has a file of its own
+        std::array<gate, 2> grouped{};
+        for (auto &g : grouped) {
+            g.regenerate_keys();
+            g.configure(km.allocate_gate_id(), "Grouped gate", pub_key{km.keys().raw_pk()});
+            km.register_gate({g.id(), pub_key{g.keys().raw_pk()}, g.app_base_key()});
+            TEST_ASSERT(g.join_group(*grp));
+            TEST_ASSERT(ok_and<false>(token.is_gate_enrolled(g.id(), true, true)));
+            const auto r_who = token.read_encrypted_gate_file(g, *grp, true, true);
+            TEST_ASSERT(r_who);
+            if (r_who) {
+                TEST_ASSERT(r_who->first == *who);
+            }
+            const auto outcome = tap(g, token);
+            TEST_ASSERT(outcome.authenticated);
+            if (outcome.authenticated) {
+                TEST_ASSERT(*outcome.authenticated == *who);
+            }
+        }
+
+        // Once out of the group, the gate does not recognize the tag anymore
+        TEST_ASSERT(grouped.front().leave_group(grp->id));
+        const auto outcome = tap(grouped.front(), token);
+        TEST_ASSERT_FALSE(outcome.authenticated);
+        TEST_ASSERT_FALSE(outcome.failure);
+    }
+
+    void test_key_migration_flow() {
+        TEST_ASSERT(instance.tag != nullptr);
+        if (instance.tag == nullptr) {
+            return;
+        }
+
+        member_token token{*instance.tag};
+        const auto who = redeploy(token, bundle.km, "Migrated user");
+        if (not who) {
+            return;
+        }
+        const gate_id gid{21};
+        gate g{};
+        g.regenerate_keys();
+        g.configure(gid, "Rotating gate", pub_key{bundle.km.keys().raw_pk()}, bundle.km.derive_gate_base_key(gid));
+        TEST_ASSERT(token.enroll_gate(bundle.km, {gid, pub_key{g.keys().raw_pk()}, g.app_base_key()}, *who));
+        TEST_ASSERT(g.rotate_keys(1, gate_base_key::derive_from(bundle.km.keys(), gid, 1)));
+        const gate_config rotated_cfg{gid, pub_key{g.keys().raw_pk()}, g.app_base_key()};
+
+        // The previous keys still open, but without a grant the tag stays on them
+        auto outcome = tap(g, token);
+        TEST_ASSERT(outcome.authenticated);
+        TEST_ASSERT_EQUAL(0, g.key_status().migrated);
+        TEST_ASSERT_FALSE(token.read_encrypted_gate_file(g, true, true));
+
+        // With a grant, the tap moves it to the current keys and drops the grant
+        TEST_ASSERT(g.grant_rekey(who->id, bundle.km.keys().derive_raw_gate_app_master_key(who->id)));
+        outcome = tap(g, token);
+        TEST_ASSERT(outcome.authenticated);
+        if (outcome.authenticated) {
+            TEST_ASSERT(*outcome.authenticated == *who);
+        }
+        const auto status = g.key_status();
+        TEST_ASSERT_EQUAL(1, status.migrated);
+        TEST_ASSERT_EQUAL(0, status.rekey_grants);
+        const auto r_who = token.read_encrypted_gate_file(g, true, true);
+        TEST_ASSERT(r_who);
+        if (r_who) {
+            TEST_ASSERT(r_who->first == *who);
+        }
+        // Same file the keymaker writes with the rotated keys
+        TEST_ASSERT(token.is_gate_enrolled_correctly(bundle.km, rotated_cfg));
+
+        // And it keeps opening once the previous keys are gone
+        g.retire_previous_keys();
+        outcome = tap(g, token);
+        TEST_ASSERT(outcome.authenticated);
+        TEST_ASSERT_EQUAL(1, g.key_status().migrated);
+        gate::config_clear();
+    }
+
+    void test_self_enroll_flow() {
+        TEST_ASSERT(instance.tag != nullptr);
+        if (instance.tag == nullptr) {
+            return;
+        }
+
+        member_token token{*instance.tag};
+        auto who = redeploy(token, bundle.km, "Self-enrolled user");
+        if (not who) {
+            return;
+        }
+        gate g{};
+        g.regenerate_keys();
+        g.configure(gate_id{22}, "Self-enrolling gate", pub_key{bundle.km.keys().raw_pk()});
+        const gate_config cfg{g.id(), pub_key{g.keys().raw_pk()}, g.app_base_key()};
+        const auto make_cert = [&] {
+            deploy_certificate cert{};
+            cert.who = *who;
+            cert.expires_at = g.pending_deploys().now() + 3600;
+            cert.mkey = bundle.km.keys().derive_raw_gate_app_master_key(who->id);
+            return cert;
+        };
+
+        // Without a certificate the tag is simply not enrolled
+        auto outcome = tap(g, token);
+        TEST_ASSERT_FALSE(outcome.authenticated);
+        TEST_ASSERT_FALSE(outcome.failure);
+
+        // With one, the gate enrolls it on tap and lets it in
+        TEST_ASSERT(g.pending_deploys().insert(make_cert()));
+        outcome = tap(g, token);
+        TEST_ASSERT(outcome.authenticated);
+        if (outcome.authenticated) {
+            TEST_ASSERT(*outcome.authenticated == *who);
+        }
+        TEST_ASSERT_FALSE(g.pending_deploys().contains(who->id));
+        // Same file the keymaker would have written
+        TEST_ASSERT(token.is_gate_enrolled_correctly(bundle.km, cfg));
+        outcome = tap(g, token);
+        TEST_ASSERT(outcome.authenticated);
+
+        // The certificate of a revoked tag is dropped without enrolling it
+        who = redeploy(token, bundle.km, "Revoked user");
+        if (not who) {
+            return;
+        }
+        TEST_ASSERT(g.pending_deploys().insert(make_cert()));
+        g.revoked_tokens().assign({who->id}, 1);
+        outcome = tap(g, token);
+        TEST_ASSERT_FALSE(outcome.authenticated);
+        TEST_ASSERT_FALSE(g.pending_deploys().contains(who->id));
+        TEST_ASSERT(ok_and<false>(token.is_gate_enrolled(g.id(), true, true)));
+        gate::config_clear();
+    }
+
+    void test_revocation_record_flow() {
+        TEST_ASSERT(instance.tag != nullptr);
+        if (instance.tag == nullptr) {
+            return;
+        }
+
+        keymaker km{};
+        km._kp = bundle.kp;
+        member_token token{*instance.tag};
+        const auto who = redeploy(token, km, "Revocation carrier");
+        if (not who) {
+            return;
+        }
+        const identity other{{0x08, 0xff, 0x00, 0x01, 0xe9, 0x0c, 0x00}, "Revoked member", "Test deployer"};
+        TEST_ASSERT(km.members().insert(*who));
+        TEST_ASSERT(km.members().insert(other));
+        const auto signer_pk = km.derive_epoch_signer().pub_key();
+        const auto mkey = km.keys().derive_gate_app_master_key(who->id);
+
+        gate g{};
+        g.regenerate_keys();
+        g.configure(gate_id{23}, "Offline gate", pub_key{km.keys().raw_pk()});
+        g.set_epoch_key(signer_pk);
+        TEST_ASSERT(token.enroll_gate(km, {g.id(), pub_key{g.keys().raw_pk()}, g.app_base_key()}, *who));
+
+        // The tag carries the record back and forth
+        TEST_ASSERT(km.revoke(other.id));
+        TEST_ASSERT(token.write_revocation_record(mkey, km.sign_revocations()));
+        const auto r_epoch = token.read_revocation_epoch();
+        TEST_ASSERT(r_epoch);
+        if (r_epoch) {
+            TEST_ASSERT_EQUAL(1, r_epoch->epoch);
+            const auto r_rec = token.read_revocation_record(*r_epoch);
+            TEST_ASSERT(r_rec);
+            if (r_rec) {
+                TEST_ASSERT_EQUAL(1, r_rec->delta.size());
+                TEST_ASSERT(r_rec->verify(signer_pk));
+            }
+        }
+
+        // A tap brings the gate up to date
+        auto outcome = tap(g, token);
+        TEST_ASSERT(outcome.authenticated);
+        TEST_ASSERT_EQUAL(1, g.revoked_tokens().version());
+        TEST_ASSERT(g.revoked_tokens().contains(other.id));
+
+        // Records signed by anyone else are ignored
+        keymaker forger{};
+        forger.revoked_tokens().add(other.id);
+        forger.revoked_tokens().add(who->id);
+        TEST_ASSERT(token.write_revocation_record(mkey, forger.sign_revocations()));
+        outcome = tap(g, token);
+        TEST_ASSERT(outcome.authenticated);
+        TEST_ASSERT_EQUAL(1, g.revoked_tokens().version());
+
+        // Including the one revoking the tag itself, which is then turned away on the same tap
+        TEST_ASSERT(km.revoke(who->id));
+        TEST_ASSERT(token.write_revocation_record(mkey, km.sign_revocations()));
+        outcome = tap(g, token);
+        TEST_ASSERT_FALSE(outcome.authenticated);
+        TEST_ASSERT(outcome.failure);
+        if (outcome.failure) {
+            TEST_ASSERT(*outcome.failure == desfire::error::permission_denied);
+        }
+        TEST_ASSERT_EQUAL(2, g.revoked_tokens().version());
+        TEST_ASSERT(g.revoked_tokens().contains(who->id));
+        gate::config_clear();
+    }
+
     void test_nvs_gate() {
         bundle.g0.config_store();
         gate g{};
@@ -809,8 +3158,33 @@ extern "C" void app_main() {
 
     RUN_TEST(ut::test_keys);
     RUN_TEST(ut::test_nvs);
+    RUN_TEST(ut::test_nvs_write_back);
+    RUN_TEST(ut::test_gate_registry);
+    RUN_TEST(ut::test_gate_id_allocation);
+    RUN_TEST(ut::test_gate_directory);
+    RUN_TEST(ut::test_member_roster);
+    RUN_TEST(ut::test_keymaker_revocation_store);
+    RUN_TEST(ut::test_production_line_queue);
+    RUN_TEST(ut::test_enrollment_pipeline);
+    RUN_TEST(ut::test_provisioning_plan);
     RUN_TEST(ut::test_nvs_gate);
     RUN_TEST(ut::test_encrypt_decrypt);
+    RUN_TEST(ut::test_secure_p2p_fast_handshake);
+    RUN_TEST(ut::test_secure_p2p_resumption);
+    RUN_TEST(ut::test_link_quality);
+    RUN_TEST(ut::test_rpc_batch);
+    RUN_TEST(ut::test_derived_gate_keys);
+    RUN_TEST(ut::test_configure_listener);
+    RUN_TEST(ut::test_gate_groups);
+    RUN_TEST(ut::test_gate_key_rotation);
+    RUN_TEST(ut::test_deploy_certificates);
+    RUN_TEST(ut::test_revocation_record);
+    RUN_TEST(ut::test_token_list_sync);
+    RUN_TEST(ut::test_gate_scheduler);
+    RUN_TEST(ut::test_telemetry);
+    RUN_TEST(ut::test_p2p_stream);
+    RUN_TEST(ut::test_ota_stream);
+    RUN_TEST(ut::test_secure_p2p_zero_copy);
 
     ESP_LOGI("TEST", "Attempting to set up a PN532 on pins %d, %d", pinout::pn532_hsu_rx, pinout::pn532_hsu_tx);
 
@@ -862,6 +3236,11 @@ extern "C" void app_main() {
         RUN_TEST(ut::test_app_ops);
         RUN_TEST(ut::test_file_ops);
         RUN_TEST(ut::test_regular_flow);
+        RUN_TEST(ut::test_gate_directory_flow);
+        RUN_TEST(ut::test_gate_group_flow);
+        RUN_TEST(ut::test_key_migration_flow);
+        RUN_TEST(ut::test_self_enroll_flow);
+        RUN_TEST(ut::test_revocation_record_flow);
 
         // Always conclude with a format test so that it leaves the test suite clean
         ut::instance.warn_before_formatting = false;
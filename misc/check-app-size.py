@@ -0,0 +1,37 @@
+# PlatformIO post-build script: fails the build if the firmware does not fit the smallest app partition, and warns when
+# little room is left for the next OTA update.
+import csv
+import os
+import sys
+from typing import Optional
+
+Import('env')
+
+MIN_HEADROOM = 0x10000
+
+
+def smallest_app_partition(path: str) -> Optional[int]:
+    sizes = []
+    with open(path, newline='') as f:
+        for row in csv.reader(line for line in f if not line.lstrip().startswith('#')):
+            row = [field.strip() for field in row]
+            if len(row) >= 5 and row[1] == 'app':
+                sizes.append(int(row[4], 0))
+    return min(sizes) if sizes else None
+
+
+def check_app_size(source, target, env):
+    image = str(target[0])
+    table = os.path.join(env.subst('$PROJECT_DIR'), env.GetProjectOption('board_build.partitions'))
+    if (limit := smallest_app_partition(table)) is None:
+        return
+    size = os.path.getsize(image)
+    print(f'Firmware image: {size:#x} bytes, app partitions: {limit:#x} bytes, {limit - size:#x} free.')
+    if size > limit:
+        sys.stderr.write(f'Error: the firmware does not fit the app partitions of {table}.\n')
+        env.Exit(1)
+    elif limit - size < MIN_HEADROOM:
+        print(f'Warning: less than {MIN_HEADROOM:#x} bytes left for future updates, review {table}.')
+
+
+env.AddPostAction('$BUILD_DIR/${PROGNAME}.bin', check_app_size)
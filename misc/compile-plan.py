@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+import sys
+import os
+import json
+import struct
+import zlib
+from multiprocessing import Pool
+from typing import Dict, List, Optional, Tuple
+from nacl.bindings import crypto_box, crypto_scalarmult_base
+
+PLAN_MAGIC = b'KAPL'
+PLAN_VERSION = 1
+NONCE_PREFIX_SIZE = 16
+TOKEN_ID_SIZE = 7
+KEY_SIZE = 32
+# Mirrors ka::member_roster
+MAX_HOLDER_SIZE = 32
+MAX_PUBLISHER_SIZE = 16
+# Size of the ka_plan partition in partitions.csv
+PLAN_PARTITION_SIZE = 0x60000
+
+Card = Tuple[bytes, str, str, List[int]]
+
+_secret_key: Optional[bytes] = None
+_public_key: Optional[bytes] = None
+_gate_keys: Dict[int, bytes] = {}
+_gate_index: Dict[int, int] = {}
+_nonce_prefix: bytes = b''
+
+
+def encode_identity(token_id: bytes, holder: str, publisher: str) -> bytes:
+    """Mirrors mlab::operator<<(bin_data &, ka::identity const &)."""
+    h = holder.encode()
+    p = publisher.encode()
+    return token_id + struct.pack('<H', len(h)) + h + struct.pack('<H', len(p)) + p
+
+
+def nonce(card_pos: int, slot: int) -> bytes:
+    """Mirrors the nonces of ka::provisioning_plan::find."""
+    return _nonce_prefix + struct.pack('<II', card_pos, slot)
+
+
+def init_worker(secret_key: bytes, gate_keys: Dict[int, bytes], gate_index: Dict[int, int], nonce_prefix: bytes):
+    global _secret_key, _public_key, _gate_keys, _gate_index, _nonce_prefix
+    _secret_key = secret_key
+    _public_key = crypto_scalarmult_base(secret_key)
+    _gate_keys = gate_keys
+    _gate_index = gate_index
+    _nonce_prefix = nonce_prefix
+
+
+def compile_card(job: Tuple[int, Card]) -> bytes:
+    """Encodes the record of one card; all its files are encrypted by the keymaker key."""
+    card_pos, (token_id, holder, publisher, gates) = job
+    identity = encode_identity(token_id, holder, publisher)
+    record = [struct.pack('<H', len(identity)), identity,
+              crypto_box(identity, nonce(card_pos, 0), _public_key, _secret_key),
+              struct.pack('<B', len(gates))]
+    for slot, gate in enumerate(gates, start=1):
+        record.append(struct.pack('<H', _gate_index[gate]))
+        record.append(crypto_box(identity, nonce(card_pos, slot), _gate_keys[gate], _secret_key))
+    return b''.join(record)
+
+
+def load_gates(path: str) -> Dict[int, bytes]:
+    with open(path, 'r') as fp:
+        gates = {int(g['id']): bytes.fromhex(g['pub_key']) for g in json.load(fp)}
+    for gate, pk in gates.items():
+        if len(pk) != KEY_SIZE:
+            raise ValueError(f'Gate {gate}: invalid public key.')
+    return gates
+
+
+def load_roster(path: str, gates: Dict[int, bytes]) -> List[Card]:
+    with open(path, 'r') as fp:
+        entries = json.load(fp)
+    cards = []
+    seen = set()
+    for entry in entries:
+        token_id = bytes.fromhex(entry['token_id'])
+        holder = entry['holder']
+        publisher = entry.get('publisher', '')
+        card_gates = [int(g) for g in entry.get('gates', [])]
+        if len(token_id) != TOKEN_ID_SIZE:
+            raise ValueError(f'{entry["token_id"]}: a token id is {TOKEN_ID_SIZE} bytes.')
+        if token_id in seen:
+            raise ValueError(f'{entry["token_id"]}: duplicate token.')
+        if len(holder.encode()) > MAX_HOLDER_SIZE or len(publisher.encode()) > MAX_PUBLISHER_SIZE:
+            raise ValueError(f'{entry["token_id"]}: holder or publisher too long.')
+        if len(card_gates) > 0xff:
+            raise ValueError(f'{entry["token_id"]}: too many gates.')
+        if missing := [g for g in card_gates if g not in gates]:
+            raise ValueError(f'{entry["token_id"]}: unknown gates {missing}.')
+        seen.add(token_id)
+        cards.append((token_id, holder, publisher, card_gates))
+    # The keymaker binary searches by token id
+    cards.sort(key=lambda card: card[0])
+    return cards
+
+
+def compile_plan(secret_key: bytes, gates: Dict[int, bytes], cards: List[Card], jobs: Optional[int]) -> bytes:
+    used_gates = sorted({g for card in cards for g in card[3]})
+    gate_index = {gate: i for i, gate in enumerate(used_gates)}
+    nonce_prefix = os.urandom(NONCE_PREFIX_SIZE)
+    with Pool(jobs, initializer=init_worker, initargs=(secret_key, gates, gate_index, nonce_prefix)) as pool:
+        records = pool.map(compile_card, enumerate(cards), chunksize=max(1, len(cards) // (4 * (jobs or os.cpu_count() or 1))))
+    gate_table = b''.join(struct.pack('<I', gate) + gates[gate] for gate in used_gates)
+    index = []
+    records_offset = len(gate_table) + len(cards) * (TOKEN_ID_SIZE + 4)
+    for (token_id, _, _, _), record in zip(cards, records):
+        index.append(token_id + struct.pack('<I', records_offset))
+        records_offset += len(record)
+    body = gate_table + b''.join(index) + b''.join(records)
+    header = PLAN_MAGIC + struct.pack('<B', PLAN_VERSION) + crypto_scalarmult_base(secret_key) + nonce_prefix
+    header += struct.pack('<IHII', len(cards), len(used_gates), len(body), zlib.crc32(body))
+    return header + body
+
+
+def main(args):
+    with open(args.secret_key, 'r') as fp:
+        secret_key = bytes.fromhex(fp.read().strip())
+    if len(secret_key) != KEY_SIZE:
+        raise ValueError('The keymaker secret key is 32 bytes.')
+    gates = load_gates(args.gates)
+    cards = load_roster(args.roster, gates)
+    plan = compile_plan(secret_key, gates, cards, args.jobs)
+    if len(plan) > args.partition_size:
+        print(f'The plan takes {len(plan)} bytes, the partition only {args.partition_size}.', file=sys.stderr)
+        sys.exit(1)
+    with open(args.output, 'wb') as fp:
+        fp.write(plan)
+    ciphertexts = sum(1 + len(card[3]) for card in cards)
+    print(f'{len(cards)} cards, {ciphertexts} files, {len(plan)} bytes '
+          f'({100 * len(plan) // args.partition_size}% of the partition).')
+    print(f'Flash with: parttool.py write_partition --partition-name ka_plan --input {args.output}')
+
+
+if __name__ == '__main__':
+    from argparse import ArgumentParser
+
+    parser = ArgumentParser('Compiles a roster into a provisioning plan for the keymaker production line.')
+    parser.add_argument('roster', help='JSON list of cards: {"token_id": hex, "holder": str, "publisher": str, "gates": [id]}.')
+    parser.add_argument('gates', help='JSON list of gates: {"id": int, "pub_key": hex}.')
+    parser.add_argument('--secret-key', required=True, help='File with the keymaker secret key, in hex.')
+    parser.add_argument('-o', '--output', default='plan.bin', help='Plan file (default: plan.bin).')
+    parser.add_argument('-j', '--jobs', type=int, default=None, help='Worker processes (default: all cores).')
+    parser.add_argument('--partition-size', type=lambda s: int(s, 0), default=PLAN_PARTITION_SIZE,
+                        help='Size of the ka_plan partition.')
+    main(parser.parse_args())
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+import sys
+import json
+import re
+from typing import Iterable, List, Optional, Tuple
+
+_RGX_TELEMETRY = re.compile(r'Telemetry of gate (?P<gate>\d+): (?P<data>[0-9a-fA-F \t]+)')
+
+FORMAT_VERSION = 2
+LATENCY_BUCKETS = 100
+
+DESFIRE_ERRORS = {
+    0x0c: 'no_changes',
+    0x0e: 'out_of_eeprom',
+    0x1c: 'illegal_command',
+    0x1e: 'integrity_error',
+    0x40: 'no_such_key',
+    0x7e: 'length_error',
+    0x9d: 'permission_denied',
+    0x9e: 'parameter_error',
+    0xa0: 'app_not_found',
+    0xa1: 'app_integrity_error',
+    0xae: 'authentication_error',
+    0xbe: 'boundary_error',
+    0xc1: 'picc_integrity_error',
+    0xca: 'command_aborted',
+    0xcd: 'picc_disabled_error',
+    0xce: 'count_error',
+    0xde: 'duplicate_error',
+    0xee: 'eeprom_error',
+    0xf0: 'file_not_found',
+    0xf1: 'file_integrity_error',
+}
+
+CHANNEL_ERRORS = ['timeout', 'app_error', 'hw_error', 'malformed']
+
+
+class Reader:
+    def __init__(self, data: bytes):
+        self.data = data
+        self.pos = 0
+
+    def byte(self) -> int:
+        if self.pos >= len(self.data):
+            raise ValueError('Truncated telemetry snapshot.')
+        self.pos += 1
+        return self.data[self.pos - 1]
+
+    def varint(self) -> int:
+        v = 0
+        for shift in range(0, 35, 7):
+            b = self.byte()
+            v |= (b & 0x7f) << shift
+            if b & 0x80 == 0:
+                return v
+        raise ValueError('Invalid varint.')
+
+    def counters(self) -> List[Tuple[int, int]]:
+        return [(self.byte(), self.varint()) for _ in range(self.varint())]
+
+
+def bucket_lower_bound(index: int) -> int:
+    """Mirrors ka::latency_buckets::lower_bound, in microseconds."""
+    if index < 4:
+        return index
+    return (4 + index % 4) << (index // 4 - 1)
+
+
+def latency_percentile(buckets: List[Tuple[int, int]], q: float) -> Optional[int]:
+    """Mirrors ka::telemetry_snapshot::latency_percentile, in microseconds."""
+    total = sum(count for _, count in buckets)
+    if total == 0:
+        return None
+    threshold = -(-min(max(q, 0.), 1.) * total // 1)
+    cumulative = 0
+    for index, count in buckets:
+        cumulative += count
+        if cumulative >= threshold:
+            return bucket_lower_bound(index + 1)
+    return bucket_lower_bound(buckets[-1][0] + 1)
+
+
+def decode(data: bytes) -> dict:
+    r = Reader(data)
+    if (version := r.byte()) != FORMAT_VERSION:
+        raise ValueError(f'Unsupported telemetry format {version}.')
+    fields = ['uptime_s', 'free_heap', 'min_free_heap', 'largest_free_block',
+              'nvs_used_entries', 'nvs_free_entries', 'nvs_commits', 'taps_ok']
+    snapshot = {field: r.varint() for field in fields}
+    snapshot['tap_failures'] = {DESFIRE_ERRORS.get(code, f'0x{code:02x}'): count for code, count in r.counters()}
+    snapshot['failed_scans'] = {CHANNEL_ERRORS[code] if code < len(CHANNEL_ERRORS) else str(code): count
+                                for code, count in r.counters()}
+    latency = r.counters()
+    snapshot['taps'] = snapshot['taps_ok'] + sum(snapshot['tap_failures'].values())
+    snapshot['latency_us'] = {f'p{int(q * 100)}': latency_percentile(latency, q) for q in (0.5, 0.9, 0.99)}
+    return snapshot
+
+
+def scan(lines: Iterable[str]) -> Iterable[Tuple[int, dict]]:
+    for line in lines:
+        for m in _RGX_TELEMETRY.finditer(line):
+            yield int(m.group('gate')), decode(bytes.fromhex(re.sub(r'\s', '', m.group('data'))))
+
+
+def print_table(snapshots: List[Tuple[int, dict]]):
+    for gate, s in snapshots:
+        lat = s['latency_us']
+        print(f'Gate {gate}: up {s["uptime_s"]} s, {s["taps"]} taps ({s["taps_ok"]} ok), '
+              f'latency p50/p90/p99 {lat["p50"]}/{lat["p90"]}/{lat["p99"]} us')
+        print(f'    heap: {s["free_heap"]} free, {s["min_free_heap"]} min, {s["largest_free_block"]} largest block')
+        print(f'    nvs: {s["nvs_used_entries"]} used, {s["nvs_free_entries"]} free, {s["nvs_commits"]} commits')
+        for name, count in s['tap_failures'].items():
+            print(f'    tap failed with {name}: {count}')
+        for name, count in s['failed_scans'].items():
+            print(f'    scan failed with {name}: {count}')
+
+
+def main(args):
+    snapshots = []
+    for path in args.logs or ['-']:
+        if path == '-':
+            snapshots.extend(scan(sys.stdin))
+        else:
+            with open(path, 'r', errors='replace') as fp:
+                snapshots.extend(scan(fp))
+    if args.json:
+        json.dump([{'gate': gate, **s} for gate, s in snapshots], sys.stdout, indent=4)
+    else:
+        print_table(snapshots)
+
+
+if __name__ == '__main__':
+    from argparse import ArgumentParser
+
+    parser = ArgumentParser('Decodes the gate telemetry snapshots logged by the keymaker.')
+    parser.add_argument('logs', nargs='*', help='Serial logs of the keymaker (default: stdin).')
+    parser.add_argument('--json', action='store_true', help='Output JSON instead of a summary.')
+    main(parser.parse_args())